@@ -936,33 +936,89 @@ domain_ipmb_rescan_time(ipmi_domain_t *domain, void *cb_data)
     }
 }
 
-static void
-handle_stat(ipmi_domain_t *domain, ipmi_domain_stat_t *stat, void *cb_data)
-{
-    ipmi_cmd_info_t *cmd_info = cb_data;
-    const char      *name = ipmi_domain_stat_get_name(stat);
-    const char      *inst = ipmi_domain_stat_get_instance(stat);
-    char            *s = ipmi_mem_alloc(strlen(name) + strlen(inst) + 2);
-
-    if (!s)
-	return;
-    sprintf(s, "%s %s", name, inst);
-    ipmi_cmdlang_out_int(cmd_info, s, ipmi_domain_stat_get(stat));
-    ipmi_mem_free(s);
-}
-
 static void
 domain_stats(ipmi_domain_t *domain, void *cb_data)
 {
-    ipmi_cmd_info_t *cmd_info = cb_data;
-    char            domain_name[IPMI_DOMAIN_NAME_LEN];
+    ipmi_cmd_info_t          *cmd_info = cb_data;
+    ipmi_cmdlang_t           *cmdlang = ipmi_cmdinfo_get_cmdlang(cmd_info);
+    int                      curr_arg = ipmi_cmdlang_get_curr_arg(cmd_info);
+    int                      argc = ipmi_cmdlang_get_argc(cmd_info);
+    char                     **argv = ipmi_cmdlang_get_argv(cmd_info);
+    char                     domain_name[IPMI_DOMAIN_NAME_LEN];
+    ipmi_domain_stats_snap_t *snap;
+    int                      zero = 0;
+    unsigned int             i, count;
+    const char               *name, *inst;
+    unsigned long            samples;
+    char                     *s;
+    int                      rv;
+
+    if ((argc - curr_arg) > 0) {
+	if (strcmp(argv[curr_arg], "-zero") != 0) {
+	    cmdlang->errstr = "Invalid option";
+	    cmdlang->err = EINVAL;
+	    goto out_err;
+	}
+	zero = 1;
+    }
+
+    /* Take them all at once so they are consistent with each other. */
+    rv = ipmi_domain_stats_snapshot(domain, NULL, NULL, zero, &snap);
+    if (rv) {
+	cmdlang->errstr = "Unable to get statistics";
+	cmdlang->err = rv;
+	goto out_err;
+    }
 
     ipmi_domain_get_name(domain, domain_name, sizeof(domain_name));
     ipmi_cmdlang_out(cmd_info, "Domain statistics", NULL);
     ipmi_cmdlang_down(cmd_info);
     ipmi_cmdlang_out(cmd_info, "Domain", domain_name);
-    ipmi_domain_stat_iterate(domain, NULL, NULL, handle_stat, cmd_info);
+    count = ipmi_domain_stats_snap_count(snap);
+    for (i=0; i<count; i++) {
+	name = ipmi_domain_stats_snap_name(snap, i);
+	inst = ipmi_domain_stats_snap_instance(snap, i);
+	samples = ipmi_domain_stats_snap_value(snap, i);
+	if (ipmi_domain_stats_snap_is_hist(snap, i)) {
+	    ipmi_cmdlang_out(cmd_info, "Histogram", NULL);
+	    ipmi_cmdlang_down(cmd_info);
+	    ipmi_cmdlang_out(cmd_info, "Name", name);
+	    ipmi_cmdlang_out(cmd_info, "Instance", inst);
+	    ipmi_cmdlang_out_long(cmd_info, "Count", samples);
+	    if (samples) {
+		ipmi_cmdlang_out_long
+		    (cmd_info, "Mean",
+		     ipmi_domain_stats_snap_hist_sum(snap, i) / samples);
+		ipmi_cmdlang_out_long
+		    (cmd_info, "P50",
+		     ipmi_domain_stats_snap_hist_percentile(snap, i, 50));
+		ipmi_cmdlang_out_long
+		    (cmd_info, "P90",
+		     ipmi_domain_stats_snap_hist_percentile(snap, i, 90));
+		ipmi_cmdlang_out_long
+		    (cmd_info, "P99",
+		     ipmi_domain_stats_snap_hist_percentile(snap, i, 99));
+		ipmi_cmdlang_out_long(cmd_info, "Max",
+				      ipmi_domain_stats_snap_hist_max(snap, i));
+	    }
+	    ipmi_cmdlang_up(cmd_info);
+	    continue;
+	}
+
+	s = ipmi_mem_alloc(strlen(name) + strlen(inst) + 2);
+	if (!s)
+	    continue;
+	sprintf(s, "%s %s", name, inst);
+	ipmi_cmdlang_out_long(cmd_info, s, samples);
+	ipmi_mem_free(s);
+    }
     ipmi_cmdlang_up(cmd_info);
+    ipmi_domain_stats_snap_free(snap);
+    return;
+
+ out_err:
+    ipmi_domain_get_name(domain, cmdlang->objstr, cmdlang->objstr_len);
+    cmdlang->location = "cmd_domain.c(domain_stats)";
 }
 
 typedef struct domain_close_info_s
@@ -1283,7 +1339,8 @@ static ipmi_cmdlang_init_t cmds_domain[] =
       " for this domain.  zero disables scans.",
       ipmi_cmdlang_domain_handler, domain_ipmb_rescan_time, NULL },
     { "stats", &domain_cmds,
-      "<domain> - Dump all the domain's statistics",
+      "<domain> [-zero] - Dump all the domain's statistics, counters"
+      " and latency histograms.  -zero clears them after reading.",
       ipmi_cmdlang_domain_handler, domain_stats, NULL },
 };
 #define CMDS_DOMAIN_LEN (sizeof(cmds_domain)/sizeof(ipmi_cmdlang_init_t))
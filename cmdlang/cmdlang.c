@@ -1539,6 +1539,12 @@ ipmi_cmdlang_out_int(ipmi_cmd_info_t *info,
 {
     char sval[20];
 
+    if (info->cmdlang->out_int) {
+	info->did_output = 1;
+	info->cmdlang->out_int(info->cmdlang, name, value);
+	return;
+    }
+
     sprintf(sval, "%d", value);
     ipmi_cmdlang_out(info, name, sval);
 }
@@ -1550,6 +1556,12 @@ ipmi_cmdlang_out_double(ipmi_cmd_info_t *info,
 {
     char sval[80];
 
+    if (info->cmdlang->out_double) {
+	info->did_output = 1;
+	info->cmdlang->out_double(info->cmdlang, name, value);
+	return;
+    }
+
     sprintf(sval, "%e", value);
     ipmi_cmdlang_out(info, name, sval);
 }
@@ -1561,6 +1573,13 @@ ipmi_cmdlang_out_hex(ipmi_cmd_info_t *info,
 {
     char sval[20];
 
+    if (info->cmdlang->out_int) {
+	info->did_output = 1;
+	info->cmdlang->out_int(info->cmdlang, name,
+			       (unsigned int) value);
+	return;
+    }
+
     sprintf(sval, "0x%x", value);
     ipmi_cmdlang_out(info, name, sval);
 }
@@ -1572,6 +1591,12 @@ ipmi_cmdlang_out_long(ipmi_cmd_info_t *info,
 {
     char sval[32];
 
+    if (info->cmdlang->out_int) {
+	info->did_output = 1;
+	info->cmdlang->out_int(info->cmdlang, name, value);
+	return;
+    }
+
     sprintf(sval, "%ld", value);
     ipmi_cmdlang_out(info, name, sval);
 }
@@ -1621,6 +1646,12 @@ ipmi_cmdlang_out_bool(ipmi_cmd_info_t *info,
 		      const char      *name,
 		      int             value)
 {
+    if (info->cmdlang->out_bool) {
+	info->did_output = 1;
+	info->cmdlang->out_bool(info->cmdlang, name, value != 0);
+	return;
+    }
+
     if (value)
 	ipmi_cmdlang_out(info, name, "true");
     else
@@ -1634,6 +1665,12 @@ ipmi_cmdlang_out_time(ipmi_cmd_info_t *info,
 {
     char sval[40];
 
+    if (info->cmdlang->out_int) {
+	info->did_output = 1;
+	info->cmdlang->out_int(info->cmdlang, name, value);
+	return;
+    }
+
     sprintf(sval, "%lld", (long long) value);
     ipmi_cmdlang_out(info, name, sval);
 }
@@ -1645,6 +1682,12 @@ ipmi_cmdlang_out_timeout(ipmi_cmd_info_t *info,
 {
     char sval[40];
 
+    if (info->cmdlang->out_int) {
+	info->did_output = 1;
+	info->cmdlang->out_int(info->cmdlang, name, value);
+	return;
+    }
+
     sprintf(sval, "%lld", (long long) value);
     ipmi_cmdlang_out(info, name, sval);
 }
@@ -2706,6 +2749,38 @@ debug(ipmi_cmd_info_t *cmd_info)
 	cmdlang->location = "cmdlang.c(debug)";
 }
 
+static void
+memstats_cache(const char    *name,
+	       unsigned int  size,
+	       unsigned int  obj_size,
+	       unsigned long in_use,
+	       unsigned long high_water,
+	       unsigned long allocs,
+	       void          *cb_data)
+{
+    ipmi_cmd_info_t *cmd_info = cb_data;
+
+    ipmi_cmdlang_out(cmd_info, "Cache", NULL);
+    ipmi_cmdlang_down(cmd_info);
+    ipmi_cmdlang_out(cmd_info, "Name", name);
+    ipmi_cmdlang_out_int(cmd_info, "Size", size);
+    ipmi_cmdlang_out_int(cmd_info, "Object Size", obj_size);
+    ipmi_cmdlang_out_long(cmd_info, "In Use", in_use);
+    ipmi_cmdlang_out_long(cmd_info, "High Water", high_water);
+    ipmi_cmdlang_out_long(cmd_info, "Allocs", allocs);
+    ipmi_cmdlang_up(cmd_info);
+}
+
+static void
+memstats(ipmi_cmd_info_t *cmd_info)
+{
+    ipmi_cmdlang_out(cmd_info, "Memory caches", NULL);
+    ipmi_cmdlang_down(cmd_info);
+    ipmi_cmdlang_out_long(cmd_info, "Slab Bytes", ipmi_mem_cache_slab_bytes());
+    ipmi_mem_cache_report(memstats_cache, cmd_info);
+    ipmi_cmdlang_up(cmd_info);
+}
+
 static ipmi_cmdlang_init_t cmds_global[] =
 {
     { "evinfo", NULL,
@@ -2719,6 +2794,10 @@ static ipmi_cmdlang_init_t cmds_global[] =
       " msg, rawmsg, events, con0, con1, con2, con3.  This is primarily"
       " for designers of OpenIPMI trying to debug problems.",
       debug, NULL, NULL },
+    { "memstats", NULL,
+      "- Show the occupancy and high-water mark of the memory caches"
+      " for the frequently allocated objects.",
+      memstats, NULL, NULL },
 };
 #define CMDS_GLOBAL_LEN (sizeof(cmds_global)/sizeof(ipmi_cmdlang_init_t))
 
@@ -84,6 +84,7 @@ static int done = 0;
 static int evcount = 0;
 static int handling_input = 0;
 static int cmd_redisp = 1;
+static int read_nest = 0;
 #ifdef HAVE_UCDSNMP
 static int do_snmp = 0;
 #endif
@@ -103,6 +104,9 @@ redraw_cmdline(int force)
     }
 }
 
+/* Logs go to stderr with structured output, to keep stdout clean. */
+static FILE *log_stream;
+
 static void
 my_vlog(os_handler_t         *handler,
 	const char           *format,
@@ -113,28 +117,28 @@ my_vlog(os_handler_t         *handler,
     static int last_was_cont = 0;
 
     if (handling_input && !last_was_cont && !done && cmd_redisp) 
-	fputc('\n', stdout);
+	fputc('\n', log_stream);
 
     last_was_cont = 0;
     switch(log_type) {
     case IPMI_LOG_INFO:
-	printf("INFO: ");
+	fprintf(log_stream, "INFO: ");
 	break;
 
     case IPMI_LOG_WARNING:
-	printf("WARN: ");
+	fprintf(log_stream, "WARN: ");
 	break;
 
     case IPMI_LOG_SEVERE:
-	printf("SEVR: ");
+	fprintf(log_stream, "SEVR: ");
 	break;
 
     case IPMI_LOG_FATAL:
-	printf("FATL: ");
+	fprintf(log_stream, "FATL: ");
 	break;
 
     case IPMI_LOG_ERR_INFO:
-	printf("EINF: ");
+	fprintf(log_stream, "EINF: ");
 	break;
 
     case IPMI_LOG_DEBUG_START:
@@ -142,7 +146,7 @@ my_vlog(os_handler_t         *handler,
 	last_was_cont = 1;
 	/* FALLTHROUGH */
     case IPMI_LOG_DEBUG:
-	printf("DEBG: ");
+	fprintf(log_stream, "DEBG: ");
 	break;
 
     case IPMI_LOG_DEBUG_CONT:
@@ -153,9 +157,9 @@ my_vlog(os_handler_t         *handler,
 	break;
     }
 
-    vprintf(format, ap);
+    vfprintf(log_stream, format, ap);
     if (do_nl) {
-	printf("\n");
+	fprintf(log_stream, "\n");
 	redraw_cmdline(0);
     }
 }
@@ -562,6 +566,10 @@ up_level(ipmi_cmdlang_t *info)
 
 static void cmd_done(ipmi_cmdlang_t *info);
 
+/* Set if the output is JSON or CBOR instead of text. */
+static enum ipmi_cmdlang_sout_format sout_format;
+static ipmi_cmdlang_sout_t *sout;
+
 static out_data_t lout_data =
 {
     .stream = NULL,
@@ -587,33 +595,52 @@ static ipmi_cmdlang_t cmdlang =
 
 int *done_ptr = NULL;
 
+/* Print the error from a command, if any, to s (NULL for none) and
+   clear it. */
+static void
+cmd_err(FILE *s, ipmi_cmdlang_t *info)
+{
+    char errval[128];
+
+    if (!info->err)
+	return;
+
+    if (!info->location)
+	info->location = "";
+    if (!s) {
+	/* Already in the structured output. */
+    } else if (strlen(info->objstr) == 0) {
+	fprintf(s, "error: %s: %s (0x%x, %s)\n",
+		info->location, info->errstr,
+		info->err,
+		ipmi_get_error_string(info->err, errval, sizeof(errval)));
+    } else {
+	fprintf(s, "error: %s %s: %s (0x%x, %s)\n",
+		info->location, info->objstr, info->errstr,
+		info->err,
+		ipmi_get_error_string(info->err, errval, sizeof(errval)));
+    }
+    if (info->errstr_dynalloc)
+	ipmi_mem_free(info->errstr);
+    info->errstr_dynalloc = 0;
+    info->errstr = NULL;
+    info->location = NULL;
+    info->objstr[0] = '\0';
+    info->err = 0;
+}
+
 static void
 cmd_done(ipmi_cmdlang_t *info)
 {
     out_data_t *out_data = info->user_data;
 
-    if (info->err) {
-	char errval[128];
-	if (!info->location)
-	    info->location = "";
-	if (strlen(info->objstr) == 0) {
-	    fprintf(out_data->stream, "error: %s: %s (0x%x, %s)\n",
-		    info->location, info->errstr,
-		    info->err,
-		    ipmi_get_error_string(info->err, errval, sizeof(errval)));
-	} else {
-	    fprintf(out_data->stream, "error: %s %s: %s (0x%x, %s)\n",
-		    info->location, info->objstr, info->errstr,
-		    info->err,
-		    ipmi_get_error_string(info->err, errval, sizeof(errval)));
-	}
-	if (info->errstr_dynalloc)
-	    ipmi_mem_free(info->errstr);
-	info->errstr_dynalloc = 0;
-	info->errstr = NULL;
-	info->location = NULL;
-	info->objstr[0] = '\0';
-	info->err = 0;
+    if (sout) {
+	/* The user data is the structured output. */
+	ipmi_cmdlang_sout_done(info);
+	out_data = &lout_data;
+	cmd_err(NULL, info);
+    } else {
+	cmd_err(out_data->stream, info);
     }
 
     if (done_ptr) {
@@ -626,6 +653,160 @@ cmd_done(ipmi_cmdlang_t *info)
     }
 }
 
+/*
+ * Pipelined commands.  With --pipeline N, up to N commands run at
+ * once instead of waiting for each to finish before reading the next.
+ * Each command gets its own cmdlang, its output is kept until it is
+ * done and then written tagged with the command's number (counting
+ * from 1 in the order the commands are read, skipping blank lines and
+ * comments) and, in text mode, the command itself, so the output of
+ * different commands is not mixed but may come out of order.  "sync"
+ * waits for all commands before it to finish.
+ */
+typedef struct pipe_cmd_s
+{
+    ipmi_cmdlang_t      cmdlang;
+    out_data_t          out_data;
+    char                *outbuf;
+    size_t              outlen;
+    ipmi_cmdlang_sout_t *sout;
+    int                 waiting;
+    char                objstr[IPMI_MAX_NAME_LEN];
+} pipe_cmd_t;
+
+static unsigned int pipeline_max;
+static unsigned int pipe_in_flight;
+/* "read" commands waiting for their own commands, they don't count
+   against the limit. */
+static unsigned int pipe_waiting;
+static unsigned long pipe_tag;
+static ipmi_cmd_info_t *pipe_sync_info;
+
+static int
+pipe_full(void)
+{
+    return pipe_sync_info || (pipe_in_flight - pipe_waiting >= pipeline_max);
+}
+
+static void pipe_cmd_done(ipmi_cmdlang_t *info);
+
+static pipe_cmd_t *
+pipe_cmd(ipmi_cmdlang_t *cmdlang)
+{
+    if (cmdlang->done != pipe_cmd_done)
+	return NULL;
+    /* The cmdlang is the first thing in the structure. */
+    return (pipe_cmd_t *) cmdlang;
+}
+
+static void
+pipe_cmd_done(ipmi_cmdlang_t *info)
+{
+    pipe_cmd_t      *pcmd = pipe_cmd(info);
+    ipmi_cmd_info_t *sync_info;
+
+    if (pcmd->sout) {
+	ipmi_cmdlang_sout_done(info);
+	cmd_err(NULL, info);
+	ipmi_cmdlang_sout_free(pcmd->sout);
+    } else {
+	cmd_err(pcmd->out_data.stream, info);
+	if (pcmd->out_data.stream != stdout) {
+	    fclose(pcmd->out_data.stream);
+	    fwrite(pcmd->outbuf, 1, pcmd->outlen, stdout);
+	    free(pcmd->outbuf);
+	}
+	fflush(stdout);
+    }
+    ipmi_mem_free(pcmd);
+    pipe_in_flight--;
+
+    if (pipe_sync_info && (pipe_in_flight - pipe_waiting == 1)) {
+	/* Only the sync is left. */
+	sync_info = pipe_sync_info;
+	pipe_sync_info = NULL;
+	ipmi_cmdlang_cmd_info_put(sync_info);
+    }
+
+    if (!done && !read_nest && !term_fd_id && !pipe_full()) {
+	handling_input = 1;
+	redraw_cmdline(1);
+	enable_term_fd(&cmdlang);
+    }
+}
+
+static void
+pipe_handle(char *str)
+{
+    pipe_cmd_t *pcmd;
+    int        rv;
+    size_t     len;
+
+    /* Blank lines and comments don't get a tag. */
+    if ((str[strspn(str, " \t\r\n")] == '\0') || (*str == '#'))
+	return;
+
+    pcmd = ipmi_mem_alloc(sizeof(*pcmd));
+    if (!pcmd)
+	goto out_nomem;
+    memset(pcmd, 0, sizeof(*pcmd));
+    pcmd->cmdlang = cmdlang;
+    pcmd->cmdlang.done = pipe_cmd_done;
+    pcmd->cmdlang.objstr = pcmd->objstr;
+    pcmd->cmdlang.objstr_len = sizeof(pcmd->objstr);
+    pcmd->cmdlang.err = 0;
+    pcmd->cmdlang.errstr = NULL;
+    pcmd->cmdlang.errstr_dynalloc = 0;
+    pcmd->cmdlang.location = NULL;
+
+    pipe_tag++;
+    if (sout) {
+	rv = ipmi_cmdlang_sout_alloc(sout_format, stdout, &pcmd->sout);
+	if (rv) {
+	    ipmi_mem_free(pcmd);
+	    goto out_nomem;
+	}
+	ipmi_cmdlang_sout_setup(pcmd->sout, &pcmd->cmdlang);
+	pcmd->cmdlang.out_int(&pcmd->cmdlang, "Tag", pipe_tag);
+    } else {
+	pcmd->cmdlang.user_data = &pcmd->out_data;
+	pcmd->out_data.stream = open_memstream(&pcmd->outbuf, &pcmd->outlen);
+	if (!pcmd->out_data.stream)
+	    /* Just write it as it comes. */
+	    pcmd->out_data.stream = stdout;
+	len = strcspn(str, "\r\n");
+	fprintf(pcmd->out_data.stream, "Tag: %lu > %.*s\n", pipe_tag,
+		(int) len, str);
+    }
+
+    pipe_in_flight++;
+    ipmi_cmdlang_handle(&pcmd->cmdlang, str);
+    return;
+
+ out_nomem:
+    fprintf(stderr, "Out of memory running command: %s\n", str);
+}
+
+/* Wait until another command can be started. */
+static void
+pipe_wait_slot(os_handler_t *os_hnd)
+{
+    while (pipe_full()) {
+	snmp_setup_fds(os_hnd);
+	os_hnd->perform_one_op(os_hnd, NULL);
+    }
+}
+
+/* Wait until all commands but the waiting "read"s are done. */
+static void
+pipe_wait_idle(os_handler_t *os_hnd)
+{
+    while (pipe_in_flight > pipe_waiting) {
+	snmp_setup_fds(os_hnd);
+	os_hnd->perform_one_op(os_hnd, NULL);
+    }
+}
+
 static void
 cmdlang_err(char *objstr,
 	    char *location,
@@ -653,6 +834,13 @@ cmdlang_report_event(ipmi_cmdlang_event_t *event)
     int                         indent2;
     unsigned int                i;
 
+    if (sout) {
+	ipmi_cmdlang_sout_event(sout, event);
+	evcount = 0;
+	redraw_cmdline(0);
+	return;
+    }
+
     if (handling_input && !done && cmd_redisp)
 	fputc('\n', stdout);
     ipmi_cmdlang_event_restart(event);
@@ -707,6 +895,13 @@ rl_ipmish_cb_handler(char *cmdline)
     result = history_expand(cmdline, &expansion);
     if (result < 0 || result == 2) {
 	fprintf(stderr, "%s\n", expansion);
+    } else if (expansion && strlen(expansion) && pipeline_max) {
+	add_history(expansion);
+	pipe_handle(expansion);
+	if (pipe_full()) {
+	    handling_input = 0;
+	    disable_term_fd(&cmdlang);
+	}
     } else if (expansion && strlen(expansion)){
 	cmdlang.err = 0;
 	cmdlang.errstr = NULL;
@@ -786,7 +981,18 @@ exit_cmd(ipmi_cmd_info_t *cmd_info)
     ipmi_cmdlang_out(cmd_info, "Exiting ipmish", NULL);
 }
 
-static int read_nest = 0;
+static void
+sync_cmd(ipmi_cmd_info_t *cmd_info)
+{
+    if (pipe_in_flight - pipe_waiting > 1) {
+	/* Hold this command until all the others are done, no new
+	   ones are started while it is held. */
+	ipmi_cmdlang_cmd_info_get(cmd_info);
+	pipe_sync_info = cmd_info;
+    }
+    ipmi_cmdlang_out(cmd_info, "Synced", NULL);
+}
+
 static void
 read_cmd(ipmi_cmd_info_t *cmd_info)
 {
@@ -801,6 +1007,7 @@ read_cmd(ipmi_cmd_info_t *cmd_info)
     char           **argv = ipmi_cmdlang_get_argv(cmd_info);
     int            *saved_done_ptr;
     char           *fname;
+    ipmi_cmdlang_sout_t *my_sout = NULL;
 
     if ((argc - curr_arg) < 1) {
 	cmdlang->errstr = "No filename entered";
@@ -817,6 +1024,17 @@ read_cmd(ipmi_cmd_info_t *cmd_info)
 	goto out_err;
     }
 
+    if (sout && !pipeline_max) {
+	/* The commands in the file get their own output objects. */
+	cmdlang->err = ipmi_cmdlang_sout_alloc(sout_format, stdout, &my_sout);
+	if (cmdlang->err) {
+	    fclose(s);
+	    cmdlang->errstr = "Unable to allocate output";
+	    goto out_err;
+	}
+	ipmi_cmdlang_sout_setup(my_sout, &my_cmdlang);
+    }
+
     if (!read_nest) {
 	handling_input = 0;
 	disable_term_fd(cmdlang);
@@ -824,15 +1042,36 @@ read_cmd(ipmi_cmd_info_t *cmd_info)
     read_nest++;
     saved_done_ptr = done_ptr;
 
+    if (pipeline_max) {
+	pipe_cmd_t *pcmd = pipe_cmd(cmdlang);
+
+	/* This just waits for its commands, don't count it. */
+	if (pcmd) {
+	    pcmd->waiting = 1;
+	    pipe_waiting++;
+	}
+	while (fgets(cmdline, sizeof(cmdline), s)) {
+	    pipe_wait_slot(cmdlang->os_hnd);
+	    pipe_handle(cmdline);
+	}
+	pipe_wait_idle(cmdlang->os_hnd);
+	if (pcmd) {
+	    pcmd->waiting = 0;
+	    pipe_waiting--;
+	}
+    }
+
     /* not record the file's commands into history */
-    while (fgets(cmdline, sizeof(cmdline), s)) {
-	my_out_data.stream = stdout;
-	my_out_data.indent = 0;
-	my_cmdlang.user_data = &my_out_data;
+    while (!pipeline_max && fgets(cmdline, sizeof(cmdline), s)) {
 	cdone = 0;
 	done_ptr = &cdone;
-	printf("> %s", cmdline);
-	fflush(stdout);
+	if (!my_sout) {
+	    my_out_data.stream = stdout;
+	    my_out_data.indent = 0;
+	    my_cmdlang.user_data = &my_out_data;
+	    printf("> %s", cmdline);
+	    fflush(stdout);
+	}
 	ipmi_cmdlang_handle(&my_cmdlang, cmdline);
 	while (!cdone) {
 	    snmp_setup_fds(cmdlang->os_hnd);
@@ -841,10 +1080,13 @@ read_cmd(ipmi_cmd_info_t *cmd_info)
 	done_ptr = NULL;
     }
     fclose(s);
+    if (my_sout)
+	ipmi_cmdlang_sout_free(my_sout);
 
     done_ptr = saved_done_ptr;
     read_nest--;
-    if (!read_nest) {
+    if (!read_nest && !pipeline_max) {
+	/* When pipelined, this is done when the read is done. */
 	handling_input = 1;
 	enable_term_fd(cmdlang);
     }
@@ -882,6 +1124,17 @@ setup_cmds(void)
 	exit(1);
     }
 
+    rv = ipmi_cmdlang_reg_cmd(NULL,
+			      "sync",
+			      "- Wait for all commands before this one to"
+			      " finish before starting any more.  Only useful"
+			      " with --pipeline.",
+			      sync_cmd, NULL, NULL, NULL);
+    if (rv) {
+	fprintf(stderr, "Error adding sync command: 0x%x\n", rv);
+	exit(1);
+    }
+
     rv = ipmi_cmdlang_reg_cmd(NULL,
 			      "read",
 			      "<file> - Read commands from the file and"
@@ -964,6 +1217,11 @@ static char *usage_str =
 "  --drawmsg - turn on raw message tracing.\n"
 "  --dmsg - turn on message tracing debugging.\n"
 "  --dmsgerr - turn on printing out low-level message errors.\n"
+"  --pipeline <n> - run up to n commands at once.  Output is tagged\n"
+"    with the command number (and the command in text mode), use the\n"
+"    sync command to wait for the commands before it.\n"
+"  --output text|json|cbor - the format of command output and events.\n"
+"    json writes one object per line, cbor one item per command.\n"
 #ifdef HAVE_GLIB
 "  --glib - use glib for the OS handler.\n"
 #endif
@@ -988,6 +1246,7 @@ main(int argc, char *argv[])
     const char       *arg;
     os_handler_t     *os_hnd;
     int              use_debug_os = 0;
+    int              use_sout = 0;
     char             *colstr;
 #ifdef HAVE_GLIB
     int              use_glib = 0;
@@ -1031,6 +1290,44 @@ main(int argc, char *argv[])
 	    DEBUG_MSG_ENABLE();
 	} else if (strcmp(arg, "--dmsgerr") == 0) {
 	    DEBUG_MSG_ERR_ENABLE();
+	} else if (strcmp(arg, "--pipeline") == 0) {
+	    char *end;
+
+	    if (curr_arg >= argc) {
+		fprintf(stderr, "No option given for %s", arg);
+		usage(argv[0]);
+		return 1;
+	    }
+	    pipeline_max = strtoul(argv[curr_arg], &end, 0);
+	    if ((*end != '\0') || (pipeline_max < 1)) {
+		fprintf(stderr, "Invalid pipeline size: %s\n", argv[curr_arg]);
+		usage(argv[0]);
+		return 1;
+	    }
+	    if (pipeline_max == 1)
+		/* One at a time is the normal way. */
+		pipeline_max = 0;
+	    curr_arg++;
+	} else if (strcmp(arg, "--output") == 0) {
+	    if (curr_arg >= argc) {
+		fprintf(stderr, "No option given for %s", arg);
+		usage(argv[0]);
+		return 1;
+	    }
+	    if (strcmp(argv[curr_arg], "json") == 0) {
+		sout_format = IPMI_CMDLANG_SOUT_JSON;
+		use_sout = 1;
+	    } else if (strcmp(argv[curr_arg], "cbor") == 0) {
+		sout_format = IPMI_CMDLANG_SOUT_CBOR;
+		use_sout = 1;
+	    } else if (strcmp(argv[curr_arg], "text") == 0) {
+		use_sout = 0;
+	    } else {
+		fprintf(stderr, "Unknown output format: %s\n", argv[curr_arg]);
+		usage(argv[0]);
+		return 1;
+	    }
+	    curr_arg++;
 #ifdef HAVE_UCDSNMP
 	} else if (strcmp(arg, "--snmp") == 0) {
 	    do_snmp = 1;
@@ -1054,6 +1351,9 @@ main(int argc, char *argv[])
     }
 
     rl_initialize();
+    if (use_sout)
+	/* Keep the prompt and echo out of the output. */
+	rl_outstream = stderr;
 
     if (use_debug_os) {
 	os_hnd = &ipmi_debug_os_handlers;
@@ -1100,6 +1400,7 @@ main(int argc, char *argv[])
 	}
     }
 
+    log_stream = use_sout ? stderr : stdout;
     os_hnd->set_log_handler(os_hnd, my_vlog);
 
     /* Initialize the OpenIPMI library. */
@@ -1122,13 +1423,33 @@ main(int argc, char *argv[])
 
     setup_term(os_hnd);
 
+    if (use_sout) {
+	rv = ipmi_cmdlang_sout_alloc(sout_format, stdout, &sout);
+	if (rv) {
+	    fprintf(stderr, "Unable to allocate output: 0x%x\n", rv);
+	    return 1;
+	}
+	ipmi_cmdlang_sout_setup(sout, &cmdlang);
+    }
+
     while (execs) {
 	exec_list_t *e = execs;
 	int         cdone = 0;
 	read_nest = 1;
 	execs = e->next;
-	printf("> %s\n", e->str);
-	fflush(stdout);
+	if (pipeline_max) {
+	    pipe_wait_slot(os_hnd);
+	    rl_ipmish_cb_handler(e->str);
+	    free(e);
+	    if (!execs)
+		pipe_wait_idle(os_hnd);
+	    read_nest = 0;
+	    continue;
+	}
+	if (!sout) {
+	    printf("> %s\n", e->str);
+	    fflush(stdout);
+	}
 	done_ptr = &cdone;
 	rl_ipmish_cb_handler(e->str);
 	while (!cdone) {
@@ -1150,6 +1471,9 @@ main(int argc, char *argv[])
 	os_hnd->perform_one_op(os_hnd, NULL);
     }
 
+    /* Let any pipelined commands finish. */
+    pipe_wait_idle(os_hnd);
+
     cleanup_term();
 
     /* Shut down all existing domains. */
@@ -1162,6 +1486,8 @@ main(int argc, char *argv[])
     }
 
     ipmi_cmdlang_cleanup();
+    if (sout)
+	ipmi_cmdlang_sout_free(sout);
     ipmi_shutdown();
 
     ipmi_debug_malloc_cleanup();
@@ -1169,10 +1495,10 @@ main(int argc, char *argv[])
     os_hnd->free_os_handler(os_hnd);
 
     /* remove the prompt which editline printed */
-    printf("\b\b  \b\b");
+    fprintf(log_stream, "\b\b  \b\b");
     if (evcount)
-	printf("\n");
-    fflush(stdout);
+	fprintf(log_stream, "\n");
+    fflush(log_stream);
 
     if (rv)
 	return 1;
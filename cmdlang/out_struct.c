@@ -0,0 +1,871 @@
+/*
+ * out_struct.c
+ *
+ * Structured (JSON and CBOR) output for the OpenIPMI command
+ * interpreter.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <OpenIPMI/ipmi_err.h>
+#include <OpenIPMI/ipmi_cmdlang.h>
+
+/* Internal includes, do not use in your programs */
+#include <OpenIPMI/internal/ipmi_malloc.h>
+
+/*
+ * The output of a command is kept as a tree of nodes.  Each node is a
+ * name with an optional value, the children are what was output after
+ * a "down" following the node.  Nodes and strings are allocated from
+ * chunks that are all freed when the command is done, a big command
+ * output does not do a malloc per field.
+ */
+#define SOUT_CHUNK_SIZE	16384
+
+enum sout_type {
+    SOUT_NULL,
+    SOUT_STR,
+    SOUT_BIN,
+    SOUT_INT,
+    SOUT_DOUBLE,
+    SOUT_BOOL
+};
+
+typedef struct sout_node_s sout_node_t;
+struct sout_node_s
+{
+    const char     *name;
+    enum sout_type type;
+    unsigned int   len;
+    union {
+	const char *s;
+	long long  i;
+	double     d;
+    } v;
+
+    /* Nodes with the same name in an object, set up when writing. */
+    int            grouped;
+    unsigned int   count;
+    sout_node_t    *same;
+
+    sout_node_t    *parent;
+    sout_node_t    *children, *last;
+    sout_node_t    *next;
+};
+
+typedef struct sout_chunk_s sout_chunk_t;
+struct sout_chunk_s
+{
+    sout_chunk_t *next;
+    size_t       size;
+    size_t       used;
+    double       data[0]; /* double for alignment */
+};
+
+typedef struct sout_tree_s
+{
+    sout_chunk_t *chunks;
+    sout_node_t  root;
+    sout_node_t  *cur;
+    int          nomem;
+} sout_tree_t;
+
+struct ipmi_cmdlang_sout_s
+{
+    enum ipmi_cmdlang_sout_format format;
+    FILE                          *stream;
+
+    sout_tree_t                   tree;
+
+    /* The encoded output, kept between commands. */
+    unsigned char                 *buf;
+    size_t                        len;
+    size_t                        size;
+};
+
+static void
+tree_init(sout_tree_t *tree)
+{
+    memset(tree, 0, sizeof(*tree));
+    tree->cur = &tree->root;
+}
+
+/* Free everything but the first chunk and empty the tree. */
+static void
+tree_reset(sout_tree_t *tree)
+{
+    sout_chunk_t *chunk = tree->chunks;
+
+    if (chunk) {
+	sout_chunk_t *c;
+
+	while (chunk->next) {
+	    c = chunk->next;
+	    chunk->next = c->next;
+	    ipmi_mem_free(c);
+	}
+	chunk->used = 0;
+    }
+    memset(&tree->root, 0, sizeof(tree->root));
+    tree->cur = &tree->root;
+    tree->nomem = 0;
+}
+
+static void
+tree_free(sout_tree_t *tree)
+{
+    tree_reset(tree);
+    if (tree->chunks)
+	ipmi_mem_free(tree->chunks);
+    tree->chunks = NULL;
+}
+
+static void *
+tree_alloc(sout_tree_t *tree, size_t size)
+{
+    sout_chunk_t *chunk = tree->chunks;
+    size_t       csize;
+    void         *rv;
+
+    size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    if (!chunk || (chunk->size - chunk->used < size)) {
+	csize = SOUT_CHUNK_SIZE;
+	if (size > csize)
+	    csize = size;
+	chunk = ipmi_mem_alloc(sizeof(*chunk) + csize);
+	if (!chunk) {
+	    tree->nomem = 1;
+	    return NULL;
+	}
+	chunk->size = csize;
+	chunk->used = 0;
+	if (tree->chunks) {
+	    /* Keep the first chunk first, it is the one kept on reset. */
+	    chunk->next = tree->chunks->next;
+	    tree->chunks->next = chunk;
+	} else {
+	    chunk->next = NULL;
+	    tree->chunks = chunk;
+	}
+    }
+    rv = ((char *) chunk->data) + chunk->used;
+    chunk->used += size;
+    return rv;
+}
+
+static const char *
+tree_strdup(sout_tree_t *tree, const char *str, unsigned int len)
+{
+    char *s = tree_alloc(tree, len + 1);
+
+    if (!s)
+	return NULL;
+    memcpy(s, str, len);
+    s[len] = '\0';
+    return s;
+}
+
+static sout_node_t *
+tree_add(sout_tree_t *tree, sout_node_t *parent, const char *name,
+	 enum sout_type type)
+{
+    sout_node_t *node;
+
+    if (tree->nomem)
+	return NULL;
+    node = tree_alloc(tree, sizeof(*node));
+    if (!node)
+	return NULL;
+    memset(node, 0, sizeof(*node));
+    node->name = tree_strdup(tree, name, strlen(name));
+    if (!node->name)
+	return NULL;
+    node->type = type;
+    node->parent = parent;
+    if (parent->last)
+	parent->last->next = node;
+    else
+	parent->children = node;
+    parent->last = node;
+    return node;
+}
+
+static int
+tree_add_str(sout_tree_t *tree, sout_node_t *parent, const char *name,
+	     enum sout_type type, const char *value, unsigned int len)
+{
+    sout_node_t *node;
+
+    node = tree_add(tree, parent, name, type);
+    if (!node)
+	return ENOMEM;
+    node->len = len;
+    node->v.s = tree_strdup(tree, value, len);
+    if (!node->v.s)
+	return ENOMEM;
+    return 0;
+}
+
+static void
+tree_down(sout_tree_t *tree)
+{
+    sout_node_t *node = tree->cur->last;
+
+    if (!node) {
+	/* Nesting without a name, give it an empty one. */
+	node = tree_add(tree, tree->cur, "", SOUT_NULL);
+	if (!node)
+	    return;
+    }
+    tree->cur = node;
+}
+
+static void
+tree_up(sout_tree_t *tree)
+{
+    if (tree->cur->parent)
+	tree->cur = tree->cur->parent;
+}
+
+/*
+ * Link the children of node with the same name together and return
+ * the number of distinct names.  This is quadratic in the number of
+ * distinct names, but objects only have a few of those; the long
+ * lists (sensors, entities, etc.) are many nodes with one name.
+ */
+static unsigned int
+group_children(sout_node_t *node)
+{
+    sout_node_t  *c, *d, *tail;
+    unsigned int groups = 0;
+
+    for (c = node->children; c; c = c->next) {
+	if (c->grouped)
+	    continue;
+	groups++;
+	c->count = 1;
+	c->same = NULL;
+	tail = c;
+	for (d = c->next; d; d = d->next) {
+	    if (!d->grouped && (strcmp(d->name, c->name) == 0)) {
+		d->grouped = 1;
+		d->same = NULL;
+		tail->same = d;
+		tail = d;
+		c->count++;
+	    }
+	}
+    }
+    return groups;
+}
+
+/*
+ * The output buffer.
+ */
+static int
+buf_need(ipmi_cmdlang_sout_t *sout, size_t len)
+{
+    unsigned char *nbuf;
+    size_t        nsize;
+
+    if (sout->size - sout->len >= len)
+	return 0;
+    nsize = sout->size * 2;
+    while (nsize - sout->len < len)
+	nsize *= 2;
+    nbuf = ipmi_mem_alloc(nsize);
+    if (!nbuf)
+	return ENOMEM;
+    memcpy(nbuf, sout->buf, sout->len);
+    ipmi_mem_free(sout->buf);
+    sout->buf = nbuf;
+    sout->size = nsize;
+    return 0;
+}
+
+static int
+buf_put(ipmi_cmdlang_sout_t *sout, const void *data, size_t len)
+{
+    if (buf_need(sout, len))
+	return ENOMEM;
+    memcpy(sout->buf + sout->len, data, len);
+    sout->len += len;
+    return 0;
+}
+
+static int
+buf_byte(ipmi_cmdlang_sout_t *sout, unsigned char c)
+{
+    return buf_put(sout, &c, 1);
+}
+
+/*
+ * JSON encoding.
+ */
+static int
+json_str(ipmi_cmdlang_sout_t *sout, const char *str, unsigned int len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *) str;
+    unsigned int  i, start;
+    char          esc[6];
+    int           rv;
+
+    rv = buf_byte(sout, '"');
+    for (i = 0, start = 0; !rv && (i < len); i++) {
+	if ((s[i] >= 0x20) && (s[i] != '"') && (s[i] != '\\'))
+	    continue;
+	rv = buf_put(sout, s + start, i - start);
+	if (rv)
+	    break;
+	start = i + 1;
+	if ((s[i] == '"') || (s[i] == '\\')) {
+	    esc[0] = '\\';
+	    esc[1] = s[i];
+	    rv = buf_put(sout, esc, 2);
+	} else {
+	    esc[0] = '\\';
+	    esc[1] = 'u';
+	    esc[2] = '0';
+	    esc[3] = '0';
+	    esc[4] = hex[s[i] >> 4];
+	    esc[5] = hex[s[i] & 0xf];
+	    rv = buf_put(sout, esc, 6);
+	}
+    }
+    if (!rv)
+	rv = buf_put(sout, s + start, len - start);
+    if (!rv)
+	rv = buf_byte(sout, '"');
+    return rv;
+}
+
+static int
+json_scalar(ipmi_cmdlang_sout_t *sout, sout_node_t *node)
+{
+    char         num[32];
+    unsigned int i;
+    int          rv = 0;
+
+    switch (node->type) {
+    case SOUT_NULL:
+	return buf_put(sout, "null", 4);
+
+    case SOUT_STR:
+	return json_str(sout, node->v.s, node->len);
+
+    case SOUT_BIN:
+	rv = buf_byte(sout, '[');
+	for (i = 0; !rv && (i < node->len); i++) {
+	    sprintf(num, i ? ",%u" : "%u",
+		    (unsigned char) node->v.s[i]);
+	    rv = buf_put(sout, num, strlen(num));
+	}
+	if (!rv)
+	    rv = buf_byte(sout, ']');
+	return rv;
+
+    case SOUT_INT:
+	sprintf(num, "%lld", node->v.i);
+	return buf_put(sout, num, strlen(num));
+
+    case SOUT_DOUBLE:
+	if (!isfinite(node->v.d))
+	    return buf_put(sout, "null", 4);
+	sprintf(num, "%.17g", node->v.d);
+	return buf_put(sout, num, strlen(num));
+
+    case SOUT_BOOL:
+	if (node->v.i)
+	    return buf_put(sout, "true", 4);
+	return buf_put(sout, "false", 5);
+    }
+    return 0;
+}
+
+static int json_value(ipmi_cmdlang_sout_t *sout, sout_node_t *node);
+
+static int
+json_object(ipmi_cmdlang_sout_t *sout, sout_node_t *node)
+{
+    sout_node_t *c, *d;
+    int         first = 1;
+    int         rv;
+
+    group_children(node);
+    rv = buf_byte(sout, '{');
+    if (!rv && (node->type != SOUT_NULL)) {
+	rv = buf_put(sout, "\"value\":", 8);
+	if (!rv)
+	    rv = json_scalar(sout, node);
+	first = 0;
+    }
+    for (c = node->children; !rv && c; c = c->next) {
+	if (c->grouped)
+	    continue;
+	if (!first)
+	    rv = buf_byte(sout, ',');
+	first = 0;
+	if (!rv)
+	    rv = json_str(sout, c->name, strlen(c->name));
+	if (!rv)
+	    rv = buf_byte(sout, ':');
+	if (rv)
+	    break;
+	if (c->count == 1) {
+	    rv = json_value(sout, c);
+	    continue;
+	}
+	rv = buf_byte(sout, '[');
+	for (d = c; !rv && d; d = d->same) {
+	    if (d != c)
+		rv = buf_byte(sout, ',');
+	    if (!rv)
+		rv = json_value(sout, d);
+	}
+	if (!rv)
+	    rv = buf_byte(sout, ']');
+    }
+    if (!rv)
+	rv = buf_byte(sout, '}');
+    return rv;
+}
+
+static int
+json_value(ipmi_cmdlang_sout_t *sout, sout_node_t *node)
+{
+    if (node->children)
+	return json_object(sout, node);
+    return json_scalar(sout, node);
+}
+
+/*
+ * CBOR (RFC 7049) encoding.
+ */
+static int
+cbor_head(ipmi_cmdlang_sout_t *sout, unsigned int major,
+	  unsigned long long val)
+{
+    unsigned char b[9];
+    unsigned int  n, i;
+
+    major <<= 5;
+    if (val < 24) {
+	b[0] = major | val;
+	return buf_put(sout, b, 1);
+    } else if (val <= 0xff) {
+	b[0] = major | 24;
+	n = 1;
+    } else if (val <= 0xffff) {
+	b[0] = major | 25;
+	n = 2;
+    } else if (val <= 0xffffffffULL) {
+	b[0] = major | 26;
+	n = 4;
+    } else {
+	b[0] = major | 27;
+	n = 8;
+    }
+    for (i = n; i > 0; i--) {
+	b[i] = val & 0xff;
+	val >>= 8;
+    }
+    return buf_put(sout, b, n + 1);
+}
+
+static int
+cbor_bytes(ipmi_cmdlang_sout_t *sout, unsigned int major,
+	   const char *data, unsigned int len)
+{
+    int rv;
+
+    rv = cbor_head(sout, major, len);
+    if (!rv)
+	rv = buf_put(sout, data, len);
+    return rv;
+}
+
+static int
+cbor_scalar(ipmi_cmdlang_sout_t *sout, sout_node_t *node)
+{
+    unsigned char      b[9];
+    unsigned long long bits;
+    int                i;
+
+    switch (node->type) {
+    case SOUT_NULL:
+	return buf_byte(sout, 0xf6);
+
+    case SOUT_STR:
+	return cbor_bytes(sout, 3, node->v.s, node->len);
+
+    case SOUT_BIN:
+	return cbor_bytes(sout, 2, node->v.s, node->len);
+
+    case SOUT_INT:
+	if (node->v.i >= 0)
+	    return cbor_head(sout, 0, node->v.i);
+	return cbor_head(sout, 1, -1 - node->v.i);
+
+    case SOUT_DOUBLE:
+	memcpy(&bits, &node->v.d, sizeof(bits));
+	b[0] = 0xfb;
+	for (i = 8; i > 0; i--) {
+	    b[i] = bits & 0xff;
+	    bits >>= 8;
+	}
+	return buf_put(sout, b, 9);
+
+    case SOUT_BOOL:
+	return buf_byte(sout, node->v.i ? 0xf5 : 0xf4);
+    }
+    return 0;
+}
+
+static int cbor_value(ipmi_cmdlang_sout_t *sout, sout_node_t *node);
+
+static int
+cbor_object(ipmi_cmdlang_sout_t *sout, sout_node_t *node)
+{
+    sout_node_t  *c, *d;
+    unsigned int count;
+    int          rv;
+
+    count = group_children(node);
+    if (node->type != SOUT_NULL)
+	count++;
+    rv = cbor_head(sout, 5, count);
+    if (!rv && (node->type != SOUT_NULL)) {
+	rv = cbor_bytes(sout, 3, "value", 5);
+	if (!rv)
+	    rv = cbor_scalar(sout, node);
+    }
+    for (c = node->children; !rv && c; c = c->next) {
+	if (c->grouped)
+	    continue;
+	rv = cbor_bytes(sout, 3, c->name, strlen(c->name));
+	if (rv)
+	    break;
+	if (c->count == 1) {
+	    rv = cbor_value(sout, c);
+	    continue;
+	}
+	rv = cbor_head(sout, 4, c->count);
+	for (d = c; !rv && d; d = d->same)
+	    rv = cbor_value(sout, d);
+    }
+    return rv;
+}
+
+static int
+cbor_value(ipmi_cmdlang_sout_t *sout, sout_node_t *node)
+{
+    if (node->children)
+	return cbor_object(sout, node);
+    return cbor_scalar(sout, node);
+}
+
+/* Used if we run out of memory writing the output. */
+static const char json_nomem[] = "{\"error\":{\"message\":\"Out of memory\"}}\n";
+static const unsigned char cbor_nomem[] = {
+    0xa1, 0x65, 'e', 'r', 'r', 'o', 'r',
+    0xa1, 0x67, 'm', 'e', 's', 's', 'a', 'g', 'e',
+    0x6d, 'O', 'u', 't', ' ', 'o', 'f', ' ', 'm', 'e', 'm', 'o', 'r', 'y'
+};
+
+/* Encode the tree and write it to the stream in one go. */
+static void
+sout_write(ipmi_cmdlang_sout_t *sout, sout_tree_t *tree)
+{
+    int rv;
+
+    sout->len = 0;
+    if (sout->format == IPMI_CMDLANG_SOUT_CBOR) {
+	rv = cbor_object(sout, &tree->root);
+	if (rv)
+	    fwrite(cbor_nomem, 1, sizeof(cbor_nomem), sout->stream);
+    } else {
+	rv = json_object(sout, &tree->root);
+	if (!rv)
+	    rv = buf_byte(sout, '\n');
+	if (rv)
+	    fputs(json_nomem, sout->stream);
+    }
+    if (!rv)
+	fwrite(sout->buf, 1, sout->len, sout->stream);
+    fflush(sout->stream);
+}
+
+/*
+ * The cmdlang callbacks.
+ */
+static void
+sout_nomem(ipmi_cmdlang_t *cmdlang)
+{
+    if (cmdlang->err)
+	return;
+    cmdlang->err = ENOMEM;
+    cmdlang->errstr = "Out of memory";
+    cmdlang->location = "out_struct.c(sout_out)";
+}
+
+static void
+sout_out(ipmi_cmdlang_t *cmdlang, const char *name, const char *value)
+{
+    ipmi_cmdlang_sout_t *sout = cmdlang->user_data;
+    sout_tree_t         *tree = &sout->tree;
+    int                 rv;
+
+    if (value)
+	rv = tree_add_str(tree, tree->cur, name, SOUT_STR,
+			  value, strlen(value));
+    else
+	rv = tree_add(tree, tree->cur, name, SOUT_NULL) == NULL;
+    if (rv)
+	sout_nomem(cmdlang);
+}
+
+static void
+sout_out_binary(ipmi_cmdlang_t *cmdlang, const char *name, const char *value,
+		unsigned int len)
+{
+    ipmi_cmdlang_sout_t *sout = cmdlang->user_data;
+    sout_tree_t         *tree = &sout->tree;
+
+    if (tree_add_str(tree, tree->cur, name, SOUT_BIN, value, len))
+	sout_nomem(cmdlang);
+}
+
+static void
+sout_out_int(ipmi_cmdlang_t *cmdlang, const char *name, long long value)
+{
+    ipmi_cmdlang_sout_t *sout = cmdlang->user_data;
+    sout_node_t         *node;
+
+    node = tree_add(&sout->tree, sout->tree.cur, name, SOUT_INT);
+    if (!node) {
+	sout_nomem(cmdlang);
+	return;
+    }
+    node->v.i = value;
+}
+
+static void
+sout_out_double(ipmi_cmdlang_t *cmdlang, const char *name, double value)
+{
+    ipmi_cmdlang_sout_t *sout = cmdlang->user_data;
+    sout_node_t         *node;
+
+    node = tree_add(&sout->tree, sout->tree.cur, name, SOUT_DOUBLE);
+    if (!node) {
+	sout_nomem(cmdlang);
+	return;
+    }
+    node->v.d = value;
+}
+
+static void
+sout_out_bool(ipmi_cmdlang_t *cmdlang, const char *name, long long value)
+{
+    ipmi_cmdlang_sout_t *sout = cmdlang->user_data;
+    sout_node_t         *node;
+
+    node = tree_add(&sout->tree, sout->tree.cur, name, SOUT_BOOL);
+    if (!node) {
+	sout_nomem(cmdlang);
+	return;
+    }
+    node->v.i = value != 0;
+}
+
+static void
+sout_down(ipmi_cmdlang_t *cmdlang)
+{
+    ipmi_cmdlang_sout_t *sout = cmdlang->user_data;
+
+    tree_down(&sout->tree);
+    if (sout->tree.nomem)
+	sout_nomem(cmdlang);
+}
+
+static void
+sout_up(ipmi_cmdlang_t *cmdlang)
+{
+    ipmi_cmdlang_sout_t *sout = cmdlang->user_data;
+
+    tree_up(&sout->tree);
+}
+
+static int
+add_error(sout_tree_t *tree, ipmi_cmdlang_t *cmdlang)
+{
+    sout_node_t *err, *node;
+    const char  *s;
+    char        errval[128];
+    int         rv;
+
+    err = tree_add(tree, &tree->root, "error", SOUT_NULL);
+    if (!err)
+	return ENOMEM;
+    s = cmdlang->location ? cmdlang->location : "";
+    rv = tree_add_str(tree, err, "location", SOUT_STR, s, strlen(s));
+    if (!rv && cmdlang->objstr && cmdlang->objstr[0])
+	rv = tree_add_str(tree, err, "object", SOUT_STR,
+			  cmdlang->objstr, strlen(cmdlang->objstr));
+    s = cmdlang->errstr ? cmdlang->errstr : "";
+    if (!rv)
+	rv = tree_add_str(tree, err, "message", SOUT_STR, s, strlen(s));
+    if (rv)
+	return rv;
+    node = tree_add(tree, err, "errno", SOUT_INT);
+    if (!node)
+	return ENOMEM;
+    node->v.i = cmdlang->err;
+    s = ipmi_get_error_string(cmdlang->err, errval, sizeof(errval));
+    return tree_add_str(tree, err, "errstr", SOUT_STR, s, strlen(s));
+}
+
+void
+ipmi_cmdlang_sout_done(ipmi_cmdlang_t *cmdlang)
+{
+    ipmi_cmdlang_sout_t *sout = cmdlang->user_data;
+    sout_tree_t         *tree = &sout->tree;
+
+    if (cmdlang->err) {
+	if (tree->nomem)
+	    /* The output is not complete, just report the error. */
+	    tree_reset(tree);
+	if (add_error(tree, cmdlang))
+	    tree_reset(tree);
+    }
+    if (tree->nomem) {
+	if (sout->format == IPMI_CMDLANG_SOUT_CBOR)
+	    fwrite(cbor_nomem, 1, sizeof(cbor_nomem), sout->stream);
+	else
+	    fputs(json_nomem, sout->stream);
+	fflush(sout->stream);
+    } else {
+	sout_write(sout, tree);
+    }
+    tree_reset(tree);
+}
+
+void
+ipmi_cmdlang_sout_event(ipmi_cmdlang_sout_t  *sout,
+			ipmi_cmdlang_event_t *event)
+{
+    sout_tree_t                 tree;
+    unsigned int                level, len, curr_level = 0;
+    enum ipmi_cmdlang_out_types type;
+    char                        *name, *value;
+    enum sout_type              stype;
+
+    /* A command may be in progress, so this uses its own tree. */
+    tree_init(&tree);
+    tree_add(&tree, &tree.root, "Event", SOUT_NULL);
+    tree_down(&tree);
+
+    ipmi_cmdlang_event_restart(event);
+    while (ipmi_cmdlang_event_next_field(event, &level, &type, &name, &len,
+					 &value))
+    {
+	for (; curr_level < level; curr_level++)
+	    tree_down(&tree);
+	for (; curr_level > level; curr_level--)
+	    tree_up(&tree);
+	if ((type == IPMI_CMDLANG_STRING) && !value) {
+	    tree_add(&tree, tree.cur, name, SOUT_NULL);
+	    continue;
+	}
+	if (type == IPMI_CMDLANG_STRING)
+	    stype = SOUT_STR;
+	else
+	    stype = SOUT_BIN;
+	tree_add_str(&tree, tree.cur, name, stype, value, len);
+    }
+
+    if (tree.nomem) {
+	if (sout->format == IPMI_CMDLANG_SOUT_CBOR)
+	    fwrite(cbor_nomem, 1, sizeof(cbor_nomem), sout->stream);
+	else
+	    fputs(json_nomem, sout->stream);
+	fflush(sout->stream);
+    } else {
+	sout_write(sout, &tree);
+    }
+    tree_free(&tree);
+}
+
+void
+ipmi_cmdlang_sout_setup(ipmi_cmdlang_sout_t *sout, ipmi_cmdlang_t *cmdlang)
+{
+    cmdlang->out = sout_out;
+    cmdlang->out_binary = sout_out_binary;
+    cmdlang->out_unicode = sout_out_binary;
+    cmdlang->out_int = sout_out_int;
+    cmdlang->out_double = sout_out_double;
+    cmdlang->out_bool = sout_out_bool;
+    cmdlang->down = sout_down;
+    cmdlang->up = sout_up;
+    cmdlang->user_data = sout;
+}
+
+int
+ipmi_cmdlang_sout_alloc(enum ipmi_cmdlang_sout_format format,
+			FILE                          *stream,
+			ipmi_cmdlang_sout_t           **new_sout)
+{
+    ipmi_cmdlang_sout_t *sout;
+
+    if ((format != IPMI_CMDLANG_SOUT_JSON)
+	&& (format != IPMI_CMDLANG_SOUT_CBOR))
+	return EINVAL;
+
+    sout = ipmi_mem_alloc(sizeof(*sout));
+    if (!sout)
+	return ENOMEM;
+    memset(sout, 0, sizeof(*sout));
+    sout->size = 4096;
+    sout->buf = ipmi_mem_alloc(sout->size);
+    if (!sout->buf) {
+	ipmi_mem_free(sout);
+	return ENOMEM;
+    }
+    sout->format = format;
+    sout->stream = stream;
+    tree_init(&sout->tree);
+
+    *new_sout = sout;
+    return 0;
+}
+
+void
+ipmi_cmdlang_sout_free(ipmi_cmdlang_sout_t *sout)
+{
+    tree_free(&sout->tree);
+    ipmi_mem_free(sout->buf);
+    ipmi_mem_free(sout);
+}
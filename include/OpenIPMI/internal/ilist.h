@@ -226,5 +226,10 @@ IPMI_UTILS_DLL_PUBLIC
 void *ilist_mem_alloc(size_t size);
 IPMI_UTILS_DLL_PUBLIC
 void ilist_mem_free(void *data);
+/* Allocation of the list items the list allocates itself. */
+IPMI_UTILS_DLL_PUBLIC
+void *ilist_item_mem_alloc(void);
+IPMI_UTILS_DLL_PUBLIC
+void ilist_item_mem_free(void *data);
 
 #endif /* OPENIPMI_ILIST_H */
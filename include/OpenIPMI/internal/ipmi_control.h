@@ -46,7 +46,9 @@ int ipmi_controls_alloc(ipmi_mc_t *mc, ipmi_control_info_t **new_controls);
 /* Destroy a control repository and all the controls in it. */
 int ipmi_controls_destroy(ipmi_control_info_t *controls);
 
-/* Must be called with the i_ipmi_domain_entity_lock() held. */
+/* The caller must keep the control from being freed while this runs,
+   by holding the MC's control index lock, the entity's control list
+   lock, or another reference. */
 int i_ipmi_control_get(ipmi_control_t *control);
 
 /* Must be called with no locks held. */
@@ -61,6 +61,11 @@ void i_ipmi_entities_report_sdrs_read(ipmi_entity_info_t *ents);
    the entity code can know when to report entities fully up. */
 void i_ipmi_entities_report_mcs_scanned(ipmi_entity_info_t *ents);
 
+/* Called by the domain code when a connection comes up.  Events may
+   have been missed while it was down, so the presence of every entity
+   is checked again, however fresh it is. */
+void i_ipmi_entities_presence_stale(ipmi_entity_info_t *ents);
+
 /* Used so entities can be forced to be kept around. */
 int i_ipmi_entity_add_ref(ipmi_entity_t *ent);
 int i_ipmi_entity_remove_ref(ipmi_entity_t *ent);
@@ -120,8 +125,9 @@ int ipmi_entity_get_subentity(ipmi_entity_t *ent,
 
 /* Add a sensor/indicator to the entity.  This call is guaranteed to
    succeed, since the link is provided (and must be provided).  Note
-   that the link must be a locked_list_entry_t, although it is taken
-   as a void to avoid namespace pollution.  Note that this must be
+   that the link must be the locked_list_entry_t embedded in the
+   sensor/control, although it is taken as a void to avoid namespace
+   pollution.  The entity never frees it.  Note that this must be
    called with the entity lock held. */
 void ipmi_entity_add_sensor(ipmi_entity_t *ent, ipmi_sensor_t *sensor,
 			    void *link);
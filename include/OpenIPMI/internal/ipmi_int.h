@@ -53,6 +53,8 @@ os_handler_t *ipmi_get_global_os_handler(void);
 
 /* Create a lock, using the OS handlers for the given MC. */
 int ipmi_create_lock(ipmi_domain_t *mc, ipmi_lock_t **lock);
+/* See ipmi_create_nr_lock_os_hnd(). */
+int ipmi_create_nr_lock(ipmi_domain_t *domain, ipmi_lock_t **lock);
 
 /* Create a lock using the main os handler registered with ipmi_init(). */
 int ipmi_create_global_lock(ipmi_lock_t **new_lock);
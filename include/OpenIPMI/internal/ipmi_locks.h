@@ -66,6 +66,13 @@ typedef struct ipmi_lock_s ipmi_lock_t;
 IPMI_UTILS_DLL_PUBLIC
 int ipmi_create_lock_os_hnd(os_handler_t *os_hnd, ipmi_lock_t **lock);
 
+/* Create a lock that is never claimed recursively and is never held
+   while calling out to other code.  The OS handler may make these
+   cheaper than normal locks, and claiming one recursively may then
+   deadlock. */
+IPMI_UTILS_DLL_PUBLIC
+int ipmi_create_nr_lock_os_hnd(os_handler_t *os_hnd, ipmi_lock_t **lock);
+
 /* Destroy a lock. */
 IPMI_UTILS_DLL_PUBLIC
 void ipmi_destroy_lock(ipmi_lock_t *lock);
@@ -95,6 +95,71 @@ extern void (*ipmi_malloc_log)(enum ipmi_log_type_e log_type,
 #endif
 ;
 
+/*
+ * Caches for small objects that are allocated and freed at a high
+ * rate (message items, timer data, list entries, events).  A cache is
+ * a statically initialized descriptor owned by the code that uses the
+ * type:
+ *
+ *   static ipmi_mem_cache_t msgi_cache =
+ *       IPMI_MEM_CACHE_INIT("ipmi_msgi", sizeof(ipmi_msgi_t));
+ *
+ * Objects come from slabs shared by all caches of the same size
+ * class, with a per-thread magazine of free objects in front of each
+ * class so the usual alloc/free pair takes no lock.  Slab memory comes
+ * from the OS handler and is only returned at ipmi_malloc_shutdown().
+ *
+ * An object allocated from a cache must be freed to the same cache,
+ * never with ipmi_mem_free().  Objects larger than the biggest size
+ * class, and everything when malloc debugging is on, are passed
+ * through to ipmi_mem_alloc(), so malloc debugging should be set
+ * before the first allocation and not changed afterwards.
+ */
+typedef struct ipmi_mem_cache_s ipmi_mem_cache_t;
+struct ipmi_mem_cache_s
+{
+    const char       *name;
+    unsigned int     size;
+
+    /* Internal, do not touch. */
+    int              registered;
+    int              size_class;
+    int              id;
+    ipmi_mem_cache_t *next;
+    long             in_use;
+    long             high_water;
+    unsigned long    allocs;
+};
+#define IPMI_MEM_CACHE_INIT(name, size) \
+	{ (name), (size), 0, -1, -1, NULL, 0, 0, 0 }
+
+IPMI_UTILS_DLL_PUBLIC
+void *ipmi_mem_cache_alloc(ipmi_mem_cache_t *cache);
+IPMI_UTILS_DLL_PUBLIC
+void ipmi_mem_cache_free(ipmi_mem_cache_t *cache, void *data);
+
+/* Report every cache that has been used.  in_use is the number of
+   objects currently allocated from the cache, high_water the most
+   that were ever allocated at once and allocs the total number of
+   allocations.  obj_size is the size class the objects are carved
+   from, or 0 if the cache passes through to ipmi_mem_alloc().
+   Threads add their counts in batches, so with several threads
+   in_use and the high-water mark are within a batch per thread of
+   the truth. */
+typedef void (*ipmi_mem_cache_report_cb)(const char    *name,
+					 unsigned int  size,
+					 unsigned int  obj_size,
+					 unsigned long in_use,
+					 unsigned long high_water,
+					 unsigned long allocs,
+					 void          *cb_data);
+IPMI_UTILS_DLL_PUBLIC
+void ipmi_mem_cache_report(ipmi_mem_cache_report_cb handler, void *cb_data);
+
+/* The number of bytes held in slabs for all the caches. */
+IPMI_UTILS_DLL_PUBLIC
+unsigned long ipmi_mem_cache_slab_bytes(void);
+
 IPMI_UTILS_DLL_PUBLIC
 int ipmi_malloc_init(os_handler_t *os_hnd);
 IPMI_UTILS_DLL_PUBLIC
@@ -151,11 +151,11 @@ int ipmi_domain_set_sdrs_fixup_handler(ipmi_domain_t                 *mc,
    added to the entity, the OEM device is assumed to have taken over
    control of the sensor.  The OEM handler may also add it's own
    callback or register it's own data conversion handler for this
-   sensor.  The link is a value allocated with
-   ipmi_entity_alloc_sensor_link; if the OEM callback returns false,
-   the oem callback cannot use this value.  If it returns true, the
-   oem callback will own the link and be responsible for freeing the
-   link.  Setting the callback to NULL will disable it. */
+   sensor.  The link is the entity list entry embedded in the sensor;
+   if the OEM callback returns false, the oem callback cannot use this
+   value.  If it returns true, the oem callback may use the link to add
+   the sensor to an entity itself, it is never freed.  Setting the
+   callback to NULL will disable it. */
 typedef int (*ipmi_mc_oem_new_sensor_cb)(ipmi_mc_t     *mc,
 					 ipmi_entity_t *ent,
 					 ipmi_sensor_t *sensor,
@@ -49,12 +49,21 @@ int ipmi_sensors_alloc(ipmi_mc_t *mc, ipmi_sensor_info_t **new_sensors);
 /* Destroy a sensor repository and all the sensors in it. */
 int ipmi_sensors_destroy(ipmi_sensor_info_t *sensors);
 
-/* Must be called with the i_ipmi_domain_entity_lock() held. */
+/* The caller must keep the sensor from being freed while this runs,
+   by holding the MC's sensor index lock, the entity's sensor list
+   lock, or another reference. */
 int i_ipmi_sensor_get(ipmi_sensor_t *sensor);
 
 /* Must be called with no locks held. */
 void i_ipmi_sensor_put(ipmi_sensor_t *sensor);
 
+/* Get a reference to the sensor in a slot of an SDR sensor array (an
+   MC's device SDR sensors or the domain's main SDR sensors), and to
+   its entity.  Returns NULL if the slot is empty or the sensor is
+   being destroyed.  Must be called with no locks held. */
+ipmi_sensor_t *i_ipmi_sensor_get_sdr_slot(ipmi_domain_t *domain,
+					  ipmi_sensor_t **slot);
+
 /* Return the number of sensors in the data structure. */
 unsigned int ipmi_sensors_get_count(ipmi_sensor_info_t *sensors);
 
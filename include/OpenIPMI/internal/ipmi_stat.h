@@ -0,0 +1,189 @@
+/*
+ * ipmi_stat.h
+ *
+ * Cheap counters and latency histograms for the statistics code.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ * Copyright 2004,2005 MontaVista Software Inc.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * Lesser General Public License (GPL) Version 2 or the modified BSD
+ * license below.  The following disclamer applies to both licenses:
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * GNU Lesser General Public Licence
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Modified BSD Licence
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *   3. The name of the author may not be used to endorse or promote
+ *      products derived from this software without specific prior
+ *      written permission.
+ */
+
+#ifndef OPENIPMI_IPMI_STAT_H
+#define OPENIPMI_IPMI_STAT_H
+
+/*
+ * Statistics are bumped from the message paths, so they must not
+ * take locks.  The counters are updated with relaxed atomic
+ * operations; nothing else is ordered against them, a reader just
+ * gets a value that was current at some point.  Without the GCC
+ * builtins the plain operations are used, which may drop an
+ * increment under contention but never corrupts anything.
+ */
+#ifdef HAVE_GCC_ATOMICS
+#define ipmi_stat_atomic_add(p, v) \
+	__atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define ipmi_stat_atomic_load(p) \
+	__atomic_load_n((p), __ATOMIC_RELAXED)
+#define ipmi_stat_atomic_xchg(p, v) \
+	__atomic_exchange_n((p), (v), __ATOMIC_RELAXED)
+#else
+#define ipmi_stat_atomic_add(p, v) ((*(p)) += (v))
+#define ipmi_stat_atomic_load(p) (*(p))
+static inline unsigned long
+ipmi_stat_atomic_xchg(unsigned long *p, unsigned long v)
+{
+    unsigned long old = *p;
+    *p = v;
+    return old;
+}
+#endif
+
+/*
+ * A log2 histogram.  Bucket n holds the samples in [2^(n-1), 2^n),
+ * bucket 0 holds the zeros and the last bucket everything above.
+ * The units are up to the user (the domain uses microseconds).
+ */
+#define IPMI_STAT_HIST_BUCKETS	32
+
+typedef struct ipmi_stat_hist_s
+{
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long bucket[IPMI_STAT_HIST_BUCKETS];
+} ipmi_stat_hist_t;
+
+static inline unsigned int
+ipmi_stat_hist_bucket(unsigned long val)
+{
+    unsigned int b = 0;
+
+    while (val && (b < IPMI_STAT_HIST_BUCKETS - 1)) {
+	val >>= 1;
+	b++;
+    }
+    return b;
+}
+
+static inline void
+ipmi_stat_hist_add(ipmi_stat_hist_t *h, unsigned long val)
+{
+    ipmi_stat_atomic_add(&h->bucket[ipmi_stat_hist_bucket(val)], 1);
+    ipmi_stat_atomic_add(&h->sum, val);
+    ipmi_stat_atomic_add(&h->count, 1);
+#ifdef HAVE_GCC_ATOMICS
+    {
+	unsigned long old = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	while (val > old) {
+	    if (__atomic_compare_exchange_n(&h->max, &old, val, 1,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		break;
+	}
+    }
+#else
+    if (val > h->max)
+	h->max = val;
+#endif
+}
+
+/* Copy a histogram that may be being updated.  If zero is set, the
+   values are taken out of the histogram. */
+static inline void
+ipmi_stat_hist_snapshot(ipmi_stat_hist_t *h, ipmi_stat_hist_t *out, int zero)
+{
+    unsigned int i;
+
+    for (i = 0; i < IPMI_STAT_HIST_BUCKETS; i++) {
+	if (zero)
+	    out->bucket[i] = ipmi_stat_atomic_xchg(&h->bucket[i], 0);
+	else
+	    out->bucket[i] = ipmi_stat_atomic_load(&h->bucket[i]);
+    }
+    if (zero) {
+	out->count = ipmi_stat_atomic_xchg(&h->count, 0);
+	out->sum = ipmi_stat_atomic_xchg(&h->sum, 0);
+	out->max = ipmi_stat_atomic_xchg(&h->max, 0);
+    } else {
+	out->count = ipmi_stat_atomic_load(&h->count);
+	out->sum = ipmi_stat_atomic_load(&h->sum);
+	out->max = ipmi_stat_atomic_load(&h->max);
+    }
+}
+
+/* Return an upper bound for the given percentile (0-100) of a
+   snapshot.  This is the top of the bucket the percentile falls in,
+   limited to the largest value seen. */
+static inline unsigned long
+ipmi_stat_hist_percentile(const ipmi_stat_hist_t *h, unsigned int pct)
+{
+    unsigned long total = 0, want, top;
+    unsigned int  i;
+
+    for (i = 0; i < IPMI_STAT_HIST_BUCKETS; i++)
+	total += h->bucket[i];
+    if (total == 0)
+	return 0;
+    want = (total * pct + 99) / 100;
+    if (want == 0)
+	want = 1;
+    for (i = 0; i < IPMI_STAT_HIST_BUCKETS - 1; i++) {
+	if (h->bucket[i] >= want)
+	    break;
+	want -= h->bucket[i];
+    }
+    if (i == IPMI_STAT_HIST_BUCKETS - 1)
+	return h->max;
+    top = i ? ((1UL << i) - 1) : 0;
+    if (top > h->max)
+	top = h->max;
+    return top;
+}
+
+#endif /* OPENIPMI_IPMI_STAT_H */
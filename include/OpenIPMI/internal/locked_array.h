@@ -0,0 +1,107 @@
+/*
+ * locked_array.h
+ *
+ * A locked container kept in a flat array, for small lists that are
+ * iterated far more than they are changed.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ * Copyright 2004,2005 MontaVista Software Inc.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * Lesser General Public License (GPL) Version 2 or the modified BSD
+ * license below.  The following disclamer applies to both licenses:
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * GNU Lesser General Public Licence
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Modified BSD Licence
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *   3. The name of the author may not be used to endorse or promote
+ *      products derived from this software without specific prior
+ *      written permission.
+ */
+
+#ifndef OPENIPMI_LOCKED_ARRAY_H
+#define OPENIPMI_LOCKED_ARRAY_H
+
+#include <OpenIPMI/internal/locked_list.h>
+
+/*
+ * This works like a locked list (same callbacks, same iterator return
+ * values, adds and removes are allowed while iterating and handlers
+ * are called without any locks held), but the items are stored in a
+ * contiguous array instead of a linked list of allocated entries.
+ * Iteration is a linear walk through memory and adds only allocate
+ * when the array has to grow.  Items removed during an iteration are
+ * marked dead and squeezed out when the last iterator finishes.
+ */
+
+typedef struct locked_array_s locked_array_t;
+
+/* Allocate and free locked arrays. */
+IPMI_UTILS_DLL_PUBLIC
+locked_array_t *locked_array_alloc(os_handler_t *os_hnd);
+IPMI_UTILS_DLL_PUBLIC
+void locked_array_destroy(locked_array_t *la);
+
+/* Add an item to the end of the array.  Returns the same values as
+   locked_list_add(): true on success, 2 if the item was already
+   there, and false if memory could not be allocated. */
+IPMI_UTILS_DLL_PUBLIC
+int locked_array_add(locked_array_t *la, void *item1, void *item2);
+
+/* Remove an item.  It returns true if the item was found and false if
+   not. */
+IPMI_UTILS_DLL_PUBLIC
+int locked_array_remove(locked_array_t *la, void *item1, void *item2);
+
+/* Iterate over the items in the order they were added, see
+   locked_list_iterate() and locked_list_iterate_prefunc(). */
+IPMI_UTILS_DLL_PUBLIC
+void locked_array_iterate(locked_array_t         *la,
+			  locked_list_handler_cb handler,
+			  void                   *cb_data);
+IPMI_UTILS_DLL_PUBLIC
+void locked_array_iterate_prefunc(locked_array_t         *la,
+				  locked_list_handler_cb prefunc,
+				  locked_list_handler_cb handler,
+				  void                   *cb_data);
+
+/* Return the number of items in the array. */
+IPMI_UTILS_DLL_PUBLIC
+unsigned int locked_array_num_entries(locked_array_t *la);
+
+#endif /* OPENIPMI_LOCKED_ARRAY_H */
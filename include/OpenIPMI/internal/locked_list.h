@@ -115,6 +115,16 @@ unsigned int locked_list_num_entries(locked_list_t *ll);
    entry, the add cannot fail.  This is primarily so you can
    pre-allocate data for the list and later adds won't fail. */
 typedef struct locked_list_entry_s locked_list_entry_t;
+
+/* The entry is only public so it can be embedded in an object (see
+   locked_list_add_embedded()), the fields belong to the list code. */
+struct locked_list_entry_s
+{
+    void                *item1, *item2;
+    locked_list_entry_t *next, *prev;
+    unsigned int        embedded;
+};
+
 IPMI_UTILS_DLL_PUBLIC
 locked_list_entry_t *locked_list_alloc_entry(void);
 IPMI_UTILS_DLL_PUBLIC
@@ -128,6 +138,21 @@ IPMI_UTILS_DLL_PUBLIC
 int locked_list_add_entry(locked_list_t *ll, void *item1, void *item2,
 			  locked_list_entry_t *entry);
 
+/* Add an entry embedded in an object, the list never allocates or
+   frees it.  The add cannot fail; like the other adds, it returns 2
+   and leaves the entry alone if item1/item2 are already on the list.
+   An entry may be on one list at a time.  Once it has been removed
+   (by either remove call), the object may be freed right away, even
+   if the list is being iterated. */
+IPMI_UTILS_DLL_PUBLIC
+int locked_list_add_embedded(locked_list_t *ll, void *item1, void *item2,
+			     locked_list_entry_t *entry);
+
+/* Remove the given entry (allocated or embedded) from the list without
+   searching for it.  Returns true if the entry was on the list. */
+IPMI_UTILS_DLL_PUBLIC
+int locked_list_remove_entry(locked_list_t *ll, locked_list_entry_t *entry);
+
 /* These functions are like the previous functions, but allow the user
    to have their own lock function.  The nolock functions must be
    called with the lock already held.  */
@@ -144,6 +169,12 @@ int locked_list_add_entry_nolock(locked_list_t *ll, void *item1, void *item2,
 IPMI_UTILS_DLL_PUBLIC
 int locked_list_remove_nolock(locked_list_t *ll, void *item, void *item2);
 IPMI_UTILS_DLL_PUBLIC
+int locked_list_add_embedded_nolock(locked_list_t *ll, void *item1,
+				    void *item2, locked_list_entry_t *entry);
+IPMI_UTILS_DLL_PUBLIC
+int locked_list_remove_entry_nolock(locked_list_t       *ll,
+				    locked_list_entry_t *entry);
+IPMI_UTILS_DLL_PUBLIC
 void locked_list_iterate_nolock(locked_list_t          *ll,
 				locked_list_handler_cb handler,
 				void                   *cb_data);
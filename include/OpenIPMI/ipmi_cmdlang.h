@@ -34,6 +34,7 @@
 #ifndef OPENIPMI_CMDLANG_H
 #define OPENIPMI_CMDLANG_H
 
+#include <stdio.h>
 #include <OpenIPMI/dllvisibility.h>
 #include <OpenIPMI/selector.h>
 #include <OpenIPMI/ipmi_bits.h>
@@ -88,6 +89,13 @@ typedef void (*cmd_out_b_cb)(ipmi_cmdlang_t *info,
 			     const char     *name,
 			     const char     *value,
 			     unsigned int   len);
+/* Typed output, see out_int, out_double, and out_bool below. */
+typedef void (*cmd_out_int_cb)(ipmi_cmdlang_t *info,
+			       const char     *name,
+			       long long      value);
+typedef void (*cmd_out_double_cb)(ipmi_cmdlang_t *info,
+				  const char     *name,
+				  double         value);
 
 /* Command-specific info. */
 typedef void (*cmd_info_cb)(ipmi_cmdlang_t *info);
@@ -139,6 +147,13 @@ struct ipmi_cmdlang_s
 
 
     void         *user_data; /* User data for anything the user wants */
+
+    /* Optional typed output.  If these are NULL, integers, doubles,
+       and booleans are formatted into a string and passed to out.
+       Hex values, times, and timeouts go to out_int. */
+    cmd_out_int_cb    out_int;
+    cmd_out_double_cb out_double;
+    cmd_out_int_cb    out_bool;
 };
 
 /* Parse and handle the given command string.  This always calls the
@@ -416,6 +431,49 @@ int ipmi_cmdlang_event_next_field(ipmi_cmdlang_event_t        *event,
 				  unsigned int                *len,
 				  char                        **value);
 
+/*
+ * A structured output backend.  Instead of printing each field as it
+ * comes, this builds an object tree from the output of a command
+ * (down and up start and end nested objects) and writes the whole
+ * thing once when the command is done, as one line of JSON or one
+ * CBOR item.  Numbers and booleans keep their type.  If a name
+ * appears more than once in an object, the values are put into an
+ * array under that name.  Binary and unicode values are arrays of
+ * bytes in JSON and byte strings in CBOR.
+ */
+typedef struct ipmi_cmdlang_sout_s ipmi_cmdlang_sout_t;
+
+enum ipmi_cmdlang_sout_format {
+    IPMI_CMDLANG_SOUT_JSON,
+    IPMI_CMDLANG_SOUT_CBOR
+};
+
+/* Allocate a backend that writes to the given stream. */
+IPMI_CMDLANG_DLL_PUBLIC
+int ipmi_cmdlang_sout_alloc(enum ipmi_cmdlang_sout_format format,
+			    FILE                          *stream,
+			    ipmi_cmdlang_sout_t           **new_sout);
+IPMI_CMDLANG_DLL_PUBLIC
+void ipmi_cmdlang_sout_free(ipmi_cmdlang_sout_t *sout);
+
+/* Set the output callbacks of cmdlang to the backend.  This sets the
+   user_data of cmdlang, the done callback is left for the user. */
+IPMI_CMDLANG_DLL_PUBLIC
+void ipmi_cmdlang_sout_setup(ipmi_cmdlang_sout_t *sout,
+			     ipmi_cmdlang_t      *cmdlang);
+
+/* Call this from the done callback.  It writes the output of the
+   command and flushes the stream.  If the command failed, the error
+   is added as an "error" object.  The error fields in cmdlang are
+   not touched. */
+IPMI_CMDLANG_DLL_PUBLIC
+void ipmi_cmdlang_sout_done(ipmi_cmdlang_t *cmdlang);
+
+/* Write an event as an object with an "Event" member. */
+IPMI_CMDLANG_DLL_PUBLIC
+void ipmi_cmdlang_sout_event(ipmi_cmdlang_sout_t  *sout,
+			     ipmi_cmdlang_event_t *event);
+
 /* Supplied by the user, used to report global errors (ones that don't
    deal with a specific command invocation).  The objstr is the name
    of the object dealing with the error (like the domain name, entity
@@ -144,6 +144,40 @@ void ipmi_ll_con_stat_set_user_data(ipmi_ll_stat_info_t *info,
 IPMI_DLL_PUBLIC
 void *ipmi_ll_con_stat_get_user_data(ipmi_ll_stat_info_t *info);
 
+/* A connection may also hand its own counter to the stat code instead
+   of calling the adder for every update.  The counter must only be
+   changed with atomic adds and must stay around until
+   unregister_counter is called for the stat.  The register call
+   returns an error (ENOSYS if it's not supported at all) if the
+   counter cannot be linked; the connection should use the normal
+   register call and the adder in that case. */
+typedef int (*ipmi_ll_con_register_counter_cb)(ipmi_ll_stat_info_t *info,
+					       const char          *name,
+					       const char          *instance,
+					       unsigned long       *counter,
+					       void                **stat);
+typedef void (*ipmi_ll_con_unregister_counter_cb)(ipmi_ll_stat_info_t *info,
+						  void                *stat,
+						  unsigned long       *counter);
+IPMI_DLL_PUBLIC
+void ipmi_ll_con_stat_info_set_register_counter
+				(ipmi_ll_stat_info_t             *info,
+				 ipmi_ll_con_register_counter_cb reg);
+IPMI_DLL_PUBLIC
+void ipmi_ll_con_stat_info_set_unregister_counter
+				(ipmi_ll_stat_info_t               *info,
+				 ipmi_ll_con_unregister_counter_cb unreg);
+IPMI_DLL_PUBLIC
+int ipmi_ll_con_stat_call_register_counter(ipmi_ll_stat_info_t *info,
+					   const char          *name,
+					   const char          *instance,
+					   unsigned long       *counter,
+					   void                **stat);
+IPMI_DLL_PUBLIC
+void ipmi_ll_con_stat_call_unregister_counter(ipmi_ll_stat_info_t *info,
+					      void                *stat,
+					      unsigned long       *counter);
+
 /* Set this bit in the hacks if, even though the connection is to a
    device not at 0x20, the first part of a LAN command should always
    use 0x20. */
@@ -192,6 +226,26 @@ typedef struct ipmi_con_option_s
    this is ignored.*/
 #define IPMI_CON_MSG_OPTION_SIDE_EFFECTS	3
 
+/* The priority class of the message (IPMI_MSG_PRIO_xxx, set by ival).
+   If not given, or IPMI_MSG_PRIO_DEFAULT, the class is picked from the
+   command.  Only matters if the message has to wait to be sent. */
+#define IPMI_CON_MSG_OPTION_PRIORITY		4
+
+/* Connection helpers for priority classes.  ipmi_con_msg_prio() gets
+   the class of a message from its options, or the default for the
+   command.  ipmi_con_prio_pick() chooses which class to start next;
+   depth is how many are waiting in each class, skips is per-class
+   state kept by the caller (start it at zero).  It returns -1 if
+   nothing is waiting. */
+IPMI_DLL_PUBLIC
+int ipmi_msg_default_prio(const ipmi_msg_t *msg);
+IPMI_DLL_PUBLIC
+int ipmi_con_msg_prio(const ipmi_con_option_t *options, const ipmi_msg_t *msg);
+IPMI_DLL_PUBLIC
+int ipmi_con_prio_pick(const unsigned int depth[], unsigned int skips[]);
+IPMI_DLL_PUBLIC
+const char *ipmi_msg_prio_name(int prio);
+
 
 /* The data structure representing a connection.  The low-level handler
    fills this out then calls ipmi_init_con() with the connection. */
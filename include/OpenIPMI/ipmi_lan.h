@@ -255,6 +255,20 @@ int ipmi_lan_handle_external_event(const struct sockaddr *src_addr,
 				   const ipmi_msg_t      *msg,
 				   const unsigned char   *pet_ack);
 
+/*
+ * Limit how many LAN connections may be going through their
+ * handshake (getting the channel authentication capabilities,
+ * opening the session and authenticating) at the same time.  Other
+ * connections wait and are started in order as the running ones
+ * finish.  This keeps a large number of connections coming up at
+ * once from flooding the network and the CPU.  Zero means no limit,
+ * the default is 64.
+ */
+IPMI_DLL_PUBLIC
+void ipmi_lan_set_max_handshakes(unsigned int max);
+IPMI_DLL_PUBLIC
+unsigned int ipmi_lan_get_max_handshakes(void);
+
 /*
  * RMCP+ payload handling.  To register a payload, pass in a static
  * ipmi_payload_t stucture with the various functions set.  Note that
@@ -590,6 +604,21 @@ int ipmi_rmcpp_register_oem_integrity(unsigned int           integ_num,
 				      unsigned char          iana[3],
 				      ipmi_rmcpp_integrity_t *integ);
 
+/* Fetch the registered (non-OEM) confidentiality and integrity
+   algorithms, NULL if none is registered for the number.  With an
+   auth info from ipmi_rmcpp_auth_alloc() these let the algorithms be
+   run outside a connection, for testing and benchmarking.  Only the
+   rand, GUID, SIK and key fields of such an auth info may be used. */
+IPMI_DLL_PUBLIC
+ipmi_rmcpp_confidentiality_t *ipmi_rmcpp_get_confidentiality
+(unsigned int conf_num);
+IPMI_DLL_PUBLIC
+ipmi_rmcpp_integrity_t *ipmi_rmcpp_get_integrity(unsigned int integ_num);
+IPMI_DLL_PUBLIC
+ipmi_rmcpp_auth_t *ipmi_rmcpp_auth_alloc(void);
+IPMI_DLL_PUBLIC
+void ipmi_rmcpp_auth_free(ipmi_rmcpp_auth_t *ainfo);
+
 /* Authentication algorithms should use this to send messages.  Note
    that when yo use this interface, it will always set rspi->data4 to
    the address number, you must cast it with (long) rspi->data4. */
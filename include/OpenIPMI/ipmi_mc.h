@@ -193,7 +193,12 @@ int ipmi_mc_remove_fully_up_handler_cl(ipmi_mc_t              *mc,
 
    The sideeff version is for commands that have side effects.  This
    is primarily reserve commands, where if a link is slow a retransmit
-   can cause problems. */
+   can cause problems.
+
+   The prio version sends the command in the given priority class
+   (IPMI_MSG_PRIO_xxx), which decides the order commands waiting on a
+   busy connection are sent in.  The others pick the class from the
+   command, see IPMI_MSG_PRIO_DEFAULT. */
 typedef void (*ipmi_mc_response_handler_t)(ipmi_mc_t  *src,
 					   ipmi_msg_t *msg,
 					   void       *rsp_data);
@@ -209,6 +214,13 @@ int ipmi_mc_send_command_sideeff(ipmi_mc_t                  *mc,
 				 const ipmi_msg_t           *cmd,
 				 ipmi_mc_response_handler_t rsp_handler,
 				 void                       *rsp_data);
+IPMI_DLL_PUBLIC
+int ipmi_mc_send_command_prio(ipmi_mc_t                  *mc,
+			      unsigned int               lun,
+			      const ipmi_msg_t           *cmd,
+			      int                        prio,
+			      ipmi_mc_response_handler_t rsp_handler,
+			      void                       *rsp_data);
 
 /* Reset the MC, either a cold or warm reset depending on the type.
    Note that the effects of a reset are not defined by IPMI, so this
@@ -104,6 +104,53 @@ os_handler_t *ipmi_posix_thread_setup_os_handler(int wake_sig);
 SEL_DLL_PUBLIC
 struct selector_s *ipmi_posix_thread_os_handler_get_sel(os_handler_t *os_hnd);
 
+/* Like ipmi_posix_thread_setup_os_handler(), with flags:
+
+   IPMI_POSIX_THREAD_LEAF_LOCKS - Locks that OpenIPMI knows are never
+   claimed recursively or held while calling out (the selector's
+   locks and those created with create_nr_lock) use adaptive,
+   non-recursive mutexes instead of recursive ones.
+
+   IPMI_POSIX_THREAD_LOCK_STATS - Keep wait and hold times for the
+   mutexes, per lock class.  This costs a clock read per lock and
+   unlock.  Reader/writer locks are not counted. */
+#define IPMI_POSIX_THREAD_LEAF_LOCKS	(1 << 0)
+#define IPMI_POSIX_THREAD_LOCK_STATS	(1 << 1)
+SEL_DLL_PUBLIC
+os_handler_t *ipmi_posix_thread_setup_os_handler2(int          wake_sig,
+						  unsigned int flags);
+
+/* Lock classes for the statistics. */
+#define IPMI_POSIX_LOCK_CLASS_GENERAL	0 /* Normal (recursive) locks */
+#define IPMI_POSIX_LOCK_CLASS_LEAF	1 /* Locks from create_nr_lock */
+#define IPMI_POSIX_LOCK_CLASS_SELECTOR	2 /* The selector's locks */
+#define IPMI_POSIX_NUM_LOCK_CLASSES	3
+
+/* Times are in nanoseconds.  The wait time is how long it took to
+   get the lock, the hold time how long it was held.  The p99 values
+   are upper bounds, they come from power of two buckets. */
+typedef struct ipmi_posix_lock_stats_s
+{
+    const char    *name;
+    unsigned long acquires;
+    unsigned long contended;
+    unsigned long wait_ns_total;
+    unsigned long wait_ns_max;
+    unsigned long wait_ns_p99;
+    unsigned long hold_ns_total;
+    unsigned long hold_ns_max;
+    unsigned long hold_ns_p99;
+} ipmi_posix_lock_stats_t;
+
+/* Get the statistics for one lock class.  If zero is set, the
+   statistics are cleared as they are read.  Returns ENOSYS if the
+   OS handler was not set up with IPMI_POSIX_THREAD_LOCK_STATS. */
+SEL_DLL_PUBLIC
+int ipmi_posix_thread_get_lock_stats(os_handler_t            *os_hnd,
+				     unsigned int            lclass,
+				     ipmi_posix_lock_stats_t *stats,
+				     int                     zero);
+
 /**********************************************************************
  * Special code, like the previous non-threaded ones.  Only needed
  * if you have special selector needs.  Don't use
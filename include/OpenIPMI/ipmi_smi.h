@@ -36,6 +36,7 @@
 
 #include <OpenIPMI/dllvisibility.h>
 #include <OpenIPMI/ipmi_mc.h>
+#include <OpenIPMI/ipmi_addr.h>
 #ifdef _WIN32
 #include <winsock2.h>
 #else
@@ -61,6 +62,53 @@ int ipmi_smi_setup_con(int                if_num,
 		       void               *user_data,
 		       ipmi_con_t         **new_con);
 
+/*
+ * An SMI multiplexer (see openipmi_smuxd) owns the local interface
+ * and shares it with other processes through a Unix socket.  This
+ * creates a connection to one, it works like an SMI connection except
+ * that it cannot register to receive commands.
+ *
+ *  path - The socket of the multiplexer, NULL for the default.
+ */
+#define IPMI_SMUX_DEFAULT_PATH "/var/run/openipmi_smux"
+
+IPMI_DLL_PUBLIC
+int ipmi_smux_setup_con(const char         *path,
+			os_handler_t       *handlers,
+			void               *user_data,
+			ipmi_con_t         **new_con);
+
+/*
+ * The messages on the multiplexer socket.  It is a SOCK_SEQPACKET
+ * socket, each packet is one of these, cut off after the data.  Both
+ * ends are on the same machine, so the structure is sent as is.
+ *
+ * SEND goes to the multiplexer: send the command in the message, the
+ * response comes back with the same msgid.  EVENTS goes to the
+ * multiplexer too, netfn is 1 to get async events, 0 to stop.  RSP
+ * and EVENT come from the multiplexer, a response to a command and an
+ * async event (data in the Get Message format).
+ */
+#define IPMI_SMUX_SEND		1
+#define IPMI_SMUX_EVENTS	2
+#define IPMI_SMUX_RSP		3
+#define IPMI_SMUX_EVENT		4
+
+typedef struct ipmi_smux_msg_s
+{
+    unsigned char type;
+    unsigned char netfn;
+    unsigned char cmd;
+    unsigned char addr_len;
+    unsigned int  data_len;
+    long          msgid;
+    unsigned char addr[sizeof(ipmi_addr_t)];
+    unsigned char data[IPMI_MAX_MSG_LENGTH];
+} ipmi_smux_msg_t;
+
+#define IPMI_SMUX_MSG_LEN(m) \
+	(((unsigned char *) (m)->data - (unsigned char *) (m)) + (m)->data_len)
+
 #ifdef __cplusplus
 }
 #endif
@@ -156,6 +156,19 @@ typedef struct ipmi_msg_item_s
    knows to not free the data itself.  You must free it later. */
 #define IPMI_MSG_ITEM_USED	1
 
+/* Priority classes for commands.  When a connection has more commands
+   than it can have outstanding, the rest wait and are started in
+   class order, interactive first.  A class that keeps getting passed
+   over is let through now and then so it can't be starved.  With
+   IPMI_MSG_PRIO_DEFAULT the class comes from the command: SDR, FRU
+   and SEL entry transfers are bulk, chassis and watchdog commands are
+   interactive, and everything else is monitoring. */
+#define IPMI_MSG_PRIO_DEFAULT		-1
+#define IPMI_MSG_PRIO_INTERACTIVE	0
+#define IPMI_MSG_PRIO_MONITORING	1
+#define IPMI_MSG_PRIO_BULK		2
+#define IPMI_NUM_MSG_PRIOS		3
+
 /* Pay no attention to the contents of these structures... */
 struct ipmi_domain_id_s
 {
@@ -271,10 +271,12 @@ struct os_handler_s
     void (*operation_loop)(os_handler_t *handler);
 
 
-    /* The following are no longer implemented because they are
+    /* The is_xxx calls are no longer implemented because they are
        race-prone, unneeded, and/or difficult to implement.  You may
        safely set these to NULL, but they are here for backwards
-       compatability with old os handlers. */
+       compatability with old os handlers.  The reader/writer locks
+       are optional; if create_rwlock is NULL a normal lock is used
+       in their place. */
     int (*is_locked)(os_handler_t  *handler,
 		     os_hnd_lock_t *id);
     int (*create_rwlock)(os_handler_t  *handler,
@@ -348,6 +350,15 @@ struct os_handler_s
 
     int (*get_monotonic_time)(os_handler_t *handler, struct timeval *tv);
     int (*get_real_time)(os_handler_t *handler, struct timeval *tv);
+
+    /* Create a lock that the caller promises will never be claimed
+       again by a thread that already holds it, and that is only
+       held for short periods.  The handler may use a cheaper,
+       non-recursive lock for these.  It is destroyed, locked and
+       unlocked with the normal lock calls.  This is optional; if it
+       is NULL create_lock is used. */
+    int (*create_nr_lock)(os_handler_t  *handler,
+			  os_hnd_lock_t **id);
 };
 
 /* Only use these to allocate/free OS handlers. */
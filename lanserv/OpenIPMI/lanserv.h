@@ -75,16 +75,11 @@
 extern "C" {
 #endif
 
-/*
- * Restrictions: <=64 sessions
- */
-#define SESSION_BITS_REQ	6 /* Bits required to hold a session. */
-#define SESSION_MASK		0x3f
-
 typedef struct lmc_data_s lmc_data_t;
 typedef struct ipmi_sol_s ipmi_sol_t;
 typedef struct session_s session_t;
 typedef struct lanserv_data_s lanserv_data_t;
+typedef struct lan_crypto_op_s lan_crypto_op_t;
 
 typedef struct integ_handlers_s
 {
@@ -94,6 +89,9 @@ typedef struct integ_handlers_s
 	       unsigned char *pos,
 	       unsigned int *data_len, unsigned int data_size);
     int (*check)(lanserv_data_t *lan, session_t *session, msg_t *msg);
+    /* Called once the session keys are computed, before the first
+       add or check.  May be NULL. */
+    int (*keys_ready)(lanserv_data_t *lan, session_t *session);
 } integ_handlers_t;
 
 typedef struct conf_handlers_s
@@ -104,6 +102,9 @@ typedef struct conf_handlers_s
 		   unsigned char **pos, unsigned int *hdr_left,
 		   unsigned int *data_len, unsigned int *data_size);
     int (*decrypt)(lanserv_data_t *lan, session_t *session, msg_t *msg);
+    /* Called once the session keys are computed, before the first
+       encrypt or decrypt.  May be NULL. */
+    int (*keys_ready)(lanserv_data_t *lan, session_t *session);
 } conf_handlers_t;
 
 typedef struct auth_handlers_s
@@ -152,6 +153,10 @@ struct session_s
 
     int           handle; /* My index in the table. */
 
+    /* Next session in the session id hash chain while active, next
+       session in the free list while not. */
+    session_t     *next;
+
     uint32_t        recv_seq;
     uint32_t        xmit_seq;
     uint32_t        sid;
@@ -179,6 +184,10 @@ struct session_s
     /* The number of seconds left before the session is shut down. */
     unsigned int time_left;
 
+    /* Offloaded crypto operations in progress on the session.  A
+       closed session is not cleaned up until these are done. */
+    unsigned int crypto_refs;
+
     /* Address of the message that started the sessions. */
     void *src_addr;
     int  src_len;
@@ -283,8 +292,10 @@ struct channel_s
     unsigned int privilege_limit : 4;
     unsigned int privilege_limit_nonv : 4;
 
+    /* The session count fields in the protocol are only 6 bits
+       wide, so counts above this are reported as this value. */
 #define MAX_SESSIONS 63
-    unsigned int active_sessions : 6;
+    unsigned int active_sessions;
 
     struct {
 	unsigned char allowed_auths;
@@ -421,10 +432,33 @@ struct lanserv_data_s
     /* Generate 'size' bytes of random data into 'data'. */
     int (*gen_rand)(lanserv_data_t *lan, void *data, int size);
 
+    /* If set, the RMCP+ integrity and confidentiality processing for
+       established sessions is handed to this function instead of
+       being done inline.  The function must arrange for
+       ipmi_lan_crypto_op_run() to be called on the operation (from
+       any thread) and then ipmi_lan_crypto_op_done() to be called
+       from the thread that does everything else for this interface.
+       Operations with the same key must be completed in the order
+       they were handed off.  gen_rand must be thread-safe if this is
+       set. */
+    void (*crypto_offload)(lanserv_data_t *lan, lan_crypto_op_t *op);
+
     /* Don't fill in the below in the user code. */
 
-    /* session 0 is not used. */
-    session_t sessions[MAX_SESSIONS+1];
+    /* The maximum number of simultaneous sessions, 0 means no
+       limit.  The config code defaults it to MAX_SESSIONS. */
+    unsigned int max_sessions;
+
+    /* The session table, indexed by handle, grows as sessions are
+       needed.  session 0 is not used. */
+    session_t **sessions;
+    unsigned int num_sessions;
+    session_t *free_sessions;
+
+    /* Active sessions, hashed by session id.  The size is always a
+       power of two. */
+    session_t **sid_hash;
+    unsigned int sid_hash_size;
 
     /* Used to make the sid somewhat unique. */
     uint32_t sid_seq;
@@ -466,12 +500,88 @@ int lanserv_read_config(sys_data_t   *sys,
 IPMI_LANSERV_DLL_PUBLIC
 int ipmi_lan_init(lanserv_data_t *lan);
 
+/*
+ * An RMCP+ integrity/confidentiality operation handed to the
+ * crypto_offload function.  Only the fields below are for use by the
+ * offload code.
+ */
+struct lan_crypto_op_s
+{
+    /* For the offload code to queue the operation. */
+    lan_crypto_op_t *next;
+
+    /* Operations for the same session have the same key. */
+    uint32_t key;
+};
+
+/* Do the crypto work of the operation.  May be called from any thread. */
+IPMI_LANSERV_DLL_PUBLIC
+void ipmi_lan_crypto_op_run(lan_crypto_op_t *op);
+
+/* Finish the operation (deliver or send the message) and free it. */
+IPMI_LANSERV_DLL_PUBLIC
+void ipmi_lan_crypto_op_done(lan_crypto_op_t *op);
+
 typedef void (*ipmi_payload_handler_cb)(lanserv_data_t *lan, msg_t *msg);
 
 IPMI_LANSERV_DLL_PUBLIC
 int ipmi_register_payload(unsigned int payload_id,
 			  ipmi_payload_handler_cb handler);
 
+/*
+ * Batched LAN socket I/O.  ipmi_lan_batch_recv() reads all the
+ * datagrams waiting on the socket (up to IPMI_LAN_BATCH_MAX) and
+ * calls the handler for each one.  Anything sent with
+ * ipmi_lan_batch_send() from the handlers is held and sent in one
+ * go when the batch is done.  Outside of a batch,
+ * ipmi_lan_batch_send() sends immediately.  A batch may also be
+ * opened and closed by hand with ipmi_lan_batch_start() and
+ * ipmi_lan_batch_end(); these nest.  Only for use by the thread that
+ * handles LAN messages.
+ */
+#define IPMI_LAN_BATCH_MAX		32
+#define IPMI_LAN_BATCH_RECV_SIZE	256
+#define IPMI_LAN_BATCH_XMIT_SIZE	1200
+
+typedef void (*ipmi_lan_batch_msg_cb)(int fd, unsigned char *data,
+				      unsigned int len,
+				      struct sockaddr *addr,
+				      socklen_t addr_len,
+				      void *cb_data);
+
+/* Returns 0 or an errno if the socket had an error. */
+IPMI_LANSERV_DLL_PUBLIC
+int ipmi_lan_batch_recv(int fd, ipmi_lan_batch_msg_cb handler, void *cb_data);
+
+IPMI_LANSERV_DLL_PUBLIC
+void ipmi_lan_batch_send(int fd, struct iovec *data, int vecs,
+			 void *addr, socklen_t addr_len);
+
+IPMI_LANSERV_DLL_PUBLIC
+void ipmi_lan_batch_start(void);
+
+IPMI_LANSERV_DLL_PUBLIC
+void ipmi_lan_batch_end(void);
+
+/*
+ * Counts of system calls and messages.  The histograms count the
+ * number of calls that handled n messages at once, in index n.
+ * xmit_errs counts the messages that could not be sent.
+ */
+typedef struct ipmi_lan_batch_stats_s
+{
+    unsigned long recv_calls;
+    unsigned long recv_msgs;
+    unsigned long recv_hist[IPMI_LAN_BATCH_MAX + 1];
+    unsigned long xmit_calls;
+    unsigned long xmit_msgs;
+    unsigned long xmit_hist[IPMI_LAN_BATCH_MAX + 1];
+    unsigned long xmit_errs;
+} ipmi_lan_batch_stats_t;
+
+IPMI_LANSERV_DLL_PUBLIC
+void ipmi_lan_batch_get_stats(ipmi_lan_batch_stats_t *stats);
+
 #ifndef __GNUC__
 #  ifndef __attribute__
 #    define  __attribute__(x)  /*NOTHING*/
@@ -443,7 +443,10 @@ handle_get_channel_info(lmc_data_t    *mc,
 	medium_type = mc->channels[lchan]->medium_type;
 	protocol_type = mc->channels[lchan]->protocol_type;
 	session_support = mc->channels[lchan]->session_support;
-	active_sessions = mc->channels[lchan]->active_sessions;
+	if (mc->channels[lchan]->active_sessions > MAX_SESSIONS)
+	    active_sessions = MAX_SESSIONS;
+	else
+	    active_sessions = mc->channels[lchan]->active_sessions;
     }
 
     rdata[0] = 0;
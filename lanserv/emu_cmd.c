@@ -1178,6 +1178,33 @@ persist_cmd(emu_out_t *out, emu_data_t *emu, lmc_data_t *mc, char **toks)
     return 0;
 }
 
+static void
+print_batch_hist(emu_out_t *out, const char *name, unsigned long calls,
+		 unsigned long msgs, unsigned long *hist)
+{
+    unsigned int i;
+
+    out->eprintf(out, "%s: %lu calls, %lu messages\n", name, calls, msgs);
+    for (i = 1; i <= IPMI_LAN_BATCH_MAX; i++) {
+	if (hist[i])
+	    out->eprintf(out, "  %2u: %lu\n", i, hist[i]);
+    }
+}
+
+static int
+lan_stats_cmd(emu_out_t *out, emu_data_t *emu, lmc_data_t *mc, char **toks)
+{
+    ipmi_lan_batch_stats_t stats;
+
+    ipmi_lan_batch_get_stats(&stats);
+    print_batch_hist(out, "receive", stats.recv_calls, stats.recv_msgs,
+		     stats.recv_hist);
+    print_batch_hist(out, "transmit", stats.xmit_calls, stats.xmit_msgs,
+		     stats.xmit_hist);
+    out->eprintf(out, "transmit errors: %lu\n", stats.xmit_errs);
+    return 0;
+}
+
 static int
 quit(emu_out_t *out, emu_data_t *emu, lmc_data_t *mc, char **toks)
 {
@@ -1251,7 +1278,8 @@ static struct emu_cmd_info cmds[] =
     { "include",	NOMC,		read_cmds,		 &cmds[27] },
     { "sleep",		NOMC,		sleep_cmd,		 &cmds[28] },
     { "debug",		NOMC,		debug_cmd,		 &cmds[29] },
-    { "persist",	NOMC,		persist_cmd,		 NULL },
+    { "persist",	NOMC,		persist_cmd,		 &cmds[30] },
+    { "lan_stats",	NOMC,		lan_stats_cmd,		 NULL },
     { NULL }
 };
 
@@ -74,6 +74,7 @@
 #include <termios.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #include <config.h>
 
@@ -104,6 +105,8 @@ static char *command_string = NULL;
 static char *command_file = NULL;
 static int debug = 0;
 static int nostdio = 0;
+static int crypto_threads = 0;
+static int time_scale = 1;
 
 /*
  * Keep track of open sockets so we can close them on exec().
@@ -221,45 +224,169 @@ lan_send(lanserv_data_t *lan,
 	 struct iovec *data, int vecs,
 	 void *addr, int addr_len)
 {
-    struct msghdr msg;
-    sim_addr_t    *l = addr;
-    int           rv;
+    sim_addr_t *l = addr;
 
     /* When we send messages to ourself, we set the address to NULL so
        it won't be used. */
     if (!l)
 	return;
 
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &(l->addr);
-    msg.msg_namelen = l->addr_len;
-    msg.msg_iov = data;
-    msg.msg_iovlen = vecs;
+    ipmi_lan_batch_send(l->xmit_fd, data, vecs, &l->addr, l->addr_len);
+}
 
-    rv = sendmsg(l->xmit_fd, &msg, 0);
-    if (rv) {
-	/* FIXME - log an error. */
+/*
+ * RMCP+ crypto offload.  The integrity and confidentiality work is
+ * done by a pool of threads, but the results are handed back to the
+ * main thread, which does all the message handling.  So the MCs
+ * still only see one command at a time.  Operations are spread
+ * across the threads by key (session), so the messages on a session
+ * stay in order.
+ */
+typedef struct crypto_worker_s
+{
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    lan_crypto_op_t *head;
+    lan_crypto_op_t *tail;
+} crypto_worker_t;
+
+static crypto_worker_t *crypto_workers;
+static pthread_mutex_t crypto_done_lock = PTHREAD_MUTEX_INITIALIZER;
+static lan_crypto_op_t *crypto_done_head;
+static lan_crypto_op_t *crypto_done_tail;
+static int crypto_done_pipe[2];
+
+static void *
+crypto_worker(void *cb_data)
+{
+    crypto_worker_t *w = cb_data;
+    lan_crypto_op_t *op;
+    int             wake;
+
+    for (;;) {
+	pthread_mutex_lock(&w->lock);
+	while (!w->head)
+	    pthread_cond_wait(&w->cond, &w->lock);
+	op = w->head;
+	w->head = op->next;
+	if (!w->head)
+	    w->tail = NULL;
+	pthread_mutex_unlock(&w->lock);
+
+	ipmi_lan_crypto_op_run(op);
+
+	op->next = NULL;
+	pthread_mutex_lock(&crypto_done_lock);
+	wake = crypto_done_head == NULL;
+	if (crypto_done_tail)
+	    crypto_done_tail->next = op;
+	else
+	    crypto_done_head = op;
+	crypto_done_tail = op;
+	pthread_mutex_unlock(&crypto_done_lock);
+
+	/* Only wake the main thread when the list goes non-empty, it
+	   takes the whole list at once. */
+	if (wake)
+	    (void) write(crypto_done_pipe[1], "", 1);
+    }
+
+    return NULL;
+}
+
+static void
+crypto_done_ready(int fd, void *cb_data, os_hnd_fd_id_t *id)
+{
+    char            buf[16];
+    lan_crypto_op_t *op, *next;
+
+    (void) read(fd, buf, sizeof(buf));
+
+    pthread_mutex_lock(&crypto_done_lock);
+    op = crypto_done_head;
+    crypto_done_head = NULL;
+    crypto_done_tail = NULL;
+    pthread_mutex_unlock(&crypto_done_lock);
+
+    ipmi_lan_batch_start();
+    while (op) {
+	next = op->next;
+	ipmi_lan_crypto_op_done(op);
+	op = next;
     }
+    ipmi_lan_batch_end();
 }
 
 static void
-lan_data_ready(int lan_fd, void *cb_data, os_hnd_fd_id_t *id)
+lan_crypto_offload(lanserv_data_t *lan, lan_crypto_op_t *op)
 {
-    lanserv_data_t    *lan = cb_data;
-    int           len;
-    sim_addr_t    l;
-    unsigned char msgd[256];
+    crypto_worker_t *w = &crypto_workers[op->key % crypto_threads];
+
+    op->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail)
+	w->tail->next = op;
+    else
+	w->head = op;
+    w->tail = op;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void
+crypto_workers_init(misc_data_t *data)
+{
+    os_hnd_fd_id_t *fd_id;
+    int            i;
+    int            err;
+
+    if (pipe(crypto_done_pipe)) {
+	perror("Creating crypto pipe");
+	exit(1);
+    }
+    isim_add_fd(crypto_done_pipe[0]);
+    isim_add_fd(crypto_done_pipe[1]);
+
+    err = data->os_hnd->add_fd_to_wait_for(data->os_hnd, crypto_done_pipe[0],
+					   crypto_done_ready, data,
+					   NULL, &fd_id);
+    if (err) {
+	fprintf(stderr, "Unable to add crypto pipe wait: 0x%x\n", err);
+	exit(1);
+    }
+
+    crypto_workers = calloc(crypto_threads, sizeof(*crypto_workers));
+    if (!crypto_workers) {
+	fprintf(stderr, "Out of memory allocating crypto threads\n");
+	exit(1);
+    }
+
+    for (i = 0; i < crypto_threads; i++) {
+	crypto_worker_t *w = &crypto_workers[i];
 
-    l.addr_len = sizeof(l.addr);
-    len = recvfrom(lan_fd, msgd, sizeof(msgd), 0,
-		   (struct sockaddr *) &(l.addr), &(l.addr_len));
-    if (len < 0) {
-	if (errno != EINTR) {
-	    perror("Error receiving message");
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	err = pthread_create(&w->thread, NULL, crypto_worker, w);
+	if (err) {
+	    fprintf(stderr, "Unable to start crypto thread: %s\n",
+		    strerror(err));
 	    exit(1);
 	}
-	goto out;
     }
+}
+
+static void
+lan_msg_ready(int lan_fd, unsigned char *msgd, unsigned int len,
+	      struct sockaddr *addr, socklen_t addr_len, void *cb_data)
+{
+    lanserv_data_t *lan = cb_data;
+    sim_addr_t l;
+
+    if (addr_len > sizeof(l.addr))
+	return;
+    memcpy(&l.addr, addr, addr_len);
+    l.addr_len = addr_len;
     l.xmit_fd = lan_fd;
 
     if (lan->sysinfo->debug & DEBUG_RAW_MSG) {
@@ -270,10 +397,10 @@ lan_data_ready(int lan_fd, void *cb_data, os_hnd_fd_id_t *id)
     }
 
     if (len < 4)
-	goto out;
+	return;
 
     if (msgd[0] != 6)
-	goto out; /* Invalid version */
+	return; /* Invalid version */
 
     /* Check the message class. */
     switch (msgd[3]) {
@@ -285,8 +412,18 @@ lan_data_ready(int lan_fd, void *cb_data, os_hnd_fd_id_t *id)
 	    ipmi_handle_lan_msg(lan, msgd, len, &l, sizeof(l));
 	    break;
     }
- out:
-    return;
+}
+
+static void
+lan_data_ready(int lan_fd, void *cb_data, os_hnd_fd_id_t *id)
+{
+    int rv;
+
+    rv = ipmi_lan_batch_recv(lan_fd, lan_msg_ready, cb_data);
+    if (rv) {
+	fprintf(stderr, "Error receiving message: %s\n", strerror(rv));
+	exit(1);
+    }
 }
 
 static int
@@ -335,6 +472,8 @@ lan_channel_init(void *info, channel_t *chan)
     lan->user_info = data;
     lan->send_out = lan_send;
     lan->gen_rand = gen_rand;
+    if (crypto_threads > 0)
+	lan->crypto_offload = lan_crypto_offload;
 
     err = ipmi_lan_init(lan);
     if (err) {
@@ -799,6 +938,24 @@ static struct poptOption poptOpts[]=
 	"nopersist",
 	""
     },
+    {
+	"crypto-threads",
+	't',
+	POPT_ARG_INT,
+	&crypto_threads,
+	't',
+	"number of threads for RMCP+ crypto",
+	""
+    },
+    {
+	"time-scale",
+	'T',
+	POPT_ARG_INT,
+	&time_scale,
+	'T',
+	"run simulated time this many times faster than real time",
+	""
+    },
     POPT_AUTOHELP
     {
 	NULL,
@@ -1115,6 +1272,7 @@ sleeper(emu_data_t *emu, struct timeval *time)
 {
     misc_data_t    *data = ipmi_emu_get_user_data(emu);
     os_handler_waiter_t *waiter;
+    struct timeval tv;
 
     waiter = os_handler_alloc_waiter(data->waiter_factory);
     if (!waiter) {
@@ -1122,6 +1280,16 @@ sleeper(emu_data_t *emu, struct timeval *time)
 	exit(1);
     }
 
+    if (time_scale > 1) {
+	/* Sleeps are in simulated time. */
+	uint64_t us = (uint64_t) time->tv_sec * 1000000 + time->tv_usec;
+
+	us /= time_scale;
+	tv.tv_sec = us / 1000000;
+	tv.tv_usec = us % 1000000;
+	time = &tv;
+    }
+
     os_handler_waiter_wait(waiter, time);
     os_handler_waiter_release(waiter);
 }
@@ -1209,64 +1377,225 @@ ipmi_remove_io_hnd(ipmi_io_t *io)
     io->data->os_hnd->remove_fd_to_wait_for(io->data->os_hnd, io->id);
 }
 
+/*
+ * Emulation timers.  All the timers the emulation allocates run off
+ * a single OS timer through a timer wheel with millisecond slots.
+ * The wheel runs on simulated time, which is the OS monotonic time
+ * since startup multiplied by time_scale, so with a time scale above
+ * one everything (timers, the one-second ticks, watchdogs, session
+ * timeouts, timestamps) runs that many times faster than real time.
+ */
+#define WHEEL_SLOTS	512	/* Must be a power of 2 */
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+
 struct ipmi_timer_s
 {
-    os_hnd_timer_id_t *id;
     misc_data_t *data;
     void (*cb)(void *cb_data);
     void *cb_data;
+
+    int running;
+    uint64_t expire; /* In simulated milliseconds. */
+    ipmi_timer_t *next, *prev;
 };
 
+static ipmi_timer_t *wheel[WHEEL_SLOTS];
+static uint64_t wheel_now; /* Slots up to and including this are done. */
+static uint64_t wheel_next; /* Earliest expiry time, or 0 if unknown. */
+static unsigned int wheel_count;
+static int wheel_armed;
+static uint64_t wheel_armed_time;
+static struct timeval time_base;
+
+/* Real microseconds since startup. */
+static uint64_t
+real_elapsed_us(misc_data_t *data)
+{
+    struct timeval now;
+
+    data->os_hnd->get_monotonic_time(data->os_hnd, &now);
+    return ((uint64_t) (now.tv_sec - time_base.tv_sec) * 1000000
+	    + now.tv_usec - time_base.tv_usec);
+}
+
+static uint64_t
+sim_now_ms(misc_data_t *data)
+{
+    return real_elapsed_us(data) * time_scale / 1000;
+}
+
+static void wheel_timeout(void *cb_data, os_hnd_timer_id_t *id);
+
+static void
+wheel_arm(misc_data_t *data)
+{
+    struct timeval tv;
+    uint64_t now, delay_us;
+    int err;
+
+    if (wheel_armed) {
+	if (wheel_armed_time <= wheel_next)
+	    return;
+	data->os_hnd->stop_timer(data->os_hnd, data->timer);
+	wheel_armed = 0;
+    }
+    if (wheel_count == 0)
+	return;
+
+    /* Convert the simulated delay back to real time, rounding up. */
+    now = sim_now_ms(data);
+    if (wheel_next > now)
+	delay_us = ((wheel_next - now) * 1000 + time_scale - 1) / time_scale;
+    else
+	delay_us = 0;
+    tv.tv_sec = delay_us / 1000000;
+    tv.tv_usec = delay_us % 1000000;
+    err = data->os_hnd->start_timer(data->os_hnd, data->timer, &tv,
+				    wheel_timeout, data);
+    if (err) {
+	fprintf(stderr, "Unable to start timer: 0x%x\n", err);
+	exit(1);
+    }
+    wheel_armed = 1;
+    wheel_armed_time = wheel_next;
+}
+
+static void
+wheel_remove(ipmi_timer_t *timer)
+{
+    if (timer->prev)
+	timer->prev->next = timer->next;
+    else
+	wheel[timer->expire & WHEEL_MASK] = timer->next;
+    if (timer->next)
+	timer->next->prev = timer->prev;
+    timer->running = 0;
+    wheel_count--;
+}
+
+static void
+wheel_find_next(void)
+{
+    ipmi_timer_t *t;
+    unsigned int i;
+
+    wheel_next = 0;
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+	for (t = wheel[i]; t; t = t->next) {
+	    if (!wheel_next || t->expire < wheel_next)
+		wheel_next = t->expire;
+	}
+    }
+}
+
+static void
+wheel_timeout(void *cb_data, os_hnd_timer_id_t *id)
+{
+    misc_data_t *data = cb_data;
+    uint64_t now = sim_now_ms(data);
+    ipmi_timer_t *t;
+
+    wheel_armed = 0;
+    while (wheel_now < now) {
+	if (wheel_count == 0) {
+	    wheel_now = now;
+	    break;
+	}
+	/* Skip over the empty stretch before the next expiry. */
+	if (wheel_next > wheel_now + 1) {
+	    wheel_now = wheel_next - 1;
+	    if (wheel_now >= now) {
+		wheel_now = now;
+		break;
+	    }
+	}
+
+	wheel_now++;
+	/*
+	 * The handlers may start and stop timers, including ones in
+	 * this slot, so rescan the slot after each one.
+	 */
+    rescan:
+	for (t = wheel[wheel_now & WHEEL_MASK]; t; t = t->next) {
+	    if (t->expire <= wheel_now) {
+		wheel_remove(t);
+		t->cb(t->cb_data);
+		goto rescan;
+	    }
+	}
+	if (wheel_now >= wheel_next)
+	    wheel_find_next();
+    }
+
+    wheel_arm(data);
+}
+
 static int
 ipmi_alloc_timer(sys_data_t *sys, void (*cb)(void *cb_data),
 		 void *cb_data, ipmi_timer_t **rtimer)
 {
     misc_data_t *data = sys->info;
     ipmi_timer_t *timer;
-    int err;
 
     timer = malloc(sizeof(ipmi_timer_t));
     if (!timer)
 	return ENOMEM;
+    memset(timer, 0, sizeof(*timer));
 
     timer->cb = cb;
     timer->cb_data = cb_data;
     timer->data = data;
-    err = data->os_hnd->alloc_timer(data->os_hnd, &timer->id);
-    if (err) {
-	free(timer);
-	return err;
-    }
 
     *rtimer = timer;
     return 0;
 }
 
-static void
-timer_cb(void *cb_data, os_hnd_timer_id_t *id)
-{
-    ipmi_timer_t *timer = cb_data;
-
-    timer->cb(timer->cb_data);
-}
-
 static int
 ipmi_start_timer(ipmi_timer_t *timer, struct timeval *timeout)
 {
-    return timer->data->os_hnd->start_timer(timer->data->os_hnd, timer->id,
-					    timeout, timer_cb, timer);
+    misc_data_t *data = timer->data;
+    uint64_t expire;
+    unsigned int slot;
+
+    if (timer->running)
+	wheel_remove(timer);
+
+    expire = (sim_now_ms(data) + timeout->tv_sec * 1000
+	      + (timeout->tv_usec + 999) / 1000);
+    if (expire <= wheel_now)
+	expire = wheel_now + 1;
+
+    timer->expire = expire;
+    slot = expire & WHEEL_MASK;
+    timer->prev = NULL;
+    timer->next = wheel[slot];
+    if (timer->next)
+	timer->next->prev = timer;
+    wheel[slot] = timer;
+    timer->running = 1;
+    wheel_count++;
+
+    if (!wheel_next || expire < wheel_next)
+	wheel_next = expire;
+    wheel_arm(data);
+    return 0;
 }
 
 static int
 ipmi_stop_timer(ipmi_timer_t *timer)
 {
-    return timer->data->os_hnd->stop_timer(timer->data->os_hnd, timer->id);
+    if (!timer->running)
+	return ETIMEDOUT;
+    wheel_remove(timer);
+    return 0;
 }
 
 static void
 ipmi_free_timer(ipmi_timer_t *timer)
 {
-    timer->data->os_hnd->free_timer(timer->data->os_hnd, timer->id);
+    if (timer->running)
+	wheel_remove(timer);
+    free(timer);
 }
 
 static ipmi_tick_handler_t *tick_handlers;
@@ -1278,12 +1607,13 @@ is_register_tick_handler(ipmi_tick_handler_t *handler)
     tick_handlers = handler;
 }
 
+static ipmi_timer_t *tick_timer;
+
 static void
-tick(void *cb_data, os_hnd_timer_id_t *id)
+tick(void *cb_data)
 {
     misc_data_t *data = cb_data;
     struct timeval tv;
-    int err;
     ipmi_tick_handler_t *h;
 
     h = tick_handlers;
@@ -1296,11 +1626,7 @@ tick(void *cb_data, os_hnd_timer_id_t *id)
 
     tv.tv_sec = 1;
     tv.tv_usec = 0;
-    err = data->os_hnd->start_timer(data->os_hnd, data->timer, &tv, tick, data);
-    if (err) {
-	fprintf(stderr, "Unable to start timer: 0x%x\n", err);
-	exit(1);
-    }
+    ipmi_start_timer(tick_timer, &tv);
 }
 
 static void *
@@ -1419,18 +1745,37 @@ ipmi_do_kill(startcmd_t *startcmd, int noblock)
 	kill(startcmd->vmpid, SIGTERM);
 }
 
+static void
+add_us(struct timeval *tv, uint64_t us)
+{
+    us += tv->tv_usec;
+    tv->tv_sec += us / 1000000;
+    tv->tv_usec = us % 1000000;
+}
+
+/*
+ * Both clocks run at the simulated rate, the real time clock just
+ * gets ahead of the wall clock when time is accelerated.
+ */
 static int ipmi_get_monotonic_time(sys_data_t *sys, struct timeval *tv)
 {
     misc_data_t *data = sys->info;
-    os_handler_t *os_hnd = data->os_hnd;
-    return os_hnd->get_monotonic_time(os_hnd, tv);
+
+    *tv = time_base;
+    add_us(tv, real_elapsed_us(data) * time_scale);
+    return 0;
 }
 
 static int ipmi_get_real_time(sys_data_t *sys, struct timeval *tv)
 {
     misc_data_t *data = sys->info;
     os_handler_t *os_hnd = data->os_hnd;
-    return os_hnd->get_real_time(os_hnd, tv);
+    int rv;
+
+    rv = os_hnd->get_real_time(os_hnd, tv);
+    if (!rv && time_scale > 1)
+	add_us(tv, real_elapsed_us(data) * (time_scale - 1));
+    return rv;
 }
 
 int
@@ -1467,6 +1812,11 @@ main(int argc, const char *argv[])
     }
     poptFreeContext(poptCtx);
 
+    if (time_scale < 1) {
+	fprintf(stderr, "Time scale must be at least 1\n");
+	exit(1);
+    }
+
     printf("IPMI Simulator version %s\n", PVERSION);
 
     global_misc_data = &data;
@@ -1489,6 +1839,7 @@ main(int argc, const char *argv[])
 	fprintf(stderr, "Unable to allocate timer: 0x%x\n", err);
 	exit(1);
     }
+    data.os_hnd->get_monotonic_time(data.os_hnd, &time_base);
 
     sysinfo_init(&sysinfo);
     sysinfo.info = &data;
@@ -1554,6 +1905,9 @@ main(int argc, const char *argv[])
 	exit(1);
     }
 
+    if (crypto_threads > 0)
+	crypto_workers_init(&data);
+
     data.emu = ipmi_emu_alloc(&data, sleeper, &sysinfo);
 
     /* Set this up for console I/O, even if we don't use it. */
@@ -1725,13 +2079,14 @@ main(int argc, const char *argv[])
 	}
     }
 
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    err = data.os_hnd->start_timer(data.os_hnd, data.timer, &tv, tick, &data);
+    err = ipmi_alloc_timer(&sysinfo, tick, &data, &tick_timer);
     if (err) {
-	fprintf(stderr, "Unable to start timer: 0x%x\n", err);
+	fprintf(stderr, "Unable to allocate tick timer: 0x%x\n", err);
 	goto out;
     }
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    ipmi_start_timer(tick_timer, &tv);
 
     data.os_hnd->operation_loop(data.os_hnd);
     rv = 0;
@@ -133,22 +133,9 @@ lan_send(lanserv_data_t *lan,
 	 struct iovec *data, int vecs,
 	 void *addr, int addr_len)
 {
-    struct msghdr msg;
     lanserv_addr_t *l = addr;
-    int           rv;
 
-    msg.msg_name = &(l->addr);
-    msg.msg_namelen = l->addr_len;
-    msg.msg_iov = data;
-    msg.msg_iovlen = vecs;
-    msg.msg_control = NULL;
-    msg.msg_controllen = 0;
-    msg.msg_flags = 0;
-
-    rv = sendmsg(l->xmit_fd, &msg, 0);
-    if (rv) {
-	/* FIXME - log an error. */
-    }
+    ipmi_lan_batch_send(l->xmit_fd, data, vecs, &l->addr, l->addr_len);
 }
 
 static void
@@ -309,23 +296,16 @@ handle_msg_ipmi_dev(int smi_fd, void *cb_data, os_hnd_fd_id_t *id)
 }
 
 static void
-lan_data_ready(int lan_fd, void *cb_data, os_hnd_fd_id_t *id)
+lan_msg_ready(int lan_fd, unsigned char *data, unsigned int len,
+	      struct sockaddr *addr, socklen_t addr_len, void *cb_data)
 {
     lanserv_data_t *lan = cb_data;
-    int                len;
-    lanserv_addr_t     l;
-    unsigned char      data[256];
-
-    l.addr_len = sizeof(l.addr);
-    len = recvfrom(lan_fd, data, sizeof(data), 0, 
-		    (struct sockaddr *)&(l.addr), &(l.addr_len));
-    if (len < 0) {
-	if (errno != EINTR) {
-	    perror("Error receiving message");
-	    exit(1);
-	}
+    lanserv_addr_t l;
+
+    if (addr_len > sizeof(l.addr))
 	return;
-    }
+    memcpy(&l.addr, addr, addr_len);
+    l.addr_len = addr_len;
     l.xmit_fd = lan_fd;
 
     if (lan->sysinfo->debug & DEBUG_RAW_MSG) {
@@ -353,6 +333,18 @@ lan_data_ready(int lan_fd, void *cb_data, os_hnd_fd_id_t *id)
     }
 }
 
+static void
+lan_data_ready(int lan_fd, void *cb_data, os_hnd_fd_id_t *id)
+{
+    int rv;
+
+    rv = ipmi_lan_batch_recv(lan_fd, lan_msg_ready, cb_data);
+    if (rv) {
+	fprintf(stderr, "Error receiving message: %s\n", strerror(rv));
+	exit(1);
+    }
+}
+
 static int
 ipmi_open(char *ipmi_dev)
 {
@@ -0,0 +1,326 @@
+/*
+ * lanserv_batch.c
+ *
+ * MontaVista IPMI LAN interface batched socket I/O
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ * Copyright 2003,2004,2005 MontaVista Software Inc.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * Lesser General Public License (GPL) Version 2 or the modified BSD
+ * license below.  The following disclamer applies to both licenses:
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * GNU Lesser General Public Licence
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Modified BSD Licence
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *   3. The name of the author may not be used to endorse or promote
+ *      products derived from this software without specific prior
+ *      written permission.
+ */
+
+/*
+ * Batched datagram handling for the LAN interface.  All the
+ * datagrams waiting on a socket are pulled in with one recvmmsg()
+ * call, and the responses generated while handling them are held and
+ * pushed out with one sendmmsg() call per socket, instead of a system
+ * call for every message.  Responses generated outside of a batch
+ * (timers, asynchronous responses) are sent immediately.
+ *
+ * This is only for use by the thread that handles the LAN messages.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <OpenIPMI/lanserv.h>
+
+typedef struct batch_xmit_s
+{
+    int                     fd;
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    struct iovec            iov;
+    unsigned char           data[IPMI_LAN_BATCH_XMIT_SIZE];
+} batch_xmit_t;
+
+static unsigned int batch_depth;
+static unsigned int xmit_count;
+static batch_xmit_t xmit_q[IPMI_LAN_BATCH_MAX];
+
+static unsigned char recv_data[IPMI_LAN_BATCH_MAX][IPMI_LAN_BATCH_RECV_SIZE];
+static struct sockaddr_storage recv_addr[IPMI_LAN_BATCH_MAX];
+
+static ipmi_lan_batch_stats_t stats;
+
+static void
+count_recv(unsigned int count)
+{
+    stats.recv_calls++;
+    stats.recv_msgs += count;
+    stats.recv_hist[count]++;
+}
+
+static void
+count_xmit(unsigned int count)
+{
+    stats.xmit_calls++;
+    stats.xmit_msgs += count;
+    stats.xmit_hist[count]++;
+}
+
+static void
+send_one(int fd, struct iovec *data, int vecs, void *addr,
+	 socklen_t addr_len)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = data;
+    msg.msg_iovlen = vecs;
+
+    if (sendmsg(fd, &msg, 0) >= 0)
+	count_xmit(1);
+    else
+	stats.xmit_errs++;
+}
+
+#ifdef HAVE_SENDMMSG
+static void
+flush_xmit(void)
+{
+    struct mmsghdr msgs[IPMI_LAN_BATCH_MAX];
+    unsigned int   start, end, i;
+    int            rv;
+
+    memset(msgs, 0, sizeof(msgs[0]) * xmit_count);
+    for (i = 0; i < xmit_count; i++) {
+	msgs[i].msg_hdr.msg_name = &xmit_q[i].addr;
+	msgs[i].msg_hdr.msg_namelen = xmit_q[i].addr_len;
+	msgs[i].msg_hdr.msg_iov = &xmit_q[i].iov;
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* Messages are sent in order, one system call per run of
+       messages on the same socket. */
+    for (start = 0; start < xmit_count; start = end) {
+	for (end = start + 1; end < xmit_count; end++) {
+	    if (xmit_q[end].fd != xmit_q[start].fd)
+		break;
+	}
+	while (start < end) {
+	    rv = sendmmsg(xmit_q[start].fd, msgs + start, end - start, 0);
+	    if (rv < 0 && errno == EINTR)
+		continue;
+	    if (rv < 0 && errno == ENOSYS) {
+		for (; start < end; start++)
+		    send_one(xmit_q[start].fd, &xmit_q[start].iov, 1,
+			     &xmit_q[start].addr, xmit_q[start].addr_len);
+		break;
+	    }
+	    if (rv <= 0) {
+		/* The first message could not be sent, which may only be
+		   a problem with its destination.  Drop it like a lost
+		   datagram, the remote end will retry, and go on with
+		   the rest. */
+		stats.xmit_errs++;
+		start++;
+		continue;
+	    }
+	    count_xmit(rv);
+	    start += rv;
+	}
+    }
+    xmit_count = 0;
+}
+#else
+static void
+flush_xmit(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < xmit_count; i++)
+	send_one(xmit_q[i].fd, &xmit_q[i].iov, 1,
+		 &xmit_q[i].addr, xmit_q[i].addr_len);
+    xmit_count = 0;
+}
+#endif
+
+void
+ipmi_lan_batch_start(void)
+{
+    batch_depth++;
+}
+
+void
+ipmi_lan_batch_end(void)
+{
+    if (batch_depth == 0)
+	return;
+    batch_depth--;
+    if (batch_depth == 0 && xmit_count > 0)
+	flush_xmit();
+}
+
+void
+ipmi_lan_batch_send(int fd, struct iovec *data, int vecs,
+		    void *addr, socklen_t addr_len)
+{
+    batch_xmit_t *x;
+    unsigned int len = 0;
+    int          i;
+
+    for (i = 0; i < vecs; i++)
+	len += data[i].iov_len;
+
+    if ((batch_depth == 0) || (len > sizeof(x->data))
+	|| (addr_len > sizeof(x->addr)))
+    {
+	send_one(fd, data, vecs, addr, addr_len);
+	return;
+    }
+
+    if (xmit_count >= IPMI_LAN_BATCH_MAX)
+	flush_xmit();
+
+    x = &xmit_q[xmit_count];
+    x->fd = fd;
+    memcpy(&x->addr, addr, addr_len);
+    x->addr_len = addr_len;
+    len = 0;
+    for (i = 0; i < vecs; i++) {
+	memcpy(x->data + len, data[i].iov_base, data[i].iov_len);
+	len += data[i].iov_len;
+    }
+    x->iov.iov_base = x->data;
+    x->iov.iov_len = len;
+    xmit_count++;
+}
+
+static int
+recv_one(int fd, unsigned int *lens, socklen_t *addr_lens)
+{
+    int rv;
+
+    addr_lens[0] = sizeof(recv_addr[0]);
+    rv = recvfrom(fd, recv_data[0], IPMI_LAN_BATCH_RECV_SIZE, 0,
+		  (struct sockaddr *) &recv_addr[0], &addr_lens[0]);
+    if (rv < 0)
+	return -1;
+    lens[0] = rv;
+    return 1;
+}
+
+#ifdef HAVE_RECVMMSG
+static int
+recv_msgs(int fd, unsigned int *lens, socklen_t *addr_lens)
+{
+    static int     no_recvmmsg;
+    struct mmsghdr msgs[IPMI_LAN_BATCH_MAX];
+    struct iovec   iov[IPMI_LAN_BATCH_MAX];
+    int            i, rv;
+
+    if (no_recvmmsg)
+	return recv_one(fd, lens, addr_lens);
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < IPMI_LAN_BATCH_MAX; i++) {
+	iov[i].iov_base = recv_data[i];
+	iov[i].iov_len = IPMI_LAN_BATCH_RECV_SIZE;
+	msgs[i].msg_hdr.msg_name = &recv_addr[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(recv_addr[i]);
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* Only take what is already there, don't wait for a full batch. */
+    rv = recvmmsg(fd, msgs, IPMI_LAN_BATCH_MAX, MSG_DONTWAIT, NULL);
+    if (rv < 0) {
+	if (errno != ENOSYS)
+	    return -1;
+	/* Kernel too old, fall back to one at a time. */
+	no_recvmmsg = 1;
+	return recv_one(fd, lens, addr_lens);
+    }
+
+    for (i = 0; i < rv; i++) {
+	lens[i] = msgs[i].msg_len;
+	addr_lens[i] = msgs[i].msg_hdr.msg_namelen;
+    }
+    return rv;
+}
+#else
+#define recv_msgs recv_one
+#endif
+
+int
+ipmi_lan_batch_recv(int fd, ipmi_lan_batch_msg_cb handler, void *cb_data)
+{
+    unsigned int lens[IPMI_LAN_BATCH_MAX];
+    socklen_t    addr_lens[IPMI_LAN_BATCH_MAX];
+    int          count, i;
+
+    count = recv_msgs(fd, lens, addr_lens);
+    if (count < 0) {
+	if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
+	    return 0;
+	return errno;
+    }
+    if (count == 0)
+	return 0;
+    count_recv(count);
+
+    ipmi_lan_batch_start();
+    for (i = 0; i < count; i++)
+	handler(fd, recv_data[i], lens[i],
+		(struct sockaddr *) &recv_addr[i], addr_lens[i], cb_data);
+    ipmi_lan_batch_end();
+
+    return 0;
+}
+
+void
+ipmi_lan_batch_get_stats(ipmi_lan_batch_stats_t *rstats)
+{
+    *rstats = stats;
+}
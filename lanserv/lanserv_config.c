@@ -98,6 +98,7 @@ lanserv_read_config(sys_data_t    *sys,
     lan->channel.protocol_type = IPMI_CHANNEL_PROTOCOL_IPMB;
     lan->channel.session_support = IPMI_CHANNEL_MULTI_SESSION;
     lan->users = sys->cusers;
+    lan->max_sessions = MAX_SESSIONS;
 
     if (sys->chan_set[channel_num]) {
 	err = -1;
@@ -172,6 +173,8 @@ lanserv_read_config(sys_data_t    *sys,
 	    err = read_bytes(&tokptr, lan->bmc_key, &errstr, 20);
 	    if (err)
 		goto out_err;
+	} else if (strcmp(tok, "max_sessions") == 0) {
+	    err = get_uint(&tokptr, &lan->max_sessions, &errstr);
 	} else if (strcmp(tok, "lan_config_program") == 0) {
 	    err = get_delim_str(&tokptr, &lan->config_prog, &errstr);
 	    if (err)
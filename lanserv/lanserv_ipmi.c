@@ -105,52 +105,125 @@ find_user(lanserv_data_t *lan, uint8_t *user, int name_only_lookup, int priv)
     return rv;
 }
 
+/* Session ids are handed out sequentially (shifted left by one), so
+   the low bits spread evenly across the hash table. */
+#define SID_HASH(lan, sid) (((sid) >> 1) & ((lan)->sid_hash_size - 1))
+
 static session_t *
 sid_to_session(lanserv_data_t *lan, unsigned int sid)
 {
-    int       idx;
     session_t *session;
 
     if (sid & 1)
 	return NULL;
-    idx = (sid >> 1) & SESSION_MASK;
-    if (idx > MAX_SESSIONS)
-	return NULL;
-    session = lan->sessions + idx;
-    if (!session->active)
-	return NULL;
-    if (session->sid != sid)
+    if (!lan->sid_hash)
 	return NULL;
-    return session;
+    session = lan->sid_hash[SID_HASH(lan, sid)];
+    while (session) {
+	if (session->sid == sid)
+	    return session;
+	session = session->next;
+    }
+    return NULL;
 }
 
+/*
+ * Give the session a session id that is not in use and make it
+ * visible to sid_to_session().
+ */
 static void
-close_session(lanserv_data_t *lan, session_t *session)
+register_session(lanserv_data_t *lan, session_t *session)
 {
-    unsigned int i;
+    unsigned int idx;
 
-    for (i = 0; i < LANSERV_NUM_CLOSERS; i++) {
-	if (session->closers[i].close_cb) {
-	    session->closers[i].close_cb(
-		session->closers[i].mc,
-		session->sid, session->closers[i].close_cb_data);
-	    session->closers[i].close_cb = NULL;
-	    session->closers[i].mc = NULL;
+    do {
+	lan->sid_seq++;
+	session->sid = lan->sid_seq << 1;
+    } while ((session->sid == 0) || sid_to_session(lan, session->sid));
+
+    idx = SID_HASH(lan, session->sid);
+    session->next = lan->sid_hash[idx];
+    lan->sid_hash[idx] = session;
+    lan->channel.active_sessions++;
+}
+
+static void
+unregister_session(lanserv_data_t *lan, session_t *session)
+{
+    session_t **prev = &lan->sid_hash[SID_HASH(lan, session->sid)];
+
+    while (*prev) {
+	if (*prev == session) {
+	    *prev = session->next;
+	    lan->channel.active_sessions--;
+	    break;
 	}
+	prev = &(*prev)->next;
     }
+    session->next = NULL;
+    session->sid = 0;
+}
 
-    session->active = 0;
+static int
+sessions_full(lanserv_data_t *lan)
+{
+    return (lan->max_sessions
+	    && (lan->channel.active_sessions >= lan->max_sessions));
+}
+
+/* Limit a session count to what fits in the 6-bit protocol fields. */
+static unsigned char
+session_count(unsigned int count)
+{
+    if (count > MAX_SESSIONS)
+	return MAX_SESSIONS;
+    return count;
+}
+
+static void
+release_session(lanserv_data_t *lan, session_t *session)
+{
     if (session->authtype <= 4)
 	ipmi_auths[session->authtype].authcode_cleanup(session->authdata);
     if (session->integh)
 	session->integh->cleanup(lan, session);
     if (session->confh)
 	session->confh->cleanup(lan, session);
-    lan->channel.active_sessions--;
     if (session->src_addr) {
 	lan->channel.free(&lan->channel, session->src_addr);
 	session->src_addr = NULL;
     }
+
+    session->next = lan->free_sessions;
+    lan->free_sessions = session;
+}
+
+static void
+close_session(lanserv_data_t *lan, session_t *session)
+{
+    unsigned int i;
+
+    if (!session->active)
+	return;
+
+    for (i = 0; i < LANSERV_NUM_CLOSERS; i++) {
+	if (session->closers[i].close_cb) {
+	    session->closers[i].close_cb(
+		session->closers[i].mc,
+		session->sid, session->closers[i].close_cb_data);
+	    session->closers[i].close_cb = NULL;
+	    session->closers[i].mc = NULL;
+	}
+    }
+
+    session->active = 0;
+    if (session->sid)
+	unregister_session(lan, session);
+
+    /* Offloaded crypto operations may still be using the keys, the
+       last one to finish releases the session. */
+    if (!session->crypto_refs)
+	release_session(lan, session);
 }
 
 static int
@@ -270,156 +343,290 @@ raw_send(lanserv_data_t *lan,
     lan->send_out(lan, vec, vecs, addr, addr_len);
 }
 
-static void
-return_rmcpp_rsp(lanserv_data_t *lan, session_t *session, msg_t *msg,
-		 unsigned int payload, unsigned char *data, unsigned int len,
-		 unsigned char *iana, unsigned int payload_id)
+/* An RMCP+ message being built for sending. */
+typedef struct rmcpp_rsp_s
 {
-    uint8_t d[IPMI_LAN_MAX_HEADER_SIZE+IPMI_LAN_MAX_HEADER_SIZE
-	      +IPMI_LAN_MAX_TRAILER_SIZE+1];
-    uint8_t *pos = d + IPMI_LAN_MAX_HEADER_SIZE;
-    uint8_t *tpos;
-    unsigned int hdr_left = IPMI_LAN_MAX_HEADER_SIZE;
-    unsigned int dlen = IPMI_LAN_MAX_HEADER_SIZE + IPMI_LAN_MAX_TRAILER_SIZE;
+    uint8_t      d[IPMI_LAN_MAX_HEADER_SIZE+IPMI_LAN_MAX_HEADER_SIZE
+		   +IPMI_LAN_MAX_TRAILER_SIZE+1];
+    uint8_t      *pos;
+    unsigned int hdr_left;
+    unsigned int len;
+    unsigned int dlen;
     unsigned int mlen;
-    struct iovec vec[3];
-    uint32_t sid, seq, *seqp;
-    int rv;
-    unsigned int s;
 
-    if (!session)
-	session = sid_to_session(lan, msg->sid);
+    unsigned int  payload;
+    unsigned char iana[3];
+    unsigned int  payload_id;
+    uint32_t      sid;
+    uint32_t      seq;
+} rmcpp_rsp_t;
 
-    if (len > dlen)
-	return;
-    memcpy(pos, data, len);
+/*
+ * The real structure behind lan_crypto_op_t.  The message and its
+ * source address are copied in, they must survive the caller.
+ */
+typedef struct crypto_op_s
+{
+    lan_crypto_op_t op; /* Must be first. */
 
-    if (payload == 0) {
-	/* Add the IPMI header - fixme -cheap hack */
-	if (hdr_left < 6)
-	    return;
-	hdr_left -= 6;
-	pos -= 6;
-	dlen += 6; /* Adding header, increase total length */
-	len += 6;
-	pos[0] = msg->rq_addr;
-	pos[1] = ((msg->netfn | 1) << 2) | msg->rq_lun;
-	pos[2] = -ipmb_checksum(pos, 2, 0);
-	pos[3] = msg->rs_addr;
-	pos[4] = (msg->rq_seq << 2) | msg->rs_lun;
-	pos[5] = msg->cmd;
-	pos[len] = -ipmb_checksum(pos+3, len-3, 0);
-	len++;
-	dlen++;
-    }
+    lanserv_data_t *lan;
+    session_t      *session;
+    int            outgoing;
+    int            err;
+    const char     *errstr;
 
-    if (session && !session->in_startup) {
-	if (session->conf) {
-	    rv = session->confh->encrypt(lan, session,
-					 &pos, &hdr_left, &len, &dlen);
-	    if (rv) {
-		lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
-			 "Message failure:"
-			 " encryption failed: 0x%x", rv);
-		return;
-	    }
+    /* Incoming messages. */
+    msg_t          msg;
+    msg_t          imsg;
+
+    /* Outgoing messages. */
+    rmcpp_rsp_t    rsp;
+
+    unsigned char  buf[1];
+} crypto_op_t;
+
+/*
+ * Allocate a crypto operation with room for the source address and
+ * data_len bytes of packet data.  The address is copied in.  The
+ * message data belongs to the caller and is gone by the time the
+ * operation is done, so it is not kept; the caller points it at its
+ * own copy if it needs it.
+ */
+static crypto_op_t *
+alloc_crypto_op(lanserv_data_t *lan, session_t *session, msg_t *msg,
+		unsigned int data_len)
+{
+    crypto_op_t *op;
+
+    op = malloc(sizeof(*op) + msg->src_len + data_len);
+    if (!op)
+	return NULL;
+    memset(op, 0, sizeof(*op));
+    op->op.key = session->sid;
+    op->lan = lan;
+    op->session = session;
+    op->msg = *msg;
+    op->msg.data = NULL;
+    op->msg.len = 0;
+    op->msg.rmcpp.authdata = NULL;
+    if (msg->src_addr) {
+	op->msg.src_addr = op->buf;
+	memcpy(op->buf, msg->src_addr, msg->src_len);
+    }
+    session->crypto_refs++;
+    return op;
+}
+
+/*
+ * Encrypt the payload, add the RMCP+ header and the integrity data.
+ * This may be run from a crypto offload thread; that code runs all the
+ * operations for a session in one thread, so the session's crypto state
+ * is never used from two threads at once.  On failure *errstr is set
+ * if the failure should be logged.
+ */
+static int
+rmcpp_seal_rsp(lanserv_data_t *lan, session_t *session, rmcpp_rsp_t *r,
+	       const char **errstr)
+{
+    uint8_t      *tpos;
+    int          secure = session && !session->in_startup;
+    int          rv;
+    unsigned int s;
+
+    *errstr = NULL;
+
+    if (secure && session->conf) {
+	rv = session->confh->encrypt(lan, session,
+				     &r->pos, &r->hdr_left, &r->len, &r->dlen);
+	if (rv) {
+	    *errstr = "encryption failed";
+	    return rv;
 	}
     }
 
-    mlen = len;
-    if (session && !session->in_startup && session->integ) {
+    r->mlen = r->len;
+    if (secure && session->integ) {
 	unsigned int count;
 	/* Pad to the next multiple of 4, including the pad length and
 	   next header. */
 	count = 0;
-	while ((mlen+2) % 4) {
-	    if (mlen == dlen)
-		return;
-	    pos[mlen] = 0xff;
+	while ((r->mlen+2) % 4) {
+	    if (r->mlen == r->dlen)
+		return E2BIG;
+	    r->pos[r->mlen] = 0xff;
 	    count++;
-	    mlen++;
+	    r->mlen++;
 	}
-	if (mlen == dlen)
-	    return;
-	pos[mlen] = count;
-	mlen++;
-	if (mlen == dlen)
-	    return;
-	pos[mlen] = 0x07; /* Next header */
-	mlen++;
+	if (r->mlen == r->dlen)
+	    return E2BIG;
+	r->pos[r->mlen] = count;
+	r->mlen++;
+	if (r->mlen == r->dlen)
+	    return E2BIG;
+	r->pos[r->mlen] = 0x07; /* Next header */
+	r->mlen++;
     }
 
-    if (payload == 2)
+    if (r->payload == 2)
 	s = 22;
     else
 	s = 16;
-    if (hdr_left < s)
-	return;
-    hdr_left -= s;
-    pos -= s;
-    dlen += s; /* Adding header, increase total length */
-    mlen += s;
-    pos[0] = 0x06;
-    pos[1] = 0;
-    pos[2] = 0xff;
-    pos[3] = 0x07;
-    pos[4] = IPMI_AUTHTYPE_RMCP_PLUS;
-    pos[5] = payload;
-    if (!session || session->in_startup) {
-	sid = 0;
-	seq = 0;
-	seqp = NULL;
-    } else {
-	sid = session->rem_sid;
-	if (session->integ != 0) {
-	    seq = session->xmit_seq;
-	    seqp = &session->xmit_seq;
-	    pos[5] |= 0x40;
-	} else {
-	    seq = session->unauth_xmit_seq;
-	    seqp = &session->unauth_xmit_seq;
-	}
+    if (r->hdr_left < s)
+	return E2BIG;
+    r->hdr_left -= s;
+    r->pos -= s;
+    r->dlen += s; /* Adding header, increase total length */
+    r->mlen += s;
+    r->pos[0] = 0x06;
+    r->pos[1] = 0;
+    r->pos[2] = 0xff;
+    r->pos[3] = 0x07;
+    r->pos[4] = IPMI_AUTHTYPE_RMCP_PLUS;
+    r->pos[5] = r->payload;
+    if (secure) {
+	if (session->integ != 0)
+	    r->pos[5] |= 0x40;
 	if (session->conf != 0)
-	    pos[5] |= 0x80;
+	    r->pos[5] |= 0x80;
     }
 
-    tpos = pos + 6;
-    if (payload == 2) {
-	assert(iana);
-	memcpy(tpos, iana, 3);
+    tpos = r->pos + 6;
+    if (r->payload == 2) {
+	memcpy(tpos, r->iana, 3);
 	tpos[3] = 0;
-	ipmi_set_uint16(tpos+4, payload_id);
+	ipmi_set_uint16(tpos+4, r->payload_id);
 	tpos += 6;
     }
 
-    ipmi_set_uint32(tpos, sid);
+    ipmi_set_uint32(tpos, r->sid);
     tpos += 4;
-    ipmi_set_uint32(tpos, seq);
+    ipmi_set_uint32(tpos, r->seq);
     tpos += 4;
-    ipmi_set_uint16(tpos, seq);
-    ipmi_set_uint16(tpos, len);
+    ipmi_set_uint16(tpos, r->seq);
+    ipmi_set_uint16(tpos, r->len);
 
-    if (session && !session->in_startup && session->integ) {
+    if (secure && session->integ) {
 	rv = session->integh->add(lan, session,
-				  pos, &mlen, dlen);
+				  r->pos, &r->mlen, r->dlen);
 	if (rv) {
-	    lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
-		     "Message failure:"
-		     " encryption failed: 0x%x", rv);
-	    return;
+	    *errstr = "integrity failed";
+	    return rv;
 	}
     }
 
+    return 0;
+}
+
+static void
+send_rmcpp_rsp(lanserv_data_t *lan, rmcpp_rsp_t *r, msg_t *msg)
+{
+    struct iovec vec[1];
+
+    vec[0].iov_base = r->pos;
+    vec[0].iov_len = r->mlen;
+
+    raw_send(lan, vec, 1, msg->src_addr, msg->src_len);
+}
+
+static void
+return_rmcpp_rsp(lanserv_data_t *lan, session_t *session, msg_t *msg,
+		 unsigned int payload, unsigned char *data, unsigned int len,
+		 unsigned char *iana, unsigned int payload_id)
+{
+    rmcpp_rsp_t  rsp;
+    rmcpp_rsp_t  *r = &rsp;
+    uint32_t     *seqp;
+    crypto_op_t  *op;
+    const char   *errstr;
+    int          rv;
+
+    if (!session)
+	session = sid_to_session(lan, msg->sid);
+
+    r->pos = r->d + IPMI_LAN_MAX_HEADER_SIZE;
+    r->hdr_left = IPMI_LAN_MAX_HEADER_SIZE;
+    r->dlen = IPMI_LAN_MAX_HEADER_SIZE + IPMI_LAN_MAX_TRAILER_SIZE;
+    r->len = len;
+    r->payload = payload;
+    r->payload_id = payload_id;
+    if (payload == 2) {
+	assert(iana);
+	memcpy(r->iana, iana, 3);
+    }
+
+    if (len > r->dlen)
+	return;
+    memcpy(r->pos, data, len);
+
+    if (payload == 0) {
+	uint8_t *pos;
+
+	/* Add the IPMI header - fixme -cheap hack */
+	if (r->hdr_left < 6)
+	    return;
+	r->hdr_left -= 6;
+	r->pos -= 6;
+	r->dlen += 6; /* Adding header, increase total length */
+	r->len += 6;
+	pos = r->pos;
+	pos[0] = msg->rq_addr;
+	pos[1] = ((msg->netfn | 1) << 2) | msg->rq_lun;
+	pos[2] = -ipmb_checksum(pos, 2, 0);
+	pos[3] = msg->rs_addr;
+	pos[4] = (msg->rq_seq << 2) | msg->rs_lun;
+	pos[5] = msg->cmd;
+	pos[r->len] = -ipmb_checksum(pos+3, r->len-3, 0);
+	r->len++;
+	r->dlen++;
+    }
+
+    if (!session || session->in_startup) {
+	r->sid = 0;
+	r->seq = 0;
+	seqp = NULL;
+    } else {
+	r->sid = session->rem_sid;
+	if (session->integ != 0)
+	    seqp = &session->xmit_seq;
+	else
+	    seqp = &session->unauth_xmit_seq;
+	r->seq = *seqp;
+    }
+
+    /* The sequence number is taken here so messages may be sealed
+       out of line. */
     if (seqp) {
 	(*seqp)++;
 	if (*seqp == 0)
 	    *seqp = 1;
     }
 
-    vec[0].iov_base = pos;
-    vec[0].iov_len = mlen;
+    if (lan->crypto_offload && session && !session->in_startup
+	&& (session->conf || session->integ))
+    {
+	op = alloc_crypto_op(lan, session, msg, 0);
+	if (op) {
+	    op->outgoing = 1;
+	    op->rsp = *r;
+	    op->rsp.pos = op->rsp.d + (r->pos - r->d);
+	    lan->crypto_offload(lan, &op->op);
+	    return;
+	}
+	/* Just do it inline if we can't allocate, unless an offloaded
+	   operation could be using the session's crypto state. */
+	if (session->crypto_refs)
+	    return;
+    }
 
-    raw_send(lan, vec, 1, msg->src_addr, msg->src_len);
+    rv = rmcpp_seal_rsp(lan, session, r, &errstr);
+    if (rv) {
+	if (errstr)
+	    lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
+			      "Message failure: %s: 0x%x", errstr, rv);
+	return;
+    }
+
+    send_rmcpp_rsp(lan, r, msg);
 }
 
 static void
@@ -665,7 +872,7 @@ handle_get_session_challenge(lanserv_data_t *lan, msg_t *msg)
 	return;
     }
 
-    if (lan->channel.active_sessions >= MAX_SESSIONS) {
+    if (sessions_full(lan)) {
 	lan->sysinfo->log(lan->sysinfo, SESSION_CHALLENGE_FAILED, msg,
 		 "Session challenge failed: To many open sessions");
 	return_err(lan, msg, NULL, IPMI_OUT_OF_SPACE_CC);
@@ -828,16 +1035,107 @@ ifree(void *info, void *data)
     lan->channel.free(&lan->channel, data);
 }
 
+/*
+ * Double the size of the session table (up to max_sessions) and put
+ * the new sessions on the free list.  The sessions themselves are
+ * never moved, so session pointers stay valid.
+ */
+static int
+grow_sessions(lanserv_data_t *lan)
+{
+    sys_data_t   *sys = lan->sysinfo;
+    unsigned int old_num = lan->num_sessions;
+    unsigned int new_num;
+    unsigned int hash_size;
+    unsigned int i;
+    session_t    **table;
+    session_t    **hash;
+    session_t    *new_sessions;
+    session_t    *session;
+
+    if (old_num == 0)
+	new_num = MAX_SESSIONS + 1;
+    else
+	new_num = old_num * 2;
+    if (lan->max_sessions && (new_num > lan->max_sessions + 1))
+	new_num = lan->max_sessions + 1;
+    if (new_num <= old_num)
+	return ENOSPC;
+
+    hash_size = 1;
+    while (hash_size < new_num)
+	hash_size <<= 1;
+
+    table = sys->alloc(sys, new_num * sizeof(*table));
+    if (!table)
+	return ENOMEM;
+    hash = sys->alloc(sys, hash_size * sizeof(*hash));
+    if (!hash) {
+	sys->free(sys, table);
+	return ENOMEM;
+    }
+    new_sessions = sys->alloc(sys, (new_num - old_num) * sizeof(*new_sessions));
+    if (!new_sessions) {
+	sys->free(sys, hash);
+	sys->free(sys, table);
+	return ENOMEM;
+    }
+    memset(new_sessions, 0, (new_num - old_num) * sizeof(*new_sessions));
+    memset(hash, 0, hash_size * sizeof(*hash));
+
+    for (i = 0; i < old_num; i++)
+	table[i] = lan->sessions[i];
+    for (i = old_num; i < new_num; i++) {
+	table[i] = new_sessions + (i - old_num);
+	table[i]->handle = i;
+    }
+
+    /* Rehash the active sessions. */
+    for (i = 1; i < old_num; i++) {
+	session = table[i];
+	if (session->active && session->sid) {
+	    unsigned int idx = (session->sid >> 1) & (hash_size - 1);
+
+	    session->next = hash[idx];
+	    hash[idx] = session;
+	}
+    }
+
+    /* Session 0 is invalid, and lower handles are handed out first. */
+    for (i = new_num - 1; i > 0 && i >= old_num; i--) {
+	table[i]->next = lan->free_sessions;
+	lan->free_sessions = table[i];
+    }
+
+    if (lan->sessions)
+	sys->free(sys, lan->sessions);
+    if (lan->sid_hash)
+	sys->free(sys, lan->sid_hash);
+    lan->sessions = table;
+    lan->num_sessions = new_num;
+    lan->sid_hash = hash;
+    lan->sid_hash_size = hash_size;
+
+    return 0;
+}
+
 static session_t *
 find_free_session(lanserv_data_t *lan)
 {
-    int i;
-    /* Find a free session.  Session 0 is invalid. */
-    for (i=1; i<=MAX_SESSIONS; i++) {
-	if (! lan->sessions[i].active)
-	    return &(lan->sessions[i]);
-    }
-    return NULL;
+    session_t *session;
+    int       handle;
+
+    if (!lan->free_sessions && grow_sessions(lan))
+	return NULL;
+
+    session = lan->free_sessions;
+    lan->free_sessions = session->next;
+
+    handle = session->handle;
+    memset(session, 0, sizeof(*session));
+    session->handle = handle;
+    session->active = 1;
+    return session;
 }
 
 static void
@@ -889,7 +1187,7 @@ handle_temp_session(lanserv_data_t *lan, msg_t *msg)
 	return;
     }
 
-    if (lan->channel.active_sessions >= MAX_SESSIONS) {
+    if (sessions_full(lan)) {
 	lan->sysinfo->log(lan->sysinfo, NEW_SESSION_FAILED, msg,
 		 "Session challenge failed: To many open sessions");
 	return;
@@ -957,6 +1255,14 @@ handle_temp_session(lanserv_data_t *lan, msg_t *msg)
 	goto out_free;
     }
 
+    rv = lan->gen_rand(lan, seq_data, 4);
+    if (rv) {
+	lan->sysinfo->log(lan->sysinfo, NEW_SESSION_FAILED, msg,
+		 "Activate session failed: Could not generate random number");
+	return_err(lan, msg, &dummy_session, IPMI_UNKNOWN_ERR_CC);
+	goto out_free;
+    }
+
     session = find_free_session(lan);
 
     if (!session) {
@@ -971,22 +1277,15 @@ handle_temp_session(lanserv_data_t *lan, msg_t *msg)
 	lan->sysinfo->log(lan->sysinfo, NEW_SESSION_FAILED, msg,
 		 "Activate session failed: out of memory");
 	return_err(lan, msg, &dummy_session, IPMI_UNKNOWN_ERR_CC);
+	close_session(lan, session);
 	goto out_free;
     }
     memcpy(session->src_addr, msg->src_addr, msg->src_len);
     session->src_len = msg->src_len;
 
-    session->active = 1;
     session->rmcpplus = 0;
     session->authtype = auth;
     session->authdata = dummy_session.authdata;
-    rv = lan->gen_rand(lan, seq_data, 4);
-    if (rv) {
-	lan->sysinfo->log(lan->sysinfo, NEW_SESSION_FAILED, msg,
-		 "Activate session failed: Could not generate random number");
-	return_err(lan, msg, &dummy_session, IPMI_UNKNOWN_ERR_CC);
-	goto out_free;
-    }
     session->recv_seq = ipmi_get_uint32(seq_data) & ~1;
     if (!session->recv_seq)
 	session->recv_seq = 2;
@@ -996,17 +1295,11 @@ handle_temp_session(lanserv_data_t *lan, msg_t *msg)
     session->userid = user->idx;
     session->time_left = lan->default_session_timeout;
 
-    lan->channel.active_sessions++;
+    register_session(lan, session);
     lan->sysinfo->log(lan->sysinfo, NEW_SESSION, msg,
 	     "Activate session: Session opened for user 0x%x, max priv %d",
 	     user_idx, priv);
 
-    if (lan->sid_seq == 0)
-	lan->sid_seq++;
-    session->sid = ((lan->sid_seq << (SESSION_BITS_REQ+1))
-		    | (session->handle << 1));
-    lan->sid_seq++;
-
     data[0] = 0;
     data[1] = auth;
     
@@ -1165,7 +1458,7 @@ handle_get_session_info(lanserv_data_t *lan, session_t *session, msg_t *msg)
 	sid = ipmi_get_uint32(msg->data+1);
 	nses = sid_to_session(lan, sid);
     } else if (idx == 0xfe) {
-	int handle;
+	unsigned int handle;
 
 	if (msg->len < 2) {
 	    return_err(lan, msg, session,
@@ -1174,23 +1467,23 @@ handle_get_session_info(lanserv_data_t *lan, session_t *session, msg_t *msg)
 	}
 	
 	handle = msg->data[1];
-	if (handle >= MAX_SESSIONS) {
+	if (handle >= lan->num_sessions) {
 	    return_err(lan, msg, session, IPMI_INVALID_DATA_FIELD_CC);
 	    return;
 	}
-	if (lan->sessions[handle].active)
-	    nses = &lan->sessions[handle];
+	if (lan->sessions[handle]->active)
+	    nses = lan->sessions[handle];
     } else if (idx == 0) {
 	nses = session;
     } else {
-	int i;
+	unsigned int i;
 
 	if (idx <= lan->channel.active_sessions) {
-	    for (i=0; i<=MAX_SESSIONS; i++) {
-		if (lan->sessions[i].active) {
+	    for (i=1; i<lan->num_sessions; i++) {
+		if (lan->sessions[i]->active) {
 		    idx--;
 		    if (idx == 0) {
-			nses = &lan->sessions[i];
+			nses = lan->sessions[i];
 			break;
 		    }
 		}
@@ -1199,10 +1492,14 @@ handle_get_session_info(lanserv_data_t *lan, session_t *session, msg_t *msg)
     }
 
     data[0] = 0;
-    data[2] = MAX_SESSIONS;
-    data[3] = lan->channel.active_sessions;
+    if (lan->max_sessions)
+	data[2] = session_count(lan->max_sessions);
+    else
+	data[2] = MAX_SESSIONS;
+    data[3] = session_count(lan->channel.active_sessions);
     if (nses) {
-	data[1] = nses->handle;
+	/* Handles above 255 do not fit in the response. */
+	data[1] = (nses->handle > 0xff) ? 0 : nses->handle;
 	data[4] = nses->userid;
 	data[5] = nses->priv;
 	data[6] = lan->channel.channel_num | (session->rmcpplus << 4);
@@ -2048,9 +2345,107 @@ hmac_md5_init(lanserv_data_t *lan, session_t *session)
     return 0;
 }
 
+/*
+ * Per-session HMAC state.  The hash states after the key XOR ipad and
+ * key XOR opad blocks are computed once when the keys are known, each
+ * packet copies them into the work context and hashes only the packet
+ * itself.  All crypto on a session is done in one thread at a time,
+ * so a single work context is enough.
+ */
+typedef struct hmac_state_s
+{
+    EVP_MD_CTX *ictx;
+    EVP_MD_CTX *octx;
+    EVP_MD_CTX *work;
+} hmac_state_t;
+
 static void
 hmac_cleanup(lanserv_data_t *lan, session_t *session)
 {
+    hmac_state_t *h = session->auth_data.idata;
+
+    if (!h)
+	return;
+    if (h->ictx)
+	EVP_MD_CTX_free(h->ictx);
+    if (h->octx)
+	EVP_MD_CTX_free(h->octx);
+    if (h->work)
+	EVP_MD_CTX_free(h->work);
+    free(h);
+    session->auth_data.idata = NULL;
+}
+
+static int
+hmac_key_ctx(EVP_MD_CTX *ctx, const EVP_MD *md,
+	     const unsigned char *k, unsigned int klen, unsigned char padval)
+{
+    unsigned char pad[128];
+    unsigned int  blen = EVP_MD_block_size(md);
+    unsigned int  i;
+    int           ok;
+
+    if (klen > blen || blen > sizeof(pad))
+	return EINVAL;
+    memset(pad, padval, blen);
+    for (i = 0; i < klen; i++)
+	pad[i] ^= k[i];
+    ok = (EVP_DigestInit_ex(ctx, md, NULL)
+	  && EVP_DigestUpdate(ctx, pad, blen));
+    memset(pad, 0, sizeof(pad));
+    return ok ? 0 : ENOMEM;
+}
+
+static int
+hmac_keys_ready(lanserv_data_t *lan, session_t *session)
+{
+    auth_data_t  *a = &session->auth_data;
+    hmac_state_t *h;
+    int          rv;
+
+    h = malloc(sizeof(*h));
+    if (!h)
+	return ENOMEM;
+    memset(h, 0, sizeof(*h));
+    a->idata = h;
+
+    h->ictx = EVP_MD_CTX_new();
+    h->octx = EVP_MD_CTX_new();
+    h->work = EVP_MD_CTX_new();
+    if (!h->ictx || !h->octx || !h->work) {
+	rv = ENOMEM;
+	goto out_err;
+    }
+
+    rv = hmac_key_ctx(h->ictx, a->ikey2, a->ikey, a->ikey_len, 0x36);
+    if (!rv)
+	rv = hmac_key_ctx(h->octx, a->ikey2, a->ikey, a->ikey_len, 0x5c);
+    if (rv)
+	goto out_err;
+    return 0;
+
+ out_err:
+    hmac_cleanup(lan, session);
+    return rv;
+}
+
+static int
+hmac_calc(hmac_state_t *h, const unsigned char *data, unsigned int len,
+	  unsigned char *integ)
+{
+    unsigned char inner[EVP_MAX_MD_SIZE];
+    unsigned int  ilen;
+
+    if (!h)
+	return EINVAL;
+    if (!EVP_MD_CTX_copy_ex(h->work, h->ictx)
+	|| !EVP_DigestUpdate(h->work, data, len)
+	|| !EVP_DigestFinal_ex(h->work, inner, &ilen)
+	|| !EVP_MD_CTX_copy_ex(h->work, h->octx)
+	|| !EVP_DigestUpdate(h->work, inner, ilen)
+	|| !EVP_DigestFinal_ex(h->work, integ, &ilen))
+	return ENOMEM;
+    return 0;
 }
 
 static int 
@@ -2059,13 +2454,15 @@ hmac_add(lanserv_data_t *lan, session_t *session,
 	 unsigned int *data_len, unsigned int data_size)
 {
     auth_data_t   *a = &session->auth_data;
-    unsigned int  ilen;
-    unsigned char integ[20];
+    unsigned char integ[EVP_MAX_MD_SIZE];
+    int           rv;
 
     if (((*data_len) + a->ikey_len) > data_size)
 	return E2BIG;
 
-    HMAC(a->ikey2, a->ikey, a->ikey_len, pos+4, (*data_len)-4, integ, &ilen);
+    rv = hmac_calc(a->idata, pos+4, (*data_len)-4, integ);
+    if (rv)
+	return rv;
     memcpy(pos+(*data_len), integ, a->integ_len);
     *data_len += a->integ_len;
     return 0;
@@ -2074,15 +2471,16 @@ hmac_add(lanserv_data_t *lan, session_t *session,
 static int
 hmac_check(lanserv_data_t *lan, session_t *session, msg_t *msg)
 {
-    unsigned char integ[20];
+    unsigned char integ[EVP_MAX_MD_SIZE];
     auth_data_t   *a = &session->auth_data;
-    unsigned int  ilen;
+    int           rv;
 
     if ((msg->len-5) < a->integ_len)
 	return E2BIG;
 
-    HMAC(a->ikey2, a->ikey, a->ikey_len, msg->data, msg->len-a->integ_len,
-	 integ, &ilen);
+    rv = hmac_calc(a->idata, msg->data, msg->len-a->integ_len, integ);
+    if (rv)
+	return rv;
     if (memcmp(msg->data+msg->len-a->integ_len, integ, a->integ_len) != 0)
 	return EINVAL;
     return 0;
@@ -2164,9 +2562,9 @@ md5_check(lanserv_data_t *lan, session_t *session, msg_t *msg)
 }
 
 static integ_handlers_t hmac_sha1_integ =
-{ hmac_sha1_init, hmac_cleanup, hmac_add, hmac_check };
+{ hmac_sha1_init, hmac_cleanup, hmac_add, hmac_check, hmac_keys_ready };
 static integ_handlers_t hmac_md5_integ =
-{ hmac_md5_init, hmac_cleanup, hmac_add, hmac_check };
+{ hmac_md5_init, hmac_cleanup, hmac_add, hmac_check, hmac_keys_ready };
 static integ_handlers_t md5_integ =
 { md5_init, md5_cleanup, md5_add, md5_check };
 #define HMAC_INIT , &hmac_sha1_integ, &hmac_md5_integ
@@ -2180,9 +2578,53 @@ aes_cbc_init(lanserv_data_t *lan, session_t *session)
     return 0;
 }
 
+/*
+ * Per-session AES state, the key schedule is set up once for each
+ * direction and only the IV is loaded per packet.
+ */
+typedef struct aes_cbc_state_s
+{
+    EVP_CIPHER_CTX *enc;
+    EVP_CIPHER_CTX *dec;
+} aes_cbc_state_t;
+
 static void
 aes_cbc_cleanup(lanserv_data_t *lan, session_t *session)
 {
+    aes_cbc_state_t *c = session->auth_data.cdata;
+
+    if (!c)
+	return;
+    if (c->enc)
+	EVP_CIPHER_CTX_free(c->enc);
+    if (c->dec)
+	EVP_CIPHER_CTX_free(c->dec);
+    free(c);
+    session->auth_data.cdata = NULL;
+}
+
+static int
+aes_cbc_keys_ready(lanserv_data_t *lan, session_t *session)
+{
+    auth_data_t     *a = &session->auth_data;
+    aes_cbc_state_t *c;
+
+    c = malloc(sizeof(*c));
+    if (!c)
+	return ENOMEM;
+    a->cdata = c;
+    c->enc = EVP_CIPHER_CTX_new();
+    c->dec = EVP_CIPHER_CTX_new();
+    if (!c->enc || !c->dec
+	|| !EVP_EncryptInit_ex(c->enc, EVP_aes_128_cbc(), NULL, a->ckey, NULL)
+	|| !EVP_DecryptInit_ex(c->dec, EVP_aes_128_cbc(), NULL, a->ckey, NULL))
+    {
+	aes_cbc_cleanup(lan, session);
+	return ENOMEM;
+    }
+    EVP_CIPHER_CTX_set_padding(c->enc, 0);
+    EVP_CIPHER_CTX_set_padding(c->dec, 0);
+    return 0;
 }
 
 static int
@@ -2190,25 +2632,23 @@ aes_cbc_encrypt(lanserv_data_t *lan, session_t *session,
 		unsigned char **pos, unsigned int *hdr_left,
 		unsigned int *data_len, unsigned int *data_size)
 {
-    auth_data_t    *a = &session->auth_data;
-    unsigned int   l = *data_len;
-    unsigned char  *d;
-    unsigned char  *iv;
-    unsigned int   i;
-    EVP_CIPHER_CTX *ctx;
-    int            rv;
-    int            outlen;
-    int            tmplen;
-    unsigned char  *padpos;
-    unsigned char  padval;
-    unsigned int   padlen;
+    aes_cbc_state_t *c = session->auth_data.cdata;
+    unsigned int    l = *data_len;
+    unsigned char   *d = *pos;
+    unsigned char   *iv;
+    unsigned int    i;
+    int             rv;
+    int             outlen;
+    unsigned char   *padpos;
+    unsigned char   padval;
+    unsigned int    padlen;
+
+    if (!c)
+	return EINVAL;
 
     if (*hdr_left < 16)
 	return E2BIG;
 
-    /* Calculate the number of padding bytes -> e.  Note that the pad
-       length byte is included, thus the +1.  We don't add the pad,
-       AES does, but we need to know what it is. */
     /* Calculate the number of padding bytes -> e.  Note that the pad
        length byte is included, thus the +1.  We then do the padding. */
     padlen = 15 - (l % 16);
@@ -2216,15 +2656,7 @@ aes_cbc_encrypt(lanserv_data_t *lan, session_t *session,
     if (l > *data_size)
 	return E2BIG;
 
-    /* We store the unencrypted data here, then crypt into the real
-       data. */
-    d = malloc(l);
-    if (!d)
-	return ENOMEM;
-
-    memcpy(d, *pos, *data_len);
-
-    /* Now add the padding. */
+    /* Now add the padding, the data is crypted in place. */
     padpos = d + *data_len;
     padval = 1;
     for (i=0; i<padlen; i++, padpos++, padval++)
@@ -2232,99 +2664,62 @@ aes_cbc_encrypt(lanserv_data_t *lan, session_t *session,
     *padpos = padlen;
 
     /* Now create the initialization vector, including making room for it. */
-    iv = (*pos) - 16;
+    iv = d - 16;
     rv = lan->gen_rand(lan, iv, 16);
-    if (rv) {
-	free(d);
+    if (rv)
 	return rv;
-    }
-    *hdr_left -= 16;
-    *data_size += 16;
 
-    /* Ok, we're set to do the crypt operation. */
-    ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) {
-	    rv = ENOMEM;
-	    goto out_cleanup;
-    }
-    EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, a->ckey, iv);
-    EVP_CIPHER_CTX_set_padding(ctx, 0);
-    if (!EVP_EncryptUpdate(ctx, *pos, &outlen, d, l)) {
-	rv = ENOMEM;
-	goto out_cleanup;
-    }
-    if (!EVP_EncryptFinal_ex(ctx, (*pos) + outlen, &tmplen)) {
-	rv = ENOMEM; /* right? */
-	goto out_cleanup;
-    }
-    outlen += tmplen;
+    /* Ok, we're set to do the crypt operation.  The data is already
+       16-byte aligned, so there is nothing to finalize. */
+    if (!EVP_EncryptInit_ex(c->enc, NULL, NULL, NULL, iv)
+	|| !EVP_EncryptUpdate(c->enc, d, &outlen, d, l))
+	return ENOMEM;
 
+    *hdr_left -= 16;
+    *data_size += 16;
     *pos = iv;
     *data_len = outlen + 16;
-
- out_cleanup:
-    EVP_CIPHER_CTX_free(ctx);
-    free(d);
-    return rv;
+    return 0;
 }
 
 static int
 aes_cbc_decrypt(lanserv_data_t *lan, session_t *session, msg_t *msg)
 {
-    auth_data_t    *a = &session->auth_data;
-    unsigned int   l = msg->len;
-    unsigned char  *d;
-    EVP_CIPHER_CTX *ctx;
-    int            outlen;
-    unsigned char  *pad;
-    int            padlen;
-    int            rv = 0;
+    aes_cbc_state_t *c = session->auth_data.cdata;
+    unsigned int    l = msg->len;
+    unsigned char   *d = msg->data + 16;
+    int             outlen;
+    unsigned char   *pad;
+    int             padlen;
+
+    if (!c)
+	return EINVAL;
 
     if (l < 32)
 	/* Not possible with this algorithm. */
 	return EINVAL;
     l -= 16;
+    if (l % 16)
+	return EINVAL;
 
-    /* We store the encrypted data here, then decrypt into the real
-       data. */
-    d = malloc(l);
-    if (!d)
-	return ENOMEM;
-
-    memcpy(d, msg->data+16, l);
-
-    /* Ok, we're set to do the decrypt operation. */
-    ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) {
-	    rv = ENOMEM;
-	    goto out_cleanup;
-    }
-    EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, a->k2, msg->data);
-    EVP_CIPHER_CTX_set_padding(ctx, 0);
-    if (!EVP_DecryptUpdate(ctx, msg->data+16, &outlen, d, l)) {
-	rv = EINVAL;
-	goto out_cleanup;
-    }
+    /* Ok, we're set to do the decrypt operation, in place. */
+    if (!EVP_DecryptInit_ex(c->dec, NULL, NULL, NULL, msg->data)
+	|| !EVP_DecryptUpdate(c->dec, d, &outlen, d, l))
+	return EINVAL;
 
-    if (outlen < 16) {
-	rv = EINVAL;
-	goto out_cleanup;
-    }
+    if (outlen < 16)
+	return EINVAL;
 
     /* Now remove the padding */
-    pad = msg->data + 16 + outlen - 1;
+    pad = d + outlen - 1;
     padlen = *pad;
-    if (padlen >= 16) {
-	rv = EINVAL;
-	goto out_cleanup;
-    }
+    if (padlen >= 16)
+	return EINVAL;
     outlen--;
     pad--;
     while (padlen) {
-	if (*pad != padlen) {
-	    rv = EINVAL;
-	    goto out_cleanup;
-	}
+	if (*pad != padlen)
+	    return EINVAL;
 	outlen--;
 	pad--;
 	padlen--;
@@ -2332,15 +2727,12 @@ aes_cbc_decrypt(lanserv_data_t *lan, session_t *session, msg_t *msg)
     
     msg->data += 16; /* Remove the init vector */
     msg->len = outlen;
-
- out_cleanup:
-    EVP_CIPHER_CTX_free(ctx);
-    free(d);
-    return rv;
+    return 0;
 }
 
 static conf_handlers_t aes_cbc_conf =
-{ aes_cbc_init, aes_cbc_cleanup, aes_cbc_encrypt, aes_cbc_decrypt };
+{ aes_cbc_init, aes_cbc_cleanup, aes_cbc_encrypt, aes_cbc_decrypt,
+  aes_cbc_keys_ready };
 #define AES_CBC_INIT , &aes_cbc_conf
 
 unsigned int default_auth = 1; /* RAKP-HMAC-SHA1 */
@@ -2514,7 +2906,6 @@ handle_open_session_payload(lanserv_data_t *lan, msg_t *msg)
     memcpy(session->src_addr, msg->src_addr, msg->src_len);
     session->src_len = msg->src_len;
 
-    session->active = 1;
     session->in_startup = 1;
     session->rmcpplus = 1;
     session->authtype = IPMI_AUTHTYPE_RMCP_PLUS;
@@ -2543,9 +2934,7 @@ handle_open_session_payload(lanserv_data_t *lan, msg_t *msg)
     session->userid = 0;
     session->time_left = lan->default_session_timeout;
 
-    session->sid = ((lan->sid_seq << (SESSION_BITS_REQ+1))
-		    | (session->handle << 1));
-    lan->sid_seq++;
+    register_session(lan, session);
 
     lan->sysinfo->log(lan->sysinfo, NEW_SESSION, msg,
 	     "Activate session: Session started, max priv %d", priv);
@@ -2566,8 +2955,6 @@ handle_open_session_payload(lanserv_data_t *lan, msg_t *msg)
     data[31] = 8;
     data[32] = conf;
 
-    lan->channel.active_sessions++;
-
     return_rmcpp_rsp(lan, session, msg, 0x11, data, 36, NULL, 0);
     return;
  out_err:
@@ -2723,6 +3110,25 @@ handle_rakp3_payload(lanserv_data_t *lan, msg_t *msg)
 	return;
     }
 
+    /* The keys are known now, let the integrity and confidentiality
+       code set up their per-session state.  This is only done once;
+       a resent RAKP3 for a session that is already up just gets the
+       RAKP4 again, the state may be in use by the crypto threads. */
+    if (!session->in_startup)
+	goto out_err;
+    if (session->integh && session->integh->keys_ready
+	&& session->integh->keys_ready(lan, session))
+    {
+	err = IPMI_RMCPP_INSUFFICIENT_RESOURCES_FOR_SESSION;
+	goto out_err;
+    }
+    if (session->confh && session->confh->keys_ready
+	&& session->confh->keys_ready(lan, session))
+    {
+	err = IPMI_RMCPP_INSUFFICIENT_RESOURCES_FOR_SESSION;
+	goto out_err;
+    }
+
  out_err:
     memset(data, 0, sizeof(data));
     data[0] = msg->data[0];
@@ -2766,8 +3172,22 @@ ipmi_register_payload(unsigned int payload_id, ipmi_payload_handler_cb handler)
 }
 
 static int
-decrypt_message(lanserv_data_t *lan, session_t *session, msg_t *msg)
+check_message_flags(lanserv_data_t *lan, session_t *session, msg_t *msg)
 {
+    if (!msg->rmcpp.authenticated) {
+	if (session->integ != 0) {
+	    lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
+		     "Message failure:"
+		     " Unauthenticated msg on authenticated session");
+	    return EINVAL;
+	}
+    } else if (session->integ == 0) {
+	lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
+		 "Message failure:"
+		 " Authenticated msg on unauthenticated session");
+	return EINVAL;
+    }
+
     if (!msg->rmcpp.encrypted) {
 	if (session->conf != 0) {
 	    lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
@@ -2775,39 +3195,155 @@ decrypt_message(lanserv_data_t *lan, session_t *session, msg_t *msg)
 		     " Unencrypted msg on encrypted session");
 	    return EINVAL;
 	}
-	return 0;
+    } else if (session->conf == 0) {
+	lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
+		 "Message failure:"
+		 " Encrypted msg on unencrypted session");
+	return EINVAL;
     }
 
-    return session->confh->decrypt(lan, session, msg);
+    return 0;
 }
 
+/*
+ * Check the integrity of and decrypt a message.  imsg covers the
+ * whole message for the integrity check.  This only reads the
+ * session's keys, so it may be run from a crypto offload thread.
+ */
 static int
-check_message_integrity(lanserv_data_t *lan, session_t *session, msg_t *msg)
+verify_message(lanserv_data_t *lan, session_t *session,
+	       msg_t *msg, msg_t *imsg, const char **errstr)
 {
-    if (!msg->rmcpp.authenticated) {
-	if (session->integ != 0) {
+    int rv;
+
+    if (msg->rmcpp.authenticated) {
+	rv = session->integh->check(lan, session, imsg);
+	if (rv) {
+	    *errstr = "Message integrity failed";
+	    return rv;
+	}
+    }
+
+    if (msg->rmcpp.encrypted) {
+	rv = session->confh->decrypt(lan, session, msg);
+	if (rv) {
+	    *errstr = "Message decryption failed";
+	    return rv;
+	}
+    }
+
+    return 0;
+}
+
+/* Handle a message that has been verified and decrypted. */
+static void
+deliver_rmcpp_msg(lanserv_data_t *lan, session_t *session, msg_t *msg)
+{
+    uint32_t *seq;
+    int      diff;
+
+    if (session) {
+	/* Check that the session sequence number is valid.  We make
+	   sure it is within 8 of the last highest received sequence
+	   number, per the spec. */
+	if (msg->rmcpp.authenticated)
+	    seq = &session->recv_seq;
+	else
+	    seq = &session->unauth_recv_seq;
+	diff = msg->seq - *seq;
+	if ((diff < -16) || (diff > 15)) {
 	    lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
-		     "Message failure:"
-		     " Unauthenticated msg on authenticated session");
-	    return EINVAL;
+		     "Normal session message failure: SEQ out of range");
+	    return;
 	}
-	return 0;
-    } else if (session->integ == 0) {
-	lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
-		 "Message failure:"
-		 " Authenticated msg on unauthenticated session");
-	return EINVAL;
+
+	/* We wait until after the message is authenticated to set the
+	   sequence number, to prevent spoofing. */
+	if (msg->seq > *seq)
+	    *seq = msg->seq;
     }
 
-    return session->integh->check(lan, session, msg);
+    if (payload_handlers[msg->rmcpp.payload])
+	payload_handlers[msg->rmcpp.payload](lan, msg);
+}
+
+/*
+ * Hand the crypto work for an incoming message to the offload code.
+ * Returns non-zero if that could not be done.
+ */
+static int
+offload_rmcpp_msg(lanserv_data_t *lan, session_t *session,
+		  msg_t *msg, msg_t *imsg)
+{
+    crypto_op_t   *op;
+    unsigned char *data;
+
+    op = alloc_crypto_op(lan, session, msg, imsg->len);
+    if (!op)
+	return ENOMEM;
+
+    /* Move the message into the operation's buffer. */
+    data = op->buf + msg->src_len;
+    memcpy(data, imsg->data, imsg->len);
+    op->imsg = *imsg;
+    op->imsg.data = data;
+    op->msg.data = data + (msg->data - imsg->data);
+    op->msg.len = msg->len;
+    op->msg.rmcpp.authdata = data + (msg->rmcpp.authdata - imsg->data);
+
+    lan->crypto_offload(lan, &op->op);
+    return 0;
+}
+
+void
+ipmi_lan_crypto_op_run(lan_crypto_op_t *lop)
+{
+    crypto_op_t *op = (crypto_op_t *) lop;
+
+    if (op->outgoing)
+	op->err = rmcpp_seal_rsp(op->lan, op->session, &op->rsp,
+				 &op->errstr);
+    else
+	op->err = verify_message(op->lan, op->session, &op->msg, &op->imsg,
+				 &op->errstr);
+}
+
+void
+ipmi_lan_crypto_op_done(lan_crypto_op_t *lop)
+{
+    crypto_op_t    *op = (crypto_op_t *) lop;
+    lanserv_data_t *lan = op->lan;
+    session_t      *session = op->session;
+
+    if (op->err) {
+	if (op->outgoing && op->errstr)
+	    lan->sysinfo->log(lan->sysinfo, INVALID_MSG, &op->msg,
+			      "Message failure: %s: 0x%x",
+			      op->errstr, op->err);
+	else if (!op->outgoing)
+	    lan->sysinfo->log(lan->sysinfo, LAN_ERR, &op->msg,
+			      "LAN msg failure: %s", op->errstr);
+    } else if (op->outgoing) {
+	/* Responses are sent even if the session closed meanwhile,
+	   the close session response depends on that. */
+	send_rmcpp_rsp(lan, &op->rsp, &op->msg);
+    } else if (session->active) {
+	deliver_rmcpp_msg(lan, session, &op->msg);
+    }
+
+    session->crypto_refs--;
+    if (!session->active && !session->crypto_refs)
+	release_session(lan, session);
+
+    free(op);
 }
 
 static void
 ipmi_handle_rmcpp_msg(lanserv_data_t *lan, msg_t *msg)
 {
     unsigned int len;
-    uint32_t     *seq;
     msg_t        imsg;
+    session_t    *session = NULL;
 
     imsg.data = msg->data-1;
     imsg.len = msg->len+1;
@@ -2858,10 +3394,10 @@ ipmi_handle_rmcpp_msg(lanserv_data_t *lan, msg_t *msg)
 	    return;
 	}
     } else {
-	session_t    *session = sid_to_session(lan, msg->sid);
-	int          rv;
-	int          diff;
+	const char *errstr;
+	int        rv;
 
+	session = sid_to_session(lan, msg->sid);
 	if (session == NULL) {
 	    lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
 		     "Normal session message failure: Invalid SID");
@@ -2878,44 +3414,29 @@ ipmi_handle_rmcpp_msg(lanserv_data_t *lan, msg_t *msg)
 	imsg.rmcpp.encrypted = msg->rmcpp.encrypted;
 	imsg.rmcpp.authenticated = msg->rmcpp.authenticated;
 
-	rv = check_message_integrity(lan, session, &imsg);
-	if (rv) {
-	    lan->sysinfo->log(lan->sysinfo, LAN_ERR, msg,
-		     "LAN msg failure:"
-		     " Message integrity failed");
+	if (check_message_flags(lan, session, msg))
 	    return;
+
+	if (lan->crypto_offload && !session->in_startup
+	    && (msg->rmcpp.authenticated || msg->rmcpp.encrypted))
+	{
+	    if (!offload_rmcpp_msg(lan, session, msg, &imsg))
+		return;
+	    /* The session's crypto state may be in use by the offload
+	       code, drop the message, the remote end will retry. */
+	    if (session->crypto_refs)
+		return;
 	}
 
-	rv = decrypt_message(lan, session, msg);
+	rv = verify_message(lan, session, msg, &imsg, &errstr);
 	if (rv) {
 	    lan->sysinfo->log(lan->sysinfo, LAN_ERR, msg,
-		     "LAN msg failure:"
-		     " Message decryption failed");
-	    return;
-	}
-
-	/* Check that the session sequence number is valid.  We make
-	   sure it is within 8 of the last highest received sequence
-	   number, per the spec. */
-	if (msg->rmcpp.authenticated)
-	    seq = &session->recv_seq;
-	else
-	    seq = &session->unauth_recv_seq;
-	diff = msg->seq - *seq;
-	if ((diff < -16) || (diff > 15)) {
-	    lan->sysinfo->log(lan->sysinfo, INVALID_MSG, msg,
-		     "Normal session message failure: SEQ out of range");
+		     "LAN msg failure: %s", errstr);
 	    return;
 	}
-
-	/* We wait until after the message is authenticated to set the
-	   sequence number, to prevent spoofing. */
-	if (msg->seq > *seq)
-	    *seq = msg->seq;
     }
 
-    if (payload_handlers[msg->rmcpp.payload])
-	payload_handlers[msg->rmcpp.payload](lan, msg);
+    deliver_rmcpp_msg(lan, session, msg);
 }
 
 static void
@@ -3051,20 +3572,24 @@ static void
 ipmi_lan_tick(void *info, unsigned int time_since_last)
 {
     lanserv_data_t *lan = info;
-    int i;
+    unsigned int i;
+    session_t *session;
 
-    for (i=1; i<=MAX_SESSIONS; i++) {
-	if (lan->sessions[i].active) {
-	    if (lan->sessions[i].time_left <= time_since_last) {
+    /* Reap idle sessions.  Closing a session only puts it on the free
+       list, so the table itself does not change under us. */
+    for (i=1; i<lan->num_sessions; i++) {
+	session = lan->sessions[i];
+	if (session->active) {
+	    if (session->time_left <= time_since_last) {
 		msg_t msg = { 0 }; /* A fake message to hold the address. */
 
-		msg.src_addr = lan->sessions[i].src_addr;
-		msg.src_len = lan->sessions[i].src_len;
+		msg.src_addr = session->src_addr;
+		msg.src_len = session->src_len;
 		lan->sysinfo->log(lan->sysinfo, SESSION_CLOSED, &msg,
 			 "Session closed: Closed due to timeout");
-		close_session(lan, &(lan->sessions[i]));
+		close_session(lan, session);
 	    } else {
-		lan->sessions[i].time_left -= time_since_last;
+		session->time_left -= time_since_last;
 	    }
 	}
     }
@@ -3156,10 +3681,6 @@ ipmi_lan_init(lanserv_data_t *lan)
     int rv;
     uint8_t challenge_data[16];
 
-    for (i=0; i<=MAX_SESSIONS; i++) {
-	lan->sessions[i].handle = i;
-    }
-
     rv = read_lan_config(lan);
     if (rv)
 	return rv;
@@ -40,37 +40,81 @@
 #include <openssl/evp.h>
 #include <OpenIPMI/ipmi_lan.h>
 #include <OpenIPMI/internal/ipmi_malloc.h>
+#include <OpenIPMI/internal/ipmi_locks.h>
 
+/*
+ * The AES key schedule is set up once per session in a cipher context
+ * for each direction; per packet only the IV gets loaded, and the data
+ * is crypted in place in the message buffer.
+ */
 typedef struct aes_cbc_info_s
 {
-    unsigned char k2[16];
+    ipmi_lock_t    *enc_lock;
+    EVP_CIPHER_CTX *enc_ctx;
+    ipmi_lock_t    *dec_lock;
+    EVP_CIPHER_CTX *dec_ctx;
 } aes_cbc_info_t;
 
+static void
+aes_cbc_free(ipmi_con_t *ipmi, void *conf_data)
+{
+    aes_cbc_info_t *info = conf_data;
+
+    /* Freeing the contexts clears the key schedule. */
+    if (info->enc_ctx)
+	EVP_CIPHER_CTX_free(info->enc_ctx);
+    if (info->dec_ctx)
+	EVP_CIPHER_CTX_free(info->dec_ctx);
+    if (info->enc_lock)
+	ipmi_destroy_lock(info->enc_lock);
+    if (info->dec_lock)
+	ipmi_destroy_lock(info->dec_lock);
+    ipmi_mem_free(info);
+}
+
 static int
 aes_cbc_init(ipmi_con_t *ipmi, ipmi_rmcpp_auth_t *ainfo, void **conf_data)
 {
-    aes_cbc_info_t *info;
-    unsigned int   k2len;
+    aes_cbc_info_t      *info;
+    const unsigned char *k2;
+    unsigned int        k2len;
+    int                 rv;
+
+    if (ipmi_rmcpp_auth_get_k2_len(ainfo) < 16)
+	return EINVAL;
 
     info = ipmi_mem_alloc(sizeof(*info));
     if (!info)
 	return ENOMEM;
+    memset(info, 0, sizeof(*info));
+
+    rv = ipmi_create_lock_os_hnd(ipmi->os_hnd, &info->enc_lock);
+    if (rv)
+	goto out_err;
+    rv = ipmi_create_lock_os_hnd(ipmi->os_hnd, &info->dec_lock);
+    if (rv)
+	goto out_err;
+
+    rv = ENOMEM;
+    info->enc_ctx = EVP_CIPHER_CTX_new();
+    info->dec_ctx = EVP_CIPHER_CTX_new();
+    if (!info->enc_ctx || !info->dec_ctx)
+	goto out_err;
+
+    k2 = ipmi_rmcpp_auth_get_k2(ainfo, &k2len);
+    if (!EVP_EncryptInit_ex(info->enc_ctx, EVP_aes_128_cbc(), NULL, k2, NULL)
+	|| !EVP_DecryptInit_ex(info->dec_ctx, EVP_aes_128_cbc(), NULL,
+			       k2, NULL))
+	goto out_err;
+    EVP_CIPHER_CTX_set_padding(info->enc_ctx, 0);
+    EVP_CIPHER_CTX_set_padding(info->dec_ctx, 0);
 
-    if (ipmi_rmcpp_auth_get_k2_len(ainfo) < 16)
-	return EINVAL;
-    
-    memcpy(info->k2, ipmi_rmcpp_auth_get_k2(ainfo, &k2len), 16);
     *conf_data = info;
     return 0;
-}
 
-static void
-aes_cbc_free(ipmi_con_t *ipmi, void *conf_data)
-{
-    aes_cbc_info_t *info = conf_data;
-
-    memset(info->k2, 0, 16);
-    ipmi_mem_free(info);
+ out_err:
+    aes_cbc_free(ipmi, info);
+    return rv;
 }
 
 static int
@@ -85,11 +129,9 @@ aes_cbc_encrypt(ipmi_con_t    *ipmi,
     unsigned char  *iv;
     unsigned int   l = *payload_len;
     unsigned int   i;
-    unsigned char  *d;
-    EVP_CIPHER_CTX *ctx;
+    unsigned char  *d = *payload;
     int            rv;
     int            outlen;
-    int            tmplen;
     unsigned char  *padpos;
     unsigned char  padval;
     unsigned int   padlen;
@@ -108,15 +150,7 @@ aes_cbc_encrypt(ipmi_con_t    *ipmi,
     if (l > *max_payload_len)
 	return E2BIG;
 
-    /* We store the unencrypted data here, then crypt into the real
-       data. */
-    d = ipmi_mem_alloc(l);
-    if (!d)
-	return ENOMEM;
-
-    memcpy(d, *payload, *payload_len);
-
-    /* Now add the padding. */
+    /* Now add the padding, the data is crypted in place. */
     padpos = d + *payload_len;
     padval = 1;
     for (i=0; i<padlen; i++, padpos++, padval++)
@@ -124,44 +158,27 @@ aes_cbc_encrypt(ipmi_con_t    *ipmi,
     *padpos = padlen;
 
     /* Now create the initialization vector, including making room for it. */
-    iv = (*payload)-16;
+    iv = d-16;
     rv = ipmi->os_hnd->get_random(ipmi->os_hnd, iv, 16);
-    if (rv) {
-	ipmi_mem_free(d);
+    if (rv)
 	return rv;
-    }
-    *header_len -= 16;
-    *max_payload_len += 16;
 
-    ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) {
-	    rv = ENOMEM;
-	    goto out_cleanup;
-    }
-    /* Ok, we're set to do the crypt operation. */
-    EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, info->k2, iv);
-    EVP_CIPHER_CTX_set_padding(ctx, 0);
-    if (!EVP_EncryptUpdate(ctx, *payload, &outlen, d, l)) {
+    /* Ok, we're set to do the crypt operation.  The data is already
+       16-byte aligned, so there is nothing to finalize. */
+    ipmi_lock(info->enc_lock);
+    if (!EVP_EncryptInit_ex(info->enc_ctx, NULL, NULL, NULL, iv)
+	|| !EVP_EncryptUpdate(info->enc_ctx, d, &outlen, d, l))
 	rv = ENOMEM; /* right? */
-	goto out_cleanup;
-    }
-    if (!EVP_EncryptFinal_ex(ctx, (*payload) + outlen, &tmplen)) {
-	rv = ENOMEM; /* right? */
-	goto out_cleanup;
-    }
-    outlen += tmplen;
-
-    /* Don't call EncryptFinal_ex, it adds 16 bytes of useless data.
-       We have already 16-byte aligned the data, no need for it. */
+    ipmi_unlock(info->enc_lock);
+    if (rv)
+	return rv;
 
+    *header_len -= 16;
+    *max_payload_len += 16;
     *payload = iv;
     *payload_len = outlen + 16;
 
- out_cleanup:
-    EVP_CIPHER_CTX_free(ctx);
-    ipmi_mem_free(d);
-
-    return rv;
+    return 0;
 }
 
 static int
@@ -172,9 +189,7 @@ aes_cbc_decrypt(ipmi_con_t    *ipmi,
 {
     aes_cbc_info_t *info = conf_data;
     unsigned int   l = *payload_len;
-    unsigned char  *d;
     unsigned char  *p;
-    EVP_CIPHER_CTX *ctx;
     int            outlen;
     int            rv = 0;
     unsigned char  *pad;
@@ -188,48 +203,32 @@ aes_cbc_decrypt(ipmi_con_t    *ipmi,
 	return EINVAL;
 
     l -= 16;
-    /* We store the encrypted data here, then decrypt into the real
-       data. */
-    d = ipmi_mem_alloc(l);
-    if (!d)
-	return ENOMEM;
-
+    if (l % 16)
+	return EINVAL;
     p = (*payload)+16;
 
-    memcpy(d, p, l);
-
-    /* Ok, we're set to do the decrypt operation. */
-    ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) {
-	    rv = ENOMEM;
-	    goto out_cleanup;
-    }
-    EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, info->k2, *payload);
-    EVP_CIPHER_CTX_set_padding(ctx, 0);
-    if (!EVP_DecryptUpdate(ctx, p, &outlen, d, l)) {
+    /* Ok, we're set to do the decrypt operation, in place. */
+    ipmi_lock(info->dec_lock);
+    if (!EVP_DecryptInit_ex(info->dec_ctx, NULL, NULL, NULL, *payload)
+	|| !EVP_DecryptUpdate(info->dec_ctx, p, &outlen, p, l))
 	rv = EINVAL;
-	goto out_cleanup;
-    }
+    ipmi_unlock(info->dec_lock);
+    if (rv)
+	return rv;
 
-    if (outlen < 16) {
-	rv = EINVAL;
-	goto out_cleanup;
-    }
+    if (outlen < 16)
+	return EINVAL;
 
     /* Now remove the padding */
     pad = p + outlen - 1;
     padlen = *pad;
-    if (padlen >= 16) {
-	rv = EINVAL;
-	goto out_cleanup;
-    }
+    if (padlen >= 16)
+	return EINVAL;
     outlen--;
     pad--;
     while (padlen) {
-	if (*pad != padlen) {
-	    rv = EINVAL;
-	    goto out_cleanup;
-	}
+	if (*pad != padlen)
+	    return EINVAL;
 	outlen--;
 	pad--;
 	padlen--;
@@ -238,10 +237,7 @@ aes_cbc_decrypt(ipmi_con_t    *ipmi,
     *payload = p;
     *payload_len = outlen;
 
- out_cleanup:
-    EVP_CIPHER_CTX_free(ctx);
-    ipmi_mem_free(d);
-    return rv;
+    return 0;
 }
 
 static ipmi_rmcpp_confidentiality_t aes_conf =
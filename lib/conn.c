@@ -35,6 +35,7 @@
 #include <string.h>
 
 #include <OpenIPMI/ipmi_conn.h>
+#include <OpenIPMI/ipmi_msgbits.h>
 
 #include <OpenIPMI/internal/locked_list.h>
 #include <OpenIPMI/internal/ipmi_oem.h>
@@ -495,13 +496,20 @@ struct ipmi_ll_stat_info_s
     ipmi_ll_con_add_stat_cb        adder;
     ipmi_ll_con_register_stat_cb   reg;
     ipmi_ll_con_unregister_stat_cb unreg;
+    ipmi_ll_con_register_counter_cb   reg_counter;
+    ipmi_ll_con_unregister_counter_cb unreg_counter;
     void                           *user_data;
 };
 
 ipmi_ll_stat_info_t *
 ipmi_ll_con_alloc_stat_info(void)
 {
-    return ipmi_mem_alloc(sizeof(ipmi_ll_stat_info_t));
+    ipmi_ll_stat_info_t *info;
+
+    info = ipmi_mem_alloc(sizeof(*info));
+    if (info)
+	memset(info, 0, sizeof(*info));
+    return info;
 }
 
 void
@@ -531,6 +539,22 @@ ipmi_ll_con_stat_info_set_unregister(ipmi_ll_stat_info_t            *info,
     info->unreg = unreg;
 }
 
+void
+ipmi_ll_con_stat_info_set_register_counter
+				(ipmi_ll_stat_info_t             *info,
+				 ipmi_ll_con_register_counter_cb reg)
+{
+    info->reg_counter = reg;
+}
+
+void
+ipmi_ll_con_stat_info_set_unregister_counter
+				(ipmi_ll_stat_info_t               *info,
+				 ipmi_ll_con_unregister_counter_cb unreg)
+{
+    info->unreg_counter = unreg;
+}
+
 void
 ipmi_ll_con_stat_call_adder(ipmi_ll_stat_info_t *info,
 			    void                *stat,
@@ -555,6 +579,29 @@ ipmi_ll_con_stat_call_unregister(ipmi_ll_stat_info_t *info,
     info->unreg(info, stat);
 }
 
+int
+ipmi_ll_con_stat_call_register_counter(ipmi_ll_stat_info_t *info,
+				       const char          *name,
+				       const char          *instance,
+				       unsigned long       *counter,
+				       void                **stat)
+{
+    if (!info->reg_counter)
+	return ENOSYS;
+    return info->reg_counter(info, name, instance, counter, stat);
+}
+
+void
+ipmi_ll_con_stat_call_unregister_counter(ipmi_ll_stat_info_t *info,
+					 void                *stat,
+					 unsigned long       *counter)
+{
+    if (info->unreg_counter)
+	info->unreg_counter(info, stat, counter);
+    else
+	info->unreg(info, stat);
+}
+
 void
 ipmi_ll_con_stat_set_user_data(ipmi_ll_stat_info_t *info,
 			       void                *data)
@@ -568,6 +615,108 @@ ipmi_ll_con_stat_get_user_data(ipmi_ll_stat_info_t *info)
     return info->user_data;
 }
 
+/***********************************************************************
+ *
+ * Message priority classes
+ *
+ **********************************************************************/
+
+/* How many times a waiting class can be passed over for a higher one
+   before it gets the next slot anyway. */
+#define IPMI_PRIO_MAX_SKIPS 8
+
+static const char *msg_prio_names[IPMI_NUM_MSG_PRIOS] =
+{
+    "interactive", "monitoring", "bulk"
+};
+
+const char *
+ipmi_msg_prio_name(int prio)
+{
+    if ((prio < 0) || (prio >= IPMI_NUM_MSG_PRIOS))
+	return "unknown";
+    return msg_prio_names[prio];
+}
+
+int
+ipmi_msg_default_prio(const ipmi_msg_t *msg)
+{
+    switch (msg->netfn) {
+    case IPMI_CHASSIS_NETFN:
+	return IPMI_MSG_PRIO_INTERACTIVE;
+
+    case IPMI_APP_NETFN:
+	switch (msg->cmd) {
+	case IPMI_RESET_WATCHDOG_TIMER_CMD:
+	case IPMI_SET_WATCHDOG_TIMER_CMD:
+	case IPMI_GET_WATCHDOG_TIMER_CMD:
+	    return IPMI_MSG_PRIO_INTERACTIVE;
+	}
+	break;
+
+    case IPMI_SENSOR_EVENT_NETFN:
+	if (msg->cmd == IPMI_GET_DEVICE_SDR_CMD)
+	    return IPMI_MSG_PRIO_BULK;
+	break;
+
+    case IPMI_STORAGE_NETFN:
+	switch (msg->cmd) {
+	case IPMI_READ_FRU_DATA_CMD:
+	case IPMI_WRITE_FRU_DATA_CMD:
+	case IPMI_GET_SDR_CMD:
+	case IPMI_GET_SEL_ENTRY_CMD:
+	    return IPMI_MSG_PRIO_BULK;
+	}
+	break;
+    }
+
+    return IPMI_MSG_PRIO_MONITORING;
+}
+
+int
+ipmi_con_msg_prio(const ipmi_con_option_t *options, const ipmi_msg_t *msg)
+{
+    int i;
+
+    if (options) {
+	for (i=0; options[i].option != IPMI_CON_OPTION_LIST_END; i++) {
+	    if ((options[i].option == IPMI_CON_MSG_OPTION_PRIORITY)
+		&& (options[i].ival >= 0)
+		&& (options[i].ival < IPMI_NUM_MSG_PRIOS))
+		return options[i].ival;
+	}
+    }
+    return ipmi_msg_default_prio(msg);
+}
+
+int
+ipmi_con_prio_pick(const unsigned int depth[], unsigned int skips[])
+{
+    int prio, pick = -1;
+
+    for (prio=0; prio<IPMI_NUM_MSG_PRIOS; prio++) {
+	if (!depth[prio])
+	    continue;
+	if (pick == -1)
+	    pick = prio;
+	else if (skips[prio] >= IPMI_PRIO_MAX_SKIPS) {
+	    /* Starved, let it go ahead of the higher classes once. */
+	    pick = prio;
+	    break;
+	}
+    }
+    if (pick == -1)
+	return -1;
+
+    for (prio=0; prio<IPMI_NUM_MSG_PRIOS; prio++) {
+	if (prio == pick)
+	    skips[prio] = 0;
+	else if (depth[prio])
+	    skips[prio]++;
+    }
+    return pick;
+}
+
 /***********************************************************************
  *
  * Init/shutdown
@@ -55,7 +55,9 @@ struct ipmi_control_info_s
        controls. */
     unsigned int             idx_size;
 
-    ipmi_lock_t              *idx_lock;
+    /* Lookups take this for read, adding and removing controls take
+       it for write.  Nothing may be called out to with this held. */
+    ipmi_rwlock_t            *idx_lock;
 
     /* Total number of controls we have in this. */
     unsigned int             control_count;
@@ -67,6 +69,9 @@ struct ipmi_control_info_s
 #define CONTROL_ID_LEN 32
 struct ipmi_control_s
 {
+    /* Protects usecount, destroyed, and add_pending.  Never held
+       while calling out, so it is a non-recursive lock. */
+    ipmi_lock_t  *lock;
     unsigned int usecount;
 
     ipmi_domain_t *domain;
@@ -77,6 +82,8 @@ struct ipmi_control_s
     ipmi_mc_t *source_mc;
 
     ipmi_entity_t *entity;
+    /* Our entry on the entity's control list. */
+    locked_list_entry_t entity_link;
 
     int destroyed;
 
@@ -150,39 +157,56 @@ static void control_final_destroy(ipmi_control_t *control);
  *
  **********************************************************************/
 
-/* Must be called with the domain entity lock held. */
+/* The caller must make sure the control cannot be freed while this
+   is called, generally by holding the MC's control index lock, the
+   entity's control list lock, or another reference. */
 int
 i_ipmi_control_get(ipmi_control_t *control)
 {
+    int rv = 0;
+
+    ipmi_lock(control->lock);
     if (control->destroyed)
-	return EINVAL;
+	rv = EINVAL;
+    else
+	control->usecount++;
+    ipmi_unlock(control->lock);
+    return rv;
+}
+
+/* Get a reference even if the control is destroyed, for the error
+   paths that still own a pointer to it. */
+static void
+control_ref(ipmi_control_t *control)
+{
+    ipmi_lock(control->lock);
     control->usecount++;
-    return 0;
+    ipmi_unlock(control->lock);
 }
 
 void
 i_ipmi_control_put(ipmi_control_t *control)
 {
-    i_ipmi_domain_entity_lock(control->domain);
+    ipmi_lock(control->lock);
     if (control->usecount == 1) {
 	if (control->add_pending) {
 	    control->add_pending = 0;
-	    i_ipmi_domain_entity_unlock(control->domain);
+	    ipmi_unlock(control->lock);
 	    i_ipmi_entity_call_control_handlers(control->entity,
 					       control, IPMI_ADDED);
-	    i_ipmi_domain_entity_lock(control->domain);
+	    ipmi_lock(control->lock);
 	}
 	if (control->destroyed
 	    && (!control->waitq
 		|| (!opq_stuff_in_progress(control->waitq))))
 	{
-	    i_ipmi_domain_entity_unlock(control->domain);
+	    ipmi_unlock(control->lock);
 	    control_final_destroy(control);
 	    return;
 	}
     }
     control->usecount--;
-    i_ipmi_domain_entity_unlock(control->domain);
+    ipmi_unlock(control->lock);
 }
 
 ipmi_control_id_t
@@ -217,12 +241,12 @@ mc_cb(ipmi_mc_t *mc, void *cb_data)
     ipmi_entity_t       *entity = NULL;
     
     controls = i_ipmi_mc_get_controls(mc);
-    i_ipmi_domain_entity_lock(domain);
     if (info->id.lun > 4) {
 	info->err = EINVAL;
-	goto out_unlock;
+	return;
     }
 
+    ipmi_rwlock_read_lock(controls->idx_lock);
     if (info->id.control_num >= controls->idx_size) {
 	info->err = EINVAL;
 	goto out_unlock;
@@ -234,27 +258,28 @@ mc_cb(ipmi_mc_t *mc, void *cb_data)
 	goto out_unlock;
     }
 
-    info->err = i_ipmi_entity_get(control->entity);
-    if (info->err)
-	goto out_unlock;
-    entity = control->entity;
-
     info->err = i_ipmi_control_get(control);
     if (info->err)
 	goto out_unlock;
+    ipmi_rwlock_read_unlock(controls->idx_lock);
 
+    /* The control holds its entity until it is finally destroyed. */
+    i_ipmi_domain_entity_lock(domain);
+    info->err = i_ipmi_entity_get(control->entity);
+    if (!info->err)
+	entity = control->entity;
     i_ipmi_domain_entity_unlock(domain);
 
-    info->handler(control, info->cb_data);
+    if (entity)
+	info->handler(control, info->cb_data);
 
     i_ipmi_control_put(control);
-    i_ipmi_entity_put(entity);
+    if (entity)
+	i_ipmi_entity_put(entity);
     return;
 
  out_unlock:
-    i_ipmi_domain_entity_unlock(domain);
-    if (entity)
-	i_ipmi_entity_put(entity);
+    ipmi_rwlock_read_unlock(controls->idx_lock);
 }
 
 int
@@ -437,6 +462,7 @@ control_final_destroy(ipmi_control_t *control)
 	control->oem_info_cleanup_handler(control, control->oem_info);
 
     i_ipmi_entity_put(control->entity);
+    ipmi_destroy_lock(control->lock);
     ipmi_mem_free(control);
 }
 
@@ -451,7 +477,7 @@ ipmi_control_destroy(ipmi_control_t *control)
     i_ipmi_domain_mc_unlock(control->domain);
     controls = i_ipmi_mc_get_controls(control->mc);
 
-    ipmi_lock(controls->idx_lock);
+    ipmi_rwlock_write_lock(controls->idx_lock);
     if (controls->controls_by_idx[control->num] == control) {
 	controls->control_count--;
 	controls->controls_by_idx[control->num] = NULL;
@@ -459,9 +485,11 @@ ipmi_control_destroy(ipmi_control_t *control)
 
     i_ipmi_control_get(control);
 
-    ipmi_unlock(controls->idx_lock);
+    ipmi_rwlock_write_unlock(controls->idx_lock);
 
+    ipmi_lock(control->lock);
     control->destroyed = 1;
+    ipmi_unlock(control->lock);
     i_ipmi_control_put(control);
     i_ipmi_mc_put(mc);
 
@@ -606,7 +634,7 @@ control_rsp_handler(ipmi_mc_t  *mc,
 	ipmi_entity_t *entity = NULL;
 
 	i_ipmi_domain_entity_lock(control->domain);
-	control->usecount++;
+	control_ref(control);
 	i_ipmi_domain_entity_unlock(control->domain);
 
 	rv = i_ipmi_entity_get(control->entity);
@@ -632,7 +660,7 @@ control_rsp_handler(ipmi_mc_t  *mc,
 		 "MC was destroyed while a control operation was in progress");
 
 	i_ipmi_domain_entity_lock(control->domain);
-	control->usecount++;
+	control_ref(control);
 	i_ipmi_domain_entity_unlock(control->domain);
 
 	rv = i_ipmi_entity_get(control->entity);
@@ -662,7 +690,7 @@ control_rsp_handler(ipmi_mc_t  *mc,
 		 "Could not convert control id to a pointer",
 		 MC_NAME(mc));
 	i_ipmi_domain_entity_lock(control->domain);
-	control->usecount++;
+	control_ref(control);
 	i_ipmi_domain_entity_unlock(control->domain);
 
 	nrv = i_ipmi_entity_get(control->entity);
@@ -720,7 +748,7 @@ control_addr_response_handler(ipmi_domain_t *domain, ipmi_msgi_t *rspi)
 	    info->__rsp_handler(control, ECANCELED, NULL, info->__cb_data);
 
 	i_ipmi_domain_entity_lock(control->domain);
-	control->usecount++;
+	control_ref(control);
 	i_ipmi_domain_entity_unlock(control->domain);
 	i_ipmi_control_put(control);
 	return IPMI_MSG_ITEM_NOT_USED;
@@ -738,7 +766,7 @@ control_addr_response_handler(ipmi_domain_t *domain, ipmi_msgi_t *rspi)
 		 DOMAIN_NAME(domain));
 	if (info->__rsp_handler) {
 	    i_ipmi_domain_entity_lock(control->domain);
-	    control->usecount++;
+	    control_ref(control);
 	    i_ipmi_domain_entity_unlock(control->domain);
 	    info->__rsp_handler(control, rv, NULL, info->__cb_data);
 	    i_ipmi_control_put(control);
@@ -795,7 +823,7 @@ ipmi_controls_alloc(ipmi_mc_t *mc, ipmi_control_info_t **new_controls)
 	return ENOMEM;
     }
 
-    rv = ipmi_create_lock_os_hnd(os_hnd, &controls->idx_lock);
+    rv = ipmi_create_rwlock_os_hnd(os_hnd, &controls->idx_lock);
     if (rv) {
 	opq_destroy(controls->control_wait_q);
 	ipmi_mem_free(controls);
@@ -840,7 +868,6 @@ ipmi_control_add_nonstandard(ipmi_mc_t               *mc,
     ipmi_domain_t       *domain;
     os_handler_t        *os_hnd;
     ipmi_control_info_t *controls = i_ipmi_mc_get_controls(mc);
-    locked_list_entry_t *link;
     int                 err;
     unsigned int        i;
 
@@ -853,8 +880,14 @@ ipmi_control_add_nonstandard(ipmi_mc_t               *mc,
     if ((num >= 256) && (num != UINT_MAX))
 	return EINVAL;
 
+    if (!control->lock) {
+	err = ipmi_create_nr_lock_os_hnd(os_hnd, &control->lock);
+	if (err)
+	    return err;
+    }
+
     i_ipmi_domain_entity_lock(domain);
-    ipmi_lock(controls->idx_lock);
+    ipmi_rwlock_write_lock(controls->idx_lock);
 
     if (num == UINT_MAX){
 	for (i=0; i<controls->idx_size; i++) {
@@ -913,17 +946,6 @@ ipmi_control_add_nonstandard(ipmi_mc_t               *mc,
 	goto out_err;
     }
 
-    link = locked_list_alloc_entry();
-    if (!link) {
-	opq_destroy(control->waitq);
-	control->waitq = NULL;
-	locked_list_destroy(control->handler_list);
-	locked_list_destroy(control->handler_list_cl);
-	control->handler_list = NULL;
-	err = ENOMEM;
-	goto out_err;
-    }
-
     control->domain = domain;
     control->mc = mc;
     control->source_mc = source_mc;
@@ -944,18 +966,18 @@ ipmi_control_add_nonstandard(ipmi_mc_t               *mc,
     control->destroy_handler_cb_data = destroy_handler_cb_data;
     control_set_name(control);
 
-    ipmi_unlock(controls->idx_lock);
+    ipmi_rwlock_write_unlock(controls->idx_lock);
 
     i_ipmi_domain_entity_unlock(domain);
 
-    ipmi_entity_add_control(ent, control, link);
+    ipmi_entity_add_control(ent, control, &control->entity_link);
 
     control->add_pending = 1;
 
     return 0;
 
  out_err:
-    ipmi_unlock(controls->idx_lock);
+    ipmi_rwlock_write_unlock(controls->idx_lock);
     i_ipmi_domain_entity_unlock(domain);
     return err;
 }
@@ -980,7 +1002,7 @@ ipmi_controls_destroy(ipmi_control_info_t *controls)
     if (controls->control_wait_q)
 	opq_destroy(controls->control_wait_q);
     if (controls->idx_lock)
-	ipmi_destroy_lock(controls->idx_lock);
+	ipmi_destroy_rwlock(controls->idx_lock);
     ipmi_mem_free(controls);
     return 0;
 }
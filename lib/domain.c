@@ -48,6 +48,7 @@
 #include <OpenIPMI/ipmi_auth.h>
 
 #include <OpenIPMI/internal/locked_list.h>
+#include <OpenIPMI/internal/locked_array.h>
 #include <OpenIPMI/internal/ilist.h>
 #include <OpenIPMI/internal/ipmi_event.h>
 #include <OpenIPMI/internal/ipmi_int.h>
@@ -56,6 +57,7 @@
 #include <OpenIPMI/internal/ipmi_domain.h>
 #include <OpenIPMI/internal/ipmi_entity.h>
 #include <OpenIPMI/internal/ipmi_mc.h>
+#include <OpenIPMI/internal/ipmi_stat.h>
 
 #ifdef DEBUG_EVENTS
 static void
@@ -74,6 +76,16 @@ dump_hex(const unsigned char *data, int len)
 /* Rescan the bus for MCs every 10 minutes by default. */
 #define IPMI_AUDIT_DOMAIN_INTERVAL 600
 
+/* How many domains in the process may audit at the same time by
+   default.  A domain that finds no room tries again after this many
+   seconds. */
+#define IPMI_AUDIT_MAX_RUNNING 8
+#define IPMI_AUDIT_RETRY_TIME 2
+
+/* Check the presence of every entity on every this many audits, the
+   other audits only check entities something happened to. */
+#define IPMI_AUDIT_FULL_PRESENCE 6
+
 /* Re-query the SEL every 10 seconds by default. */
 #define IPMI_SEL_QUERY_INTERVAL 10
 
@@ -124,7 +136,23 @@ typedef struct ll_msg_s
 
     int                          side_effects;
 
+    /* The priority class (IPMI_MSG_PRIO_xxx), never the default. */
+    int                          prio;
+
+    /* When the message was sent, for the latency histogram. */
+    struct timeval               send_time;
+
+    /* Set if others may join this command (see coalescing below),
+       it is then in the domain's coal_cmds list. */
+    int                          coalescable;
+
+    /* Identical commands that joined this one while it was in
+       flight, they get a copy of its response. */
+    struct ll_msg_s              *followers;
+    struct ll_msg_s              *next_follower;
+
     ilist_item_t link;
+    ilist_item_t coal_link;
 } ll_msg_t;
 
 typedef struct activate_timer_info_s
@@ -212,8 +240,15 @@ struct ipmi_domain_s
 				       switchovers to avoid handling
 				       old messages. */
 
-    locked_list_t            *event_handlers;
-    locked_list_t            *event_handlers_cl;
+    /* In-flight commands that identical ones may join instead of
+       going out themselves, and the commands (one bit per netfn/cmd)
+       that may be coalesced.  Both are protected by cmds_lock. */
+    ilist_t       *coal_cmds;
+    int           coalesce;
+    unsigned char coalesce_ok[32][32];
+
+    locked_array_t           *event_handlers;
+    locked_array_t           *event_handlers_cl;
     ipmi_oem_event_handler_cb oem_event_handler;
     void                      *oem_event_cb_data;
 
@@ -262,6 +297,18 @@ struct ipmi_domain_s
     os_hnd_timer_id_t   *audit_domain_timer;
     audit_domain_info_t *audit_domain_timer_info;
 
+    /* Set while an audit holds one of the process-wide audit slots,
+       until its bus scan and SDR check are done.  Protected by
+       mc_lock. */
+    int                 audit_running;
+    int                 audit_sdrs_pending;
+    /* Set once cleanup_domain() starts, so callbacks cancelled by the
+       teardown know to leave the domain alone. */
+    int                 cleaning_up;
+    unsigned int        audit_count;
+    ipmi_domain_stat_t  *audits;
+    ipmi_domain_stat_t  *audits_deferred;
+
     /* This is a list of all the bus scans currently happening, so
        they can be properly freed. */
     mc_ipmb_scan_info_t *bus_scans_running;
@@ -325,6 +372,19 @@ struct ipmi_domain_s
     /* Statistics for the domain. */
     locked_list_t *stats;
 
+    /* Histogram of the time from sending a command to getting its
+       response, in microseconds. */
+    ipmi_domain_stat_t *cmd_latency;
+
+    /* The same per priority class, and a histogram of how many
+       commands of the class were in flight when one was sent. */
+    ipmi_domain_stat_t *prio_latency[IPMI_NUM_MSG_PRIOS];
+    ipmi_domain_stat_t *prio_depth[IPMI_NUM_MSG_PRIOS];
+    unsigned long      prio_in_flight[IPMI_NUM_MSG_PRIOS];
+
+    /* Commands that got the response of an identical one. */
+    ipmi_domain_stat_t *coalesced;
+
     /* Keep a linked-list of these. */
     ipmi_domain_t *next, *prev;
 
@@ -358,6 +418,8 @@ static locked_list_t *domains_list;
 
 static void domain_audit(void *cb_data, os_hnd_timer_id_t *id);
 
+static void audit_put_slot(void);
+
 static int domain_send_mc_id(ipmi_domain_t *domain);
 
 static void cancel_domain_oem_check(ipmi_domain_t *domain);
@@ -443,6 +505,152 @@ deliver_rsp(ipmi_domain_t                *domain,
 	ipmi_free_msg_item(rspi);
 }
 
+/***********************************************************************
+ *
+ * Coalescing of identical commands.  When coalescing is on, a command
+ * in the list below that is identical (same address, command and
+ * data) to one already in flight does not go out, it gets a copy of
+ * the response to the one in flight.  Only commands that just read
+ * something are in the list.
+ *
+ **********************************************************************/
+static struct {
+    unsigned char netfn, cmd;
+} default_coalesce_cmds[] =
+{
+    { IPMI_APP_NETFN,		IPMI_GET_DEVICE_ID_CMD },
+    { IPMI_APP_NETFN,		IPMI_GET_SELF_TEST_RESULTS_CMD },
+    { IPMI_APP_NETFN,		IPMI_GET_DEVICE_GUID_CMD },
+    { IPMI_APP_NETFN,		IPMI_GET_SYSTEM_GUID_CMD },
+    { IPMI_APP_NETFN,		IPMI_GET_BMC_GLOBAL_ENABLES_CMD },
+    { IPMI_CHASSIS_NETFN,	IPMI_GET_CHASSIS_STATUS_CMD },
+    { IPMI_SENSOR_EVENT_NETFN,	IPMI_GET_DEVICE_SDR_INFO_CMD },
+    { IPMI_SENSOR_EVENT_NETFN,	IPMI_GET_SENSOR_HYSTERESIS_CMD },
+    { IPMI_SENSOR_EVENT_NETFN,	IPMI_GET_SENSOR_THRESHOLD_CMD },
+    { IPMI_SENSOR_EVENT_NETFN,	IPMI_GET_SENSOR_EVENT_ENABLE_CMD },
+    { IPMI_SENSOR_EVENT_NETFN,	IPMI_GET_SENSOR_EVENT_STATUS_CMD },
+    { IPMI_SENSOR_EVENT_NETFN,	IPMI_GET_SENSOR_READING_CMD },
+    { IPMI_STORAGE_NETFN,	IPMI_GET_FRU_INVENTORY_AREA_INFO_CMD },
+    { IPMI_STORAGE_NETFN,	IPMI_GET_SDR_REPOSITORY_INFO_CMD },
+    { IPMI_STORAGE_NETFN,	IPMI_GET_SEL_INFO_CMD },
+    { IPMI_STORAGE_NETFN,	IPMI_GET_SEL_TIME_CMD },
+    { 0xff, 0xff }
+};
+
+static void
+set_coalesce_ok(ipmi_domain_t *domain, unsigned char netfn,
+		unsigned char cmd, int ok)
+{
+    unsigned char *bits = &domain->coalesce_ok[netfn >> 1][cmd >> 3];
+
+    if (ok)
+	*bits |= 1 << (cmd & 7);
+    else
+	*bits &= ~(1 << (cmd & 7));
+}
+
+/* Must be called with the cmds_lock held. */
+static int
+coalesce_allowed(ipmi_domain_t *domain, const ipmi_msg_t *msg)
+{
+    if (!domain->coalesce || (msg->netfn & 1) || (msg->netfn > 0x3f))
+	return 0;
+    return ((domain->coalesce_ok[msg->netfn >> 1][msg->cmd >> 3]
+	     >> (msg->cmd & 7)) & 1);
+}
+
+static int
+cmp_coal(void *item, void *cb_data)
+{
+    ll_msg_t *nmsg1 = item;
+    ll_msg_t *nmsg2 = cb_data;
+
+    return ((nmsg1->msg.netfn == nmsg2->msg.netfn)
+	    && (nmsg1->msg.cmd == nmsg2->msg.cmd)
+	    && (nmsg1->msg.data_len == nmsg2->msg.data_len)
+	    && (memcmp(nmsg1->msg_data, nmsg2->msg_data,
+		       nmsg1->msg.data_len) == 0)
+	    && ipmi_addr_equal(&nmsg1->rsp_item->addr,
+			       nmsg1->rsp_item->addr_len,
+			       &nmsg2->rsp_item->addr,
+			       nmsg2->rsp_item->addr_len));
+}
+
+/* Must be called with the cmds_lock held.  Stop others from joining
+   nmsg and return the ones that already did. */
+static ll_msg_t *
+coalesce_detach(ipmi_domain_t *domain, ll_msg_t *nmsg)
+{
+    ll_msg_t *followers = nmsg->followers;
+
+    if (nmsg->coalescable) {
+	ilist_remove_item_from_list(domain->coal_cmds, nmsg);
+	nmsg->coalescable = 0;
+    }
+    nmsg->followers = NULL;
+    return followers;
+}
+
+/* Give each command in the list a copy of the response and free
+   it. */
+static void
+deliver_coalesced(ipmi_domain_t    *domain,
+		  ll_msg_t         *followers,
+		  const ipmi_msg_t *rsp)
+{
+    ll_msg_t    *nmsg;
+    ipmi_msgi_t *rspi;
+
+    while (followers) {
+	nmsg = followers;
+	followers = nmsg->next_follower;
+
+	rspi = nmsg->rsp_item;
+	rspi->msg.netfn = rsp->netfn;
+	rspi->msg.cmd = rsp->cmd;
+	rspi->msg.data = rspi->data;
+	rspi->msg.data_len = rsp->data_len;
+	memcpy(rspi->data, rsp->data, rsp->data_len);
+	deliver_rsp(domain, nmsg->rsp_handler, rspi);
+	ipmi_mem_free(nmsg);
+    }
+}
+
+void
+ipmi_domain_set_cmd_coalescing(ipmi_domain_t *domain, int enable)
+{
+    CHECK_DOMAIN_LOCK(domain);
+
+    ipmi_lock(domain->cmds_lock);
+    domain->coalesce = enable != 0;
+    ipmi_unlock(domain->cmds_lock);
+}
+
+int
+ipmi_domain_get_cmd_coalescing(ipmi_domain_t *domain)
+{
+    CHECK_DOMAIN_LOCK(domain);
+
+    return domain->coalesce;
+}
+
+int
+ipmi_domain_set_coalesce_cmd(ipmi_domain_t *domain,
+			     unsigned char netfn,
+			     unsigned char cmd,
+			     int           allow)
+{
+    CHECK_DOMAIN_LOCK(domain);
+
+    if ((netfn & 1) || (netfn > 0x3f))
+	return EINVAL;
+
+    ipmi_lock(domain->cmds_lock);
+    set_coalesce_ok(domain, netfn, cmd, allow);
+    ipmi_unlock(domain->cmds_lock);
+    return 0;
+}
+
 /***********************************************************************
  *
  * Used for handling detecting when the domain is fully up.
@@ -593,6 +801,8 @@ cleanup_domain(ipmi_domain_t *domain)
     unsigned int i;
     int          rv;
 
+    domain->cleaning_up = 1;
+
     /* This must be first, so that nuking the oustanding messages will
        cause the right thing to happen. */
     cancel_domain_oem_check(domain);
@@ -603,6 +813,33 @@ cleanup_domain(ipmi_domain_t *domain)
 	domain->attr = NULL;
     }
 
+    if (domain->cmd_latency) {
+	ipmi_domain_stat_put(domain->cmd_latency);
+	domain->cmd_latency = NULL;
+    }
+    if (domain->coalesced) {
+	ipmi_domain_stat_put(domain->coalesced);
+	domain->coalesced = NULL;
+    }
+    if (domain->audits) {
+	ipmi_domain_stat_put(domain->audits);
+	domain->audits = NULL;
+    }
+    if (domain->audits_deferred) {
+	ipmi_domain_stat_put(domain->audits_deferred);
+	domain->audits_deferred = NULL;
+    }
+    for (i=0; i<IPMI_NUM_MSG_PRIOS; i++) {
+	if (domain->prio_latency[i]) {
+	    ipmi_domain_stat_put(domain->prio_latency[i]);
+	    domain->prio_latency[i] = NULL;
+	}
+	if (domain->prio_depth[i]) {
+	    ipmi_domain_stat_put(domain->prio_depth[i]);
+	    domain->prio_depth[i] = NULL;
+	}
+    }
+
     if (domain->stats) {
 	locked_list_iterate(domain->stats, destroy_stat, domain);
 	locked_list_destroy(domain->stats);
@@ -621,15 +858,18 @@ cleanup_domain(ipmi_domain_t *domain)
 	ok = ilist_first(&iter);
 	while (ok) {
 	    ipmi_msgi_t *rspi;
+	    ll_msg_t    *followers;
 
 	    nmsg = ilist_get(&iter);
 	    rspi = nmsg->rsp_item;
+	    followers = coalesce_detach(domain, nmsg);
 
 	    rspi->msg.netfn = nmsg->msg.netfn | 1;
 	    rspi->msg.cmd = nmsg->msg.cmd;
 	    rspi->msg.data = rspi->data;
 	    rspi->msg.data_len = 1;
 	    rspi->msg.data[0] = IPMI_UNKNOWN_ERR_CC;
+	    deliver_coalesced(domain, followers, &rspi->msg);
 	    deliver_rsp(domain, nmsg->rsp_handler, rspi);
 	    
 	    ilist_delete(&iter);
@@ -642,6 +882,10 @@ cleanup_domain(ipmi_domain_t *domain)
 	ipmi_destroy_lock(domain->cmds_lock);
     if (domain->cmds)
 	free_ilist(domain->cmds);
+    if (domain->coal_cmds)
+	/* Commands to the system interface may still be in here, they
+	   are finished when their response comes back. */
+	free_ilist(domain->coal_cmds);
 
     /* Shutdown code called here. */
     if (domain->shutdown_handler)
@@ -650,23 +894,23 @@ cleanup_domain(ipmi_domain_t *domain)
     /* Delete the sensors from the main SDR repository. */
     if (domain->sensors_in_main_sdr) {
 	for (i=0; i<domain->sensors_in_main_sdr_count; i++) {
-	    i_ipmi_domain_entity_lock(domain);
-	    if (domain->sensors_in_main_sdr[i]) {
-		ipmi_sensor_t *sensor = domain->sensors_in_main_sdr[i];
-		ipmi_entity_t *entity = ipmi_sensor_get_entity(sensor);
-		ipmi_mc_t     *mc = ipmi_sensor_get_mc(sensor);
-		i_ipmi_entity_get(entity);
-		i_ipmi_sensor_get(sensor);
-		i_ipmi_domain_entity_unlock(domain);
-		i_ipmi_domain_mc_lock(domain);
-		i_ipmi_mc_get(mc);
-		i_ipmi_domain_mc_unlock(domain);
-		ipmi_sensor_destroy(domain->sensors_in_main_sdr[i]);
-		i_ipmi_sensor_put(sensor);
-		i_ipmi_mc_put(mc);
-		i_ipmi_entity_put(entity);
-	    } else
-		i_ipmi_domain_entity_unlock(domain);
+	    ipmi_sensor_t *sensor;
+	    ipmi_entity_t *entity;
+	    ipmi_mc_t     *mc;
+
+	    sensor = i_ipmi_sensor_get_sdr_slot(domain,
+						&domain->sensors_in_main_sdr[i]);
+	    if (!sensor)
+		continue;
+	    entity = ipmi_sensor_get_entity(sensor);
+	    mc = ipmi_sensor_get_mc(sensor);
+	    i_ipmi_domain_mc_lock(domain);
+	    i_ipmi_mc_get(mc);
+	    i_ipmi_domain_mc_unlock(domain);
+	    ipmi_sensor_destroy(sensor);
+	    i_ipmi_sensor_put(sensor);
+	    i_ipmi_mc_put(mc);
+	    i_ipmi_entity_put(entity);
 	}
 	ipmi_mem_free(domain->sensors_in_main_sdr);
     }
@@ -745,14 +989,18 @@ cleanup_domain(ipmi_domain_t *domain)
 	    ipmi_mem_free(domain->audit_domain_timer_info);
 	}
     }
+    if (domain->audit_running) {
+	domain->audit_running = 0;
+	audit_put_slot();
+    }
 
     if (domain->event_handlers) {
-	locked_list_iterate(domain->event_handlers, event_handler_cleanup,
-			    domain);
-	locked_list_destroy(domain->event_handlers);
+	locked_array_iterate(domain->event_handlers, event_handler_cleanup,
+			     domain);
+	locked_array_destroy(domain->event_handlers);
     }
     if (domain->event_handlers_cl)
-	locked_list_destroy(domain->event_handlers_cl);
+	locked_array_destroy(domain->event_handlers_cl);
 
     if (domain->con_change_handlers) {
 	locked_list_iterate(domain->con_change_handlers, con_change_cleanup,
@@ -843,6 +1091,10 @@ cleanup_domain(ipmi_domain_t *domain)
     ipmi_mem_free(domain);
 }
 
+static int domain_stat_link(ipmi_domain_stat_t *stat, unsigned long *counter);
+static void domain_stat_unlink(ipmi_domain_stat_t *stat,
+			       unsigned long      *counter);
+
 static int con_register_stat(ipmi_ll_stat_info_t *info,
 			     const char          *name,
 			     const char          *instance,
@@ -871,6 +1123,103 @@ static void con_unregister_stat(ipmi_ll_stat_info_t *info,
     ipmi_domain_stat_put(stat);
 }
 
+static int con_register_counter(ipmi_ll_stat_info_t *info,
+				const char          *name,
+				const char          *instance,
+				unsigned long       *counter,
+				void                **stat)
+{
+    ipmi_domain_stat_t *rstat = NULL;
+    int                rv;
+    ipmi_domain_t      *domain = ipmi_ll_con_stat_get_user_data(info);
+
+    rv = ipmi_domain_stat_register(domain, name, instance, &rstat);
+    if (rv)
+	return rv;
+    rv = domain_stat_link(rstat, counter);
+    if (rv)
+	ipmi_domain_stat_put(rstat);
+    else
+	*stat = rstat;
+    return rv;
+}
+
+static void con_unregister_counter(ipmi_ll_stat_info_t *info,
+				   void                *stat,
+				   unsigned long       *counter)
+{
+    domain_stat_unlink(stat, counter);
+    ipmi_domain_stat_put(stat);
+}
+
+/* Called when a command sent by send_command_addr() is finished. */
+static void
+record_cmd_latency(ipmi_domain_t *domain, ll_msg_t *nmsg)
+{
+    struct timeval now;
+    long           usec;
+
+    ipmi_stat_atomic_add(&domain->prio_in_flight[nmsg->prio],
+			 (unsigned long) -1);
+    if (!domain->cmd_latency)
+	return;
+    domain->os_hnd->get_monotonic_time(domain->os_hnd, &now);
+    usec = ((now.tv_sec - nmsg->send_time.tv_sec) * 1000000
+	    + (now.tv_usec - nmsg->send_time.tv_usec));
+    if (usec < 0)
+	usec = 0;
+    ipmi_domain_stat_add_sample(domain->cmd_latency, usec);
+    if (domain->prio_latency[nmsg->prio])
+	ipmi_domain_stat_add_sample(domain->prio_latency[nmsg->prio], usec);
+}
+
+static void
+record_cmd_sent(ipmi_domain_t *domain, ll_msg_t *nmsg)
+{
+    unsigned long depth;
+
+    ipmi_stat_atomic_add(&domain->prio_in_flight[nmsg->prio], 1);
+    depth = ipmi_stat_atomic_load(&domain->prio_in_flight[nmsg->prio]);
+    if (domain->prio_depth[nmsg->prio])
+	ipmi_domain_stat_add_sample(domain->prio_depth[nmsg->prio], depth);
+}
+
+static void
+register_prio_stats(ipmi_domain_t *domain)
+{
+    char name[40];
+    int  i;
+
+    for (i=0; i<IPMI_NUM_MSG_PRIOS; i++) {
+	snprintf(name, sizeof(name), "domain_%s_latency_us",
+		 ipmi_msg_prio_name(i));
+	ipmi_domain_stat_register_hist(domain, name, domain->name,
+				       &domain->prio_latency[i]);
+	snprintf(name, sizeof(name), "domain_%s_queue_depth",
+		 ipmi_msg_prio_name(i));
+	ipmi_domain_stat_register_hist(domain, name, domain->name,
+				       &domain->prio_depth[i]);
+    }
+}
+
+/* The options to send a command with, opt_data must have room for 3. */
+static ipmi_con_option_t *
+cmd_options(ipmi_con_option_t *opt_data, int side_effects, int prio)
+{
+    int i = 0;
+
+    if (side_effects) {
+	opt_data[i].option = IPMI_CON_MSG_OPTION_SIDE_EFFECTS;
+	opt_data[i].ival = 1;
+	i++;
+    }
+    opt_data[i].option = IPMI_CON_MSG_OPTION_PRIORITY;
+    opt_data[i].ival = prio;
+    i++;
+    opt_data[i].option = IPMI_CON_OPTION_LIST_END;
+    return opt_data;
+}
+
 static int
 process_options(ipmi_domain_t      *domain, 
 		ipmi_open_option_t *options,
@@ -908,6 +1257,9 @@ process_options(ipmi_domain_t      *domain,
 	case IPMI_OPEN_OPTION_USE_CACHE:
 	    domain->option_use_cache = options[i].ival != 0;
 	    break;
+	case IPMI_OPEN_OPTION_COALESCE:
+	    domain->coalesce = options[i].ival != 0;
+	    break;
 	case IPMI_OPEN_OPTION_ACTIVATE_IF_POSSIBLE:
 	    domain->option_activate_if_possible = options[i].ival != 0;
 	    break;
@@ -937,6 +1289,7 @@ setup_domain(const char         *name,
     ipmi_system_interface_addr_t si;
     int                          i, j;
     unsigned int                 priv;
+    unsigned int                 rnd = 0;
 
     /* Don't allow '(' in the domain name, as that messes up the
        naming.  That is the only restriction. */
@@ -1003,8 +1356,23 @@ setup_domain(const char         *name,
     ipmi_ll_con_stat_info_set_adder(domain->con_stat_info, con_add_stat);
     ipmi_ll_con_stat_info_set_unregister(domain->con_stat_info,
 					 con_unregister_stat);
+    ipmi_ll_con_stat_info_set_register_counter(domain->con_stat_info,
+					       con_register_counter);
+    ipmi_ll_con_stat_info_set_unregister_counter(domain->con_stat_info,
+						 con_unregister_counter);
     ipmi_ll_con_stat_set_user_data(domain->con_stat_info, domain);
 
+    /* Not fatal if this fails, we just don't track latency. */
+    ipmi_domain_stat_register_hist(domain, "domain_cmd_latency_us",
+				   domain->name, &domain->cmd_latency);
+    register_prio_stats(domain);
+    ipmi_domain_stat_register(domain, "domain_coalesced_cmds",
+			      domain->name, &domain->coalesced);
+    ipmi_domain_stat_register(domain, "domain_audits",
+			      domain->name, &domain->audits);
+    ipmi_domain_stat_register(domain, "domain_audits_deferred",
+			      domain->name, &domain->audits_deferred);
+
     for (i=0; i<num_con; i++) {
 	int len1 = strlen(domain->name);
 	domain->conn[i] = ipmi[i];
@@ -1069,13 +1437,13 @@ setup_domain(const char         *name,
     if (rv)
 	goto out_err;
 
-    domain->event_handlers_cl = locked_list_alloc(domain->os_hnd);
+    domain->event_handlers_cl = locked_array_alloc(domain->os_hnd);
     if (!domain->event_handlers_cl) {
 	rv = ENOMEM;
 	goto out_err;
     }
 
-    domain->event_handlers = locked_list_alloc(domain->os_hnd);
+    domain->event_handlers = locked_array_alloc(domain->os_hnd);
     if (!domain->event_handlers) {
 	rv = ENOMEM;
 	goto out_err;
@@ -1118,6 +1486,15 @@ setup_domain(const char         *name,
 	goto out_err;
     }
 
+    domain->coal_cmds = alloc_ilist();
+    if (! domain->coal_cmds) {
+	rv = ENOMEM;
+	goto out_err;
+    }
+    for (i=0; default_coalesce_cmds[i].netfn != 0xff; i++)
+	set_coalesce_ok(domain, default_coalesce_cmds[i].netfn,
+			default_coalesce_cmds[i].cmd, 1);
+
     domain->con_change_cl_handlers = locked_list_alloc(domain->os_hnd);
     if (! domain->con_change_cl_handlers) {
 	rv = ENOMEM;
@@ -1179,7 +1556,11 @@ setup_domain(const char         *name,
     if (rv)
 	goto out_err;
 
-    timeout.tv_sec = domain->audit_domain_interval;
+    /* Spread the first audit of domains opened together over a whole
+       interval, they drift apart from there. */
+    domain->os_hnd->get_random(domain->os_hnd, &rnd, sizeof(rnd));
+    timeout.tv_sec = (domain->audit_domain_interval / 2
+		      + rnd % (domain->audit_domain_interval + 1));
     timeout.tv_usec = 0;
     domain->os_hnd->start_timer(domain->os_hnd,
 				domain->audit_domain_timer,
@@ -2044,6 +2425,7 @@ ll_rsp_handler(ipmi_con_t   *ipmi,
     ll_msg_t      *nmsg = orspi->data2;
     intptr_t      seq = (intptr_t) orspi->data3;
     intptr_t      conn_seq = (intptr_t) orspi->data4;
+    ll_msg_t      *followers;
     int           rv;
 
     rv = i_ipmi_domain_get(domain);
@@ -2063,8 +2445,12 @@ ll_rsp_handler(ipmi_con_t   *ipmi,
 	ipmi_unlock(domain->cmds_lock);
 	goto out_unlock;
     }
+    followers = coalesce_detach(domain, nmsg);
     ipmi_unlock(domain->cmds_lock);
 
+    record_cmd_latency(domain, nmsg);
+
+    deliver_coalesced(domain, followers, &orspi->msg);
     rspi = nmsg->rsp_item;
     if (nmsg->rsp_handler) {
 	ipmi_move_msg_item(rspi, orspi);
@@ -2085,6 +2471,7 @@ ll_si_rsp_handler(ipmi_con_t *ipmi, ipmi_msgi_t *orspi)
     ipmi_msgi_t                  *rspi;
     ipmi_domain_t                *domain = orspi->data1;
     ll_msg_t                     *nmsg = orspi->data2;
+    ll_msg_t                     *followers;
     int                          rv;
 
     rspi = nmsg->rsp_item;
@@ -2094,10 +2481,20 @@ ll_si_rsp_handler(ipmi_con_t *ipmi, ipmi_msgi_t *orspi)
 	/* Note that since we don't track SI messages, we must report
 	   them to the upper layer through this interface when the
 	   domain goes away. */
+	deliver_coalesced(NULL, nmsg->followers, &orspi->msg);
 	deliver_rsp(NULL, nmsg->rsp_handler, rspi);
 	return IPMI_MSG_ITEM_NOT_USED;
     }
 
+    record_cmd_latency(domain, nmsg);
+
+    if (nmsg->coalescable) {
+	ipmi_lock(domain->cmds_lock);
+	followers = coalesce_detach(domain, nmsg);
+	ipmi_unlock(domain->cmds_lock);
+	deliver_coalesced(domain, followers, &orspi->msg);
+    }
+
     if (nmsg->rsp_handler) {
 	ipmi_move_msg_item(rspi, orspi);
 	/* Set the LUN from the response message. */
@@ -2175,7 +2572,8 @@ send_command_addr(ipmi_domain_t                *domain,
 		  ipmi_addr_response_handler_t rsp_handler,
 		  void                         *rsp_data1,
 		  void                         *rsp_data2,
-		  int			       side_effects)
+		  int			       side_effects,
+		  int			       prio)
 {
     int                          rv;
     int                          u;
@@ -2185,8 +2583,8 @@ send_command_addr(ipmi_domain_t                *domain,
     void                         *data4 = NULL;
     int                          is_ipmb = 0;
     ipmi_msgi_t                  *rspi;
-    ipmi_con_option_t            opt_data[2];
-    ipmi_con_option_t		 *options = NULL;
+    ipmi_con_option_t            opt_data[3];
+    ipmi_con_option_t		 *options;
 
     if (addr_len > sizeof(ipmi_addr_t))
 	return EINVAL;
@@ -2197,12 +2595,11 @@ send_command_addr(ipmi_domain_t                *domain,
     if (domain->in_shutdown)
 	return EINVAL;
 
-    if (side_effects) {
-	options = opt_data;
-	options[0].option = IPMI_CON_MSG_OPTION_SIDE_EFFECTS;
-	options[0].ival = 1;
-	options[1].option = IPMI_CON_OPTION_LIST_END;
-    }
+    if (prio == IPMI_MSG_PRIO_DEFAULT)
+	prio = ipmi_msg_default_prio(msg);
+    else if ((prio < 0) || (prio >= IPMI_NUM_MSG_PRIOS))
+	return EINVAL;
+    options = cmd_options(opt_data, side_effects, prio);
 
     CHECK_DOMAIN_LOCK(domain);
 
@@ -2274,8 +2671,32 @@ send_command_addr(ipmi_domain_t                *domain,
     nmsg->rsp_item->data2 = rsp_data2;
 
     nmsg->side_effects = side_effects;
+    nmsg->prio = prio;
+    nmsg->coalescable = 0;
+    nmsg->followers = NULL;
+    nmsg->next_follower = NULL;
+    domain->os_hnd->get_monotonic_time(domain->os_hnd, &nmsg->send_time);
 
     ipmi_lock(domain->cmds_lock);
+    if (!side_effects && coalesce_allowed(domain, msg)) {
+	ll_msg_t *leader = ilist_search(domain->coal_cmds, cmp_coal, nmsg);
+
+	if (leader) {
+	    /* The same thing is already on its way, wait for that
+	       response instead of sending another. */
+	    ll_msg_t **end = &leader->followers;
+
+	    while (*end)
+		end = &(*end)->next_follower;
+	    *end = nmsg;
+	    ipmi_unlock(domain->cmds_lock);
+	    if (domain->coalesced)
+		ipmi_domain_stat_add(domain->coalesced, 1);
+	    return 0;
+	}
+	nmsg->coalescable = 1;
+    }
+
     nmsg->seq = domain->cmds_seq;
     domain->cmds_seq++;
 
@@ -2299,7 +2720,11 @@ send_command_addr(ipmi_domain_t                *domain,
     if (rv) {
 	ipmi_free_msg_item(rspi);
 	goto out_unlock;
-    } else if (is_ipmb) {
+    }
+    record_cmd_sent(domain, nmsg);
+    if (nmsg->coalescable)
+	ilist_add_tail(domain->coal_cmds, nmsg, &nmsg->coal_link);
+    if (is_ipmb) {
 	/* If it's a system interface we don't add it to the list of
 	   commands running, because it will never need to be
 	   rerouted. */
@@ -2326,7 +2751,21 @@ ipmi_send_command_addr(ipmi_domain_t                *domain,
 		       void                         *rsp_data2)
 {
     return send_command_addr(domain, addr, addr_len, msg, rsp_handler,
-			     rsp_data1, rsp_data2, 0);
+			     rsp_data1, rsp_data2, 0, IPMI_MSG_PRIO_DEFAULT);
+}
+
+int
+ipmi_send_command_addr_prio(ipmi_domain_t                *domain,
+			    const ipmi_addr_t	         *addr,
+			    unsigned int                 addr_len,
+			    const ipmi_msg_t             *msg,
+			    int                          prio,
+			    ipmi_addr_response_handler_t rsp_handler,
+			    void                         *rsp_data1,
+			    void                         *rsp_data2)
+{
+    return send_command_addr(domain, addr, addr_len, msg, rsp_handler,
+			     rsp_data1, rsp_data2, 0, prio);
 }
 
 int
@@ -2339,7 +2778,7 @@ ipmi_send_command_addr_sideeff(ipmi_domain_t                *domain,
 			       void                         *rsp_data2)
 {
     return send_command_addr(domain, addr, addr_len, msg, rsp_handler,
-			     rsp_data1, rsp_data2, 1);
+			     rsp_data1, rsp_data2, 1, IPMI_MSG_PRIO_DEFAULT);
 }
 
 /* Take all the commands for any inactive or down connection and
@@ -2359,8 +2798,8 @@ reroute_cmds(ipmi_domain_t *domain, int old_con, int new_con)
 	nmsg = ilist_get(&iter);
 	if (nmsg->con == old_con) {
 	    ipmi_msgi_t       *rspi;
-	    ipmi_con_option_t opt_data[2];
-	    ipmi_con_option_t *options = NULL;
+	    ipmi_con_option_t opt_data[3];
+	    ipmi_con_option_t *options;
 
 	    nmsg->seq = domain->cmds_seq;
 	    domain->cmds_seq++; /* Make the message unique so a
@@ -2372,12 +2811,7 @@ reroute_cmds(ipmi_domain_t *domain, int old_con, int new_con)
 	    if (!rspi)
 		goto send_err;
 
-	    if (nmsg->side_effects) {
-		options = opt_data;
-		options[0].option = IPMI_CON_MSG_OPTION_SIDE_EFFECTS;
-		options[0].ival = 1;
-		options[1].option = IPMI_CON_OPTION_LIST_END;
-	    }
+	    options = cmd_options(opt_data, nmsg->side_effects, nmsg->prio);
 
 	    rspi->data1 = domain;
 	    rspi->data2 = nmsg;
@@ -2391,18 +2825,21 @@ reroute_cmds(ipmi_domain_t *domain, int old_con, int new_con)
 				     ll_rsp_handler,
 				     rspi);
 	    if (rv) {
+		ll_msg_t *followers;
+
 		ipmi_free_msg_item(rspi);
 	    send_err:
 		/* Couldn't send the message, just fail it. */
-		if (nmsg->rsp_handler) {
-		    rspi = nmsg->rsp_item;
-		    rspi->msg.netfn = nmsg->msg.netfn | 1;
-		    rspi->msg.cmd = nmsg->msg.cmd;
-		    rspi->msg.data = rspi->data;
-		    rspi->msg.data_len = 1;
-		    rspi->data[0] = IPMI_UNKNOWN_ERR_CC;
-		    deliver_rsp(domain, nmsg->rsp_handler, rspi);
-		}
+		followers = coalesce_detach(domain, nmsg);
+		rspi = nmsg->rsp_item;
+		rspi->msg.netfn = nmsg->msg.netfn | 1;
+		rspi->msg.cmd = nmsg->msg.cmd;
+		rspi->msg.data = rspi->data;
+		rspi->msg.data_len = 1;
+		rspi->data[0] = IPMI_UNKNOWN_ERR_CC;
+		deliver_coalesced(domain, followers, &rspi->msg);
+		deliver_rsp(domain, nmsg->rsp_handler, rspi);
+		record_cmd_latency(domain, nmsg);
 		rv = ilist_delete(&iter);
 		ipmi_mem_free(nmsg);
 		continue;
@@ -2423,6 +2860,78 @@ reroute_cmds(ipmi_domain_t *domain, int old_con, int new_con)
    to in a row to be considered dead. */
 #define MAX_MC_MISSED_RESPONSES 10
 
+/* Audits (presence check, bus scan and SDR check) of all the domains
+   in the process share a limited number of slots so they don't all
+   hit the buses at once.  Protected by audit_lock. */
+static ipmi_lock_t  *audit_lock;
+static unsigned int audits_running;
+static unsigned int audit_max_running = IPMI_AUDIT_MAX_RUNNING;
+
+void
+ipmi_set_max_concurrent_domain_audits(unsigned int max)
+{
+    /* This may be called before ipmi_init(), when there is nothing
+       to race with yet. */
+    if (!audit_lock) {
+	audit_max_running = max;
+	return;
+    }
+    ipmi_lock(audit_lock);
+    audit_max_running = max;
+    ipmi_unlock(audit_lock);
+}
+
+static int
+audit_get_slot(void)
+{
+    int rv = 0;
+
+    ipmi_lock(audit_lock);
+    if ((audit_max_running == 0) || (audits_running < audit_max_running)) {
+	audits_running++;
+	rv = 1;
+    }
+    ipmi_unlock(audit_lock);
+    return rv;
+}
+
+static void
+audit_put_slot(void)
+{
+    ipmi_lock(audit_lock);
+    audits_running--;
+    ipmi_unlock(audit_lock);
+}
+
+/* Must be called with the mc_lock held.  Give back the audit slot
+   once everything the audit started is done. */
+static void
+audit_check_done(ipmi_domain_t *domain)
+{
+    if (!domain->audit_running || domain->scanning_bus_count
+	|| domain->audit_sdrs_pending)
+	return;
+    domain->audit_running = 0;
+    audit_put_slot();
+}
+
+/* A time up to an eighth more or less than the given number of
+   seconds, so domains that audit together drift apart. */
+static void
+audit_jitter(ipmi_domain_t *domain, unsigned int secs, struct timeval *tv)
+{
+    unsigned long ms = secs * 1000UL;
+    unsigned long spread = ms / 4;
+    unsigned int  rnd = 0;
+
+    if (spread) {
+	domain->os_hnd->get_random(domain->os_hnd, &rnd, sizeof(rnd));
+	ms = ms - (spread / 2) + (rnd % (spread + 1));
+    }
+    tv->tv_sec = ms / 1000;
+    tv->tv_usec = (ms % 1000) * 1000;
+}
+
 void
 ipmi_domain_set_ipmb_rescan_time(ipmi_domain_t *domain, unsigned int seconds)
 {
@@ -2441,8 +2950,7 @@ ipmi_domain_set_ipmb_rescan_time(ipmi_domain_t *domain, unsigned int seconds)
 	ipmi_unlock(domain->audit_domain_timer_info->lock);
 	return;
     }
-    timeout.tv_sec = domain->audit_domain_interval;
-    timeout.tv_usec = 0;
+    audit_jitter(domain, domain->audit_domain_interval, &timeout);
     domain->os_hnd->start_timer(domain->os_hnd,
 				domain->audit_domain_timer,
 				&timeout,
@@ -2890,6 +3398,7 @@ mc_scan_done(ipmi_domain_t *domain, int err, void *cb_data)
 	return;
     }
 
+    audit_check_done(domain);
     bus_scan_handler = domain->bus_scan_handler;
     bus_scan_handler_cb_data = domain->bus_scan_handler_cb_data;
     ipmi_unlock(domain->mc_lock);
@@ -3031,6 +3540,12 @@ refetch_sdr_handler(ipmi_sdr_info_t *sdrs,
 {
     ipmi_domain_t *domain = cb_data;
 
+    /* ECANCELED also comes if the MC went away during the fetch, only
+       leave the domain alone if it is being torn down.  Its audit
+       state is cleaned up there. */
+    if (domain->cleaning_up)
+	return;
+
     if (changed) {
 	ipmi_entity_scan_sdrs(domain, NULL,
 			      domain->entities, domain->main_sdrs);
@@ -3038,13 +3553,32 @@ refetch_sdr_handler(ipmi_sdr_info_t *sdrs,
 	ipmi_detect_ents_presence_changes(domain->entities, 1);
 	i_ipmi_entities_report_sdrs_read(domain->entities);
     }
+
+    ipmi_lock(domain->mc_lock);
+    domain->audit_sdrs_pending = 0;
+    audit_check_done(domain);
+    ipmi_unlock(domain->mc_lock);
 }
 
+/* This only fetches the SDRs again if the timestamps in the
+   repository info changed. */
 static void
 check_main_sdrs(ipmi_domain_t *domain)
 {
-    if (ipmi_option_SDRs(domain))
-	ipmi_sdr_fetch(domain->main_sdrs, refetch_sdr_handler, domain);
+    int rv;
+
+    if (!ipmi_option_SDRs(domain))
+	return;
+
+    ipmi_lock(domain->mc_lock);
+    domain->audit_sdrs_pending = 1;
+    ipmi_unlock(domain->mc_lock);
+    rv = ipmi_sdr_fetch(domain->main_sdrs, refetch_sdr_handler, domain);
+    if (rv) {
+	ipmi_lock(domain->mc_lock);
+	domain->audit_sdrs_pending = 0;
+	ipmi_unlock(domain->mc_lock);
+    }
 }
 
 static void
@@ -3078,17 +3612,44 @@ domain_audit(void *cb_data, os_hnd_timer_id_t *id)
     if (! domain->connection_up)
 	goto out_start_timer;
 
-    /* Rescan all the presence sensors to make sure they are valid. */
-    ipmi_detect_domain_presence_changes(domain, 1);
+    ipmi_lock(domain->mc_lock);
+    if (domain->audit_running) {
+	/* The last one is still going, skip this one. */
+	ipmi_unlock(domain->mc_lock);
+	goto out_start_timer;
+    }
+    if (!audit_get_slot()) {
+	/* Too many domains are auditing right now, wait a bit. */
+	ipmi_unlock(domain->mc_lock);
+	if (domain->audits_deferred)
+	    ipmi_domain_stat_add(domain->audits_deferred, 1);
+	audit_jitter(domain, IPMI_AUDIT_RETRY_TIME, &timeout);
+	goto out_restart_timer;
+    }
+    domain->audit_running = 1;
+    ipmi_unlock(domain->mc_lock);
+    if (domain->audits)
+	ipmi_domain_stat_add(domain->audits, 1);
+
+    /* Rescan the presence sensors to make sure they are valid.  Every
+       so often check all of them, otherwise only the entities where
+       something happened that may have changed their presence. */
+    domain->audit_count++;
+    ipmi_detect_domain_presence_changes(domain,
+			(domain->audit_count % IPMI_AUDIT_FULL_PRESENCE) == 0);
     
     ipmi_domain_start_full_ipmb_scan(domain);
 
     /* Also check to see if the SDRs have changed. */
     check_main_sdrs(domain);
 
+    ipmi_lock(domain->mc_lock);
+    audit_check_done(domain);
+    ipmi_unlock(domain->mc_lock);
+
  out_start_timer:
-    timeout.tv_sec = domain->audit_domain_interval;
-    timeout.tv_usec = 0;
+    audit_jitter(domain, domain->audit_domain_interval, &timeout);
+ out_restart_timer:
     domain->os_hnd->start_timer(domain->os_hnd,
 				id,
 				&timeout,
@@ -3279,7 +3840,7 @@ ipmi_handle_unhandled_event(ipmi_domain_t *domain, ipmi_event_t *event)
 
     info.domain = domain;
     info.event = event;
-    locked_list_iterate(domain->event_handlers, call_event_handler, &info);
+    locked_array_iterate(domain->event_handlers, call_event_handler, &info);
 }
 
 int
@@ -3289,7 +3850,7 @@ ipmi_domain_add_event_handler(ipmi_domain_t           *domain,
 {
     CHECK_DOMAIN_LOCK(domain);
 
-    if (locked_list_add(domain->event_handlers, handler, cb_data))
+    if (locked_array_add(domain->event_handlers, handler, cb_data))
 	return 0;
     else
 	return ENOMEM;
@@ -3302,7 +3863,7 @@ ipmi_domain_remove_event_handler(ipmi_domain_t           *domain,
 {
     CHECK_DOMAIN_LOCK(domain);
 
-    if (locked_list_remove(domain->event_handlers, handler, cb_data))
+    if (locked_array_remove(domain->event_handlers, handler, cb_data))
 	return 0;
     else
 	return EINVAL;
@@ -3334,8 +3895,8 @@ call_event_handler_cl_handlers(ipmi_domain_t         *domain,
 
     info.handler = handler;
     info.handler_data = handler_data;
-    locked_list_iterate(domain->event_handlers_cl, iterate_event_handler_cl,
-			&info);
+    locked_array_iterate(domain->event_handlers_cl, iterate_event_handler_cl,
+			 &info);
 }
 
 int
@@ -3345,7 +3906,7 @@ ipmi_domain_add_event_handler_cl(ipmi_domain_t            *domain,
 {
     CHECK_DOMAIN_LOCK(domain);
 
-    if (locked_list_add(domain->event_handlers_cl, handler, cb_data))
+    if (locked_array_add(domain->event_handlers_cl, handler, cb_data))
 	return 0;
     else
 	return ENOMEM;
@@ -3358,7 +3919,7 @@ ipmi_domain_remove_event_handler_cl(ipmi_domain_t            *domain,
 {
     CHECK_DOMAIN_LOCK(domain);
 
-    if (locked_list_remove(domain->event_handlers_cl, handler, cb_data))
+    if (locked_array_remove(domain->event_handlers_cl, handler, cb_data))
 	return 0;
     else
 	return EINVAL;
@@ -4573,6 +5134,7 @@ con_up_complete(ipmi_domain_t *domain)
 
     ipmi_domain_start_full_ipmb_scan(domain);
 
+    i_ipmi_entities_presence_stale(domain->entities);
     ipmi_detect_ents_presence_changes(domain->entities, 1);
 
     ipmi_entity_scan_sdrs(domain, NULL, domain->entities, domain->main_sdrs);
@@ -6077,12 +6639,25 @@ ipmi_domain_id_find_attribute(ipmi_domain_id_t   domain_id,
  *
  **********************************************************************/
 
+/*
+ * The counts are updated with atomic operations and without the stat
+ * lock, since they are bumped for every message.  The lock protects
+ * the refcount and the linked counter.
+ *
+ * A connection may link one of its own counters to a stat (see
+ * con_register_counter()), then it just bumps its counter and the
+ * value is read from there when somebody asks for it.  ext_base is
+ * the value of the external counter at the last zero.
+ */
 struct ipmi_domain_stat_s
 {
     char               *name;
     char               *instance;
     ipmi_lock_t        *lock;
-    unsigned int       count;
+    unsigned long      count;
+    unsigned long      *ext;
+    unsigned long      ext_base;
+    ipmi_stat_hist_t   *hist;
     ipmi_domain_stat_t *stat;
     unsigned int       refcount;
 };
@@ -6121,11 +6696,12 @@ domain_stat_cmp(void *cb_data, void *item1, void *item2)
     return LOCKED_LIST_ITER_CONTINUE;
 }
 
-int
-ipmi_domain_stat_register(ipmi_domain_t      *domain,
-			  const char         *name,
-			  const char         *instance,
-			  ipmi_domain_stat_t **stat)
+static int
+domain_stat_register(ipmi_domain_t      *domain,
+		     const char         *name,
+		     const char         *instance,
+		     int                is_hist,
+		     ipmi_domain_stat_t **stat)
 {
     ipmi_domain_stat_t  *val = NULL;
     domain_stat_cmp_t   info;
@@ -6138,6 +6714,11 @@ ipmi_domain_stat_register(ipmi_domain_t      *domain,
     locked_list_lock(domain->stats);
     locked_list_iterate_nolock(domain->stats, domain_stat_cmp, &info);
     if (info.stat) {
+	if (is_hist != (info.stat->hist != NULL)) {
+	    /* Can't change the type of an existing statistic. */
+	    rv = EINVAL;
+	    goto out_unlock;
+	}
 	ipmi_lock(info.stat->lock);
 	info.stat->refcount++;
 	ipmi_unlock(info.stat->lock);
@@ -6150,50 +6731,77 @@ ipmi_domain_stat_register(ipmi_domain_t      *domain,
 	rv = ENOMEM;
 	goto out_unlock;
     }
+    memset(val, 0, sizeof(*val));
+
+    if (is_hist) {
+	val->hist = ipmi_mem_alloc(sizeof(*val->hist));
+	if (!val->hist) {
+	    rv = ENOMEM;
+	    goto out_free;
+	}
+	memset(val->hist, 0, sizeof(*val->hist));
+    }
 
     val->name = ipmi_strdup(name);
     if (!val->name) {
-	ipmi_mem_free(val);
 	rv = ENOMEM;
-	goto out_unlock;
+	goto out_free;
     }
 
     val->instance = ipmi_strdup(instance);
     if (!val->instance) {
-	ipmi_mem_free(val->name);
-	ipmi_mem_free(val);
 	rv = ENOMEM;
-	goto out_unlock;
+	goto out_free;
     }
 
     entry = locked_list_alloc_entry();
     if (!entry) {
-	ipmi_mem_free(val->instance);
-	ipmi_mem_free(val->name);
-	ipmi_mem_free(val);
 	rv = ENOMEM;
-	goto out_unlock;
+	goto out_free;
     }
 
     rv = ipmi_create_lock(domain, &val->lock);
     if (rv) {
 	locked_list_free_entry(entry);
-	ipmi_mem_free(val->instance);
-	ipmi_mem_free(val->name);
-	ipmi_mem_free(val);
-	goto out_unlock;
+	goto out_free;
     }
 
     val->refcount = 2;
-    val->count = 0;
 
     locked_list_add_entry_nolock(domain->stats, val, NULL, entry);
 
     *stat = val;
+    goto out_unlock;
 
+ out_free:
+    if (val->instance)
+	ipmi_mem_free(val->instance);
+    if (val->name)
+	ipmi_mem_free(val->name);
+    if (val->hist)
+	ipmi_mem_free(val->hist);
+    ipmi_mem_free(val);
  out_unlock:    
     locked_list_unlock(domain->stats);
-    return 0;
+    return rv;
+}
+
+int
+ipmi_domain_stat_register(ipmi_domain_t      *domain,
+			  const char         *name,
+			  const char         *instance,
+			  ipmi_domain_stat_t **stat)
+{
+    return domain_stat_register(domain, name, instance, 0, stat);
+}
+
+int
+ipmi_domain_stat_register_hist(ipmi_domain_t      *domain,
+			       const char         *name,
+			       const char         *instance,
+			       ipmi_domain_stat_t **stat)
+{
+    return domain_stat_register(domain, name, instance, 1, stat);
 }
 
 int
@@ -6233,38 +6841,103 @@ ipmi_domain_stat_put(ipmi_domain_stat_t *stat)
     }
     ipmi_unlock(stat->lock);
     ipmi_destroy_lock(stat->lock);
+    if (stat->hist)
+	ipmi_mem_free(stat->hist);
     ipmi_mem_free(stat->name);
     ipmi_mem_free(stat->instance);
     ipmi_mem_free(stat);
 }
 
+static int
+domain_stat_link(ipmi_domain_stat_t *stat, unsigned long *counter)
+{
+    int rv = 0;
+
+    ipmi_lock(stat->lock);
+    if (stat->ext || stat->hist)
+	/* Somebody else already owns it, they will have to push. */
+	rv = EBUSY;
+    else {
+	stat->ext = counter;
+	stat->ext_base = ipmi_stat_atomic_load(counter);
+    }
+    ipmi_unlock(stat->lock);
+    return rv;
+}
+
+static void
+domain_stat_unlink(ipmi_domain_stat_t *stat, unsigned long *counter)
+{
+    ipmi_lock(stat->lock);
+    if (stat->ext == counter) {
+	/* Keep what was counted so far in the stat itself. */
+	ipmi_stat_atomic_add(&stat->count,
+			     ipmi_stat_atomic_load(counter) - stat->ext_base);
+	stat->ext = NULL;
+    }
+    ipmi_unlock(stat->lock);
+}
+
 void
 ipmi_domain_stat_add(ipmi_domain_stat_t *stat, int amount)
 {
+    if (stat->hist) {
+	/* A histogram only counts samples, a negative one is meaningless. */
+	if (amount >= 0)
+	    ipmi_stat_hist_add(stat->hist, amount);
+	return;
+    }
+    ipmi_stat_atomic_add(&stat->count, (unsigned long) (long) amount);
+}
+
+void
+ipmi_domain_stat_add_sample(ipmi_domain_stat_t *stat, unsigned long value)
+{
+    if (stat->hist)
+	ipmi_stat_hist_add(stat->hist, value);
+    else
+	ipmi_stat_atomic_add(&stat->count, value);
+}
+
+static unsigned long
+domain_stat_value(ipmi_domain_stat_t *stat, int zero)
+{
+    unsigned long    rv, cur;
+    ipmi_stat_hist_t snap;
+
+    if (stat->hist) {
+	/* Zeroing has to take the whole histogram, not just the count. */
+	ipmi_stat_hist_snapshot(stat->hist, &snap, zero);
+	return snap.count;
+    }
+
+    if (zero)
+	rv = ipmi_stat_atomic_xchg(&stat->count, 0);
+    else
+	rv = ipmi_stat_atomic_load(&stat->count);
+
+    /* The lock is only needed to keep the external counter around. */
     ipmi_lock(stat->lock);
-    stat->count += amount;
+    if (stat->ext) {
+	cur = ipmi_stat_atomic_load(stat->ext);
+	rv += cur - stat->ext_base;
+	if (zero)
+	    stat->ext_base = cur;
+    }
     ipmi_unlock(stat->lock);
+    return rv;
 }
 
 unsigned int
 ipmi_domain_stat_get(ipmi_domain_stat_t *stat)
 {
-    unsigned int rv;
-    ipmi_lock(stat->lock);
-    rv = stat->count;
-    ipmi_unlock(stat->lock);
-    return rv;
+    return domain_stat_value(stat, 0);
 }
 
 unsigned int
 ipmi_domain_stat_get_and_zero(ipmi_domain_stat_t *stat)
 {
-    unsigned int rv;
-    ipmi_lock(stat->lock);
-    rv = stat->count;
-    stat->count = 0;
-    ipmi_unlock(stat->lock);
-    return rv;
+    return domain_stat_value(stat, 1);
 }
 
 const char *
@@ -6279,6 +6952,217 @@ ipmi_domain_stat_get_instance(ipmi_domain_stat_t *stat)
     return stat->instance;
 }
 
+/*
+ * Snapshots.  These copy all the matching statistics at once, so the
+ * user can print or process them without holding anything.
+ */
+typedef struct domain_stats_snap_ent_s
+{
+    char             *name;
+    char             *instance;
+    unsigned long    value;
+    int              is_hist;
+    ipmi_stat_hist_t hist;
+} domain_stats_snap_ent_t;
+
+struct ipmi_domain_stats_snap_s
+{
+    unsigned int            count;
+    domain_stats_snap_ent_t *ents;
+};
+
+typedef struct domain_stats_snap_info_s
+{
+    const char               *name;
+    const char               *instance;
+    int                      zero;
+    unsigned int             count;
+    ipmi_domain_stats_snap_t *snap;
+    int                      rv;
+} domain_stats_snap_info_t;
+
+static int
+domain_stats_snap_match(domain_stats_snap_info_t *info,
+			ipmi_domain_stat_t       *stat)
+{
+    if (info->name && (strcmp(info->name, stat->name) != 0))
+	return 0;
+    if (info->instance && (strcmp(info->instance, stat->instance) != 0))
+	return 0;
+    return 1;
+}
+
+static int
+domain_stats_snap_count(void *cb_data, void *item1, void *item2)
+{
+    domain_stats_snap_info_t *info = cb_data;
+
+    if (domain_stats_snap_match(info, item1))
+	info->count++;
+    return LOCKED_LIST_ITER_CONTINUE;
+}
+
+static int
+domain_stats_snap_copy(void *cb_data, void *item1, void *item2)
+{
+    domain_stats_snap_info_t *info = cb_data;
+    ipmi_domain_stat_t       *stat = item1;
+    ipmi_domain_stats_snap_t *snap = info->snap;
+    domain_stats_snap_ent_t  *ent;
+
+    if (!domain_stats_snap_match(info, stat))
+	return LOCKED_LIST_ITER_CONTINUE;
+
+    ent = &snap->ents[snap->count];
+    ent->name = ipmi_strdup(stat->name);
+    ent->instance = ipmi_strdup(stat->instance);
+    if (!ent->name || !ent->instance) {
+	if (ent->name)
+	    ipmi_mem_free(ent->name);
+	if (ent->instance)
+	    ipmi_mem_free(ent->instance);
+	info->rv = ENOMEM;
+	return LOCKED_LIST_ITER_STOP;
+    }
+    if (stat->hist) {
+	ent->is_hist = 1;
+	ipmi_stat_hist_snapshot(stat->hist, &ent->hist, info->zero);
+	ent->value = ent->hist.count;
+    } else
+	ent->value = domain_stat_value(stat, info->zero);
+    snap->count++;
+    return LOCKED_LIST_ITER_CONTINUE;
+}
+
+int
+ipmi_domain_stats_snapshot(ipmi_domain_t            *domain,
+			   const char               *name,
+			   const char               *instance,
+			   int                      zero,
+			   ipmi_domain_stats_snap_t **rsnap)
+{
+    domain_stats_snap_info_t info;
+    ipmi_domain_stats_snap_t *snap;
+
+    snap = ipmi_mem_alloc(sizeof(*snap));
+    if (!snap)
+	return ENOMEM;
+    memset(snap, 0, sizeof(*snap));
+
+    info.name = name;
+    info.instance = instance;
+    info.zero = zero;
+    info.count = 0;
+    info.snap = snap;
+    info.rv = 0;
+
+    /* Hold the list lock so the set of stats can't change between
+       counting and copying. */
+    locked_list_lock(domain->stats);
+    locked_list_iterate_nolock(domain->stats, domain_stats_snap_count, &info);
+    if (info.count) {
+	snap->ents = ipmi_mem_alloc(sizeof(*snap->ents) * info.count);
+	if (!snap->ents)
+	    info.rv = ENOMEM;
+	else {
+	    memset(snap->ents, 0, sizeof(*snap->ents) * info.count);
+	    locked_list_iterate_nolock(domain->stats, domain_stats_snap_copy,
+				       &info);
+	}
+    }
+    locked_list_unlock(domain->stats);
+
+    if (info.rv) {
+	ipmi_domain_stats_snap_free(snap);
+	return info.rv;
+    }
+
+    *rsnap = snap;
+    return 0;
+}
+
+void
+ipmi_domain_stats_snap_free(ipmi_domain_stats_snap_t *snap)
+{
+    unsigned int i;
+
+    for (i=0; i<snap->count; i++) {
+	ipmi_mem_free(snap->ents[i].name);
+	ipmi_mem_free(snap->ents[i].instance);
+    }
+    if (snap->ents)
+	ipmi_mem_free(snap->ents);
+    ipmi_mem_free(snap);
+}
+
+unsigned int
+ipmi_domain_stats_snap_count(ipmi_domain_stats_snap_t *snap)
+{
+    return snap->count;
+}
+
+const char *
+ipmi_domain_stats_snap_name(ipmi_domain_stats_snap_t *snap, unsigned int idx)
+{
+    if (idx >= snap->count)
+	return NULL;
+    return snap->ents[idx].name;
+}
+
+const char *
+ipmi_domain_stats_snap_instance(ipmi_domain_stats_snap_t *snap,
+				unsigned int             idx)
+{
+    if (idx >= snap->count)
+	return NULL;
+    return snap->ents[idx].instance;
+}
+
+unsigned long
+ipmi_domain_stats_snap_value(ipmi_domain_stats_snap_t *snap, unsigned int idx)
+{
+    if (idx >= snap->count)
+	return 0;
+    return snap->ents[idx].value;
+}
+
+int
+ipmi_domain_stats_snap_is_hist(ipmi_domain_stats_snap_t *snap,
+			       unsigned int             idx)
+{
+    if (idx >= snap->count)
+	return 0;
+    return snap->ents[idx].is_hist;
+}
+
+unsigned long
+ipmi_domain_stats_snap_hist_sum(ipmi_domain_stats_snap_t *snap,
+				unsigned int             idx)
+{
+    if (idx >= snap->count)
+	return 0;
+    return snap->ents[idx].hist.sum;
+}
+
+unsigned long
+ipmi_domain_stats_snap_hist_max(ipmi_domain_stats_snap_t *snap,
+				unsigned int             idx)
+{
+    if (idx >= snap->count)
+	return 0;
+    return snap->ents[idx].hist.max;
+}
+
+unsigned long
+ipmi_domain_stats_snap_hist_percentile(ipmi_domain_stats_snap_t *snap,
+				       unsigned int             idx,
+				       unsigned int             pct)
+{
+    if (idx >= snap->count)
+	return 0;
+    return ipmi_stat_hist_percentile(&snap->ents[idx].hist, pct);
+}
+
 typedef struct stat_iterate_s
 {
     ipmi_domain_t *domain;
@@ -6388,6 +7272,19 @@ i_ipmi_domain_init(void)
 	return rv;
     }
 
+    rv = ipmi_create_global_lock(&audit_lock);
+    if (rv) {
+	locked_list_destroy(mc_oem_handlers);
+	locked_list_destroy(domain_change_handlers);
+	locked_list_destroy(domains_list);
+	domains_list = NULL;
+	free_ilist(oem_handlers);
+	oem_handlers = NULL;
+	ipmi_destroy_lock(domains_lock);
+	domains_lock = NULL;
+	return rv;
+    }
+
     domains_initialized = 1;
 
     return 0;
@@ -6409,6 +7306,8 @@ i_ipmi_domain_shutdown(void)
     oem_handlers = NULL;
     ipmi_destroy_lock(domains_lock);
     domains_lock = NULL;
+    ipmi_destroy_lock(audit_lock);
+    audit_lock = NULL;
 }
 
 
@@ -57,6 +57,14 @@
 
 #define ENTITY_ID_LEN 32
 
+/* A forced presence check skips entities whose presence was found out
+   less than this many seconds ago.  If it came from a presence sensor
+   that sends events, the events keep it up to date, so it is trusted
+   much longer.  Not across a reconnect, though, events may have been
+   lost while the connection was down. */
+#define IPMI_PRESENCE_FRESH_TIME	10
+#define IPMI_PRESENCE_EVENT_TRUST_TIME	1800
+
 /* Uniquely identifies a device in the system.  If all the values are
    zero, then it is not used (it's in the system-relative range). */
 typedef struct ipmi_device_num_s
@@ -221,6 +229,13 @@ struct ipmi_entity_s
     int           presence_possibly_changed;
     unsigned int  presence_event_count; /* Changed when presence
 					   events are reported. */
+
+    /* When the presence was last found out, by a check or an event.
+       presence_events is set if the presence (bit) sensor sends
+       events. */
+    int            presence_known;
+    struct timeval presence_updated;
+    int            presence_events;
     /* Only allow one presence check at a time. */
     int           in_presence_check;
 
@@ -324,6 +339,11 @@ struct ipmi_entity_info_s
     ipmi_domain_t         *domain;
     ipmi_domain_id_t      domain_id;
     locked_list_t         *entities;
+
+    /* Presence checks done, and ones skipped because the presence
+       was still fresh. */
+    ipmi_domain_stat_t    *presence_probes;
+    ipmi_domain_stat_t    *presence_probes_avoided;
 };
 
 #define ent_lock(e) ipmi_lock(e->elock)
@@ -466,6 +486,15 @@ ipmi_entity_info_alloc(ipmi_domain_t *domain, ipmi_entity_info_t **new_info)
 	return ENOMEM;
     }
 
+    ents->presence_probes = NULL;
+    ents->presence_probes_avoided = NULL;
+    ipmi_domain_stat_register(domain, "entity_presence_probes",
+			      i_ipmi_domain_name(domain),
+			      &ents->presence_probes);
+    ipmi_domain_stat_register(domain, "entity_presence_probes_avoided",
+			      i_ipmi_domain_name(domain),
+			      &ents->presence_probes_avoided);
+
     *new_info = ents;
 
     return 0;
@@ -842,6 +871,10 @@ ipmi_entity_info_destroy(ipmi_entity_info_t *ents)
     locked_list_destroy(ents->update_cl_handlers);
     locked_list_iterate(ents->entities, destroy_entity, NULL);
     locked_list_destroy(ents->entities);
+    if (ents->presence_probes)
+	ipmi_domain_stat_put(ents->presence_probes);
+    if (ents->presence_probes_avoided)
+	ipmi_domain_stat_put(ents->presence_probes_avoided);
     ipmi_mem_free(ents);
     return 0;
 }
@@ -1866,6 +1899,9 @@ presence_changed(ipmi_entity_t *ent, int present)
     int           entity_fru_fetch = 0;
 
     ent->presence_event_count++;
+    ent->presence_known = 1;
+    ipmi_domain_get_os_hnd(domain)->get_monotonic_time
+	(ipmi_domain_get_os_hnd(domain), &ent->presence_updated);
 
     if (present != ent->curr_present) {
 	ent->curr_present = present;
@@ -2548,6 +2584,28 @@ ipmi_entity_detector_done(ipmi_entity_t *entity,
     presence_finalize(entity, "entity_detector_done");
 }
   
+/* Must be called with the entity lock held.  Is the presence we
+   have recent enough that a forced check doesn't need to ask? */
+static int
+presence_is_fresh(ipmi_entity_t *ent)
+{
+    os_handler_t   *os_hnd = ipmi_domain_get_os_hnd(ent->domain);
+    struct timeval now;
+    long           limit;
+
+    if (!ent->presence_known)
+	return 0;
+
+    if (!ent->detect_presence && ent->presence_events
+	&& (ent->presence_sensor || ent->presence_bit_sensor))
+	limit = IPMI_PRESENCE_EVENT_TRUST_TIME;
+    else
+	limit = IPMI_PRESENCE_FRESH_TIME;
+
+    os_hnd->get_monotonic_time(os_hnd, &now);
+    return (now.tv_sec - ent->presence_updated.tv_sec) < limit;
+}
+
 static void
 ent_detect_presence_nolock(ipmi_entity_t *ent, void *cb_data)
 {
@@ -2557,6 +2615,15 @@ ent_detect_presence_nolock(ipmi_entity_t *ent, void *cb_data)
     if (ent->in_presence_check
 		|| ((!info->force) && (! ent->presence_possibly_changed)))
 	return;
+    if (!ent->presence_possibly_changed && presence_is_fresh(ent)) {
+	/* Nothing happened to it and we know its presence, don't
+	   bother asking again. */
+	if (ent->ents->presence_probes_avoided)
+	    ipmi_domain_stat_add(ent->ents->presence_probes_avoided, 1);
+	return;
+    }
+    if (ent->ents->presence_probes)
+	ipmi_domain_stat_add(ent->ents->presence_probes, 1);
     ent->presence_possibly_changed = 0;
     ent->in_presence_check = 1;
 
@@ -2646,9 +2713,10 @@ entity_mc_active(ipmi_mc_t *mc, int active, void *cb_data)
 	if (ent_use_frudev_for_presence(ent)) {
 	    ent_detect_info_t info;
 
+	    ent->presence_possibly_changed = 1;
 	    ent_unlock(ent);
 	    i_ipmi_domain_entity_unlock(ent->domain);
-	    info.force = 1;
+	    info.force = 0;
 	    ent_detect_presence(ent, &info);
 	    goto do_put;
 	}
@@ -2690,6 +2758,7 @@ handle_new_presence_sensor(ipmi_entity_t *ent, ipmi_sensor_t *sensor)
 	ent->presence_bit_offset = 0;
 
     event_support = ipmi_sensor_get_event_support(sensor);
+    ent->presence_events = event_support != IPMI_EVENT_SUPPORT_NONE;
 
     /* Add our own event handler. */
     ipmi_sensor_add_discrete_event_handler(sensor,
@@ -2753,6 +2822,7 @@ handle_new_presence_bit_sensor(ipmi_entity_t *ent, ipmi_sensor_t *sensor,
     ent->presence_bit_sensor_id = ipmi_sensor_convert_to_id(sensor);
 
     event_support = ipmi_sensor_get_event_support(sensor);
+    ent->presence_events = event_support != IPMI_EVENT_SUPPORT_NONE;
 
     /* Add our own event handler. */
     ipmi_sensor_add_discrete_event_handler(sensor,
@@ -2891,6 +2961,20 @@ i_ipmi_entities_report_mcs_scanned(ipmi_entity_info_t *ents)
     ipmi_entities_iterate_entities(ents, report_mcs_scanned_check, NULL);
 }
 
+static void
+presence_stale(ipmi_entity_t *ent, void *cb_data)
+{
+    ent_lock(ent);
+    ent->presence_possibly_changed = 1;
+    ent_unlock(ent);
+}
+
+void
+i_ipmi_entities_presence_stale(ipmi_entity_info_t *ents)
+{
+    ipmi_entities_iterate_entities(ents, presence_stale, NULL);
+}
+
 /***********************************************************************
  *
  * Handling of sensor and control addition and removal.
@@ -3224,7 +3308,7 @@ ipmi_entity_add_sensor(ipmi_entity_t *ent,
     }
     ent_unlock(ent);
 
-    locked_list_add_entry(ent->sensors, sensor, NULL, link);
+    locked_list_add_embedded(ent->sensors, sensor, NULL, link);
 	
     ent->presence_possibly_changed = 1;
 }
@@ -3346,7 +3430,7 @@ ipmi_entity_add_control(ipmi_entity_t  *ent,
 	handle_new_hot_swap_indicator(ent, control);
     ent_unlock(ent);
 
-    locked_list_add_entry(ent->controls, control, NULL, link);
+    locked_list_add_embedded(ent->controls, control, NULL, link);
     ent->presence_possibly_changed = 1;
 }
 
@@ -4152,11 +4236,6 @@ cmp_dlr_qsort(const void *a, const void *b)
     return cmp_dlr(d1, d2);
 }
 
-struct locked_list_entry_s
-{
-    locked_list_entry_t *next;
-};
-
 int
 ipmi_entity_scan_sdrs(ipmi_domain_t      *domain,
 		      ipmi_mc_t          *mc,
@@ -55,6 +55,31 @@ struct ipmi_event_s
     unsigned char data[0];
 };
 
+/* Events from the SEL and the event receiver have 16 bytes of data at
+   most, bigger ones go to the general allocator. */
+#define EVENT_CACHE_DATA_LEN 16
+
+static ipmi_mem_cache_t event_cache =
+    IPMI_MEM_CACHE_INIT("ipmi_event",
+			sizeof(ipmi_event_t) + EVENT_CACHE_DATA_LEN);
+
+static ipmi_event_t *
+event_mem_alloc(unsigned int data_len)
+{
+    if (data_len <= EVENT_CACHE_DATA_LEN)
+	return ipmi_mem_cache_alloc(&event_cache);
+    return ipmi_mem_alloc(sizeof(ipmi_event_t) + data_len);
+}
+
+static void
+event_mem_free(ipmi_event_t *event)
+{
+    if (event->data_len <= EVENT_CACHE_DATA_LEN)
+	ipmi_mem_cache_free(&event_cache, event);
+    else
+	ipmi_mem_free(event);
+}
+
 ipmi_event_t *
 ipmi_event_alloc(ipmi_mcid_t   mcid,
 		 unsigned int  record_id,
@@ -65,19 +90,19 @@ ipmi_event_alloc(ipmi_mcid_t   mcid,
 {
     ipmi_event_t *rv;
 
-    rv = ipmi_mem_alloc(sizeof(ipmi_event_t) + data_len);
+    rv = event_mem_alloc(data_len);
     if (!rv)
 	return NULL;
 
+    rv->data_len = data_len;
     if (ipmi_create_global_lock(&rv->lock)) {
-	ipmi_mem_free(rv);
+	event_mem_free(rv);
 	return NULL;
     }
     rv->mcid = mcid;
     rv->record_id = record_id;
     rv->type = type;
     rv->timestamp = timestamp;
-    rv->data_len = data_len;
     rv->old = 0;
     if (data_len)
 	memcpy(rv->data, data, data_len);
@@ -107,7 +132,7 @@ ipmi_event_free(ipmi_event_t *event)
     if (event->refcount == 0) {
 	ipmi_unlock(event->lock);
 	ipmi_destroy_lock(event->lock);
-	ipmi_mem_free(event);
+	event_mem_free(event);
 	return;
     }
     ipmi_unlock(event->lock);
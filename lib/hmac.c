@@ -37,31 +37,133 @@
 
 #include <errno.h>
 #include <string.h>
-#include <openssl/hmac.h>
+#include <openssl/evp.h>
 #include <OpenIPMI/ipmi_lan.h>
 #include <OpenIPMI/internal/ipmi_malloc.h>
+#include <OpenIPMI/internal/ipmi_locks.h>
 
+#define HMAC_MAX_BLOCK 128
+
+/*
+ * The keyed part of an HMAC (the hash of the key XOR ipad and of the
+ * key XOR opad) is the same for every packet in a session, so it is
+ * computed once when the session comes up and kept in ictx and octx.
+ * Each packet then only copies those states into a work context and
+ * hashes the message itself.  Sending and receiving have their own
+ * work context and lock so they do not contend with each other.
+ */
 typedef struct hmac_info_s
 {
-    const EVP_MD *evp_md;
-    unsigned int  klen;
     unsigned int  ilen;
-    unsigned char k[20];
+    EVP_MD_CTX    *ictx;
+    EVP_MD_CTX    *octx;
+
+    ipmi_lock_t   *add_lock;
+    EVP_MD_CTX    *add_ctx;
+    ipmi_lock_t   *check_lock;
+    EVP_MD_CTX    *check_ctx;
 } hmac_info_t;
 
+static void
+hmac_free(ipmi_con_t *ipmi,
+	  void       *integ_data)
+{
+    hmac_info_t *info = integ_data;
+
+    if (info->ictx)
+	EVP_MD_CTX_free(info->ictx);
+    if (info->octx)
+	EVP_MD_CTX_free(info->octx);
+    if (info->add_ctx)
+	EVP_MD_CTX_free(info->add_ctx);
+    if (info->check_ctx)
+	EVP_MD_CTX_free(info->check_ctx);
+    if (info->add_lock)
+	ipmi_destroy_lock(info->add_lock);
+    if (info->check_lock)
+	ipmi_destroy_lock(info->check_lock);
+    ipmi_mem_free(info);
+}
+
+static int
+hmac_key_ctx(EVP_MD_CTX          *ctx,
+	     const EVP_MD        *evp_md,
+	     const unsigned char *k,
+	     unsigned int        klen,
+	     unsigned char       padval)
+{
+    unsigned char pad[HMAC_MAX_BLOCK];
+    unsigned int  blen = EVP_MD_block_size(evp_md);
+    unsigned int  i;
+    int           ok;
+
+    memset(pad, padval, blen);
+    for (i=0; i<klen; i++)
+	pad[i] ^= k[i];
+    ok = (EVP_DigestInit_ex(ctx, evp_md, NULL)
+	  && EVP_DigestUpdate(ctx, pad, blen));
+    memset(pad, 0, sizeof(pad));
+    return ok ? 0 : ENOMEM;
+}
+
+static int
+hmac_info_alloc(ipmi_con_t          *ipmi,
+		const EVP_MD        *evp_md,
+		const unsigned char *k,
+		unsigned int        klen,
+		unsigned int        ilen,
+		void                **integ_data)
+{
+    hmac_info_t *info;
+    int         rv;
+
+    if (klen > (unsigned int) EVP_MD_block_size(evp_md))
+	return EINVAL;
+
+    info = ipmi_mem_alloc(sizeof(*info));
+    if (!info)
+	return ENOMEM;
+    memset(info, 0, sizeof(*info));
+    info->ilen = ilen;
+
+    rv = ipmi_create_lock_os_hnd(ipmi->os_hnd, &info->add_lock);
+    if (rv)
+	goto out_err;
+    rv = ipmi_create_lock_os_hnd(ipmi->os_hnd, &info->check_lock);
+    if (rv)
+	goto out_err;
+
+    rv = ENOMEM;
+    info->ictx = EVP_MD_CTX_new();
+    info->octx = EVP_MD_CTX_new();
+    info->add_ctx = EVP_MD_CTX_new();
+    info->check_ctx = EVP_MD_CTX_new();
+    if (!info->ictx || !info->octx || !info->add_ctx || !info->check_ctx)
+	goto out_err;
+
+    rv = hmac_key_ctx(info->ictx, evp_md, k, klen, 0x36);
+    if (rv)
+	goto out_err;
+    rv = hmac_key_ctx(info->octx, evp_md, k, klen, 0x5c);
+    if (rv)
+	goto out_err;
+
+    *integ_data = info;
+    return 0;
+
+ out_err:
+    hmac_free(ipmi, info);
+    return rv;
+}
+
 static int
 hmac_sha1_init(ipmi_con_t       *ipmi,
 	       ipmi_rmcpp_auth_t *ainfo,
 	       void             **integ_data)
 {
-    hmac_info_t         *info;
     const unsigned char *k;
     unsigned int        klen;
 
-    info = ipmi_mem_alloc(sizeof(*info));
-    if (!info)
-	return ENOMEM;
-
     if (ipmi_rmcpp_auth_get_sik_len(ainfo) < 20)
 	return EINVAL;
 
@@ -72,13 +174,7 @@ hmac_sha1_init(ipmi_con_t       *ipmi,
     if (klen < 20)
 	return EINVAL;
 
-    memcpy(info->k, k, 20);
-    info->klen = 20;
-    info->ilen = 12;
-
-    info->evp_md = EVP_sha1();
-    *integ_data = info;
-    return 0;
+    return hmac_info_alloc(ipmi, EVP_sha1(), k, 20, 12, integ_data);
 }
 
 static int
@@ -86,14 +182,9 @@ hmac_md5_init(ipmi_con_t       *ipmi,
 	      ipmi_rmcpp_auth_t *ainfo,
 	      void             **integ_data)
 {
-    hmac_info_t         *info;
     const unsigned char *k;
     unsigned int        klen;
 
-    info = ipmi_mem_alloc(sizeof(*info));
-    if (!info)
-	return ENOMEM;
-
     if (ipmi_rmcpp_auth_get_sik_len(ainfo) < 16)
 	return EINVAL;
 
@@ -101,23 +192,29 @@ hmac_md5_init(ipmi_con_t       *ipmi,
     if (klen < 16)
 	return EINVAL;
 
-    memcpy(info->k, k, 16);
-    info->klen = 16;
-    info->ilen = 16;
-
-    info->evp_md = EVP_md5();
-    *integ_data = info;
-    return 0;
+    return hmac_info_alloc(ipmi, EVP_md5(), k, 16, 16, integ_data);
 }
 
-static void
-hmac_free(ipmi_con_t *ipmi,
-	  void       *integ_data)
+/* Compute the HMAC of the data into integ using the given work
+   context, which the caller must hold the lock for. */
+static int
+hmac_calc(hmac_info_t         *info,
+	  EVP_MD_CTX          *ctx,
+	  const unsigned char *data,
+	  unsigned int        len,
+	  unsigned char       *integ)
 {
-    hmac_info_t *info = integ_data;
+    unsigned char inner[EVP_MAX_MD_SIZE];
+    unsigned int  ilen;
 
-    memset(info->k, 0, sizeof(info->k));
-    ipmi_mem_free(integ_data);
+    if (!EVP_MD_CTX_copy_ex(ctx, info->ictx)
+	|| !EVP_DigestUpdate(ctx, data, len)
+	|| !EVP_DigestFinal_ex(ctx, inner, &ilen)
+	|| !EVP_MD_CTX_copy_ex(ctx, info->octx)
+	|| !EVP_DigestUpdate(ctx, inner, ilen)
+	|| !EVP_DigestFinal_ex(ctx, integ, &ilen))
+	return ENOMEM;
+    return 0;
 }
 
 static int
@@ -161,8 +258,8 @@ hmac_add(ipmi_con_t    *ipmi,
     hmac_info_t   *info = integ_data;
     unsigned char *p = payload;
     unsigned int  l = *payload_len;
-    unsigned int  ilen;
-    unsigned char integ[20];
+    unsigned char integ[EVP_MAX_MD_SIZE];
+    int           rv;
 
     if (l+info->ilen+1 > max_payload_len)
 	return E2BIG;
@@ -173,8 +270,12 @@ hmac_add(ipmi_con_t    *ipmi,
     p[l] = 0x07; /* Add the next header */
     l++;
 
-    HMAC(info->evp_md, info->k, info->klen, p+4, l-4, integ, &ilen);
-    memcpy(p+l, integ, ilen);
+    ipmi_lock(info->add_lock);
+    rv = hmac_calc(info, info->add_ctx, p+4, l-4, integ);
+    ipmi_unlock(info->add_lock);
+    if (rv)
+	return rv;
+    memcpy(p+l, integ, info->ilen);
     l += info->ilen;
 
     *payload_len = l;
@@ -191,8 +292,8 @@ hmac_check(ipmi_con_t    *ipmi,
     hmac_info_t   *info = integ_data;
     unsigned char *p = payload;
     unsigned int  l = payload_len;
-    unsigned int  ilen;
-    unsigned char new_integ[20];
+    unsigned char new_integ[EVP_MAX_MD_SIZE];
+    int           rv;
 
     /* We don't authenticate this part of the header. */
     p += 4;
@@ -203,7 +304,11 @@ hmac_check(ipmi_con_t    *ipmi,
 
     /* We add 1 to the length because we also check the next header
        field. */
-    HMAC(info->evp_md, info->k, info->klen, p, l+1, new_integ, &ilen);
+    ipmi_lock(info->check_lock);
+    rv = hmac_calc(info, info->check_ctx, p, l+1, new_integ);
+    ipmi_unlock(info->check_lock);
+    if (rv)
+	return rv;
     if (memcmp(new_integ, p+l+1, info->ilen) != 0)
 	return EINVAL;
 
@@ -88,6 +88,13 @@ ipmi_create_lock(ipmi_domain_t *domain, ipmi_lock_t **new_lock)
     return ipmi_create_lock_os_hnd(ipmi_domain_get_os_hnd(domain), new_lock);
 }
 
+int
+ipmi_create_nr_lock(ipmi_domain_t *domain, ipmi_lock_t **new_lock)
+{
+    return ipmi_create_nr_lock_os_hnd(ipmi_domain_get_os_hnd(domain),
+				      new_lock);
+}
+
 void
 ipmi_log(enum ipmi_log_type_e log_type, const char *format, ...)
 {
@@ -487,7 +494,12 @@ ipmi_init(os_handler_t *handler)
 
     ipmi_initialized = 1;
 
-    if (handler->create_lock) {
+    /* Only ever held around the increment. */
+    if (handler->create_nr_lock) {
+	rv = handler->create_nr_lock(handler, &seq_lock);
+	if (rv)
+	    goto out_err;
+    } else if (handler->create_lock) {
 	rv = handler->create_lock(handler, &seq_lock);
 	if (rv)
 	    goto out_err;
@@ -1073,6 +1085,12 @@ ipmi_parse_options(ipmi_open_option_t *option,
     } else if (strcmp(arg, "-cache") == 0) {
 	option->option = IPMI_OPEN_OPTION_USE_CACHE;
 	option->ival = 1;
+    } else if (strcmp(arg, "-nocoalesce") == 0) {
+	option->option = IPMI_OPEN_OPTION_COALESCE;
+	option->ival = 0;
+    } else if (strcmp(arg, "-coalesce") == 0) {
+	option->option = IPMI_OPEN_OPTION_COALESCE;
+	option->ival = 1;
     } else
 	return EINVAL;
 
@@ -1093,7 +1111,8 @@ ipmi_parse_options_help(void)
 	"-[no]setseltime - setting the SEL clock\n"
 	"-[no]activate - connection activation\n"
 	"-[no]localonly - Just talk to the local BMC, (ATCA-only, for blades)\n"
-        "-[no]cache - use the local cache for SDRs.  On by default."
+        "-[no]cache - use the local cache for SDRs.  On by default.\n"
+	"-[no]coalesce - share responses to identical read commands\n"
 	"-wait_til_up - wait until the domain is up before returning";
 }
 
@@ -1216,12 +1235,15 @@ ipmi_openipmi_version(void)
     return OPENIPMI_VERSION;
 }
 
+static ipmi_mem_cache_t msgi_cache =
+    IPMI_MEM_CACHE_INIT("ipmi_msgi", sizeof(ipmi_msgi_t));
+
 ipmi_msgi_t *
 ipmi_alloc_msg_item(void)
 {
     ipmi_msgi_t *rv;
 
-    rv = ipmi_mem_alloc(sizeof(ipmi_msgi_t));
+    rv = ipmi_mem_cache_alloc(&msgi_cache);
     if (!rv)
 	return NULL;
     memset(rv, 0, sizeof(*rv));
@@ -1234,7 +1256,7 @@ ipmi_free_msg_item(ipmi_msgi_t *item)
 {
     if (item->msg.data && (item->msg.data != item->data))
 	ipmi_free_msg_item_data(item->msg.data);
-    ipmi_mem_free(item);
+    ipmi_mem_cache_free(&msgi_cache, item);
 }
 
 void *
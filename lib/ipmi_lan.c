@@ -55,6 +55,7 @@
 #include <OpenIPMI/internal/ipmi_event.h>
 #include <OpenIPMI/internal/ipmi_int.h>
 #include <OpenIPMI/internal/locked_list.h>
+#include <OpenIPMI/internal/ipmi_stat.h>
 
 #if defined(DEBUG_MSG) || defined(DEBUG_RAWMSG)
 static void
@@ -89,6 +90,15 @@ dump_hex(void *vdata, int len)
    considered failed. */
 #define IP_FAIL_COUNT 4
 
+/* The default for the maximum number of connection handshakes (from
+   Get Channel Auth Capabilities to the session being up) that may be
+   in progress at once across all LAN connections. */
+#define DEFAULT_MAX_HANDSHAKES 64
+
+/* Number of seconds the parameters negotiated with a BMC are reused
+   when reconnecting to it. */
+#define TARGET_CACHE_TIME 600
+
 /* The default for the maximum number of messages that are allowed to be
    outstanding.  This is a pretty conservative number. */
 #define DEFAULT_MAX_OUTSTANDING_MSG_COUNT 2
@@ -110,6 +120,9 @@ typedef struct lan_timer_info_s
     unsigned int      seq;
 } lan_timer_info_t;
 
+static ipmi_mem_cache_t timer_info_cache =
+    IPMI_MEM_CACHE_INIT("lan_timer_info", sizeof(lan_timer_info_t));
+
 typedef struct lan_wait_queue_s
 {
     lan_timer_info_t      *info;
@@ -120,6 +133,7 @@ typedef struct lan_wait_queue_s
     ipmi_ll_rsp_handler_t rsp_handler;
     ipmi_msgi_t           *rsp_item;
     int                   side_effects;
+    int                   prio;
 
     struct lan_wait_queue_s *next;
 } lan_wait_queue_t;
@@ -216,9 +230,20 @@ typedef struct lan_stat_info_s
 #define STAT_INVALID_PAYLOAD	16
 #define STAT_SEQ_ERR		17
 #define STAT_RSP_NO_CMD		18
-#define NUM_STATS 19
+#define STAT_FAST_RECONNECT	19
+#define STAT_FAST_RECONNECT_FAIL 20
+/* Commands that had to wait, by priority class. */
+#define STAT_QUEUED_INTERACTIVE	21
+#define STAT_QUEUED_MONITORING	22
+#define STAT_QUEUED_BULK	23
+#define NUM_STATS 24
     /* Statistics */
     void *stats[NUM_STATS];
+
+    /* Set if the stat reads lan->stat_counts directly, otherwise it
+       has to be told about every update. */
+    char linked[NUM_STATS];
+    int  push;
 } lan_stat_info_t;
 
 static const char *lan_stat_names[NUM_STATS] =
@@ -241,7 +266,12 @@ static const char *lan_stat_names[NUM_STATS] =
     "lan_decrypt_fail",
     "lan_invalid_payload",
     "lan_seq_err",
-    "lan_rsp_no_cmd"
+    "lan_rsp_no_cmd",
+    "lan_fast_reconnects",
+    "lan_fast_reconnect_fails",
+    "lan_queued_interactive",
+    "lan_queued_monitoring",
+    "lan_queued_bulk"
 };
 
 
@@ -265,6 +295,7 @@ typedef struct lan_ip_data_s
     uint32_t                   unauth_out_seq_num;
     uint32_t                   unauth_in_seq_num;
     uint32_t                   unauth_recv_msg_map;
+    unsigned char              working_auth;
     unsigned char              working_integ;
     unsigned char              working_conf;
     uint32_t                   mgsys_session_id;
@@ -282,6 +313,22 @@ typedef struct lan_ip_data_s
 
     /* Use for linked-lists of IP addresses. */
     lan_link_t                 ip_link;
+
+    /* Handshake scheduling, protected by handshake_lock.  The link
+       is on the handshake queue while waiting to start. */
+#define HANDSHAKE_IDLE		0
+#define HANDSHAKE_QUEUED	1
+#define HANDSHAKE_ACTIVE	2
+    int                        handshake_state;
+    lan_link_t                 handshake_link;
+
+    /* Set while the handshake is using the parameters cached for the
+       target instead of asking the BMC, with the RMCP+ algorithms to
+       ask for in the Open Session request. */
+    int                        fast_path;
+    unsigned char              fast_auth;
+    unsigned char              fast_integ;
+    unsigned char              fast_conf;
 } lan_ip_data_t;
 
 
@@ -398,8 +445,12 @@ struct lan_data_s
     /* Address family specified at startup. */
     unsigned int addr_family;
 
-    /* List of messages waiting to be sent. */
-    lan_wait_queue_t *wait_q, *wait_q_tail;
+    /* Messages waiting to be sent, one queue per priority class.
+       wait_q_skips is for ipmi_con_prio_pick(). */
+    lan_wait_queue_t *wait_q[IPMI_NUM_MSG_PRIOS];
+    lan_wait_queue_t *wait_q_tail[IPMI_NUM_MSG_PRIOS];
+    unsigned int     wait_q_depth[IPMI_NUM_MSG_PRIOS];
+    unsigned int     wait_q_skips[IPMI_NUM_MSG_PRIOS];
 
     locked_list_t              *event_handlers;
 
@@ -422,6 +473,12 @@ struct lan_data_s
     lan_link_t link;
 
     locked_list_t *lan_stat_list;
+
+    /* The statistics are counted here with atomic adds.  Only the
+       users that can't read these directly (stat_push_users) need to
+       go through lan_stat_list on every update. */
+    unsigned long stat_counts[NUM_STATS];
+    unsigned long stat_push_users;
 };
 
 
@@ -1071,6 +1128,40 @@ ipmi_rmcpp_auth_set_k2_len(ipmi_rmcpp_auth_t *ainfo,
     ainfo->k2_len = length;
 }
 
+ipmi_rmcpp_auth_t *
+ipmi_rmcpp_auth_alloc(void)
+{
+    ipmi_rmcpp_auth_t *ainfo;
+
+    ainfo = ipmi_mem_alloc(sizeof(*ainfo));
+    if (ainfo)
+	memset(ainfo, 0, sizeof(*ainfo));
+    return ainfo;
+}
+
+void
+ipmi_rmcpp_auth_free(ipmi_rmcpp_auth_t *ainfo)
+{
+    memset(ainfo, 0, sizeof(*ainfo));
+    ipmi_mem_free(ainfo);
+}
+
+ipmi_rmcpp_confidentiality_t *
+ipmi_rmcpp_get_confidentiality(unsigned int conf_num)
+{
+    if (conf_num >= 64)
+	return NULL;
+    return confs[conf_num];
+}
+
+ipmi_rmcpp_integrity_t *
+ipmi_rmcpp_get_integrity(unsigned int integ_num)
+{
+    if (integ_num >= 64)
+	return NULL;
+    return integs[integ_num];
+}
+
 
 static void check_command_queue(ipmi_con_t *ipmi, lan_data_t *lan);
 static int send_auth_cap(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num,
@@ -1504,7 +1595,7 @@ add_stat_cb(void *cb_data, void *item1, void *item2)
     lan_stat_info_t     *stat = item1;
     lan_add_stat_info_t *sinfo = cb_data;
 
-    if (stat->stats[sinfo->statnum])
+    if (stat->stats[sinfo->statnum] && !stat->linked[sinfo->statnum])
 	ipmi_ll_con_stat_call_adder(info, stat->stats[sinfo->statnum],
 				    sinfo->count);
     return LOCKED_LIST_ITER_CONTINUE;
@@ -1516,6 +1607,10 @@ add_stat(ipmi_con_t *ipmi, int stat, int count)
     lan_data_t          *lan = ipmi->con_data;
     lan_add_stat_info_t sinfo;
 
+    ipmi_stat_atomic_add(&lan->stat_counts[stat], (unsigned long) count);
+    if (!ipmi_stat_atomic_load(&lan->stat_push_users))
+	return;
+
     sinfo.statnum = stat;
     sinfo.count = count;
     locked_list_iterate(lan->lan_stat_list, add_stat_cb, &sinfo);
@@ -1548,6 +1643,335 @@ lan_put(ipmi_con_t *ipmi)
 	lan_cleanup(ipmi);
 }
 
+/*
+ * Connection handshake scheduling.  Bringing up a connection takes
+ * several round trips and some expensive key derivations, so when a
+ * lot of connections come up at once (at startup, or when a network
+ * comes back) only handshake_max of them are run at a time.  The rest
+ * wait on the handshake queue and are started as others finish, so
+ * the handshakes stay pipelined across BMCs without all of them
+ * timing out and retrying together.
+ */
+static ipmi_lock_t  *handshake_lock = NULL;
+static unsigned int handshake_max = DEFAULT_MAX_HANDSHAKES;
+static unsigned int handshake_active;
+static int          handshake_running;
+static lan_link_t   handshake_queue;
+
+void
+ipmi_lan_set_max_handshakes(unsigned int max)
+{
+    ipmi_lock(handshake_lock);
+    handshake_max = max;
+    ipmi_unlock(handshake_lock);
+}
+
+unsigned int
+ipmi_lan_get_max_handshakes(void)
+{
+    return handshake_max;
+}
+
+static int
+handshake_slot_free(void)
+{
+    return !handshake_max || handshake_active < handshake_max;
+}
+
+static void
+handshake_dequeue(lan_ip_data_t *ip)
+{
+    ip->handshake_link.prev->next = ip->handshake_link.next;
+    ip->handshake_link.next->prev = ip->handshake_link.prev;
+    ip->handshake_link.next = NULL;
+    ip->handshake_link.prev = NULL;
+}
+
+/* Start queued handshakes while there is room for them. */
+static void
+run_handshake_queue(void)
+{
+    lan_link_t    *l;
+    lan_data_t    *lan;
+    lan_ip_data_t *ip;
+    unsigned int  addr_num;
+    int           rv;
+
+    ipmi_lock(handshake_lock);
+    /* Starting a handshake can finish one (an error sending the
+       first message, for instance), don't recurse then. */
+    if (handshake_running) {
+	ipmi_unlock(handshake_lock);
+	return;
+    }
+    handshake_running = 1;
+    while (handshake_queue.next != &handshake_queue && handshake_slot_free()) {
+	l = handshake_queue.next;
+	lan = l->lan;
+	for (addr_num=0; addr_num<MAX_IP_ADDR; addr_num++) {
+	    if (l == &lan->ip[addr_num].handshake_link)
+		break;
+	}
+	ip = &lan->ip[addr_num];
+	handshake_dequeue(ip);
+	ip->handshake_state = HANDSHAKE_IDLE;
+
+	/* Hold a reference so the connection can't go away while the
+	   handshake is started. */
+	ipmi_lock(lan_list_lock);
+	if (!lan->link.lan) {
+	    ipmi_unlock(lan_list_lock);
+	    continue;
+	}
+	lan->refcount++;
+	ipmi_unlock(lan_list_lock);
+
+	ip->handshake_state = HANDSHAKE_ACTIVE;
+	handshake_active++;
+	ipmi_unlock(handshake_lock);
+
+	rv = send_auth_cap(lan->ipmi, lan, addr_num, 0);
+
+	ipmi_lock(handshake_lock);
+	if (rv && ip->handshake_state == HANDSHAKE_ACTIVE) {
+	    /* The audit timer will try again. */
+	    ip->handshake_state = HANDSHAKE_IDLE;
+	    handshake_active--;
+	}
+	ipmi_unlock(handshake_lock);
+	lan_put(lan->ipmi);
+	ipmi_lock(handshake_lock);
+    }
+    handshake_running = 0;
+    ipmi_unlock(handshake_lock);
+}
+
+/*
+ * Start bringing up the connection on the address, or queue it if too
+ * many handshakes are already in progress.  Does nothing if one is
+ * already queued or running for the address.
+ */
+static int
+start_handshake(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num)
+{
+    lan_ip_data_t *ip = &lan->ip[addr_num];
+    int           rv;
+
+    ipmi_lock(handshake_lock);
+    if (ip->handshake_state != HANDSHAKE_IDLE) {
+	ipmi_unlock(handshake_lock);
+	return 0;
+    }
+    if (!handshake_slot_free()) {
+	ip->handshake_state = HANDSHAKE_QUEUED;
+	ip->handshake_link.lan = lan;
+	ip->handshake_link.next = &handshake_queue;
+	ip->handshake_link.prev = handshake_queue.prev;
+	handshake_queue.prev->next = &ip->handshake_link;
+	handshake_queue.prev = &ip->handshake_link;
+	ipmi_unlock(handshake_lock);
+	return 0;
+    }
+    ip->handshake_state = HANDSHAKE_ACTIVE;
+    handshake_active++;
+    ipmi_unlock(handshake_lock);
+
+    rv = send_auth_cap(ipmi, lan, addr_num, 0);
+    if (rv) {
+	ipmi_lock(handshake_lock);
+	if (ip->handshake_state == HANDSHAKE_ACTIVE) {
+	    ip->handshake_state = HANDSHAKE_IDLE;
+	    handshake_active--;
+	}
+	ipmi_unlock(handshake_lock);
+	run_handshake_queue();
+    }
+    return rv;
+}
+
+/* The handshake on the address finished (or the connection is going
+   away), let the next one run. */
+static void
+handshake_done(lan_data_t *lan, int addr_num)
+{
+    lan_ip_data_t *ip = &lan->ip[addr_num];
+
+    ipmi_lock(handshake_lock);
+    if (ip->handshake_state == HANDSHAKE_ACTIVE) {
+	handshake_active--;
+    } else if (ip->handshake_state == HANDSHAKE_QUEUED) {
+	handshake_dequeue(ip);
+    } else {
+	ipmi_unlock(handshake_lock);
+	return;
+    }
+    ip->handshake_state = HANDSHAKE_IDLE;
+    ipmi_unlock(handshake_lock);
+
+    run_handshake_queue();
+}
+
+/*
+ * The target cache.  Once a session to a BMC comes up, the parameters
+ * that were negotiated with it (the authentication type, whether
+ * RMCP+ is used and the RMCP+ algorithms it picked) are remembered by
+ * address, user and requested parameters.  This is global, so it
+ * outlives the connection; when a connection to the same target comes
+ * up again the Get Channel Auth Capabilities exchange is skipped and
+ * the session is started directly with the cached values.  If that
+ * fails the entry is dropped and full discovery is done.
+ */
+typedef struct lan_target_s lan_target_t;
+struct lan_target_s
+{
+    lan_target_t   *next;
+    struct timeval time;
+
+    /* The key. */
+    sockaddr_ip_t  addr;
+    unsigned int   authtype;
+    unsigned int   privilege;
+    unsigned int   auth;
+    unsigned int   integ;
+    unsigned int   conf;
+    unsigned int   name_lookup_only;
+    unsigned char  username[IPMI_USERNAME_MAX];
+    unsigned int   username_len;
+
+    /* What was negotiated. */
+    int            rmcpp;
+    unsigned char  chosen_authtype;
+    int            use_two_keys;
+    unsigned char  oem_iana[3];
+    unsigned char  oem_aux;
+    unsigned char  working_auth;
+    unsigned char  working_integ;
+    unsigned char  working_conf;
+};
+
+static ipmi_lock_t  *target_lock = NULL;
+static lan_target_t *target_list[LAN_HASH_SIZE];
+
+static int
+target_match(lan_target_t *t, lan_data_t *lan, int addr_num)
+{
+    lan_conn_parms_t *cparm = &lan->cparm;
+
+    return (lan_addr_same(&t->addr, &cparm->ip_addr[addr_num])
+	    && (t->authtype == cparm->authtype)
+	    && (t->privilege == cparm->privilege)
+	    && (t->auth == cparm->auth)
+	    && (t->integ == cparm->integ)
+	    && (t->conf == cparm->conf)
+	    && (t->name_lookup_only == cparm->name_lookup_only)
+	    && (t->username_len == cparm->username_len)
+	    && (memcmp(t->username, cparm->username, t->username_len) == 0));
+}
+
+/* Find the target's entry, freeing expired ones on the way.  Returns
+   the pointer to the entry's link, or NULL.  Call with target_lock
+   held. */
+static lan_target_t **
+target_find_nolock(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num)
+{
+    unsigned int   idx;
+    lan_target_t   **tp, *t;
+    struct timeval now;
+
+    idx = hash_lan_addr(&lan->cparm.ip_addr[addr_num].s_ipsock.s_addr0);
+    ipmi->os_hnd->get_monotonic_time(ipmi->os_hnd, &now);
+    tp = &target_list[idx];
+    while (*tp) {
+	t = *tp;
+	if (now.tv_sec - t->time.tv_sec >= TARGET_CACHE_TIME) {
+	    *tp = t->next;
+	    ipmi_mem_free(t);
+	    continue;
+	}
+	if (target_match(t, lan, addr_num))
+	    return tp;
+	tp = &t->next;
+    }
+    return NULL;
+}
+
+/* Copy out the cached parameters for the target.  Returns 1 if there
+   are any. */
+static int
+target_lookup(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num,
+	      lan_target_t *copy)
+{
+    lan_target_t **tp;
+
+    ipmi_lock(target_lock);
+    tp = target_find_nolock(ipmi, lan, addr_num);
+    if (tp)
+	*copy = **tp;
+    ipmi_unlock(target_lock);
+    return tp != NULL;
+}
+
+/* The session on the address is up, remember what it took. */
+static void
+target_save(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num)
+{
+    lan_ip_data_t    *ip = &lan->ip[addr_num];
+    lan_conn_parms_t *cparm = &lan->cparm;
+    lan_target_t     **tp, *t;
+    unsigned int     idx;
+
+    ipmi_lock(target_lock);
+    tp = target_find_nolock(ipmi, lan, addr_num);
+    if (tp) {
+	t = *tp;
+    } else {
+	t = ipmi_mem_alloc(sizeof(*t));
+	if (!t) {
+	    /* Not fatal, the next connection just does discovery. */
+	    ipmi_unlock(target_lock);
+	    return;
+	}
+	memset(t, 0, sizeof(*t));
+	t->addr = cparm->ip_addr[addr_num];
+	t->authtype = cparm->authtype;
+	t->privilege = cparm->privilege;
+	t->auth = cparm->auth;
+	t->integ = cparm->integ;
+	t->conf = cparm->conf;
+	t->name_lookup_only = cparm->name_lookup_only;
+	t->username_len = cparm->username_len;
+	memcpy(t->username, cparm->username, cparm->username_len);
+	idx = hash_lan_addr(&t->addr.s_ipsock.s_addr0);
+	t->next = target_list[idx];
+	target_list[idx] = t;
+    }
+    ipmi->os_hnd->get_monotonic_time(ipmi->os_hnd, &t->time);
+    t->rmcpp = ip->working_authtype == IPMI_AUTHTYPE_RMCP_PLUS;
+    t->chosen_authtype = lan->chosen_authtype;
+    t->use_two_keys = lan->use_two_keys;
+    memcpy(t->oem_iana, lan->oem_iana, 3);
+    t->oem_aux = lan->oem_aux;
+    t->working_auth = ip->working_auth;
+    t->working_integ = ip->working_integ;
+    t->working_conf = ip->working_conf;
+    ipmi_unlock(target_lock);
+}
+
+static void
+target_forget(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num)
+{
+    lan_target_t **tp, *t;
+
+    ipmi_lock(target_lock);
+    tp = target_find_nolock(ipmi, lan, addr_num);
+    if (tp) {
+	t = *tp;
+	*tp = t->next;
+	ipmi_mem_free(t);
+    }
+    ipmi_unlock(target_lock);
+}
+
 static int
 auth_gen(lan_data_t    *lan,
 	 unsigned char *out,
@@ -2098,7 +2522,7 @@ audit_timeout_handler(void              *cb_data,
 
     for (i=0; i<lan->cparm.num_ip_addr; i++) {
 	if (start_up[i])
-	    send_auth_cap(ipmi, lan, i, 0);
+	    start_handshake(ipmi, lan, i);
     }
 
     msg.netfn = IPMI_APP_NETFN;
@@ -2255,6 +2679,9 @@ connection_up(lan_data_t *lan, int addr_num, int new_con)
     } else {
 	ipmi_unlock(lan->ip_lock);
     }    
+
+    if (new_con)
+	handshake_done(lan, addr_num);
 }
 
 static void
@@ -2529,7 +2956,7 @@ rsp_timeout_handler(void              *cb_data,
 
  out:
     lan_put(ipmi);
-    ipmi_mem_free(info);
+    ipmi_mem_cache_free(&timer_info_cache, info);
 }
 
 typedef struct call_event_handler_s
@@ -2686,7 +3113,7 @@ handle_msg_send(lan_timer_info_t      *info,
 
 	if (ipmb->channel >= MAX_IPMI_USED_CHANNELS) {
 	    ipmi->os_hnd->free_timer(ipmi->os_hnd, info->timer);
-	    ipmi_mem_free(info);
+	    ipmi_mem_cache_free(&timer_info_cache, info);
 	    rv = EINVAL;
 	    goto out;
 	}
@@ -2751,7 +3178,7 @@ handle_msg_send(lan_timer_info_t      *info,
 	ipmi->os_hnd->free_timer(ipmi->os_hnd,
 				 lan->seq_table[seq].timer);
 	lan->seq_table[seq].timer = NULL;
-	ipmi_mem_free(info);
+	ipmi_mem_cache_free(&timer_info_cache, info);
 	goto out;
     }
 
@@ -2780,13 +3207,51 @@ handle_msg_send(lan_timer_info_t      *info,
 	    ipmi->os_hnd->free_timer(ipmi->os_hnd,
 				     lan->seq_table[seq].timer);
 	    lan->seq_table[seq].timer = NULL;
-	    ipmi_mem_free(info);
+	    ipmi_mem_cache_free(&timer_info_cache, info);
 	}
     }
  out:
     return rv;
 }
 
+/* Add a message to the end of its class's wait queue.  Must be called
+   with the seq_num_lock held. */
+static void
+wait_q_add(lan_data_t *lan, lan_wait_queue_t *q_item)
+{
+    int prio = q_item->prio;
+
+    q_item->next = NULL;
+    if (lan->wait_q_tail[prio] == NULL) {
+	lan->wait_q_tail[prio] = q_item;
+	lan->wait_q[prio] = q_item;
+    } else {
+	lan->wait_q_tail[prio]->next = q_item;
+	lan->wait_q_tail[prio] = q_item;
+    }
+    lan->wait_q_depth[prio]++;
+}
+
+/* Take the next message to start from the wait queues, NULL if there
+   are none.  Must be called with the seq_num_lock held. */
+static lan_wait_queue_t *
+wait_q_next(lan_data_t *lan)
+{
+    lan_wait_queue_t *q_item;
+    int              prio;
+
+    prio = ipmi_con_prio_pick(lan->wait_q_depth, lan->wait_q_skips);
+    if (prio < 0)
+	return NULL;
+
+    q_item = lan->wait_q[prio];
+    lan->wait_q[prio] = q_item->next;
+    if (lan->wait_q[prio] == NULL)
+	lan->wait_q_tail[prio] = NULL;
+    lan->wait_q_depth[prio]--;
+    return q_item;
+}
+
 static void
 check_command_queue(ipmi_con_t *ipmi, lan_data_t *lan)
 {
@@ -2794,13 +3259,9 @@ check_command_queue(ipmi_con_t *ipmi, lan_data_t *lan)
     lan_wait_queue_t *q_item;
     int              started = 0;
 
-    while (!started && (lan->wait_q != NULL)) {
-	/* Commands are waiting to be started, remove the queue item
-           and start it. */
-	q_item = lan->wait_q;
-	lan->wait_q = q_item->next;
-	if (lan->wait_q == NULL)
-	    lan->wait_q_tail = NULL;
+    while (!started && ((q_item = wait_q_next(lan)) != NULL)) {
+	/* Commands are waiting to be started, start the one with the
+	   highest priority. */
 
 	rv = handle_msg_send(q_item->info, -1, &q_item->addr, q_item->addr_len,
 			     &(q_item->msg), q_item->rsp_handler,
@@ -2983,7 +3444,8 @@ handle_payload(ipmi_con_t    *ipmi,
 	/* Timer is cancelled, free its data. */
 	ipmi->os_hnd->free_timer(ipmi->os_hnd,
 				 lan->seq_table[seq].timer);
-	ipmi_mem_free(lan->seq_table[seq].timer_info);
+	ipmi_mem_cache_free(&timer_info_cache,
+			    lan->seq_table[seq].timer_info);
     }
 
     handler = lan->seq_table[seq].rsp_handler;
@@ -3564,7 +4026,7 @@ ipmi_lan_send_command_forceip(ipmi_con_t            *ipmi,
     if (msg->netfn & 1)
 	return lan_send_addr(lan, addr, addr_len, msg, 0, addr_num, NULL);
 
-    info = ipmi_mem_alloc(sizeof(*info));
+    info = ipmi_mem_cache_alloc(&timer_info_cache);
     if (!info)
 	return ENOMEM;
     memset(info, 0, sizeof(*info));
@@ -3575,7 +4037,7 @@ ipmi_lan_send_command_forceip(ipmi_con_t            *ipmi,
 
     rv = ipmi->os_hnd->alloc_timer(ipmi->os_hnd, &(info->timer));
     if (rv) {
-	ipmi_mem_free(info);
+	ipmi_mem_cache_free(&timer_info_cache, info);
 	return rv;
     }
 
@@ -3602,7 +4064,7 @@ ipmi_lan_send_command_forceip(ipmi_con_t            *ipmi,
 	if (info) {
 	    if (info->timer)
 		ipmi->os_hnd->free_timer(ipmi->os_hnd, info->timer);
-	    ipmi_mem_free(info);
+	    ipmi_mem_cache_free(&timer_info_cache, info);
 	}
     }
     return rv;
@@ -3622,6 +4084,7 @@ lan_send_command_option(ipmi_con_t              *ipmi,
     int              rv;
     ipmi_msgi_t      *rspi = trspi;
     int              side_effects = 0;
+    int              prio;
     int              i;
 
 
@@ -3646,14 +4109,15 @@ lan_send_command_option(ipmi_con_t              *ipmi,
 		side_effects = options[i].ival;
 	}
     }
+    prio = ipmi_con_msg_prio(options, msg);
 
     if (!rspi) {
-	rspi = ipmi_mem_alloc(sizeof(*rspi));
+	rspi = ipmi_alloc_msg_item();
 	if (!rspi)
 	    return ENOMEM;
     }
 
-    info = ipmi_mem_alloc(sizeof(*info));
+    info = ipmi_mem_cache_alloc(&timer_info_cache);
     if (!info) {
 	rv = ENOMEM;
 	goto out_unlock2;
@@ -3689,16 +4153,10 @@ lan_send_command_option(ipmi_con_t              *ipmi,
 	q_item->rsp_handler = rsp_handler;
 	q_item->rsp_item = rspi;
 	q_item->side_effects = side_effects;
+	q_item->prio = prio;
 
-	/* Add it to the end of the queue. */
-	q_item->next = NULL;
-	if (lan->wait_q_tail == NULL) {
-	    lan->wait_q_tail = q_item;
-	    lan->wait_q = q_item;
-	} else {
-	    lan->wait_q_tail->next = q_item;
-	    lan->wait_q_tail = q_item;
-	}
+	wait_q_add(lan, q_item);
+	add_stat(ipmi, STAT_QUEUED_INTERACTIVE + prio, 1);
 	goto out_unlock;
     }
 
@@ -3710,7 +4168,7 @@ lan_send_command_option(ipmi_con_t              *ipmi,
 	lan->outstanding_msg_count++;
     else if (!trspi && rspi)
 	/* If we allocated an rspi, free it on error. */
-	ipmi_mem_free(rspi);
+	ipmi_free_msg_item(rspi);
     ipmi_unlock(lan->seq_num_lock);
     return rv;
 
@@ -3720,14 +4178,14 @@ lan_send_command_option(ipmi_con_t              *ipmi,
 	if (info) {
 	    if (info->timer)
 		ipmi->os_hnd->free_timer(ipmi->os_hnd, info->timer);
-	    ipmi_mem_free(info);
+	    ipmi_mem_cache_free(&timer_info_cache, info);
 	}
     }
  out_unlock2:
     if (rv) {
 	/* If we allocated an rspi, free it. */
 	if (!trspi && rspi)
-	    ipmi_mem_free(rspi);
+	    ipmi_free_msg_item(rspi);
     }
     return rv;
 }
@@ -3869,6 +4327,29 @@ send_close_session(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num)
 		  NULL);
 }
 
+static void
+lan_release_stats(lan_data_t          *lan,
+		  lan_stat_info_t     *stat,
+		  ipmi_ll_stat_info_t *info)
+{
+    int i;
+
+    for (i=0; i<NUM_STATS; i++) {
+	if (!stat->stats[i])
+	    continue;
+	if (stat->linked[i])
+	    ipmi_ll_con_stat_call_unregister_counter(info, stat->stats[i],
+						     &lan->stat_counts[i]);
+	else
+	    ipmi_ll_con_stat_call_unregister(info, stat->stats[i]);
+	stat->stats[i] = NULL;
+    }
+    if (stat->push) {
+	ipmi_stat_atomic_add(&lan->stat_push_users, (unsigned long) -1);
+	stat->push = 0;
+    }
+}
+
 typedef struct lan_unreg_stat_info_s
 {
     lan_data_t          *lan;
@@ -3882,15 +4363,10 @@ lan_unreg_stat_info(void *cb_data, void *item1, void *item2)
     ipmi_ll_stat_info_t   *info = item2;
     lan_stat_info_t       *stat = item1;
     lan_unreg_stat_info_t *sinfo = cb_data;
-    int                   i;
 
     if (!sinfo->cmpinfo || (sinfo->cmpinfo == info)) {
 	locked_list_remove(sinfo->lan->lan_stat_list, stat, info);
-	for (i=0; i<NUM_STATS; i++)
-	    if (stat->stats[i]) {
-		ipmi_ll_con_stat_call_unregister(info, stat->stats[i]);
-		stat->stats[i] = NULL;
-	    }
+	lan_release_stats(sinfo->lan, stat, info);
 	ipmi_mem_free(stat);
 	sinfo->found = 1;
     }
@@ -3980,6 +4456,9 @@ lan_cleanup(ipmi_con_t *ipmi)
 
     lan->in_cleanup = 1;
 
+    for (i=0; i<lan->cparm.num_ip_addr; i++)
+	handshake_done(lan, i);
+
     ipmi_lock(lan->seq_num_lock);
     for (i=0; i<64; i++) {
 	if (lan->seq_table[i].inuse) {
@@ -4019,7 +4498,7 @@ lan_cleanup(ipmi_con_t *ipmi)
 		info->cancelled = 1;
 	    else {
 		ipmi->os_hnd->free_timer(ipmi->os_hnd, info->timer);
-		ipmi_mem_free(info);
+		ipmi_mem_cache_free(&timer_info_cache, info);
 	    }
 
 	    ipmi_unlock(lan->seq_num_lock);
@@ -4034,11 +4513,12 @@ lan_cleanup(ipmi_con_t *ipmi)
 	    ipmi_lock(lan->seq_num_lock);
 	}
     }
-    while (lan->wait_q != NULL) {
+    for (;;) {
 	lan_wait_queue_t *q_item;
 
-	q_item = lan->wait_q;
-	lan->wait_q = q_item->next;
+	q_item = wait_q_next(lan);
+	if (!q_item)
+	    break;
 
 	ipmi->os_hnd->free_timer(ipmi->os_hnd, q_item->info->timer);
 
@@ -4055,7 +4535,7 @@ lan_cleanup(ipmi_con_t *ipmi)
 	    ipmi_lock(lan->seq_num_lock);
 	}
 
-	ipmi_mem_free(q_item->info);
+	ipmi_mem_cache_free(&timer_info_cache, q_item->info);
 	ipmi_mem_free(q_item);
     }
     if (lan->audit_info) {
@@ -4141,8 +4621,19 @@ handle_connected(ipmi_con_t *ipmi, int err, int addr_num)
        for a lock here. */
 
     /* Make sure session data is reset on an error. */
-    if (err)
+    if (err) {
 	reset_session_data(lan, addr_num);
+	if (lan->ip[addr_num].fast_path) {
+	    /* The cached parameters didn't work, the BMC's configuration
+	       may have changed.  Forget them and do full discovery. */
+	    lan->ip[addr_num].fast_path = 0;
+	    add_stat(ipmi, STAT_FAST_RECONNECT_FAIL, 1);
+	    target_forget(ipmi, lan, addr_num);
+	    if (!lan->in_cleanup && !send_auth_cap(ipmi, lan, addr_num, 0))
+		return;
+	}
+    }
+    handshake_done(lan, addr_num);
 
     ipmi_lock(lan->ip_lock);
     ipmi_lock(lan->con_change_lock);
@@ -4155,6 +4646,8 @@ static void
 finish_connection(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num)
 {
     lan->connected = 1;
+    lan->ip[addr_num].fast_path = 0;
+    target_save(ipmi, lan, addr_num);
     connection_up(lan, addr_num, 1);
     if (! lan->initialized) {
 	lan->initialized = 1;
@@ -4318,7 +4811,7 @@ lan_oem_done(ipmi_con_t *ipmi, void *cb_data)
     int         addr_num = (intptr_t) rspi->data4;
 
     if (! ipmi) {
-	ipmi_mem_free(rspi);
+	ipmi_free_msg_item(rspi);
 	return;
     }
 
@@ -4326,7 +4819,7 @@ lan_oem_done(ipmi_con_t *ipmi, void *cb_data)
     rv = send_get_dev_id(ipmi, lan, addr_num, rspi);
     if (rv) {
         handle_connected(ipmi, rv, addr_num);
-	ipmi_mem_free(rspi);
+	ipmi_free_msg_item(rspi);
     }
 }
 
@@ -4662,6 +5155,7 @@ got_rmcpp_open_session_rsp(ipmi_con_t *ipmi, ipmi_msgi_t  *rspi)
 	goto out;
     }
 
+    lan->ip[addr_num].working_auth = auth;
     lan->ip[addr_num].working_conf = conf;
     lan->ip[addr_num].working_integ = integ;
     lan->ip[addr_num].conf_info = confp;
@@ -4698,31 +5192,42 @@ send_rmcpp_open_session(ipmi_con_t *ipmi, lan_data_t *lan, ipmi_msgi_t *rspi,
     unsigned char     data[32];
     ipmi_msg_t        msg;
     ipmi_rmcpp_addr_t addr;
+    lan_ip_data_t     *ip = &lan->ip[addr_num];
+    int               auth = lan->cparm.auth;
+    int               integ = lan->cparm.integ;
+    int               conf = lan->cparm.conf;
+
+    if (ip->fast_path) {
+	/* Ask for what the BMC picked last time. */
+	auth = ip->fast_auth;
+	integ = ip->fast_integ;
+	conf = ip->fast_conf;
+    }
 
     memset(data, 0, sizeof(data));
     data[0] = 0; /* Set to seq# by the formatting code. */
     data[1] = lan->cparm.privilege;
-    ipmi_set_uint32(data+4, lan->ip[addr_num].precon_session_id);
+    ipmi_set_uint32(data+4, ip->precon_session_id);
     data[8] = 0; /* auth algorithm */
-    if ((int) lan->cparm.auth == IPMI_LANP_AUTHENTICATION_ALGORITHM_BMCPICK)
+    if (auth == IPMI_LANP_AUTHENTICATION_ALGORITHM_BMCPICK)
 	data[11] = 0; /* Let the BMC pick */
     else {
 	data[11] = 8;
-	data[12] = lan->cparm.auth;
+	data[12] = auth;
     }
     data[16] = 1; /* integrity algorithm */
-    if ((int) lan->cparm.integ == IPMI_LANP_INTEGRITY_ALGORITHM_BMCPICK)
+    if (integ == IPMI_LANP_INTEGRITY_ALGORITHM_BMCPICK)
 	data[19] = 0; /* Let the BMC pick */
     else {
 	data[19] = 8;
-	data[20] = lan->cparm.integ;
+	data[20] = integ;
     }
     data[24] = 2; /* confidentiality algorithm */
-    if ((int) lan->cparm.conf == IPMI_LANP_CONFIDENTIALITY_ALGORITHM_BMCPICK)
+    if (conf == IPMI_LANP_CONFIDENTIALITY_ALGORITHM_BMCPICK)
 	data[27] = 0; /* Let the BMC pick */
     else {
 	data[27] = 8;
-	data[28] = lan->cparm.conf;
+	data[28] = conf;
     }
 
     msg.netfn = IPMI_RMCPP_DUMMY_NETFN;
@@ -4931,15 +5436,57 @@ send_challenge(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num,
     return rv;
 }
 
+/* Start an IPMI 1.5 session with the given authentication type. */
+static int
+start_session(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num,
+	      unsigned int authtype, ipmi_msgi_t *rspi)
+{
+    int rv;
+
+    if (lan->authdata) {
+	ipmi_auths[lan->chosen_authtype].authcode_cleanup(lan->authdata);
+	lan->authdata = NULL;
+    }
+    lan->chosen_authtype = authtype;
+
+    rv = ipmi_auths[lan->chosen_authtype].authcode_init(lan->cparm.password,
+							&(lan->authdata),
+							NULL, auth_alloc,
+							auth_free);
+    if (rv) {
+        ipmi_log(IPMI_LOG_ERR_INFO,
+		 "%sipmi_lan.c(start_session): "
+		 "Unable to initialize authentication data: 0x%x",
+		 IPMI_CONN_NAME(lan->ipmi), rv);
+        handle_connected(ipmi, rv, addr_num);
+	goto out;
+    }
+
+    rv = send_challenge(ipmi, lan, addr_num, rspi);
+    if (rv) {
+        ipmi_log(IPMI_LOG_ERR_INFO,
+		 "%sipmi_lan.c(start_session): "
+		 "Unable to send challenge command: 0x%x",
+		 IPMI_CONN_NAME(lan->ipmi), rv);
+        handle_connected(ipmi, rv, addr_num);
+	goto out;
+    }
+
+    return IPMI_MSG_ITEM_USED;
+
+ out:
+    return IPMI_MSG_ITEM_NOT_USED;
+}
+
 static int
 auth_cap_done(ipmi_con_t *ipmi, ipmi_msgi_t *rspi)
 {
-    ipmi_msg_t *msg = &rspi->msg;
-    lan_data_t *lan;
-    int        rv;
-    int        addr_num = (intptr_t) rspi->data4;
-    int        supports_ipmi2;
-    int        extended_capabilities_reported;
+    ipmi_msg_t   *msg = &rspi->msg;
+    lan_data_t   *lan;
+    int          addr_num = (intptr_t) rspi->data4;
+    int          supports_ipmi2;
+    int          extended_capabilities_reported;
+    unsigned int authtype;
 
     if (!ipmi) {
 	handle_connected(ipmi, ECANCELED, addr_num);
@@ -4994,21 +5541,16 @@ auth_cap_done(ipmi_con_t *ipmi, ipmi_msgi_t *rspi)
     memcpy(lan->oem_iana, msg->data+5, 3);
     lan->oem_aux = msg->data[8];
 
-    if (lan->authdata) {
-	ipmi_auths[lan->chosen_authtype].authcode_cleanup(lan->authdata);
-	lan->authdata = NULL;
-    }
-
     if ((int) lan->cparm.authtype == IPMI_AUTHTYPE_DEFAULT) {
 	/* Pick the most secure authentication type. */
 	if (msg->data[2] & (1 << IPMI_AUTHTYPE_MD5)) {
-	    lan->chosen_authtype = IPMI_AUTHTYPE_MD5;
+	    authtype = IPMI_AUTHTYPE_MD5;
 	} else if (msg->data[2] & (1 << IPMI_AUTHTYPE_MD2)) {
-	    lan->chosen_authtype = IPMI_AUTHTYPE_MD2;
+	    authtype = IPMI_AUTHTYPE_MD2;
 	} else if (msg->data[2] & (1 << IPMI_AUTHTYPE_STRAIGHT)) {
-	    lan->chosen_authtype = IPMI_AUTHTYPE_STRAIGHT;
+	    authtype = IPMI_AUTHTYPE_STRAIGHT;
 	} else if (msg->data[2] & (1 << IPMI_AUTHTYPE_NONE)) {
-	    lan->chosen_authtype = IPMI_AUTHTYPE_NONE;
+	    authtype = IPMI_AUTHTYPE_NONE;
 	} else {
 	    ipmi_log(IPMI_LOG_ERR_INFO,
 		     "%sipmi_lan.c(auth_cap_done): "
@@ -5026,33 +5568,10 @@ auth_cap_done(ipmi_con_t *ipmi, ipmi_msgi_t *rspi)
 	    handle_connected(ipmi, EINVAL, addr_num);
 	    goto out;
 	}
-	lan->chosen_authtype = lan->cparm.authtype;
-    }
-
-    rv = ipmi_auths[lan->chosen_authtype].authcode_init(lan->cparm.password,
-							&(lan->authdata),
-							NULL, auth_alloc,
-							auth_free);
-    if (rv) {
-        ipmi_log(IPMI_LOG_ERR_INFO,
-		 "%sipmi_lan.c(auth_cap_done): "
-		 "Unable to initialize authentication data: 0x%x",
-		 IPMI_CONN_NAME(lan->ipmi), rv);
-        handle_connected(ipmi, rv, addr_num);
-	goto out;
-    }
-
-    rv = send_challenge(ipmi, lan, addr_num, rspi);
-    if (rv) {
-        ipmi_log(IPMI_LOG_ERR_INFO,
-		 "%sipmi_lan.c(auth_cap_done): "
-		 "Unable to send challenge command: 0x%x",
-		 IPMI_CONN_NAME(lan->ipmi), rv);
-        handle_connected(ipmi, rv, addr_num);
-	goto out;
+	authtype = lan->cparm.authtype;
     }
 
-    return IPMI_MSG_ITEM_USED;
+    return start_session(ipmi, lan, addr_num, authtype, rspi);
 
  out:
     return IPMI_MSG_ITEM_NOT_USED;
@@ -5112,14 +5631,38 @@ send_auth_cap(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num,
     int                          rv;
     ipmi_msgi_t                  *rspi;
     ipmi_ll_rsp_handler_t        rsp_handler;
+    lan_target_t                 target;
 
     /* FIXME - a system may only support RMCP+ and not RMCP.  We need
        a way to detect and handle that.  */
 
-    rspi = ipmi_mem_alloc(sizeof(*rspi));
+    rspi = ipmi_alloc_msg_item();
     if (!rspi)
 	return ENOMEM;
 
+    lan->ip[addr_num].fast_path = 0;
+    if (!force_ipmiv15 && target_lookup(ipmi, lan, addr_num, &target)) {
+	/* We have talked to this BMC recently, go straight to starting
+	   the session with what worked then. */
+	lan->ip[addr_num].fast_path = 1;
+	add_stat(ipmi, STAT_FAST_RECONNECT, 1);
+	lan->use_two_keys = target.use_two_keys;
+	memcpy(lan->oem_iana, target.oem_iana, 3);
+	lan->oem_aux = target.oem_aux;
+	if (target.rmcpp) {
+	    lan->ip[addr_num].fast_auth = target.working_auth;
+	    lan->ip[addr_num].fast_integ = target.working_integ;
+	    lan->ip[addr_num].fast_conf = target.working_conf;
+	    rv = start_rmcpp(ipmi, lan, rspi, addr_num);
+	} else {
+	    rv = start_session(ipmi, lan, addr_num, target.chosen_authtype,
+			       rspi);
+	}
+	if (rv == IPMI_MSG_ITEM_NOT_USED)
+	    ipmi_free_msg_item(rspi);
+	return 0;
+    }
+
     addr.addr_type = IPMI_SYSTEM_INTERFACE_ADDR_TYPE;
     addr.channel = 0xf;
     addr.lun = 0;
@@ -5144,7 +5687,7 @@ send_auth_cap(ipmi_con_t *ipmi, lan_data_t *lan, int addr_num,
 				       (ipmi_addr_t *) &addr, sizeof(addr),
 				       &msg, rsp_handler, rspi);
     if (rv)
-	ipmi_mem_free(rspi);
+	ipmi_free_msg_item(rspi);
     return rv;
 }
 
@@ -5214,7 +5757,7 @@ lan_start_con(ipmi_con_t *ipmi)
 
     for (i=0; i<lan->cparm.num_ip_addr; i++)
 	/* Ignore failures, this gets retried. */
-	send_auth_cap(ipmi, lan, i, 0);
+	start_handshake(ipmi, lan, i);
 
     return 0;
 
@@ -5351,16 +5894,27 @@ lan_register_stat_handler(ipmi_con_t          *ipmi,
 	return ENOMEM;
     memset(nstat, 0, sizeof(*nstat));
 
-    for (i=0; i<NUM_STATS; i++)
+    for (i=0; i<NUM_STATS; i++) {
+	/* Let the user read our counters if it can, so add_stat()
+	   doesn't have to call it. */
+	if (!ipmi_ll_con_stat_call_register_counter(info, lan_stat_names[i],
+						    ipmi->name,
+						    &lan->stat_counts[i],
+						    &(nstat->stats[i])))
+	{
+	    nstat->linked[i] = 1;
+	    continue;
+	}
 	ipmi_ll_con_stat_call_register(info, lan_stat_names[i],
 				       ipmi->name, &(nstat->stats[i]));
+	if (nstat->stats[i])
+	    nstat->push = 1;
+    }
+    if (nstat->push)
+	ipmi_stat_atomic_add(&lan->stat_push_users, 1);
 
     if (!locked_list_add(lan->lan_stat_list, nstat, info)) {
-	for (i=0; i<NUM_STATS; i++)
-	    if (nstat->stats[i]) {
-		ipmi_ll_con_stat_call_unregister(info, nstat->stats[i]);
-		nstat->stats[i] = NULL;
-	    }
+	lan_release_stats(lan, nstat, info);
 	ipmi_mem_free(nstat);
 	return ENOMEM;
     }
@@ -5741,8 +6295,10 @@ ipmi_lanp_setup_con(ipmi_lanp_parm_t *parms,
     lan->msg_timeout = msg_timeout;
     lan->msg_timeout_sideeff = msg_timeout_sideeff;
     lan->addr_family = set_addr_family;
-    lan->wait_q = NULL;
-    lan->wait_q_tail = NULL;
+    for (i=0; i<IPMI_NUM_MSG_PRIOS; i++) {
+	lan->wait_q[i] = NULL;
+	lan->wait_q_tail[i] = NULL;
+    }
 
     pa = (struct sockaddr_in *)&(lan->cparm.ip_addr[0]);
     lan->fd = find_free_lan_fd(pa->sin_family, lan, &lan->fd_slot);
@@ -7029,6 +7585,18 @@ i_ipmi_lan_init(os_handler_t *os_hnd)
     if (rv)
 	return rv;
 
+    handshake_queue.next = &handshake_queue;
+    handshake_queue.prev = &handshake_queue;
+    handshake_queue.lan = NULL;
+    rv = ipmi_create_global_lock(&handshake_lock);
+    if (rv)
+	return rv;
+
+    memset(target_list, 0, sizeof(target_list));
+    rv = ipmi_create_global_lock(&target_lock);
+    if (rv)
+	return rv;
+
     lan_setup = i_ipmi_alloc_con_setup(lan_parse_args, lan_parse_help,
 				       lan_con_alloc_args);
     if (! lan_setup)
@@ -7050,6 +7618,8 @@ i_ipmi_lan_init(os_handler_t *os_hnd)
 void
 i_ipmi_lan_shutdown(void)
 {
+    int i;
+
     network_shutdown();
 
     i_ipmi_unregister_con_type("lan", lan_setup);
@@ -7064,6 +7634,21 @@ i_ipmi_lan_shutdown(void)
 	ipmi_destroy_lock(lan_payload_lock);
 	lan_payload_lock = NULL;
     }
+    if (handshake_lock) {
+	ipmi_destroy_lock(handshake_lock);
+	handshake_lock = NULL;
+    }
+    if (target_lock) {
+	ipmi_destroy_lock(target_lock);
+	target_lock = NULL;
+    }
+    for (i=0; i<LAN_HASH_SIZE; i++) {
+	while (target_list[i]) {
+	    lan_target_t *t = target_list[i];
+	    target_list[i] = t->next;
+	    ipmi_mem_free(t);
+	}
+    }
     while (oem_payload_list) {
 	payload_entry_t *e = oem_payload_list;
 	oem_payload_list = e->next;
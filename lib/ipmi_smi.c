@@ -37,6 +37,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
@@ -46,6 +47,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 
 #include <linux/ipmi.h>
@@ -59,6 +61,7 @@
 #include <OpenIPMI/internal/ipmi_event.h>
 #include <OpenIPMI/internal/ipmi_int.h>
 #include <OpenIPMI/internal/locked_list.h>
+#include <OpenIPMI/internal/ipmi_stat.h>
 
 static ipmi_args_t *smi_con_alloc_args(void);
 
@@ -66,6 +69,17 @@ static ipmi_args_t *smi_con_alloc_args(void);
 #define SMI_TIMEOUT 60000
 
 #define SMI_AUDIT_TIMEOUT 10000000
+
+/* The number of commands we keep outstanding in the driver.  Commands
+   past this wait in smi->wait_q, by priority class, until a response
+   comes back.  This must be a power of two, the low bits of the msgid
+   are the index in smi->cmd_table. */
+#define SMI_MAX_OUTSTANDING 32
+#define SMI_MSGID_SLOT_MASK (SMI_MAX_OUTSTANDING - 1)
+
+/* The most messages we pull from the driver in one wakeup, so other
+   file descriptors get a chance. */
+#define SMI_RECV_BATCH 32
 #if !defined(MIN)
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #endif
@@ -94,6 +108,7 @@ typedef struct pending_cmd_s
 {
     ipmi_con_t            *ipmi;
     ipmi_msg_t            msg;
+    unsigned char         data[IPMI_MAX_MSG_LENGTH];
     ipmi_addr_t           addr;
     unsigned int          addr_len;
     ipmi_ll_rsp_handler_t rsp_handler;
@@ -101,7 +116,11 @@ typedef struct pending_cmd_s
     int                   use_orig_addr;
     ipmi_addr_t           orig_addr;
     unsigned int          orig_addr_len;
-    struct pending_cmd_s  *next, *prev;
+    long                  msgid;
+    int                   prio;
+
+    /* For the wait queue, and the list of failed commands. */
+    struct pending_cmd_s  *next;
 } pending_cmd_t;
 
 typedef struct cmd_handler_s
@@ -115,6 +134,46 @@ typedef struct cmd_handler_s
     struct cmd_handler_s *next, *prev;
 } cmd_handler_t;
 
+#define STAT_XMIT_MSGS		0
+#define STAT_RECV_MSGS		1
+#define STAT_RESPONSES		2
+#define STAT_ASYNC_EVENTS	3
+#define STAT_INCOMING_CMDS	4
+#define STAT_RSP_NO_CMD		5
+#define STAT_TRUNCATED		6
+#define STAT_SEND_ERRORS	7
+#define STAT_RECV_WAKEUPS	8
+/* Commands that had to wait, by priority class. */
+#define STAT_QUEUED_INTERACTIVE	9
+#define STAT_QUEUED_MONITORING	10
+#define STAT_QUEUED_BULK	11
+#define NUM_STATS		12
+
+static const char *smi_stat_names[NUM_STATS] =
+{
+    "smi_xmit_msgs",
+    "smi_recv_msgs",
+    "smi_responses",
+    "smi_async_events",
+    "smi_incoming_cmds",
+    "smi_rsp_no_cmd",
+    "smi_truncated",
+    "smi_send_errors",
+    "smi_recv_wakeups",
+    "smi_queued_interactive",
+    "smi_queued_monitoring",
+    "smi_queued_bulk"
+};
+
+typedef struct smi_stat_info_s
+{
+    void *stats[NUM_STATS];
+
+    /* Set if the stat reads smi->stat_counts directly. */
+    char linked[NUM_STATS];
+    int  push;
+} smi_stat_info_t;
+
 typedef struct smi_data_s
 {
     int                        refcount;
@@ -123,7 +182,26 @@ typedef struct smi_data_s
     int                        fd;
     int                        if_num;
     int			       disabled;
-    pending_cmd_t              *pending_cmds;
+
+    /* Set if this talks to a multiplexer on a socket instead of the
+       driver, see ipmi_smux_setup_con().  mux_down is set when the
+       multiplexer goes away. */
+    int                        mux;
+    char                       *mux_path;
+    int                        mux_down;
+
+    /* The commands in the driver, indexed by the low bits of their
+       msgid.  The rest of the msgid is a sequence number so a stale
+       response can't match a new command in the same slot.  Commands
+       that don't fit wait in wait_q for their priority class.  All
+       protected by cmd_lock. */
+    pending_cmd_t              *cmd_table[SMI_MAX_OUTSTANDING];
+    unsigned int               cmds_outstanding;
+    unsigned long              next_msgid;
+    pending_cmd_t              *wait_q[IPMI_NUM_MSG_PRIOS];
+    pending_cmd_t              *wait_q_tail[IPMI_NUM_MSG_PRIOS];
+    unsigned int               wait_q_depth[IPMI_NUM_MSG_PRIOS];
+    unsigned int               wait_q_skips[IPMI_NUM_MSG_PRIOS];
     ipmi_lock_t                *cmd_lock;
     cmd_handler_t              *cmd_handlers;
     ipmi_lock_t                *cmd_handlers_lock;
@@ -143,6 +221,11 @@ typedef struct smi_data_s
     locked_list_t          *con_change_handlers;
     locked_list_t          *ipmb_change_handlers;
 
+    /* Statistics, counted with atomic adds, see add_stat(). */
+    locked_list_t          *smi_stat_list;
+    unsigned long          stat_counts[NUM_STATS];
+    unsigned long          stat_push_users;
+
     struct smi_data_s *next, *prev;
 } smi_data_t;
 
@@ -166,6 +249,237 @@ static int smi_valid_ipmi(ipmi_con_t *ipmi)
     return (elem != NULL);
 }
 
+typedef struct smi_add_stat_info_s
+{
+    int statnum;
+    int count;
+} smi_add_stat_info_t;
+
+static int
+add_stat_cb(void *cb_data, void *item1, void *item2)
+{
+    ipmi_ll_stat_info_t *info = item2;
+    smi_stat_info_t     *stat = item1;
+    smi_add_stat_info_t *sinfo = cb_data;
+
+    if (stat->stats[sinfo->statnum] && !stat->linked[sinfo->statnum])
+	ipmi_ll_con_stat_call_adder(info, stat->stats[sinfo->statnum],
+				    sinfo->count);
+    return LOCKED_LIST_ITER_CONTINUE;
+}
+
+static inline void
+add_stat(smi_data_t *smi, int stat, int count)
+{
+    smi_add_stat_info_t sinfo;
+
+    ipmi_stat_atomic_add(&smi->stat_counts[stat], (unsigned long) count);
+    if (!ipmi_stat_atomic_load(&smi->stat_push_users))
+	return;
+
+    sinfo.statnum = stat;
+    sinfo.count = count;
+    locked_list_iterate(smi->smi_stat_list, add_stat_cb, &sinfo);
+}
+
+static void
+smi_release_stats(smi_data_t          *smi,
+		  smi_stat_info_t     *stat,
+		  ipmi_ll_stat_info_t *info)
+{
+    int i;
+
+    for (i=0; i<NUM_STATS; i++) {
+	if (!stat->stats[i])
+	    continue;
+	if (stat->linked[i])
+	    ipmi_ll_con_stat_call_unregister_counter(info, stat->stats[i],
+						     &smi->stat_counts[i]);
+	else
+	    ipmi_ll_con_stat_call_unregister(info, stat->stats[i]);
+	stat->stats[i] = NULL;
+    }
+    if (stat->push) {
+	ipmi_stat_atomic_add(&smi->stat_push_users, (unsigned long) -1);
+	stat->push = 0;
+    }
+}
+
+typedef struct smi_unreg_stat_info_s
+{
+    smi_data_t          *smi;
+    ipmi_ll_stat_info_t *cmpinfo;
+    int                 found;
+} smi_unreg_stat_info_t;
+
+static int
+smi_unreg_stat_info(void *cb_data, void *item1, void *item2)
+{
+    ipmi_ll_stat_info_t   *info = item2;
+    smi_stat_info_t       *stat = item1;
+    smi_unreg_stat_info_t *sinfo = cb_data;
+
+    if (!sinfo->cmpinfo || (sinfo->cmpinfo == info)) {
+	locked_list_remove(sinfo->smi->smi_stat_list, stat, info);
+	smi_release_stats(sinfo->smi, stat, info);
+	ipmi_mem_free(stat);
+	sinfo->found = 1;
+    }
+    return LOCKED_LIST_ITER_CONTINUE;
+}
+
+static void
+smi_free_stats(smi_data_t *smi)
+{
+    smi_unreg_stat_info_t sinfo;
+
+    if (!smi->smi_stat_list)
+	return;
+    sinfo.smi = smi;
+    sinfo.cmpinfo = NULL;
+    sinfo.found = 0;
+    locked_list_iterate(smi->smi_stat_list, smi_unreg_stat_info, &sinfo);
+    locked_list_destroy(smi->smi_stat_list);
+    smi->smi_stat_list = NULL;
+}
+
+static int
+smi_register_stat_handler(ipmi_con_t          *ipmi,
+			  ipmi_ll_stat_info_t *info)
+{
+    smi_stat_info_t *nstat;
+    smi_data_t      *smi = ipmi->con_data;
+    int             i;
+
+    nstat = ipmi_mem_alloc(sizeof(*nstat));
+    if (!nstat)
+	return ENOMEM;
+    memset(nstat, 0, sizeof(*nstat));
+
+    for (i=0; i<NUM_STATS; i++) {
+	if (!ipmi_ll_con_stat_call_register_counter(info, smi_stat_names[i],
+						    ipmi->name,
+						    &smi->stat_counts[i],
+						    &(nstat->stats[i])))
+	{
+	    nstat->linked[i] = 1;
+	    continue;
+	}
+	ipmi_ll_con_stat_call_register(info, smi_stat_names[i],
+				       ipmi->name, &(nstat->stats[i]));
+	if (nstat->stats[i])
+	    nstat->push = 1;
+    }
+    if (nstat->push)
+	ipmi_stat_atomic_add(&smi->stat_push_users, 1);
+
+    if (!locked_list_add(smi->smi_stat_list, nstat, info)) {
+	smi_release_stats(smi, nstat, info);
+	ipmi_mem_free(nstat);
+	return ENOMEM;
+    }
+
+    return 0;
+}
+
+static int
+smi_unregister_stat_handler(ipmi_con_t          *ipmi,
+			    ipmi_ll_stat_info_t *info)
+{
+    smi_unreg_stat_info_t sinfo;
+    smi_data_t            *smi = ipmi->con_data;
+
+    sinfo.smi = smi;
+    sinfo.cmpinfo = info;
+    sinfo.found = 0;
+    locked_list_iterate(smi->smi_stat_list, smi_unreg_stat_info, &sinfo);
+    if (sinfo.found)
+	return 0;
+    else
+	return EINVAL;
+}
+
+/* Report a command that won't get a response from the driver back to
+   its user with an error and free it. */
+static void
+fail_cmd(ipmi_con_t *ipmi, smi_data_t *smi, pending_cmd_t *cmd)
+{
+    ipmi_addr_t   *addr;
+    unsigned int  addr_len;
+    unsigned char data[1];
+
+    if (!smi->disabled && cmd->rsp_handler) {
+	if (cmd->use_orig_addr) {
+	    addr = &cmd->orig_addr;
+	    addr_len = cmd->orig_addr_len;
+	} else {
+	    addr = &cmd->addr;
+	    addr_len = cmd->addr_len;
+	}
+	data[0] = IPMI_UNKNOWN_ERR_CC;
+
+	cmd->msg.netfn |= 1;
+	cmd->msg.data = data;
+	cmd->msg.data_len = 1;
+	ipmi_handle_rsp_item_copyall(ipmi, cmd->rsp_item,
+				     addr, addr_len, &cmd->msg,
+				     cmd->rsp_handler);
+    }
+    ipmi_mem_free(cmd);
+}
+
+/* The wait queue functions must be called with cmd_lock held. */
+static void
+wait_q_add(smi_data_t *smi, pending_cmd_t *cmd)
+{
+    int prio = cmd->prio;
+
+    cmd->next = NULL;
+    if (smi->wait_q_tail[prio])
+	smi->wait_q_tail[prio]->next = cmd;
+    else
+	smi->wait_q[prio] = cmd;
+    smi->wait_q_tail[prio] = cmd;
+    smi->wait_q_depth[prio]++;
+}
+
+static pending_cmd_t *
+wait_q_next(smi_data_t *smi)
+{
+    pending_cmd_t *cmd;
+    int           prio;
+
+    prio = ipmi_con_prio_pick(smi->wait_q_depth, smi->wait_q_skips);
+    if (prio < 0)
+	return NULL;
+    cmd = smi->wait_q[prio];
+    smi->wait_q[prio] = cmd->next;
+    if (!smi->wait_q[prio])
+	smi->wait_q_tail[prio] = NULL;
+    smi->wait_q_depth[prio]--;
+    cmd->next = NULL;
+    return cmd;
+}
+
+/* Empty all the wait queues onto the front of list, return the new
+   list. */
+static pending_cmd_t *
+wait_q_take_all(smi_data_t *smi, pending_cmd_t *list)
+{
+    int prio;
+
+    for (prio=IPMI_NUM_MSG_PRIOS-1; prio>=0; prio--) {
+	if (!smi->wait_q[prio])
+	    continue;
+	smi->wait_q_tail[prio]->next = list;
+	list = smi->wait_q[prio];
+	smi->wait_q[prio] = NULL;
+	smi->wait_q_tail[prio] = NULL;
+	smi->wait_q_depth[prio] = 0;
+    }
+    return list;
+}
+
 static void
 smi_cleanup(ipmi_con_t *ipmi)
 {
@@ -173,6 +487,7 @@ smi_cleanup(ipmi_con_t *ipmi)
     pending_cmd_t *cmd, *next_cmd;
     cmd_handler_t *hnd_to_free, *next_hnd;
     int           rv;
+    int           i;
 
     /* First order of business is to remove it from the SMI list. */
     smi = (smi_data_t *) ipmi->con_data;
@@ -189,31 +504,17 @@ smi_cleanup(ipmi_con_t *ipmi)
     if (smi->close_done)
 	smi->close_done(ipmi, smi->close_cb_data);
 
-    cmd = smi->pending_cmds;
-    smi->pending_cmds = NULL;
+    for (i=0; i<SMI_MAX_OUTSTANDING; i++) {
+	cmd = smi->cmd_table[i];
+	smi->cmd_table[i] = NULL;
+	if (cmd)
+	    fail_cmd(ipmi, smi, cmd);
+    }
+    smi->cmds_outstanding = 0;
+    cmd = wait_q_take_all(smi, NULL);
     while (cmd) {
-	ipmi_addr_t   *addr;
-	unsigned int  addr_len;
-	unsigned char data[1];
 	next_cmd = cmd->next;
-	if (!smi->disabled && cmd->rsp_handler) {
-	    if (cmd->use_orig_addr) {
-		addr = &cmd->orig_addr;
-		addr_len = cmd->orig_addr_len;
-	    } else {
-		addr = &cmd->addr;
-		addr_len = cmd->addr_len;
-	    }
-	    data[0] = IPMI_UNKNOWN_ERR_CC;
-	    
-	    cmd->msg.netfn |= 1;
-	    cmd->msg.data = data;
-	    cmd->msg.data_len = 1;
-	    ipmi_handle_rsp_item_copyall(ipmi, cmd->rsp_item,
-					 addr, addr_len, &cmd->msg,
-					 cmd->rsp_handler);
-	}
-	ipmi_mem_free(cmd);
+	fail_cmd(ipmi, smi, cmd);
 	cmd = next_cmd;
     }
 
@@ -238,6 +539,7 @@ smi_cleanup(ipmi_con_t *ipmi)
     if (ipmi->oem_data_cleanup)
 	ipmi->oem_data_cleanup(ipmi);
     ipmi_con_attr_cleanup(ipmi);
+    smi_free_stats(smi);
     if (smi->smi_lock)
 	ipmi_destroy_lock(smi->smi_lock);
     if (smi->cmd_handlers_lock)
@@ -256,6 +558,8 @@ smi_cleanup(ipmi_con_t *ipmi)
     /* Close the fd after we have deregistered it. */
     close(smi->fd);
 
+    if (smi->mux_path)
+	ipmi_mem_free(smi->mux_path);
     ipmi_mem_free(smi);
     if (ipmi->name)
 	ipmi_mem_free(ipmi->name);
@@ -290,26 +594,67 @@ add_cmd(ipmi_con_t        *ipmi,
     memcpy(&(cmd->addr), addr, addr_len);
     cmd->addr_len = addr_len;
     cmd->msg = *msg;
-    cmd->msg.data = NULL;
+    /* Keep the data, the command may have to wait before it's sent. */
+    memcpy(cmd->data, msg->data, msg->data_len);
+    cmd->msg.data = cmd->data;
+    cmd->next = NULL;
+}
+
+static int smi_send(smi_data_t        *smi,
+		    int               fd,
+		    const ipmi_addr_t *addr,
+		    unsigned int      addr_len,
+		    const ipmi_msg_t  *msg,
+		    long              msgid);
+
+/* Must be called with cmd_lock held and a free slot in the command
+   table.  Give the command a msgid and send it to the driver. */
+static int
+start_cmd(smi_data_t *smi, pending_cmd_t *cmd)
+{
+    unsigned int slot;
+    int          rv;
 
-    cmd->next = smi->pending_cmds;
-    cmd->prev = NULL;
-    if (smi->pending_cmds)
-	smi->pending_cmds->prev = cmd;
-    smi->pending_cmds = cmd;
+    while (smi->cmd_table[smi->next_msgid & SMI_MSGID_SLOT_MASK])
+	smi->next_msgid++;
+    slot = smi->next_msgid & SMI_MSGID_SLOT_MASK;
+    cmd->msgid = (long) smi->next_msgid;
+    smi->next_msgid++;
+
+    rv = smi_send(smi, smi->fd, &cmd->addr, cmd->addr_len, &cmd->msg,
+		  cmd->msgid);
+    if (rv) {
+	add_stat(smi, STAT_SEND_ERRORS, 1);
+	return rv;
+    }
+    smi->cmd_table[slot] = cmd;
+    smi->cmds_outstanding++;
+    add_stat(smi, STAT_XMIT_MSGS, 1);
+    return 0;
 }
 
-static void
-remove_cmd(ipmi_con_t    *ipmi,
-	   smi_data_t    *smi,
-	   pending_cmd_t *cmd)
-{
-    if (cmd->next)
-	cmd->next->prev = cmd->prev;
-    if (cmd->prev)
-	cmd->prev->next = cmd->next;
-    else
-	smi->pending_cmds = cmd->next;
+/* Must be called with cmd_lock held.  Send waiting commands while
+   there is room in the driver.  Commands that could not be sent are
+   returned in a list, the caller must fail them after releasing the
+   lock. */
+static pending_cmd_t *
+start_waiting_cmds(smi_data_t *smi)
+{
+    pending_cmd_t *cmd, *failed = NULL, *failed_tail = NULL;
+
+    while (smi->cmds_outstanding < SMI_MAX_OUTSTANDING) {
+	cmd = wait_q_next(smi);
+	if (!cmd)
+	    break;
+	if (start_cmd(smi, cmd)) {
+	    if (failed_tail)
+		failed_tail->next = cmd;
+	    else
+		failed = cmd;
+	    failed_tail = cmd;
+	}
+    }
+    return failed;
 }
 
 static int
@@ -417,6 +762,34 @@ open_smi_fd(int if_num, int *reterr)
     return fd;
 }
 
+static int
+open_smux_fd(const char *path, int *reterr)
+{
+    struct sockaddr_un sun;
+    int                fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+	*reterr = ENAMETOOLONG;
+	return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1) {
+	*reterr = errno;
+	return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+	*reterr = errno;
+	close(fd);
+	return -1;
+    }
+    *reterr = 0;
+    return fd;
+}
+
 static int
 smi_send(smi_data_t        *smi,
 	 int               fd,
@@ -459,6 +832,28 @@ smi_send(smi_data_t        *smi,
     if (msg->data_len > IPMI_MAX_MSG_LENGTH)
 	return EBADF;
 
+    if (smi->mux) {
+	ipmi_smux_msg_t m;
+
+	if (smi->mux_down)
+	    return EPIPE;
+	if (addr_len > sizeof(m.addr))
+	    return EINVAL;
+	memset(&m, 0, sizeof(m));
+	m.type = IPMI_SMUX_SEND;
+	m.netfn = msg->netfn;
+	m.cmd = msg->cmd;
+	m.addr_len = addr_len;
+	memcpy(m.addr, addr, addr_len);
+	m.data_len = msg->data_len;
+	memcpy(m.data, msg->data, msg->data_len);
+	m.msgid = msgid;
+	rv = send(fd, &m, IPMI_SMUX_MSG_LEN(&m), MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (rv == -1)
+	    return errno;
+	return 0;
+    }
+
     req.addr = (unsigned char *) addr;
     req.addr_len = addr_len;
     req.msgid = (long) smi;
@@ -481,6 +876,10 @@ set_ipmb_in_dev(smi_data_t          *smi,
     int                                 rv;
     unsigned int                        i;
 
+    if (smi->mux)
+	/* The multiplexer owns the driver settings. */
+	return;
+
     for (i=0; i<num_ipmb_addr; i++) {
 	if (!ipmb_addr[i])
 	    continue;
@@ -664,23 +1063,19 @@ static void
 handle_response(ipmi_con_t *ipmi, struct ipmi_recv *recv)
 {
     smi_data_t            *smi = (smi_data_t *) ipmi->con_data;
-    pending_cmd_t         *cmd, *finder;
+    pending_cmd_t         *cmd, *failed, *next_cmd;
     ipmi_ll_rsp_handler_t rsp_handler;
     ipmi_msgi_t           *rspi;
+    unsigned int          slot = recv->msgid & SMI_MSGID_SLOT_MASK;
 
-    cmd = (pending_cmd_t *) recv->msgid;
-    
     ipmi_lock(smi->cmd_lock);
 
-    finder = smi->pending_cmds;
-    while (finder) {
-	if (finder == cmd)
-	    break;
-	finder = finder->next;
-    }
-    if (!finder)
+    cmd = smi->cmd_table[slot];
+    if (!cmd || (cmd->msgid != recv->msgid)) {
 	/* The command was not found. */
+	add_stat(smi, STAT_RSP_NO_CMD, 1);
 	goto out_unlock;
+    }
 
     /* We have found the command, handle it. */
 
@@ -688,10 +1083,20 @@ handle_response(ipmi_con_t *ipmi, struct ipmi_recv *recv)
     rsp_handler = cmd->rsp_handler;
     rspi = cmd->rsp_item;
 
-    remove_cmd(ipmi, smi, cmd);
+    smi->cmd_table[slot] = NULL;
+    smi->cmds_outstanding--;
+
+    /* There's room in the driver now. */
+    failed = start_waiting_cmds(smi);
 
     ipmi_unlock(smi->cmd_lock);
 
+    while (failed) {
+	next_cmd = failed->next;
+	fail_cmd(ipmi, smi, failed);
+	failed = next_cmd;
+    }
+
     if (cmd->use_orig_addr) {
 	/* We did an address translation, make sure the address is the one
 	   that was previously provided. */
@@ -732,6 +1137,29 @@ call_event_handler(void *cb_data, void *item1, void *item2)
     return LOCKED_LIST_ITER_CONTINUE;
 }
 
+/* Returns -1 with errno set on failure, like the ioctl. */
+static int
+smi_set_gets_events(smi_data_t *smi, int val)
+{
+    ipmi_smux_msg_t m;
+
+    if (!smi->mux)
+	return ioctl(smi->fd, IPMICTL_SET_GETS_EVENTS_CMD, &val);
+
+    if (smi->mux_down) {
+	errno = EPIPE;
+	return -1;
+    }
+    memset(&m, 0, sizeof(m));
+    m.type = IPMI_SMUX_EVENTS;
+    m.netfn = val;
+    m.data_len = 0;
+    if (send(smi->fd, &m, IPMI_SMUX_MSG_LEN(&m),
+	     MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+	return -1;
+    return 0;
+}
+
 static int
 smi_add_event_handler(ipmi_con_t            *ipmi,
 		      ipmi_ll_evt_handler_t handler,
@@ -745,8 +1173,7 @@ smi_add_event_handler(ipmi_con_t            *ipmi,
 	rv = ENOMEM;
     if (!rv) {
 	if (locked_list_num_entries(smi->event_handlers) == 1) {
-	    int val = 1;
-	    rv = ioctl(smi->fd, IPMICTL_SET_GETS_EVENTS_CMD, &val);
+	    rv = smi_set_gets_events(smi, 1);
 	    if (rv == -1) {
 		locked_list_remove(smi->event_handlers, handler, cb_data);
 		rv = errno;
@@ -768,10 +1195,8 @@ smi_remove_event_handler(ipmi_con_t            *ipmi,
     ipmi_lock(smi->smi_lock);
     if (! locked_list_remove(smi->event_handlers, handler, cb_data))
 	rv = EINVAL;
-    if (locked_list_num_entries(smi->event_handlers) == 0) {
-	int val = 0;
-	ioctl(smi->fd, IPMICTL_SET_GETS_EVENTS_CMD, &val);
-    }
+    if (locked_list_num_entries(smi->event_handlers) == 0)
+	smi_set_gets_events(smi, 0);
     ipmi_unlock(smi->smi_lock);
     return rv;
 }
@@ -879,15 +1304,18 @@ gen_recv_msg(ipmi_con_t *ipmi, struct ipmi_recv *recv)
 
     switch (recv->recv_type) {
 	case IPMI_RESPONSE_RECV_TYPE:
+	    add_stat(ipmi->con_data, STAT_RESPONSES, 1);
 	    handle_response(ipmi, recv);
 	    break;
 
 	case IPMI_ASYNC_EVENT_RECV_TYPE:
+	    add_stat(ipmi->con_data, STAT_ASYNC_EVENTS, 1);
 	    handle_async_event(ipmi, (ipmi_addr_t *) recv->addr,
 			       recv->addr_len, &recv->msg);
 	    break;
 
 	case IPMI_CMD_RECV_TYPE:
+	    add_stat(ipmi->con_data, STAT_INCOMING_CMDS, 1);
 	    handle_incoming_command(ipmi, recv);
 	    break;
 
@@ -896,50 +1324,153 @@ gen_recv_msg(ipmi_con_t *ipmi, struct ipmi_recv *recv)
     }
 }
 
+static void call_con_change_handlers(smi_data_t *smi, int err,
+				     unsigned int port, int any_port_up);
+
+/* Get a message from the multiplexer socket into recv.  Returns -1
+   with errno set like the receive ioctl, EPIPE means the multiplexer
+   is gone. */
+static int
+smux_recv(int fd, struct ipmi_recv *rcv)
+{
+    ipmi_smux_msg_t m;
+    ssize_t         len;
+    ssize_t         hdr = offsetof(ipmi_smux_msg_t, data);
+
+    len = recv(fd, &m, sizeof(m), MSG_DONTWAIT);
+    if (len == 0) {
+	errno = EPIPE;
+	return -1;
+    }
+    if (len < 0)
+	return -1;
+    if ((len < hdr) || (m.data_len > (len - hdr))
+	|| (m.addr_len > rcv->addr_len))
+    {
+	/* Bad message, just skip it. */
+	errno = EBADMSG;
+	return -1;
+    }
+
+    if (m.type == IPMI_SMUX_EVENT)
+	rcv->recv_type = IPMI_ASYNC_EVENT_RECV_TYPE;
+    else
+	rcv->recv_type = IPMI_RESPONSE_RECV_TYPE;
+    rcv->msgid = m.msgid;
+    memcpy(rcv->addr, m.addr, m.addr_len);
+    rcv->addr_len = m.addr_len;
+    rcv->msg.netfn = m.netfn;
+    rcv->msg.cmd = m.cmd;
+    if (m.data_len > rcv->msg.data_len) {
+	m.data_len = rcv->msg.data_len;
+	memcpy(rcv->msg.data, m.data, m.data_len);
+	errno = EMSGSIZE;
+	return -1;
+    }
+    memcpy(rcv->msg.data, m.data, m.data_len);
+    rcv->msg.data_len = m.data_len;
+    return 0;
+}
+
+/* The multiplexer went away, nothing will come back from it. */
+static void
+smux_lost(ipmi_con_t *ipmi, smi_data_t *smi)
+{
+    pending_cmd_t *failed = NULL, *cmd;
+    int           i;
+
+    ipmi_log(IPMI_LOG_SEVERE,
+	     "%sipmi_smi.c(smux_lost): Lost the connection to %s",
+	     IPMI_CONN_NAME(ipmi), smi->mux_path);
+
+    ipmi_lock(smi->cmd_lock);
+    smi->mux_down = 1;
+    for (i=0; i<SMI_MAX_OUTSTANDING; i++) {
+	cmd = smi->cmd_table[i];
+	smi->cmd_table[i] = NULL;
+	if (cmd) {
+	    cmd->next = failed;
+	    failed = cmd;
+	}
+    }
+    smi->cmds_outstanding = 0;
+    failed = wait_q_take_all(smi, failed);
+    ipmi_unlock(smi->cmd_lock);
+
+    /* The socket will stay readable, stop waiting on it. */
+    if (ipmi->os_hnd->set_fd_enables)
+	ipmi->os_hnd->set_fd_enables(ipmi->os_hnd, smi->fd_wait_id, 0, 0, 0);
+
+    while (failed) {
+	cmd = failed->next;
+	fail_cmd(ipmi, smi, failed);
+	failed = cmd;
+    }
+
+    call_con_change_handlers(smi, EPIPE, 0, 0);
+}
+
 static void
 ipmi_dev_data_handler(int            fd,
 		      void           *cb_data,
 		      os_hnd_fd_id_t *id)
 {
     ipmi_con_t       *ipmi = (ipmi_con_t *) cb_data;
+    smi_data_t       *smi;
     unsigned char    data[IPMI_MAX_MSG_LENGTH];
     ipmi_addr_t      addr;
     struct ipmi_recv recv;
     int              rv;
+    int              count;
 
     if (!smi_valid_ipmi(ipmi)) {
 	/* We can have due to a race condition, just return and
            everything should be fine. */
 	return;
     }
+    smi = ipmi->con_data;
+    add_stat(smi, STAT_RECV_WAKEUPS, 1);
+
+    /* Pull everything the driver has for us (up to a limit), the
+       driver returns EAGAIN when its queue is empty. */
+    for (count = 0; count < SMI_RECV_BATCH; count++) {
+	recv.msg.data = data;
+	recv.msg.data_len = sizeof(data);
+	recv.addr = (unsigned char *) &addr;
+	recv.addr_len = sizeof(addr);
+	if (smi->mux)
+	    rv = smux_recv(fd, &recv);
+	else
+	    rv = ioctl(fd, IPMICTL_RECEIVE_MSG_TRUNC, &recv);
+	if (rv == -1) {
+	    if (errno == EMSGSIZE) {
+		/* The message was truncated, handle it as such. */
+		data[0] = IPMI_REQUESTED_DATA_LENGTH_EXCEEDED_CC;
+		add_stat(smi, STAT_TRUNCATED, 1);
+	    } else if (smi->mux && (errno == EBADMSG)) {
+		continue;
+	    } else {
+		if (errno == EPIPE && !smi->mux_down)
+		    smux_lost(ipmi, smi);
+		break;
+	    }
+	}
 
-    recv.msg.data = data;
-    recv.msg.data_len = sizeof(data);
-    recv.addr = (unsigned char *) &addr;
-    recv.addr_len = sizeof(addr);
-    rv = ioctl(fd, IPMICTL_RECEIVE_MSG_TRUNC, &recv);
-    if (rv == -1) {
-	if (errno == EMSGSIZE) {
-	    /* The message was truncated, handle it as such. */
-	    data[0] = IPMI_REQUESTED_DATA_LENGTH_EXCEEDED_CC;
-	    rv = 0;
-	} else
-	    goto out;
+	add_stat(smi, STAT_RECV_MSGS, 1);
+	gen_recv_msg(ipmi, &recv);
     }
 
-    gen_recv_msg(ipmi, &recv);
-
- out:
     smi_put(ipmi);
 }
 
 static int
-smi_send_command(ipmi_con_t            *ipmi,
-		 const ipmi_addr_t     *iaddr,
-		 unsigned int          addr_len,
-		 const ipmi_msg_t      *msg,
-		 ipmi_ll_rsp_handler_t rsp_handler,
-		 ipmi_msgi_t           *trspi)
+smi_send_command_option(ipmi_con_t              *ipmi,
+			const ipmi_addr_t       *iaddr,
+			unsigned int            addr_len,
+			const ipmi_msg_t        *msg,
+			const ipmi_con_option_t *options,
+			ipmi_ll_rsp_handler_t   rsp_handler,
+			ipmi_msgi_t             *trspi)
 {
     pending_cmd_t *cmd;
     smi_data_t    *smi;
@@ -1001,22 +1532,27 @@ smi_send_command(ipmi_con_t            *ipmi,
 	}
     }
 
-    /* Put it in the list first. */
     cmd->msg = *msg;
     cmd->rsp_handler = rsp_handler;
     cmd->rsp_item = rspi;
+    cmd->prio = ipmi_con_msg_prio(options, msg);
 
     ipmi_lock(smi->cmd_lock);
     add_cmd(ipmi, addr, addr_len, msg, smi, cmd);
 
-    rv = smi_send(smi, smi->fd, addr, addr_len, msg, (long) cmd);
-    if (rv) {
-	remove_cmd(ipmi, smi, cmd);
-	ipmi_mem_free(cmd);
-	goto out_unlock;
+    if (smi->cmds_outstanding >= SMI_MAX_OUTSTANDING) {
+	/* The driver has enough to do, wait for a response.  Nothing
+	   can be waiting if there is room in the driver, so this
+	   doesn't jump ahead of anything. */
+	wait_q_add(smi, cmd);
+	add_stat(smi, STAT_QUEUED_INTERACTIVE + cmd->prio, 1);
+	rv = 0;
+    } else {
+	rv = start_cmd(smi, cmd);
+	if (rv)
+	    ipmi_mem_free(cmd);
     }
 
- out_unlock:
     ipmi_unlock(smi->cmd_lock);
  out_unlock2:
     if (rv) {
@@ -1027,6 +1563,18 @@ smi_send_command(ipmi_con_t            *ipmi,
     return rv;
 }
 
+static int
+smi_send_command(ipmi_con_t            *ipmi,
+		 const ipmi_addr_t     *addr,
+		 unsigned int          addr_len,
+		 const ipmi_msg_t      *msg,
+		 ipmi_ll_rsp_handler_t rsp_handler,
+		 ipmi_msgi_t           *rspi)
+{
+    return smi_send_command_option(ipmi, addr, addr_len, msg, NULL,
+				   rsp_handler, rspi);
+}
+
 static int
 smi_send_response(ipmi_con_t        *ipmi,
 		  const ipmi_addr_t *addr,
@@ -1039,6 +1587,10 @@ smi_send_response(ipmi_con_t        *ipmi,
 
     smi = (smi_data_t *) ipmi->con_data;
 
+    if (smi->mux)
+	/* No commands come in through a multiplexer to respond to. */
+	return ENOSYS;
+
     rv = smi_send(smi, smi->fd, addr, addr_len, msg, sequence);
 
     return rv;
@@ -1059,6 +1611,11 @@ smi_register_for_command(ipmi_con_t            *ipmi,
 
     smi = (smi_data_t *) ipmi->con_data;
 
+    if (smi->mux)
+	/* Only one process can get a command, so the multiplexer
+	   doesn't pass them on. */
+	return ENOSYS;
+
     rv = add_cmd_registration(ipmi, netfn, cmd, handler, cmd_data, data2, data3);
     if (rv)
 	goto out_unlock;
@@ -1086,6 +1643,9 @@ smi_deregister_for_command(ipmi_con_t    *ipmi,
 
     smi = (smi_data_t *) ipmi->con_data;
 
+    if (smi->mux)
+	return ENOSYS;
+
     reg.netfn = netfn;
     reg.cmd = cmd;
     rv = ioctl(smi->fd, IPMICTL_UNREGISTER_FOR_CMD, &reg);
@@ -1163,6 +1723,9 @@ cleanup_con(ipmi_con_t *ipmi)
 	    locked_list_destroy(smi->event_handlers);
 	if (smi->ipmb_change_handlers)
 	    locked_list_destroy(smi->ipmb_change_handlers);
+	smi_free_stats(smi);
+	if (smi->mux_path)
+	    ipmi_mem_free(smi->mux_path);
 	ipmi_mem_free(smi);
     }
 }
@@ -1438,6 +2001,7 @@ static ipmi_args_t *get_startup_args(ipmi_con_t *ipmi);
 
 static int
 setup(int          if_num,
+      const char   *mux_path,
       os_handler_t *handlers,
       void         *user_data,
       ipmi_con_t   **new_con)
@@ -1448,7 +2012,7 @@ setup(int          if_num,
     int        i;
 
     /* Keep things sane. */
-    if (if_num >= 100)
+    if (!mux_path && (if_num >= 100))
 	return EINVAL;
 
     ipmi = ipmi_mem_alloc(sizeof(*ipmi));
@@ -1458,7 +2022,7 @@ setup(int          if_num,
 
     ipmi->user_data = user_data;
     ipmi->os_hnd = handlers;
-    ipmi->con_type = "smi";
+    ipmi->con_type = mux_path ? "smux" : "smi";
     ipmi->priv_level = IPMI_PRIVILEGE_ADMIN; /* Always admin privilege. */
 
     rv = ipmi_con_attr_init(ipmi);
@@ -1479,7 +2043,17 @@ setup(int          if_num,
     for (i=0; i<MAX_IPMI_USED_CHANNELS; i++)
 	smi->slave_addr[i] = 0x20; /* Assume this until told otherwise. */
 
-    smi->fd = open_smi_fd(if_num, &rv);
+    if (mux_path) {
+	smi->mux = 1;
+	smi->mux_path = ipmi_strdup(mux_path);
+	if (!smi->mux_path) {
+	    rv = ENOMEM;
+	    smi->fd = -1;
+	    goto out_err;
+	}
+	smi->fd = open_smux_fd(mux_path, &rv);
+    } else
+	smi->fd = open_smi_fd(if_num, &rv);
     if (smi->fd == -1) {
 	goto out_err;
     }
@@ -1502,6 +2076,12 @@ setup(int          if_num,
 	goto out_err;
     }
 
+    smi->smi_stat_list = locked_list_alloc(handlers);
+    if (!smi->smi_stat_list) {
+	rv = ENOMEM;
+	goto out_err;
+    }
+
     /* Create the locks if they are available. */
     rv = ipmi_create_lock_os_hnd(handlers, &smi->cmd_lock);
     if (rv)
@@ -1524,6 +2104,7 @@ setup(int          if_num,
     ipmi->add_con_change_handler = smi_add_con_change_handler;
     ipmi->remove_con_change_handler = smi_remove_con_change_handler;
     ipmi->send_command = smi_send_command;
+    ipmi->send_command_option = smi_send_command_option;
     ipmi->add_event_handler = smi_add_event_handler;
     ipmi->remove_event_handler = smi_remove_event_handler;
     ipmi->send_response = smi_send_response;
@@ -1534,6 +2115,8 @@ setup(int          if_num,
     ipmi->handle_async_event = handle_async_event;
     ipmi->get_startup_args = get_startup_args;
     ipmi->disable = smi_disable;
+    ipmi->register_stat_handler = smi_register_stat_handler;
+    ipmi->unregister_stat_handler = smi_unregister_stat_handler;
 
     rv = handlers->add_fd_to_wait_for(ipmi->os_hnd,
 				      smi->fd,
@@ -1577,15 +2160,34 @@ ipmi_smi_setup_con(int          if_num,
 	|| !handlers->free_timer)
 	return ENOSYS;
 
-    err = setup(if_num, handlers, user_data, new_con);
+    err = setup(if_num, NULL, handlers, user_data, new_con);
     return err;
 }
 
+int
+ipmi_smux_setup_con(const char   *path,
+		    os_handler_t *handlers,
+		    void         *user_data,
+		    ipmi_con_t   **new_con)
+{
+    if (!handlers->add_fd_to_wait_for
+	|| !handlers->remove_fd_to_wait_for
+	|| !handlers->alloc_timer
+	|| !handlers->free_timer)
+	return ENOSYS;
+
+    if (!path)
+	path = IPMI_SMUX_DEFAULT_PATH;
+    return setup(0, path, handlers, user_data, new_con);
+}
+
 typedef struct smi_args_s
 {
     int ifnum;
 } smi_args_t;
 
+static ipmi_args_t *smux_con_alloc_args(const char *path);
+
 static ipmi_args_t *
 get_startup_args(ipmi_con_t *ipmi)
 {
@@ -1593,11 +2195,14 @@ get_startup_args(ipmi_con_t *ipmi)
     smi_args_t  *sargs;
     smi_data_t  *smi;
 
+    smi = (smi_data_t *) ipmi->con_data;
+    if (smi->mux)
+	return smux_con_alloc_args(smi->mux_path);
+
     args = smi_con_alloc_args();
     if (! args)
 	return NULL;
     sargs = i_ipmi_args_get_extra_data(args);
-    smi = (smi_data_t *) ipmi->con_data;
     sargs->ifnum = smi->if_num;
     return args;
 }
@@ -1771,7 +2376,178 @@ smi_con_alloc_args(void)
 			     sizeof(smi_args_t));
 }
 
+/*
+ * Connections through an SMI multiplexer, the only argument is the
+ * path to the multiplexer socket.
+ */
+typedef struct smux_args_s
+{
+    char *path;
+} smux_args_t;
+
+static void
+smux_free_args(ipmi_args_t *args)
+{
+    smux_args_t *sargs = i_ipmi_args_get_extra_data(args);
+
+    if (sargs->path)
+	ipmi_mem_free(sargs->path);
+}
+
+static int
+smux_connect_args(ipmi_args_t  *args,
+		  os_handler_t *handler,
+		  void         *user_data,
+		  ipmi_con_t   **new_con)
+{
+    smux_args_t *sargs = i_ipmi_args_get_extra_data(args);
+
+    return ipmi_smux_setup_con(sargs->path, handler, user_data, new_con);
+}
+
+static const char *
+smux_args_get_type(ipmi_args_t  *args)
+{
+    return "smux";
+}
+
+static int
+smux_args_get_val(ipmi_args_t  *args,
+		  unsigned int argnum,
+		  const char   **name,
+		  const char   **type,
+		  const char   **help,
+		  char         **value,
+		  const char   ***range)
+{
+    smux_args_t *sargs = i_ipmi_args_get_extra_data(args);
+
+    if (argnum > 0)
+	return E2BIG;
+
+    if (name)
+	*name = "Socket_Path";
+    if (type)
+	*type = "str";
+    if (help)
+	*help = "The path of the SMI multiplexer socket, the default is "
+	    IPMI_SMUX_DEFAULT_PATH ".";
+    if (value) {
+	*value = NULL;
+	if (sargs->path) {
+	    *value = ipmi_strdup(sargs->path);
+	    if (!*value)
+		return ENOMEM;
+	}
+    }
+    return 0;
+}
+
+static int
+smux_args_set_val(ipmi_args_t  *args,
+		  unsigned int argnum,
+		  const char   *name,
+		  const char   *value)
+{
+    smux_args_t *sargs = i_ipmi_args_get_extra_data(args);
+    char        *nval = NULL;
+
+    if (name) {
+	if (strcmp(name, "Socket_Path") != 0)
+	    return EINVAL;
+    } else if (argnum > 0) {
+	return E2BIG;
+    }
+
+    if (value) {
+	nval = ipmi_strdup(value);
+	if (!nval)
+	    return ENOMEM;
+    }
+    if (sargs->path)
+	ipmi_mem_free(sargs->path);
+    sargs->path = nval;
+    return 0;
+}
+
+static ipmi_args_t *
+smux_args_copy(ipmi_args_t *args)
+{
+    smux_args_t *sargs = i_ipmi_args_get_extra_data(args);
+
+    return smux_con_alloc_args(sargs->path);
+}
+
+static int
+smux_args_validate(ipmi_args_t *args, int *argnum)
+{
+    return 1; /* Can't be invalid, NULL means the default. */
+}
+
+static int
+smux_parse_args(int         *curr_arg,
+		int         arg_count,
+		char        * const *args,
+		ipmi_args_t **iargs)
+{
+    const char  *path = IPMI_SMUX_DEFAULT_PATH;
+    ipmi_args_t *p;
+
+    /* The path is optional, take it if the next arg looks like one. */
+    if ((*curr_arg < arg_count) && (args[*curr_arg][0] == '/')) {
+	path = args[*curr_arg];
+	(*curr_arg)++;
+    }
+
+    p = smux_con_alloc_args(path);
+    if (!p)
+	return ENOMEM;
+    *iargs = p;
+    return 0;
+}
+
+static const char *
+smux_parse_help(void)
+{
+    return
+	"\n"
+	" smux [<path>]\n"
+	"where <path> is the socket of an SMI multiplexer (openipmi_smuxd),\n"
+	"the default is " IPMI_SMUX_DEFAULT_PATH ".";
+}
+
+static ipmi_args_t *
+smux_con_alloc_args(const char *path)
+{
+    ipmi_args_t *args;
+    smux_args_t *sargs;
+
+    args = i_ipmi_args_alloc(smux_free_args, smux_connect_args,
+			     smux_args_get_val, smux_args_set_val,
+			     smux_args_copy, smux_args_validate,
+			     smi_args_free_val, smux_args_get_type,
+			     sizeof(smux_args_t));
+    if (!args)
+	return NULL;
+    if (path) {
+	sargs = i_ipmi_args_get_extra_data(args);
+	sargs->path = ipmi_strdup(path);
+	if (!sargs->path) {
+	    ipmi_free_args(args);
+	    return NULL;
+	}
+    }
+    return args;
+}
+
+static ipmi_args_t *
+smux_con_alloc_default_args(void)
+{
+    return smux_con_alloc_args(NULL);
+}
+
 static ipmi_con_setup_t *smi_setup;
+static ipmi_con_setup_t *smux_setup;
 
 int
 i_ipmi_smi_init(os_handler_t *os_hnd)
@@ -1796,12 +2572,36 @@ i_ipmi_smi_init(os_handler_t *os_hnd)
 	return rv;
     }
 
+    smux_setup = i_ipmi_alloc_con_setup(smux_parse_args, smux_parse_help,
+					smux_con_alloc_default_args);
+    if (! smux_setup) {
+	rv = ENOMEM;
+	goto out_err;
+    }
+    rv = i_ipmi_register_con_type("smux", smux_setup);
+    if (rv) {
+	i_ipmi_free_con_setup(smux_setup);
+	smux_setup = NULL;
+	goto out_err;
+    }
+
     return 0;
+
+ out_err:
+    i_ipmi_unregister_con_type("smi", smi_setup);
+    i_ipmi_free_con_setup(smi_setup);
+    smi_setup = NULL;
+    ipmi_destroy_lock(smi_list_lock);
+    smi_list_lock = NULL;
+    return rv;
 }
 
 void
 i_ipmi_smi_shutdown(void)
 {
+    i_ipmi_unregister_con_type("smux", smux_setup);
+    i_ipmi_free_con_setup(smux_setup);
+    smux_setup = NULL;
     i_ipmi_unregister_con_type("smi", smi_setup);
     i_ipmi_free_con_setup(smi_setup);
     smi_setup = NULL;
@@ -806,19 +806,16 @@ mc_cleanup(ipmi_mc_t *mc)
     if (mc->sensors_in_my_sdr) {
 	for (i=0; i<mc->sensors_in_my_sdr_count; i++) {
 	    ipmi_sensor_t *sensor;
-	    i_ipmi_domain_entity_lock(domain);
-	    sensor = mc->sensors_in_my_sdr[i];
-	    if (sensor) {
-		ipmi_entity_t *entity = ipmi_sensor_get_entity(sensor);
-		i_ipmi_entity_get(entity);
-		i_ipmi_sensor_get(sensor);
-		i_ipmi_domain_entity_unlock(domain);
-		ipmi_sensor_destroy(mc->sensors_in_my_sdr[i]);
-		i_ipmi_sensor_put(sensor);
-		i_ipmi_entity_put(entity);
-	    } else {
-		i_ipmi_domain_entity_unlock(domain);
-	    }
+	    ipmi_entity_t *entity;
+
+	    sensor = i_ipmi_sensor_get_sdr_slot(domain,
+						&mc->sensors_in_my_sdr[i]);
+	    if (!sensor)
+		continue;
+	    entity = ipmi_sensor_get_entity(sensor);
+	    ipmi_sensor_destroy(sensor);
+	    i_ipmi_sensor_put(sensor);
+	    i_ipmi_entity_put(entity);
 	}
 	ipmi_mem_free(mc->sensors_in_my_sdr);
 	mc->sensors_in_my_sdr = NULL;
@@ -2765,6 +2762,35 @@ ipmi_mc_send_command_sideeff(ipmi_mc_t                  *mc,
     return rv;
 }
 
+int
+ipmi_mc_send_command_prio(ipmi_mc_t                  *mc,
+			  unsigned int               lun,
+			  const ipmi_msg_t           *msg,
+			  int                        prio,
+			  ipmi_mc_response_handler_t rsp_handler,
+			  void                       *rsp_data)
+{
+    int           rv;
+    ipmi_addr_t   addr = mc->addr;
+    ipmi_domain_t *domain;
+
+    CHECK_MC_LOCK(mc);
+
+    rv = ipmi_addr_set_lun(&addr, lun);
+    if (rv)
+	return rv;
+
+    domain = ipmi_mc_get_domain(mc);
+
+    rv = ipmi_send_command_addr_prio(domain,
+				     &addr, mc->addr_len,
+				     msg, prio,
+				     addr_rsp_handler,
+				     rsp_data,
+				     rsp_handler);
+    return rv;
+}
+
 /***********************************************************************
  *
  * Handle global OEM callbacks for new MCs.
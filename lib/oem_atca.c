@@ -92,6 +92,14 @@
 /* PICMG Entity IDs. */
 #define PICMG_ENTITY_ID_FRONT_BOARD		0xa0
 
+/* An audit does not read the hot-swap sensor of a FRU whose state
+   was learned less than this many seconds ago.  Hot-swap sensors send
+   an event on every state change, so a state kept up to date by
+   events is trusted much longer.  An explicit get always reads the
+   sensor. */
+#define ATCA_HS_FRESH_TIME		10
+#define ATCA_HS_EVENT_TRUST_TIME	1800
+
 typedef struct atca_shelf_s atca_shelf_t;
 
 typedef struct atca_address_s
@@ -134,8 +142,40 @@ struct atca_fru_s
     ipmi_control_t            *diagnostic_interrupt;
     ipmi_control_t            *power;
     unsigned int              fru_capabilities;
+
+    /* When the hot-swap state was last learned, by a sensor read or
+       an event.  hs_events is set if the hot-swap sensor sends
+       events. */
+    int                       hs_state_known;
+    struct timeval            hs_state_updated;
+    int                       hs_events;
+
+    /* Waiting for the next capability fetch of the IPMC. */
+    int                       caps_pending;
 };
 
+/* The capabilities of a FRU's LEDs and FRU control, as reported by
+   the IPMC.  These are kept in the IPMC info, which lives as long as
+   the domain, so they don't have to be fetched again when the IPMC
+   or the connection goes away and comes back. */
+typedef struct atca_led_caps_s
+{
+    int           known;
+    int           local_control;
+    unsigned char colors; /* The ATCA color capability bits. */
+} atca_led_caps_t;
+
+typedef struct atca_fru_caps_s
+{
+    int             leds_known;
+    unsigned char   led_mask;
+    unsigned int    num_leds;
+    atca_led_caps_t *leds;
+
+    int             controls_known;
+    unsigned char   fru_capabilities;
+} atca_fru_caps_t;
+
 struct atca_ipmc_s
 {
     atca_shelf_t  *shelf;
@@ -155,6 +195,24 @@ struct atca_ipmc_s
 
     /* Control for reading the address info */
     ipmi_control_t *address_control;
+
+    /* Cached FRU capabilities, indexed by FRU id, and the identity of
+       the IPMC they came from.  If a different IPMC shows up at this
+       address, they are thrown away. */
+    unsigned int    num_fru_caps;
+    atca_fru_caps_t *fru_caps;
+    int             caps_id_set;
+    unsigned int    caps_mfg_id;
+    unsigned int    caps_prod_id;
+    unsigned char   caps_dev_rev;
+    unsigned char   caps_fw_major;
+    unsigned char   caps_fw_minor;
+
+    /* Capability fetches are done for all the waiting FRUs of the
+       IPMC at once.  FRUs that show up while a fetch is running wait
+       for it to finish and are done together in the next one. */
+    unsigned int    caps_outstanding;
+    int             caps_wanted;
 };
 
 struct atca_shelf_s
@@ -197,6 +255,12 @@ struct atca_shelf_s
     /* This is used to allocate address control number sequentially. */
     unsigned int next_address_control_num;
 
+    /* Hot-swap sensor reads done and skipped because the state was
+       still fresh, and FRUs whose capabilities came from the cache. */
+    ipmi_domain_stat_t *hs_reads;
+    ipmi_domain_stat_t *hs_reads_avoided;
+    ipmi_domain_stat_t *caps_cached;
+
     /* Hacks for broken implementations. */
 
     /* The shelf address is not on the advertised shelf address
@@ -385,6 +449,99 @@ atca_find_minfo_from_mc(ipmi_mc_t *mc, atca_shelf_t *info)
     return atca_find_minfo_from_ipmb(ipmi_mc_get_address(mc), info);
 }
 
+/***********************************************************************
+ *
+ * FRU capability cache.
+ *
+ **********************************************************************/
+
+/* Get the cached capabilities of the FRU, allocating room for them
+   if they are not there yet.  Returns NULL if out of memory. */
+static atca_fru_caps_t *
+atca_get_fru_caps(atca_ipmc_t *minfo, unsigned int fru_id)
+{
+    atca_fru_caps_t *new_caps;
+    unsigned int    num = fru_id + 1;
+
+    if (fru_id < minfo->num_fru_caps)
+	return &minfo->fru_caps[fru_id];
+
+    new_caps = ipmi_mem_alloc(sizeof(atca_fru_caps_t) * num);
+    if (!new_caps)
+	return NULL;
+    memset(new_caps, 0, sizeof(atca_fru_caps_t) * num);
+    if (minfo->fru_caps) {
+	memcpy(new_caps, minfo->fru_caps,
+	       sizeof(atca_fru_caps_t) * minfo->num_fru_caps);
+	ipmi_mem_free(minfo->fru_caps);
+    }
+    minfo->fru_caps = new_caps;
+    minfo->num_fru_caps = num;
+    return &minfo->fru_caps[fru_id];
+}
+
+/* Like atca_get_fru_caps(), but never allocates. */
+static atca_fru_caps_t *
+atca_find_fru_caps(atca_ipmc_t *minfo, unsigned int fru_id)
+{
+    if (fru_id < minfo->num_fru_caps)
+	return &minfo->fru_caps[fru_id];
+    return NULL;
+}
+
+static void
+atca_forget_fru_caps(atca_ipmc_t *minfo, unsigned int fru_id)
+{
+    atca_fru_caps_t *caps = atca_find_fru_caps(minfo, fru_id);
+
+    if (!caps)
+	return;
+    if (caps->leds)
+	ipmi_mem_free(caps->leds);
+    memset(caps, 0, sizeof(*caps));
+}
+
+static void
+atca_forget_ipmc_caps(atca_ipmc_t *minfo)
+{
+    unsigned int i;
+
+    for (i=0; i<minfo->num_fru_caps; i++)
+	atca_forget_fru_caps(minfo, i);
+    if (minfo->fru_caps)
+	ipmi_mem_free(minfo->fru_caps);
+    minfo->fru_caps = NULL;
+    minfo->num_fru_caps = 0;
+}
+
+/* The cached capabilities are only good for the IPMC they came from.
+   If something different shows up at the address, throw them away. */
+static void
+atca_check_ipmc_caps_identity(atca_ipmc_t *minfo, ipmi_mc_t *mc)
+{
+    unsigned int  mfg_id = ipmi_mc_manufacturer_id(mc);
+    unsigned int  prod_id = ipmi_mc_product_id(mc);
+    unsigned char dev_rev = ipmi_mc_device_revision(mc);
+    unsigned char fw_major = ipmi_mc_major_fw_revision(mc);
+    unsigned char fw_minor = ipmi_mc_minor_fw_revision(mc);
+
+    if (minfo->caps_id_set
+	&& (minfo->caps_mfg_id == mfg_id)
+	&& (minfo->caps_prod_id == prod_id)
+	&& (minfo->caps_dev_rev == dev_rev)
+	&& (minfo->caps_fw_major == fw_major)
+	&& (minfo->caps_fw_minor == fw_minor))
+	return;
+
+    atca_forget_ipmc_caps(minfo);
+    minfo->caps_id_set = 1;
+    minfo->caps_mfg_id = mfg_id;
+    minfo->caps_prod_id = prod_id;
+    minfo->caps_dev_rev = dev_rev;
+    minfo->caps_fw_major = fw_major;
+    minfo->caps_fw_minor = fw_minor;
+}
+
 
 /***********************************************************************
  *
@@ -403,6 +560,45 @@ typedef struct atca_hs_info_s
     int                           op;
 } atca_hs_info_t;
 
+static os_handler_t *
+fru_os_hnd(atca_fru_t *finfo)
+{
+    return ipmi_domain_get_os_hnd(finfo->minfo->shelf->domain);
+}
+
+/* We just learned the hot-swap state of the FRU. */
+static void
+hs_state_learned(atca_fru_t *finfo)
+{
+    os_handler_t *os_hnd = fru_os_hnd(finfo);
+
+    finfo->hs_state_known = 1;
+    os_hnd->get_monotonic_time(os_hnd, &finfo->hs_state_updated);
+}
+
+/* Is the hot-swap state we have recent enough that an audit doesn't
+   need to read the sensor?  If the sensor sends events, the events
+   keep the state current. */
+static int
+hs_state_is_fresh(atca_fru_t *finfo)
+{
+    os_handler_t   *os_hnd;
+    struct timeval now;
+    long           limit;
+
+    if (!finfo->hs_state_known)
+	return 0;
+
+    if (finfo->hs_events)
+	limit = ATCA_HS_EVENT_TRUST_TIME;
+    else
+	limit = ATCA_HS_FRESH_TIME;
+
+    os_hnd = fru_os_hnd(finfo);
+    os_hnd->get_monotonic_time(os_hnd, &now);
+    return (now.tv_sec - finfo->hs_state_updated.tv_sec) < limit;
+}
+
 static enum ipmi_hot_swap_states atca_hs_to_openipmi[] =
 {
     IPMI_HOT_SWAP_NOT_PRESENT,
@@ -462,6 +658,13 @@ atca_get_hot_swap_state_done(ipmi_sensor_t *sensor,
 	goto out;
     }
 
+    /* If the state is not what we have, let the next audit sort it
+       out and report the change. */
+    if (atca_hs_to_openipmi[i] == finfo->hs_state)
+	hs_state_learned(finfo);
+    else
+	finfo->hs_state_known = 0;
+
     if (hs_info->handler1)
 	hs_info->handler1(finfo->entity, 0, atca_hs_to_openipmi[i],
 			  hs_info->cb_data);
@@ -830,6 +1033,7 @@ hot_swap_checker(ipmi_entity_t             *entity,
 
     finfo = ipmi_entity_get_oem_info(entity);
 
+    hs_state_learned(finfo);
     if (state != finfo->hs_state) {
 	old_state = finfo->hs_state;
 	finfo->hs_state = state;
@@ -841,6 +1045,22 @@ hot_swap_checker(ipmi_entity_t             *entity,
 static int
 atca_check_hot_swap_state(ipmi_entity_t *entity)
 {
+    atca_fru_t   *finfo = ipmi_entity_get_oem_info(entity);
+    atca_shelf_t *info;
+
+    if (!finfo)
+	return atca_get_hot_swap_state(entity, hot_swap_checker, NULL);
+
+    info = finfo->minfo->shelf;
+    if (hs_state_is_fresh(finfo)) {
+	/* The events are keeping the state up to date, don't bother
+	   reading the sensor. */
+	if (info->hs_reads_avoided)
+	    ipmi_domain_stat_add(info->hs_reads_avoided, 1);
+	return 0;
+    }
+    if (info->hs_reads)
+	ipmi_domain_stat_add(info->hs_reads, 1);
     return atca_get_hot_swap_state(entity, hot_swap_checker, NULL);
 }
 
@@ -904,6 +1124,7 @@ fetched_hot_swap_state(ipmi_sensor_t *sensor,
     /* The OpenIPMI hot-swap states map directly to the ATCA ones. */
     old_state = finfo->hs_state;
     finfo->hs_state = i;
+    hs_state_learned(finfo);
     handled = IPMI_EVENT_NOT_HANDLED;
     ipmi_entity_call_hot_swap_handlers(ipmi_sensor_get_entity(sensor),
 				       old_state,
@@ -954,6 +1175,7 @@ hot_swap_state_changed(ipmi_sensor_t         *sensor,
     /* The OpenIPMI hot-swap states map directly to the ATCA ones. */
     old_state = finfo->hs_state;
     finfo->hs_state = offset;
+    hs_state_learned(finfo);
     ipmi_entity_call_hot_swap_handlers(entity,
 				       old_state,
 				       finfo->hs_state,
@@ -966,6 +1188,10 @@ hot_swap_state_changed(ipmi_sensor_t         *sensor,
 	unsigned char ipmb_addr = finfo->minfo->ipmb_address;
 	int           rv;
 
+	/* The FRU was pulled or plugged in, it may not be the same
+	   one any more. */
+	atca_forget_fru_caps(finfo->minfo, finfo->fru_id);
+
 	i_ipmi_entity_get(entity);
 	rv = ipmi_start_ipmb_mc_scan(ipmi_entity_get_domain(entity),
 				     0, ipmb_addr, ipmb_addr,
@@ -983,6 +1209,9 @@ setup_fru_hot_swap(atca_fru_t *finfo, ipmi_sensor_t *sensor)
     int rv;
 
     finfo->hs_sensor_id = ipmi_sensor_convert_to_id(sensor);
+    finfo->hs_state_known = 0;
+    finfo->hs_events = (ipmi_sensor_get_event_support(sensor)
+			!= IPMI_EVENT_SUPPORT_NONE);
 
     ipmi_entity_set_hot_swappable(finfo->entity, 1);
     ipmi_entity_set_supports_managed_hot_swap(finfo->entity, 1);
@@ -1393,34 +1622,88 @@ atca_led_control_oem_cleanup(ipmi_control_t *control,
 	l->control = NULL;
 }
 
+/* A capability fetch for a FRU, part of a capability fetch of the
+   IPMC.  We keep the IPMC and FRU id instead of the FRU info, as
+   the FRU info may go away while the message is in progress. */
+typedef struct atca_caps_req_s
+{
+    atca_ipmc_t  *minfo;
+    unsigned int fru_id;
+} atca_caps_req_t;
+
+static void atca_fetch_ipmc_caps(atca_ipmc_t *minfo);
+
+static int
+send_caps_req(ipmi_mc_t                  *mc,
+	      atca_ipmc_t                *minfo,
+	      unsigned int               fru_id,
+	      unsigned char              cmd,
+	      ipmi_mc_response_handler_t handler)
+{
+    atca_caps_req_t *req;
+    ipmi_msg_t      msg;
+    unsigned char   data[2];
+    int             rv;
+
+    req = ipmi_mem_alloc(sizeof(*req));
+    if (!req)
+	return ENOMEM;
+    req->minfo = minfo;
+    req->fru_id = fru_id;
+
+    msg.netfn = IPMI_GROUP_EXTENSION_NETFN;
+    msg.cmd = cmd;
+    msg.data = data;
+    msg.data_len = 2;
+    data[0] = IPMI_PICMG_GRP_EXT;
+    data[1] = fru_id;
+    rv = ipmi_mc_send_command(mc, 0, &msg, handler, req);
+    if (rv)
+	ipmi_mem_free(req);
+    else
+	minfo->caps_outstanding++;
+    return rv;
+}
+
+/* A capability fetch response came in.  Returns the FRU info, or NULL
+   if the FRU went away. */
+static atca_fru_t *
+caps_req_fru(atca_caps_req_t *req)
+{
+    atca_ipmc_t *minfo = req->minfo;
+
+    if ((req->fru_id < minfo->num_frus) && minfo->frus)
+	return minfo->frus[req->fru_id];
+    return NULL;
+}
+
+/* Called when done with a capability fetch response.  Once all the
+   responses for the IPMC are in, start a new fetch if more FRUs have
+   shown up in the meantime. */
 static void
-fru_led_cap_rsp(ipmi_mc_t  *mc,
-		ipmi_msg_t *msg,
-		void       *rsp_data)
+caps_req_done(atca_caps_req_t *req)
+{
+    atca_ipmc_t *minfo = req->minfo;
+
+    ipmi_mem_free(req);
+    if (minfo->caps_outstanding > 0)
+	minfo->caps_outstanding--;
+    if ((minfo->caps_outstanding == 0) && minfo->caps_wanted) {
+	minfo->caps_wanted = 0;
+	atca_fetch_ipmc_caps(minfo);
+    }
+}
+
+static void
+add_led_control(ipmi_mc_t *mc, atca_led_t *l, unsigned char colors)
 {
     ipmi_domain_t *domain;
-    atca_led_t    *l = rsp_data;
-    atca_fru_t    *finfo;
+    atca_fru_t    *finfo = l->fru;
     unsigned int  num = l->num;
     char          name[10];
     int           rv;
     int           i;
 
-    if (l->destroyed) {
-	/* The entity or MC was destroyed while the message was in
-	   progress, so the memory was not freed (because this
-	   function needed it).  The control didn't yet exist, so just
-	   free the memory. */
-	ipmi_mem_free(l);
-	goto out;
-    }
-    l->op_in_progress = 0;
-
-    if (check_for_msg_err(mc, NULL, msg, 5, "fru_led_cap_rsp"))
-	goto out;
-
-    finfo = l->fru;
-
     domain = ipmi_mc_get_domain(mc);
     i_ipmi_domain_entity_lock(domain);
     if (!finfo->entity)
@@ -1430,10 +1713,10 @@ fru_led_cap_rsp(ipmi_mc_t  *mc,
     i_ipmi_domain_entity_unlock(domain);
     if (rv) {
 	ipmi_log(IPMI_LOG_SEVERE,
-		 "%soem_atca.c(fru_led_cap_rsp): "
+		 "%soem_atca.c(add_led_control): "
 		 "Could not get entity: 0x%x",
 		 MC_NAME(mc), rv);
-	goto out;
+	return;
     }
 
     if (num == 0)
@@ -1453,14 +1736,14 @@ fru_led_cap_rsp(ipmi_mc_t  *mc,
 			    &l->control);
     if (rv) {
 	ipmi_log(IPMI_LOG_SEVERE,
-		 "%soem_atca.c(fru_led_cap_rsp): "
+		 "%soem_atca.c(add_led_control): "
 		 "Could not create LED control: 0x%x",
 		 MC_NAME(mc), rv);
 	i_ipmi_entity_put(finfo->entity);
-	goto out;
+	return;
     }
     for (i=1; i<=6; i++) {
-	if (msg->data[2] & (1 << i))
+	if (colors & (1 << i))
 	    ipmi_control_add_light_color_support(l->control, 0,
 						 atca_to_openipmi_color[i]);
     }
@@ -1476,13 +1759,45 @@ fru_led_cap_rsp(ipmi_mc_t  *mc,
     i_ipmi_entity_put(finfo->entity);
     if (rv) {
 	ipmi_log(IPMI_LOG_SEVERE,
-		 "%soem_atca.c(fru_led_cap_rsp): "
+		 "%soem_atca.c(add_led_control): "
 		 "Could not add LED control: 0x%x",
 		 MC_NAME(mc), rv);
-	goto out;
     }
- out:
-    return;
+}
+
+static void
+fru_led_cap_rsp(ipmi_mc_t  *mc,
+		ipmi_msg_t *msg,
+		void       *rsp_data)
+{
+    atca_led_t      *l = rsp_data;
+    atca_fru_t      *finfo;
+    atca_fru_caps_t *caps;
+
+    if (l->destroyed) {
+	/* The entity or MC was destroyed while the message was in
+	   progress, so the memory was not freed (because this
+	   function needed it).  The control didn't yet exist, so just
+	   free the memory. */
+	ipmi_mem_free(l);
+	return;
+    }
+    l->op_in_progress = 0;
+
+    if (check_for_msg_err(mc, NULL, msg, 5, "fru_led_cap_rsp"))
+	return;
+
+    finfo = l->fru;
+
+    /* Remember it for the next time the FRU shows up. */
+    caps = atca_find_fru_caps(finfo->minfo, finfo->fru_id);
+    if (caps && caps->leds && (l->num < caps->num_leds)) {
+	caps->leds[l->num].known = 1;
+	caps->leds[l->num].local_control = l->local_control;
+	caps->leds[l->num].colors = msg->data[2];
+    }
+
+    add_led_control(mc, l, msg->data[2]);
 }
 
 static void
@@ -1531,7 +1846,10 @@ get_led_capability_2(ipmi_mc_t  *mc,
 }
 
 static void
-get_led_capability(ipmi_mc_t *mc, atca_fru_t *finfo, unsigned int num)
+get_led_capability(ipmi_mc_t       *mc,
+		   atca_fru_t      *finfo,
+		   atca_fru_caps_t *caps,
+		   unsigned int    num)
 {
     ipmi_msg_t    msg;
     unsigned char data[3];
@@ -1541,6 +1859,15 @@ get_led_capability(ipmi_mc_t *mc, atca_fru_t *finfo, unsigned int num)
     linfo->num = num;
     linfo->fru = finfo;
 
+    if (caps && caps->leds && (num < caps->num_leds)
+	&& caps->leds[num].known)
+    {
+	/* We already know about this one. */
+	linfo->local_control = caps->leds[num].local_control;
+	add_led_control(mc, linfo, caps->leds[num].colors);
+	return;
+    }
+
     /* First we get the LED state because that is where we know if the
        LED supports local control.  Too bad it is not in the
        capabilities. */
@@ -1563,60 +1890,48 @@ get_led_capability(ipmi_mc_t *mc, atca_fru_t *finfo, unsigned int num)
     }
 }
 
+/* Create the LEDs of the FRU, from the LED properties (the mask of
+   standard LEDs and the number of application-specific LEDs). */
 static void
-fru_led_prop_rsp(ipmi_mc_t  *mc,
-		 ipmi_msg_t *rsp,
-		 void       *rsp_data)
+setup_fru_leds(ipmi_mc_t       *mc,
+	       atca_fru_t      *finfo,
+	       atca_fru_caps_t *caps,
+	       unsigned char   led_mask,
+	       unsigned int    num_aux_leds)
 {
-    atca_fru_t   *finfo = rsp_data;
-    int          i, j;
+    int          i;
+    unsigned int j;
     unsigned int num_leds;
 
-    if (check_for_msg_err(mc, NULL, rsp, 4, "fru_led_prop_rsp"))
-	goto out;
-
-    /* Note that while the MC exists, finfo is guaranteed to exist
-       because we never decrease the number of FRUs. */
-
-    if (finfo->leds)
-	/* There is a race here, it is possible to have two LED
-	   fetches running at the same time.  If they have already
-	   been fetched, just ignore this message. */
-	goto out;
-
-    if (!finfo->entity)
-	/* The entity was destroyed while the message was in progress. */
-	goto out;
-    
-    num_leds = 4 + rsp->data[3];
+    num_leds = 4 + num_aux_leds;
     finfo->leds = ipmi_mem_alloc(sizeof(atca_led_t *) * num_leds);
     if (!finfo->leds) {
 	ipmi_log(IPMI_LOG_SEVERE,
-		 "%soem_atca.c(fru_led_prop_rsp): "
+		 "%soem_atca.c(setup_fru_leds): "
 		 "Could not allocate memory LEDs",
 		 MC_NAME(mc));
-	goto out;
+	return;
     }
     memset(finfo->leds, 0, sizeof(atca_led_t *) * num_leds);
     finfo->num_leds = num_leds;
 
     for (i=0; i<4; i++) {
-	if (rsp->data[2] & (1 << i)) {
+	if (led_mask & (1 << i)) {
 	    /* We support this LED.  Fetch its capabilities */
 	    finfo->leds[i] = ipmi_mem_alloc(sizeof(atca_led_t));
 	    if (!finfo->leds[i]) {
 		ipmi_log(IPMI_LOG_SEVERE,
-			 "%soem_atca.c(fru_led_prop_rsp): "
+			 "%soem_atca.c(setup_fru_leds): "
 			 "Could not allocate memory for an LED",
 			 MC_NAME(mc));
-		goto out;
+		return;
 	    }
 	    memset(finfo->leds[i], 0, sizeof(atca_led_t));
-	    get_led_capability(mc, finfo, i);
+	    get_led_capability(mc, finfo, caps, i);
 	}
     }
 
-    for (j=0; j<rsp->data[3]; j++, i++) {
+    for (j=0; j<num_aux_leds; j++, i++) {
 	if (i >= 128)
 	    /* We only support 128 LEDs. */
 	    break;
@@ -1624,63 +1939,90 @@ fru_led_prop_rsp(ipmi_mc_t  *mc,
 	finfo->leds[i] = ipmi_mem_alloc(sizeof(atca_led_t));
 	if (!finfo->leds[i]) {
 	    ipmi_log(IPMI_LOG_SEVERE,
-		     "%soem_atca.c(fru_led_prop_rsp): "
+		     "%soem_atca.c(setup_fru_leds): "
 		     "Could not allocate memory for an aux LED",
 		     MC_NAME(mc));
-	    goto out;
+	    return;
 	}
 	memset(finfo->leds[i], 0, sizeof(atca_led_t));
-	get_led_capability(mc, finfo, i);
+	get_led_capability(mc, finfo, caps, i);
     }
- out:
-    return;
 }
 
 static void
-fetch_fru_leds_mc_cb(ipmi_mc_t *mc, void *cb_info)
+fru_led_prop_rsp(ipmi_mc_t  *mc,
+		 ipmi_msg_t *rsp,
+		 void       *rsp_data)
 {
-    atca_fru_t    *finfo = cb_info;
-    ipmi_msg_t    msg;
-    unsigned char data[2];
-    int           rv;
+    atca_caps_req_t *req = rsp_data;
+    atca_fru_t      *finfo;
+    atca_fru_caps_t *caps;
 
-    /* Now fetch the LED information. */
-    msg.netfn = IPMI_GROUP_EXTENSION_NETFN;
-    msg.cmd = IPMI_PICMG_CMD_GET_FRU_LED_PROPERTIES;
-    msg.data = data;
-    msg.data_len = 2;
-    data[0] = IPMI_PICMG_GRP_EXT;
-    data[1] = finfo->fru_id;
-    rv = ipmi_mc_send_command(mc, 0, &msg, fru_led_prop_rsp, finfo);
-    if (rv) {
-	ipmi_log(IPMI_LOG_SEVERE,
-		 "%soem_atca.c(fetch_fru_leds_mc_cb): "
-		 "Could not send FRU LED properties command: 0x%x",
-		 MC_NAME(mc), rv);
-	/* Just go on, don't shut down the info. */
+    if (check_for_msg_err(mc, NULL, rsp, 4, "fru_led_prop_rsp"))
+	goto out;
+
+    finfo = caps_req_fru(req);
+    if (!finfo)
+	/* The FRU went away while the message was in progress. */
+	goto out;
+
+    if (finfo->leds)
+	/* There is a race here, it is possible to have two LED
+	   fetches running at the same time.  If they have already
+	   been fetched, just ignore this message. */
+	goto out;
+
+    if (!finfo->entity)
+	/* The entity was destroyed while the message was in progress. */
+	goto out;
+
+    caps = atca_get_fru_caps(finfo->minfo, finfo->fru_id);
+    if (caps && !caps->leds_known) {
+	caps->num_leds = 4 + rsp->data[3];
+	caps->leds = ipmi_mem_alloc(sizeof(atca_led_caps_t) * caps->num_leds);
+	if (caps->leds) {
+	    memset(caps->leds, 0, sizeof(atca_led_caps_t) * caps->num_leds);
+	    caps->led_mask = rsp->data[2];
+	    caps->leds_known = 1;
+	} else
+	    caps->num_leds = 0;
     }
+
+    setup_fru_leds(mc, finfo, caps, rsp->data[2], rsp->data[3]);
+
+ out:
+    caps_req_done(req);
 }
 
-static void
-fetch_fru_leds(atca_fru_t *finfo)
+/* Set up the LEDs of the FRU from the cache, or fetch them.  Returns
+   1 if the cache was used. */
+static int
+fetch_fru_leds(ipmi_mc_t *mc, atca_fru_t *finfo)
 {
-    int rv;
-
-    if (finfo->minfo->ipmb_address == 0x20)
-        /* We ignore the floating IPMB address if it comes up. */
-        return;
+    atca_fru_caps_t *caps;
+    int             rv;
 
     if (finfo->leds)
 	/* We already have the LEDs fetched. */
-	return;
-    
-    rv = ipmi_mc_pointer_cb(finfo->minfo->mcid, fetch_fru_leds_mc_cb, finfo);
+	return 1;
+
+    caps = atca_find_fru_caps(finfo->minfo, finfo->fru_id);
+    if (caps && caps->leds_known) {
+	setup_fru_leds(mc, finfo, caps, caps->led_mask, caps->num_leds - 4);
+	return 1;
+    }
+
+    rv = send_caps_req(mc, finfo->minfo, finfo->fru_id,
+		       IPMI_PICMG_CMD_GET_FRU_LED_PROPERTIES,
+		       fru_led_prop_rsp);
     if (rv) {
 	ipmi_log(IPMI_LOG_SEVERE,
 		 "%soem_atca.c(fetch_fru_leds): "
-		 "Could not convert an mcid to a pointer: 0x%x",
-		 ENTITY_NAME(finfo->entity), rv);
+		 "Could not send FRU LED properties command: 0x%x",
+		 MC_NAME(mc), rv);
+	/* Just go on, don't shut down the info. */
     }
+    return 0;
 }
 
 static void
@@ -1881,26 +2223,11 @@ add_atca_fru_control(ipmi_mc_t               *mc,
 }
 
 static void
-fru_control_capabilities_rsp(ipmi_mc_t  *mc,
-			     ipmi_msg_t *rsp,
-			     void       *rsp_data)
+add_fru_reset_controls(ipmi_mc_t *mc, atca_fru_t *finfo)
 {
-    ipmi_domain_t *domain;
-    atca_fru_t    *finfo = rsp_data;
+    ipmi_domain_t *domain = ipmi_mc_get_domain(mc);
     int           rv;
 
-    if (!check_for_msg_err(mc, NULL, rsp, 3, "fru_control_capabilities_rsp"))
-	finfo->fru_capabilities = rsp->data[2];
-
-    if (!mc)
-	goto out;
-
-    domain = ipmi_mc_get_domain(mc);
-
-    /* If the command fails, we just go on, as the system doesn't
-       support the query, but still must support at least cold
-       reset. */
-
     i_ipmi_domain_entity_lock(domain);
     if (!finfo->entity) {
 	rv = EINVAL;
@@ -1909,7 +2236,7 @@ fru_control_capabilities_rsp(ipmi_mc_t  *mc,
     i_ipmi_domain_entity_unlock(domain);
     if (rv)
 	/* The entity was destroyed while the message was in progress. */
-	goto out;
+	return;
 
     /* Always support cold reset. */
     add_atca_fru_control(mc, finfo, "cold reset", IPMI_CONTROL_ONE_SHOT_RESET,
@@ -1929,56 +2256,76 @@ fru_control_capabilities_rsp(ipmi_mc_t  *mc,
 			     set_diagnostic_interrupt,
 			     &finfo->diagnostic_interrupt);
     i_ipmi_entity_put(finfo->entity);
-
- out:
-    return;
-
 }
 
 static void
-fetch_fru_control_mc_cb(ipmi_mc_t *mc, void *cb_info)
+fru_control_capabilities_rsp(ipmi_mc_t  *mc,
+			     ipmi_msg_t *rsp,
+			     void       *rsp_data)
 {
-    atca_fru_t    *finfo = cb_info;
-    ipmi_msg_t    msg;
-    unsigned char data[2];
-    int           rv;
+    atca_caps_req_t *req = rsp_data;
+    atca_fru_t      *finfo;
+    atca_fru_caps_t *caps;
+    int             err;
 
-    /* Now fetch the LED information. */
-    msg.netfn = IPMI_GROUP_EXTENSION_NETFN;
-    msg.cmd = IPMI_PICMG_CMD_FRU_CONTROL_CAPABILITIES;
-    msg.data = data;
-    msg.data_len = 2;
-    data[0] = IPMI_PICMG_GRP_EXT;
-    data[1] = finfo->fru_id;
-    rv = ipmi_mc_send_command(mc, 0, &msg, fru_control_capabilities_rsp, finfo);
-    if (rv) {
-	ipmi_log(IPMI_LOG_SEVERE,
-		 "%soem_atca.c(fetch_fru_leds_mc_cb): "
-		 "Could not send FRU LED properties command: 0x%x",
-		 MC_NAME(mc), rv);
-	/* Just go on, don't shut down the info. */
+    err = check_for_msg_err(mc, NULL, rsp, 3, "fru_control_capabilities_rsp");
+
+    if (!mc)
+	goto out;
+
+    finfo = caps_req_fru(req);
+    if (!finfo)
+	/* The FRU went away while the message was in progress. */
+	goto out;
+
+    if (!err) {
+	finfo->fru_capabilities = rsp->data[2];
+	caps = atca_get_fru_caps(finfo->minfo, finfo->fru_id);
+	if (caps) {
+	    caps->fru_capabilities = rsp->data[2];
+	    caps->controls_known = 1;
+	}
     }
+
+    /* If the command fails, we just go on, as the system doesn't
+       support the query, but still must support at least cold
+       reset. */
+    if (!finfo->cold_reset)
+	add_fru_reset_controls(mc, finfo);
+
+ out:
+    caps_req_done(req);
 }
 
-static void
-fetch_fru_control_handling(atca_fru_t *finfo)
+/* Set up the FRU controls from the cache, or fetch the capabilities.
+   Returns 1 if the cache was used. */
+static int
+fetch_fru_control_handling(ipmi_mc_t *mc, atca_fru_t *finfo)
 {
-    int rv;
+    atca_fru_caps_t *caps;
+    int             rv;
 
     if (finfo->cold_reset)
-	return;
+	return 1;
 
-    if (finfo->minfo->ipmb_address == 0x20)
-        /* We ignore the floating IPMB address if it comes up. */
-        return;
-    
-    rv = ipmi_mc_pointer_cb(finfo->minfo->mcid, fetch_fru_control_mc_cb, finfo);
+    caps = atca_find_fru_caps(finfo->minfo, finfo->fru_id);
+    if (caps && caps->controls_known) {
+	finfo->fru_capabilities = caps->fru_capabilities;
+	add_fru_reset_controls(mc, finfo);
+	return 1;
+    }
+
+    rv = send_caps_req(mc, finfo->minfo, finfo->fru_id,
+		       IPMI_PICMG_CMD_FRU_CONTROL_CAPABILITIES,
+		       fru_control_capabilities_rsp);
     if (rv) {
 	ipmi_log(IPMI_LOG_SEVERE,
 		 "%soem_atca.c(fetch_fru_control_handling): "
-		 "Could not convert an mcid to a pointer: 0x%x",
-		 ENTITY_NAME(finfo->entity), rv);
+		 "Could not send FRU control capabilities command: 0x%x",
+		 MC_NAME(mc), rv);
+	/* Just go on, don't shut down the info. */
     }
+    return 0;
 }
 
 static void
@@ -2790,6 +3137,7 @@ atca_sensor_update_handler(enum ipmi_update_e op,
 
     case IPMI_DELETED:
 	ipmi_sensor_id_set_invalid(&finfo->hs_sensor_id);
+	finfo->hs_state_known = 0;
 	/* Tell the user that we went away, if necessary. */
 	/* FIXME - what about out-of-comm state? */
 	if (finfo->hs_state != IPMI_HOT_SWAP_NOT_PRESENT) {
@@ -2814,13 +3162,62 @@ atca_sensor_update_handler(enum ipmi_update_e op,
     }
 }
 
+static void
+fetch_ipmc_caps_mc_cb(ipmi_mc_t *mc, void *cb_info)
+{
+    atca_ipmc_t  *minfo = cb_info;
+    atca_shelf_t *info = minfo->shelf;
+    atca_fru_t   *finfo;
+    unsigned int i;
+    int          cached;
+
+    for (i=0; i<minfo->num_frus; i++) {
+	finfo = minfo->frus[i];
+	if (!finfo || !finfo->caps_pending)
+	    continue;
+	finfo->caps_pending = 0;
+	if (!finfo->entity)
+	    continue;
+
+	cached = fetch_fru_leds(mc, finfo);
+	cached &= fetch_fru_control_handling(mc, finfo);
+	if (cached && info->caps_cached)
+	    ipmi_domain_stat_add(info->caps_cached, 1);
+    }
+}
+
+/* Set up the controls of all the FRUs of the IPMC waiting for them,
+   sending the capability queries for all of them together. */
+static void
+atca_fetch_ipmc_caps(atca_ipmc_t *minfo)
+{
+    int rv;
+
+    if (minfo->caps_outstanding) {
+	/* Catch them when the current fetch is done. */
+	minfo->caps_wanted = 1;
+	return;
+    }
+
+    rv = ipmi_mc_pointer_cb(minfo->mcid, fetch_ipmc_caps_mc_cb, minfo);
+    if (rv) {
+	ipmi_log(IPMI_LOG_SEVERE,
+		 "%soem_atca.c(atca_fetch_ipmc_caps): "
+		 "Could not convert an mcid to a pointer: 0x%x",
+		 DOMAIN_NAME(minfo->shelf->domain), rv);
+    }
+}
+
 static void
 add_fru_controls(atca_fru_t *finfo)
 {
     if (finfo->cold_reset)
 	return;
-    fetch_fru_leds(finfo);
-    fetch_fru_control_handling(finfo);
+    if (finfo->minfo->ipmb_address == 0x20)
+        /* We ignore the floating IPMB address if it comes up. */
+        return;
+    finfo->caps_pending = 1;
+    atca_fetch_ipmc_caps(finfo->minfo);
 #ifdef POWER_CONTROL_AVAILABLE
     add_power_handling(finfo);
 #endif
@@ -3104,11 +3501,25 @@ static void
 atca_con_up(ipmi_domain_t *domain, void *cb_data)
 {
     atca_shelf_t *info = cb_data;
+    unsigned int i, j;
 
     /* We wait until here to set up everything for the first time so
        it will be reported to the user properly. */
-    if (!info->setup)
+    if (!info->setup) {
 	setup_from_shelf_fru(domain, info);
+	return;
+    }
+
+    /* We may have missed hot-swap events while the connection was
+       down, so read the sensors again. */
+    for (i=0; i<info->num_ipmcs; i++) {
+	atca_ipmc_t *minfo = &(info->ipmcs[i]);
+
+	for (j=0; j<minfo->num_frus; j++) {
+	    if (minfo->frus[j])
+		minfo->frus[j]->hs_state_known = 0;
+	}
+    }
 }
 
 static void
@@ -3135,6 +3546,14 @@ atca_handle_new_mc(ipmi_domain_t *domain, ipmi_mc_t *mc, atca_shelf_t *info)
     minfo->mcid = ipmi_mc_convert_to_id(mc);
     minfo->mc = mc;
 
+    atca_check_ipmc_caps_identity(minfo, mc);
+
+    /* Set up any FRUs that were waiting for the MC. */
+    if (minfo->caps_outstanding)
+	minfo->caps_wanted = 1;
+    else
+	fetch_ipmc_caps_mc_cb(mc, minfo);
+
     /* Now fetch the properties. */
     msg.netfn = IPMI_GROUP_EXTENSION_NETFN;
     msg.cmd = IPMI_PICMG_CMD_GET_PROPERTIES;
@@ -4174,12 +4593,33 @@ atca_oem_data_destroyer(ipmi_domain_t *domain, void *oem_data)
 	    }
 	    ipmi_mem_free(b->frus);
 	    b->frus = NULL;
+	    atca_forget_ipmc_caps(b);
 	}
 	ipmi_mem_free(info->ipmcs);
     }
+    if (info->hs_reads)
+	ipmi_domain_stat_put(info->hs_reads);
+    if (info->hs_reads_avoided)
+	ipmi_domain_stat_put(info->hs_reads_avoided);
+    if (info->caps_cached)
+	ipmi_domain_stat_put(info->caps_cached);
     ipmi_mem_free(info);
 }
 
+static void
+atca_register_stats(ipmi_domain_t *domain, atca_shelf_t *info)
+{
+    ipmi_domain_stat_register(domain, "atca_hs_reads",
+			      i_ipmi_domain_name(domain),
+			      &info->hs_reads);
+    ipmi_domain_stat_register(domain, "atca_hs_reads_avoided",
+			      i_ipmi_domain_name(domain),
+			      &info->hs_reads_avoided);
+    ipmi_domain_stat_register(domain, "atca_fru_caps_cached",
+			      i_ipmi_domain_name(domain),
+			      &info->caps_cached);
+}
+
 static void
 atca_event_handler(ipmi_domain_t *domain,
 		   ipmi_event_t  *event,
@@ -4190,6 +4630,8 @@ atca_event_handler(ipmi_domain_t *domain,
     unsigned char new_state;
     unsigned char sensor_type;
     ipmi_mc_t     *mc;
+    atca_shelf_t  *info = event_data;
+    atca_ipmc_t   *minfo;
 
     /* Here we look for hot-swap events so we know to start the
        process of scanning for an IPMC when it is installed.  We also
@@ -4215,6 +4657,12 @@ atca_event_handler(ipmi_domain_t *domain,
 	old_state = data[10] & 0xf;
 	new_state = data[11] & 0xf;
 	if ((old_state == 0) || (new_state == 0)) {
+	    /* The FRU was pulled or plugged in, it may not be the same
+	       one any more. */
+	    minfo = atca_find_minfo_from_ipmb(data[4], info);
+	    if (minfo)
+		atca_forget_fru_caps(minfo, data[12]);
+
 	    if (data[12] != 0) {
 		/* FRU id is not 0, it's an AMC module (or something else the
 		   IPMC manages).  If the device has gone away or is newly
@@ -4250,6 +4698,10 @@ atca_event_handler(ipmi_domain_t *domain,
 	mc = i_ipmi_event_get_generating_mc(domain, NULL, event);
 	if (!mc)
 	    break;
+	/* The capabilities may have changed with the new version. */
+	minfo = atca_find_minfo_from_mc(mc, info);
+	if (minfo)
+	    atca_forget_ipmc_caps(minfo);
 	ipmi_mc_reread_sensors(mc, NULL, NULL);
 	i_ipmi_mc_put(mc);
 	/* FIXME - what about FRU data? */
@@ -4391,6 +4843,7 @@ set_up_atca_domain(ipmi_domain_t *domain, ipmi_msg_t *get_properties,
     ipmi_domain_set_oem_data(domain, info, atca_oem_data_destroyer);
     ipmi_domain_set_oem_shutdown_handler(domain,
 					 atca_oem_domain_shutdown_handler);
+    atca_register_stats(domain, info);
 
     ipmi_domain_add_mc_updated_handler(domain,
 				       atca_fix_sel_handler,
@@ -4555,6 +5008,7 @@ set_up_atca_blade(ipmi_domain_t *domain, ipmi_msg_t *get_properties,
     ipmi_domain_set_oem_data(domain, info, atca_oem_data_destroyer);
     ipmi_domain_set_oem_shutdown_handler(domain,
 					 atca_oem_domain_shutdown_handler);
+    atca_register_stats(domain, info);
 
     ipmi_domain_set_con_up_handler(domain, atca_con_up, info);
 
@@ -4889,8 +5343,9 @@ check_if_local(ipmi_domain_t *domain, int conn, void *cb_data)
 
     if (i_ipmi_domain_get_connection(domain, conn, &con))
 	return;
-    if (con->con_type && (strcmp(con->con_type, "smi") == 0))
-	/* It's a system management interface. */
+    if (con->con_type && ((strcmp(con->con_type, "smi") == 0)
+			  || (strcmp(con->con_type, "smux") == 0)))
+	/* It's a system management interface (maybe multiplexed). */
 	i_ipmi_option_set_local_only_if_not_specified(domain, 1);
 }
 
@@ -51,6 +51,9 @@ struct opq_elem_s
     ilist_item_t      ilist_item;
 };
 
+static ipmi_mem_cache_t elem_cache =
+    IPMI_MEM_CACHE_INIT("opq_elem", sizeof(opq_elem_t));
+
 struct opq_s
 {
     ilist_t        *ops;
@@ -173,14 +176,14 @@ opq_elem_t *
 opq_alloc_elem(void)
 {
     opq_elem_t *elem;
-    elem = ipmi_mem_alloc(sizeof(opq_elem_t));
+    elem = ipmi_mem_cache_alloc(&elem_cache);
     return elem;
 }
 
 void
 opq_free_elem(opq_elem_t *elem)
 {
-    ipmi_mem_free(elem);
+    ipmi_mem_cache_free(&elem_cache, elem);
 }
 
 int
@@ -251,7 +254,7 @@ opq_new_op_with_done(opq_t          *opq,
 
     opq_lock(opq);
     if (opq->in_handler) {
-	elem = ipmi_mem_alloc(sizeof(*elem));
+	elem = opq_alloc_elem();
 	if (!elem)
 	    goto out_err;
 	elem->handler = handler;
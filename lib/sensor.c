@@ -60,7 +60,10 @@ struct ipmi_sensor_info_s
     unsigned int             idx_size[5];
     /* In the above two, the 5th index is for non-standard sensors. */
 
-    ipmi_lock_t              *idx_lock;
+    /* Protects the above arrays.  Lookups take it for read, adding
+       and removing sensors take it for write.  Nothing may be called
+       out to with this held. */
+    ipmi_rwlock_t            *idx_lock;
 
     /* Total number of sensors we have in this. */
     unsigned int             sensor_count;
@@ -69,6 +72,9 @@ struct ipmi_sensor_info_s
 #define SENSOR_ID_LEN 32 /* 16 bytes are allowed for a sensor. */
 struct ipmi_sensor_s
 {
+    /* Protects usecount, destroyed, and add_pending.  Never held
+       while calling out, so it is a non-recursive lock. */
+    ipmi_lock_t   *lock;
     unsigned int  usecount;
 
     ipmi_domain_t *domain; /* Domain I am in. */
@@ -218,6 +224,9 @@ struct ipmi_sensor_s
     /* Used for temporary linking. */
     ipmi_sensor_t *tlink;
 
+    /* Our entry on the entity's sensor list. */
+    locked_list_entry_t entity_link;
+
     /* Cruft. */
     ipmi_sensor_threshold_event_handler_nd_cb threshold_event_handler;
     ipmi_sensor_discrete_event_handler_nd_cb  discrete_event_handler;
@@ -232,40 +241,82 @@ static void sensor_final_destroy(ipmi_sensor_t *sensor);
  *
  **********************************************************************/
 
-/* Must be called with the domain entity lock held. */
+/* The caller must make sure the sensor cannot be freed while this
+   is called, generally by holding the MC's sensor index lock, the
+   entity's sensor list lock, or another reference. */
 int
 i_ipmi_sensor_get(ipmi_sensor_t *sensor)
 {
+    int rv = 0;
+
+    ipmi_lock(sensor->lock);
     if (sensor->destroyed)
-	return EINVAL;
+	rv = EINVAL;
+    else
+	sensor->usecount++;
+    ipmi_unlock(sensor->lock);
+    return rv;
+}
+
+/* Get a reference even if the sensor is destroyed, for the error
+   paths that still own a pointer to it. */
+static void
+sensor_ref(ipmi_sensor_t *sensor)
+{
+    ipmi_lock(sensor->lock);
     sensor->usecount++;
-    return 0;
+    ipmi_unlock(sensor->lock);
+}
+
+/* ipmi_sensor_destroy() clears the sensor's SDR slot holding the
+   entities lock and its MC's index lock, and the sensor is not freed
+   before that.  So the entities lock keeps the sensor around long
+   enough to find its MC, and the reference is taken under the index
+   lock. */
+ipmi_sensor_t *
+i_ipmi_sensor_get_sdr_slot(ipmi_domain_t *domain, ipmi_sensor_t **slot)
+{
+    ipmi_sensor_t      *sensor;
+    ipmi_sensor_info_t *sensors;
+
+    i_ipmi_domain_entity_lock(domain);
+    sensor = *slot;
+    if (sensor) {
+	sensors = i_ipmi_mc_get_sensors(sensor->mc);
+	ipmi_rwlock_read_lock(sensors->idx_lock);
+	if ((*slot != sensor) || i_ipmi_sensor_get(sensor))
+	    sensor = NULL;
+	ipmi_rwlock_read_unlock(sensors->idx_lock);
+    }
+    if (sensor)
+	i_ipmi_entity_get(sensor->entity);
+    i_ipmi_domain_entity_unlock(domain);
+    return sensor;
 }
 
 void
 i_ipmi_sensor_put(ipmi_sensor_t *sensor)
 {
-    ipmi_domain_t *domain = sensor->domain;
-    i_ipmi_domain_entity_lock(domain);
+    ipmi_lock(sensor->lock);
     if (sensor->usecount == 1) {
 	if (sensor->add_pending) {
 	    sensor->add_pending = 0;
-	    i_ipmi_domain_entity_unlock(sensor->domain);
+	    ipmi_unlock(sensor->lock);
 	    i_ipmi_entity_call_sensor_handlers(sensor->entity,
 					      sensor, IPMI_ADDED);
-	    i_ipmi_domain_entity_lock(sensor->domain);
+	    ipmi_lock(sensor->lock);
 	}
 	if (sensor->destroyed
 	    && (!sensor->waitq
 		|| (!opq_stuff_in_progress(sensor->waitq))))
 	{
-	    i_ipmi_domain_entity_unlock(domain);
+	    ipmi_unlock(sensor->lock);
 	    sensor_final_destroy(sensor);
 	    return;
 	}
     }
     sensor->usecount--;
-    i_ipmi_domain_entity_unlock(domain);
+    ipmi_unlock(sensor->lock);
 }
 
 ipmi_sensor_id_t
@@ -331,12 +382,15 @@ mc_cb(ipmi_mc_t *mc, void *cb_data)
     ipmi_entity_t      *entity = NULL;
     
     sensors = i_ipmi_mc_get_sensors(mc);
-    i_ipmi_domain_entity_lock(domain);
     if (info->id.lun > 4) {
 	info->err = EINVAL;
-	goto out_unlock;
+	return;
     }
 
+    /* Only the MC's index is locked for the lookup, so lookups of
+       different sensors don't contend with each other or with the
+       rest of the domain. */
+    ipmi_rwlock_read_lock(sensors->idx_lock);
     if (info->id.sensor_num >= sensors->idx_size[info->id.lun]) {
 	info->err = EINVAL;
 	goto out_unlock;
@@ -348,27 +402,29 @@ mc_cb(ipmi_mc_t *mc, void *cb_data)
 	goto out_unlock;
     }
 
-    info->err = i_ipmi_entity_get(sensor->entity);
-    if (info->err)
-	goto out_unlock;
-    entity = sensor->entity;
-
     info->err = i_ipmi_sensor_get(sensor);
     if (info->err)
 	goto out_unlock;
+    ipmi_rwlock_read_unlock(sensors->idx_lock);
 
+    /* The sensor holds its entity until it is finally destroyed, so
+       the entity pointer is good here. */
+    i_ipmi_domain_entity_lock(domain);
+    info->err = i_ipmi_entity_get(sensor->entity);
+    if (!info->err)
+	entity = sensor->entity;
     i_ipmi_domain_entity_unlock(domain);
 
-    info->handler(sensor, info->cb_data);
+    if (entity)
+	info->handler(sensor, info->cb_data);
 
     i_ipmi_sensor_put(sensor);
-    i_ipmi_entity_put(entity);
+    if (entity)
+	i_ipmi_entity_put(entity);
     return;
 
  out_unlock:
-    i_ipmi_domain_entity_unlock(domain);
-    if (entity)
-	i_ipmi_entity_put(entity);
+    ipmi_rwlock_read_unlock(sensors->idx_lock);
 }
 
 int
@@ -609,7 +665,7 @@ sensor_rsp_handler(ipmi_mc_t  *mc,
 
     if (sensor->destroyed) {
 	i_ipmi_domain_entity_lock(sensor->domain);
-	sensor->usecount++;
+	sensor_ref(sensor);
 	rv = i_ipmi_entity_get(sensor->entity);
 	if (! rv)
 	    entity = sensor->entity;
@@ -626,7 +682,7 @@ sensor_rsp_handler(ipmi_mc_t  *mc,
 
     if (!mc) {
 	i_ipmi_domain_entity_lock(sensor->domain);
-	sensor->usecount++;
+	sensor_ref(sensor);
 	rv = i_ipmi_entity_get(sensor->entity);
 	if (! rv)
 	    entity = sensor->entity;
@@ -655,7 +711,7 @@ sensor_rsp_handler(ipmi_mc_t  *mc,
 		 MC_NAME(mc));
 
 	i_ipmi_domain_entity_lock(sensor->domain);
-	sensor->usecount++;
+	sensor_ref(sensor);
 	nrv = i_ipmi_entity_get(sensor->entity);
 	if (! nrv)
 	    entity = sensor->entity;
@@ -710,7 +766,7 @@ sensor_addr_response_handler(ipmi_domain_t *domain, ipmi_msgi_t *rspi)
 	    i_ipmi_domain_mc_unlock(sensor->domain);
 	    i_ipmi_domain_entity_lock(sensor->domain);
 	    i_ipmi_entity_get(sensor->entity);
-	    sensor->usecount++;
+	    sensor_ref(sensor);
 	    i_ipmi_domain_entity_unlock(sensor->domain);
 	    info->__rsp_handler(NULL, ECANCELED, NULL, info->__cb_data);
 	    i_ipmi_sensor_put(sensor);
@@ -736,7 +792,7 @@ sensor_addr_response_handler(ipmi_domain_t *domain, ipmi_msgi_t *rspi)
 	    i_ipmi_domain_mc_unlock(sensor->domain);
 	    i_ipmi_domain_entity_lock(sensor->domain);
 	    i_ipmi_entity_get(sensor->entity);
-	    sensor->usecount++;
+	    sensor_ref(sensor);
 	    i_ipmi_domain_entity_unlock(sensor->domain);
 	    info->__rsp_handler(sensor, rv, NULL, info->__cb_data);
 	    i_ipmi_sensor_put(sensor);
@@ -789,7 +845,7 @@ ipmi_sensors_alloc(ipmi_mc_t *mc, ipmi_sensor_info_t **new_sensors)
     if (!sensors)
 	return ENOMEM;
 
-    rv = ipmi_create_lock_os_hnd(os_hnd, &sensors->idx_lock);
+    rv = ipmi_create_rwlock_os_hnd(os_hnd, &sensors->idx_lock);
     if (rv) {
 	ipmi_mem_free(sensors);
 	return rv;
@@ -844,7 +900,6 @@ ipmi_sensor_add_nonstandard(ipmi_mc_t              *mc,
     ipmi_sensor_info_t *sensors = i_ipmi_mc_get_sensors(mc);
     ipmi_domain_t      *domain;
     os_handler_t       *os_hnd;
-    void               *link;
     int                err;
     unsigned int       i;
 
@@ -857,8 +912,14 @@ ipmi_sensor_add_nonstandard(ipmi_mc_t              *mc,
     if ((num >= 256) && (num != UINT_MAX))
 	return EINVAL;
 
+    if (!sensor->lock) {
+	err = ipmi_create_nr_lock_os_hnd(os_hnd, &sensor->lock);
+	if (err)
+	    return err;
+    }
+
     i_ipmi_domain_entity_lock(domain);
-    ipmi_lock(sensors->idx_lock);
+    ipmi_rwlock_write_lock(sensors->idx_lock);
 
     if (num == UINT_MAX){
 	for (i=0; i<sensors->idx_size[4]; i++) {
@@ -917,17 +978,6 @@ ipmi_sensor_add_nonstandard(ipmi_mc_t              *mc,
 	goto out_err;
     }
 
-    link = locked_list_alloc_entry();
-    if (!link) {
-	opq_destroy(sensor->waitq);
-	sensor->waitq = NULL;
-	locked_list_destroy(sensor->handler_list);
-	locked_list_destroy(sensor->handler_list_cl);
-	sensor->handler_list = NULL;
-	err = ENOMEM;
-	goto out_err;
-    }
-
     sensor->domain = domain;
     sensor->mc = mc;
     sensor->source_mc = source_mc;
@@ -946,18 +996,18 @@ ipmi_sensor_add_nonstandard(ipmi_mc_t              *mc,
     sensor->destroy_handler_cb_data = destroy_handler_cb_data;
     sensor_set_name(sensor);
 
-    ipmi_unlock(sensors->idx_lock);
+    ipmi_rwlock_write_unlock(sensors->idx_lock);
 
     i_ipmi_domain_entity_unlock(domain);
 
-    ipmi_entity_add_sensor(ent, sensor, link);
+    ipmi_entity_add_sensor(ent, sensor, &sensor->entity_link);
 
     sensor->add_pending = 1;
 
     return 0;
 
  out_err:
-    ipmi_unlock(sensors->idx_lock);
+    ipmi_rwlock_write_unlock(sensors->idx_lock);
     i_ipmi_domain_entity_unlock(domain);
     return err;
 }
@@ -1046,6 +1096,7 @@ sensor_final_destroy(ipmi_sensor_t *sensor)
 	sensor->oem_info_cleanup_handler(sensor, sensor->oem_info);
 
     i_ipmi_entity_put(sensor->entity);
+    ipmi_destroy_lock(sensor->lock);
     ipmi_mem_free(sensor);
 }
 
@@ -1060,20 +1111,25 @@ ipmi_sensor_destroy(ipmi_sensor_t *sensor)
     i_ipmi_domain_mc_unlock(sensor->domain);
     sensors = i_ipmi_mc_get_sensors(sensor->mc);
 
-    ipmi_lock(sensors->idx_lock);
+    /* See i_ipmi_sensor_get_sdr_slot() for the SDR slot locking. */
+    i_ipmi_domain_entity_lock(sensor->domain);
+    ipmi_rwlock_write_lock(sensors->idx_lock);
     if (sensor == sensors->sensors_by_idx[sensor->lun][sensor->num]) {
 	sensors->sensor_count--;
 	sensors->sensors_by_idx[sensor->lun][sensor->num] = NULL;
     }
 
-    i_ipmi_sensor_get(sensor);
+    sensor_ref(sensor);
 
     if (sensor->source_array)
 	sensor->source_array[sensor->source_idx] = NULL;
 
-    ipmi_unlock(sensors->idx_lock);
+    ipmi_rwlock_write_unlock(sensors->idx_lock);
+    i_ipmi_domain_entity_unlock(sensor->domain);
 
+    ipmi_lock(sensor->lock);
     sensor->destroyed = 1;
+    ipmi_unlock(sensor->lock);
     i_ipmi_sensor_put(sensor);
     i_ipmi_mc_put(mc);
     return 0;
@@ -1098,7 +1154,7 @@ ipmi_sensors_destroy(ipmi_sensor_info_t *sensors)
 	    ipmi_mem_free(sensors->sensors_by_idx[i]);
     }
     if (sensors->idx_lock)
-	ipmi_destroy_lock(sensors->idx_lock);
+	ipmi_destroy_rwlock(sensors->idx_lock);
     ipmi_mem_free(sensors);
     return 0;
 }
@@ -1276,6 +1332,9 @@ get_sensors_from_sdrs(ipmi_domain_t      *domain,
 	    goto out_err_enomem;
 	}
 
+	if (ipmi_create_nr_lock(domain, &s[p]->lock))
+	    goto out_err_enomem;
+
 	s[p]->destroyed = 0;
 	s[p]->destroy_handler = NULL;
 
@@ -1453,6 +1512,8 @@ get_sensors_from_sdrs(ipmi_domain_t      *domain,
 		    
 		    /* In case of error */
 		    s[p+j]->handler_list = NULL;
+		    s[p+j]->handler_list_cl = NULL;
+		    s[p+j]->lock = NULL;
 
 		    /* For every sensor except the first, increment the usage
 		       count for the MC so that it will decrement properly.
@@ -1477,6 +1538,9 @@ get_sensors_from_sdrs(ipmi_domain_t      *domain,
 		    if (! s[p+j]->handler_list)
 			goto out_err_enomem;
 
+		    if (ipmi_create_nr_lock(domain, &s[p+j]->lock))
+			goto out_err_enomem;
+
 		    s[p+j]->num += j;
 
 		    if (entity_instance_incr & 0x80) {
@@ -1547,6 +1611,8 @@ get_sensors_from_sdrs(ipmi_domain_t      *domain,
 		    locked_list_destroy(s[i]->handler_list);
 		if (s[i]->handler_list_cl)
 		    locked_list_destroy(s[i]->handler_list_cl);
+		if (s[i]->lock)
+		    ipmi_destroy_lock(s[i]->lock);
 		ipmi_mem_free(s[i]);
 	    }
 	ipmi_mem_free(s);
@@ -1556,8 +1622,7 @@ get_sensors_from_sdrs(ipmi_domain_t      *domain,
 
 static void
 handle_new_sensor(ipmi_domain_t *domain,
-		  ipmi_sensor_t *sensor,
-		  void          *link)
+		  ipmi_sensor_t *sensor)
 {
     /* Call this before the OEM call so the OEM call can replace it. */
     sensor->cbs = ipmi_standard_sensor_cb;
@@ -1576,11 +1641,11 @@ handle_new_sensor(ipmi_domain_t *domain,
 
     if ((sensor->source_mc)
 	&& (i_ipmi_mc_new_sensor(sensor->source_mc, sensor->entity,
-				 sensor, link)))
+				 sensor, &sensor->entity_link)))
     {
         /* Nothing to do, OEM code handled the sensor. */
     } else {
-	ipmi_entity_add_sensor(sensor->entity, sensor, link);
+	ipmi_entity_add_sensor(sensor->entity, sensor, &sensor->entity_link);
     }
 
     i_call_new_sensor_handlers(domain, sensor);
@@ -1666,11 +1731,6 @@ typedef struct entity_list_s
 } entity_list_t;
 
 /* Assume it has enough space for one pointer. */
-struct locked_list_entry_s
-{
-    locked_list_entry_t *next;
-};
-
 int
 ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 			ipmi_mc_t       *source_mc,
@@ -1688,7 +1748,6 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
     entity_list_t       *del_sensors = NULL;
     entity_list_t       *ent_item;
     entity_list_t       *new_ent_item;
-    locked_list_entry_t *link, *links = NULL;
     ipmi_sensor_t       **sens_tmp;
     
 
@@ -1702,8 +1761,7 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 
     ents = ipmi_domain_get_entities(domain);
 
-    /* Pre-allocate all the links we will need for registering sensors
-       with the entities, and we make sure all the entities exist. */
+    /* Make sure all the entities exist. */
     for (i=0; i<count; i++) {
 	ipmi_sensor_t      *nsensor = sdr_sensors[i];
 
@@ -1735,7 +1793,7 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 
 	    sensors = i_ipmi_mc_get_sensors(nsensor->mc);
 
-	    ipmi_lock(sensors->idx_lock);
+	    ipmi_rwlock_write_lock(sensors->idx_lock);
 	    if (nsensor->num >= sensors->idx_size[nsensor->lun]) {
 		/* There's not enough room in the sensor repository
 		   for the new item, so expand the array. */
@@ -1743,7 +1801,7 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 		unsigned int  new_size = nsensor->num+10;
 		new_by_idx = ipmi_mem_alloc(sizeof(ipmi_sensor_t *) * new_size);
 		if (!new_by_idx) {
-		    ipmi_unlock(sensors->idx_lock);
+		    ipmi_rwlock_write_unlock(sensors->idx_lock);
 		    rv = ENOMEM;
 		    i_ipmi_entity_put(ent);
 		    goto out_err_free;
@@ -1760,7 +1818,7 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 		sensors->sensors_by_idx[nsensor->lun] = new_by_idx;
 		sensors->idx_size[nsensor->lun] = new_size;
 	    }
-	    ipmi_unlock(sensors->idx_lock);
+	    ipmi_rwlock_write_unlock(sensors->idx_lock);
 
 	    /* Keep track of each entity/sensor pair. */
 	    new_ent_item = ipmi_mem_alloc(sizeof(*new_ent_item));
@@ -1775,14 +1833,6 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 	    new_ent_item->op = ENT_LIST_OLD;
 	    new_ent_item->next = new_sensors;
 	    new_sensors = new_ent_item;
-
-	    /* Pre-allocate link entries for putting the sensor into
-	       the entity. */
-	    link = locked_list_alloc_entry();
-	    if (!link)
-		goto out_err_free;
-	    link->next = links;
-	    links = link;
 	}
     }
 
@@ -1848,7 +1898,7 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 	}
 
 	sensors = i_ipmi_mc_get_sensors(nsensor->mc);
-	ipmi_lock(sensors->idx_lock);
+	ipmi_rwlock_read_lock(sensors->idx_lock);
 	if (sensors->sensors_by_idx[nsensor->lun]
 	    && (nsensor->num < sensors->idx_size[nsensor->lun])
 	    && sensors->sensors_by_idx[nsensor->lun][nsensor->num])
@@ -1867,7 +1917,7 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 		/* We have to delete the old sensor. */
 		new_ent_item = ipmi_mem_alloc(sizeof(*new_ent_item));
 		if (!new_ent_item) {
-		    ipmi_unlock(sensors->idx_lock);
+		    ipmi_rwlock_read_unlock(sensors->idx_lock);
 		    rv = ENOMEM;
 		    goto out_err_free_unlock;
 		}
@@ -1890,7 +1940,7 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 	} else {
 	    ent_item->op = ENT_LIST_NEW;
 	}
-	ipmi_unlock(sensors->idx_lock);
+	ipmi_rwlock_read_unlock(sensors->idx_lock);
 
 	ent_item = ent_item->next;
     }
@@ -1928,15 +1978,14 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 	    continue;
 	}
 
-	sensors = i_ipmi_mc_get_sensors(nsensor->mc);
-	ipmi_lock(sensors->idx_lock);
 	switch (ent_item->op) {
 	case ENT_LIST_NEW:
+	    sensors = i_ipmi_mc_get_sensors(nsensor->mc);
+	    ipmi_rwlock_write_lock(sensors->idx_lock);
 	    sensors->sensors_by_idx[nsensor->lun][nsensor->num] = nsensor;
 	    sensors->sensor_count++;
-	    link = links;
-	    links = link->next;
-	    handle_new_sensor(domain, nsensor, link);
+	    ipmi_rwlock_write_unlock(sensors->idx_lock);
+	    handle_new_sensor(domain, nsensor);
 	    break;
 
 	case ENT_LIST_OLD:
@@ -1948,6 +1997,7 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 	    opq_destroy(nsensor->waitq);
 	    locked_list_destroy(nsensor->handler_list);
 	    locked_list_destroy(nsensor->handler_list_cl);
+	    ipmi_destroy_lock(nsensor->lock);
 	    ipmi_mem_free(nsensor);
 	    ent_item->sensor = NULL;
 	    sdr_sensors[i] = osensor;
@@ -1959,7 +2009,6 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
 	    }
 	    break;
 	}
-	ipmi_unlock(sensors->idx_lock);
 	ent_item = ent_item->next;
     }
 
@@ -2019,13 +2068,6 @@ ipmi_sensor_handle_sdrs(ipmi_domain_t   *domain,
     }
 
  out:
-    /* Cleanup unused links. */
-    while (links) {
-	link = links;
-	links = link->next;
-	locked_list_free_entry(link);
-    }
-
     return rv;
 
  out_err:
@@ -0,0 +1,301 @@
+/*
+ * bench_domain.c
+ *
+ * The domain fixture shared by the benchmarks that run against a BMC.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <OpenIPMI/ipmiif.h>
+#include <OpenIPMI/ipmi_mc.h>
+#include <OpenIPMI/ipmi_msgbits.h>
+#include <OpenIPMI/ipmi_conn.h>
+#include <OpenIPMI/ipmi_err.h>
+
+#include "bench_domain.h"
+
+static os_handler_t     *bench_os_hnd;
+static ipmi_args_t      *bench_args;
+static ipmi_domain_id_t bench_domain_id;
+static pthread_t        *loops;
+static unsigned int     num_loops;
+static volatile int     stop_loops;
+static volatile int     domain_up;
+
+static ipmi_mcid_t mc_id;
+static int         have_mc;
+
+/* Shared state for the message window. */
+static pthread_mutex_t msg_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int    msgs_outstanding;
+static unsigned long   msgs_done;
+static unsigned long   msg_errs;
+static volatile int    msgs_stop;
+
+double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+op_loop(void *cb_data)
+{
+    struct timeval tv;
+
+    while (!stop_loops) {
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	bench_os_hnd->perform_one_op(bench_os_hnd, &tv);
+    }
+    return NULL;
+}
+
+static void
+fully_up(ipmi_domain_t *domain, void *cb_data)
+{
+    domain_up = 1;
+}
+
+void
+bench_domain_open(os_handler_t *os_hnd, int *curr_arg, int argc,
+		  char *argv[], unsigned int nthreads,
+		  ipmi_domain_id_t *domain_id)
+{
+    int             rv;
+    ipmi_con_t      *con;
+    unsigned int    i;
+    double          end;
+    struct timespec ts = { 0, 10000000 };
+
+    bench_os_hnd = os_hnd;
+
+    rv = ipmi_parse_args2(curr_arg, argc, argv, &bench_args);
+    if (rv) {
+	fprintf(stderr, "Error parsing command arguments, argument %d: %s\n",
+		*curr_arg, strerror(rv));
+	exit(1);
+    }
+
+    rv = ipmi_args_setup_con(bench_args, os_hnd, NULL, &con);
+    if (rv) {
+	fprintf(stderr, "ipmi_ip_setup_con: %s\n", strerror(rv));
+	exit(1);
+    }
+
+    loops = calloc(nthreads, sizeof(*loops));
+    if (!loops) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    for (i = 0; i < nthreads; i++) {
+	if (pthread_create(&loops[i], NULL, op_loop, NULL)) {
+	    fprintf(stderr, "Unable to start thread\n");
+	    exit(1);
+	}
+    }
+    num_loops = nthreads;
+
+    rv = ipmi_open_domain("bench", &con, 1, NULL, NULL, fully_up, NULL,
+			  NULL, 0, &bench_domain_id);
+    if (rv) {
+	fprintf(stderr, "ipmi_open_domain: %s\n", strerror(rv));
+	exit(1);
+    }
+
+    end = bench_now() + 60;
+    while (!domain_up && bench_now() < end)
+	nanosleep(&ts, NULL);
+    if (!domain_up) {
+	fprintf(stderr, "Domain did not come up\n");
+	exit(1);
+    }
+    *domain_id = bench_domain_id;
+}
+
+static void
+close_done(void *cb_data)
+{
+    volatile int *closed = cb_data;
+
+    *closed = 1;
+}
+
+static void
+close_domain(ipmi_domain_t *domain, void *cb_data)
+{
+    ipmi_domain_close(domain, close_done, cb_data);
+}
+
+void
+bench_domain_close(void)
+{
+    unsigned int    i;
+    double          end;
+    struct timespec ts = { 0, 10000000 };
+    volatile int    closed = 0;
+
+    ipmi_domain_pointer_cb(bench_domain_id, close_domain, (void *) &closed);
+    end = bench_now() + 10;
+    while (!closed && bench_now() < end)
+	nanosleep(&ts, NULL);
+
+    stop_loops = 1;
+    for (i = 0; i < num_loops; i++)
+	pthread_join(loops[i], NULL);
+    free(loops);
+    loops = NULL;
+    ipmi_free_args(bench_args);
+    bench_args = NULL;
+}
+
+static void
+got_mc(ipmi_domain_t *domain, ipmi_mc_t *mc, void *cb_data)
+{
+    if (!have_mc) {
+	mc_id = ipmi_mc_convert_to_id(mc);
+	have_mc = 1;
+    }
+}
+
+static void
+find_mc(ipmi_domain_t *domain, void *cb_data)
+{
+    ipmi_domain_iterate_mcs(domain, got_mc, NULL);
+}
+
+static void send_msg(ipmi_mc_t *mc);
+
+static void
+msg_rsp(ipmi_mc_t *mc, ipmi_msg_t *msg, void *rsp_data)
+{
+    int next = 0;
+
+    pthread_mutex_lock(&msg_lock);
+    if (!mc || msg->data_len < 1 || msg->data[0] != 0)
+	msg_errs++;
+    else
+	msgs_done++;
+    if (msgs_stop || !mc)
+	msgs_outstanding--;
+    else
+	next = 1;
+    pthread_mutex_unlock(&msg_lock);
+    if (next)
+	send_msg(mc);
+}
+
+static void
+send_msg(ipmi_mc_t *mc)
+{
+    ipmi_msg_t msg;
+    int        rv;
+
+    msg.netfn = IPMI_APP_NETFN;
+    msg.cmd = IPMI_GET_DEVICE_ID_CMD;
+    msg.data = NULL;
+    msg.data_len = 0;
+    rv = ipmi_mc_send_command(mc, 0, &msg, msg_rsp, NULL);
+    if (rv) {
+	pthread_mutex_lock(&msg_lock);
+	msg_errs++;
+	msgs_outstanding--;
+	pthread_mutex_unlock(&msg_lock);
+    }
+}
+
+static void
+start_msgs(ipmi_mc_t *mc, void *cb_data)
+{
+    unsigned int *count = cb_data;
+    unsigned int i;
+
+    for (i = 0; i < *count; i++)
+	send_msg(mc);
+}
+
+int
+bench_msg_window(ipmi_domain_id_t domain_id, unsigned int outstanding,
+		 unsigned int seconds, double *rate, unsigned long *errs)
+{
+    unsigned int    left;
+    unsigned long   done;
+    double          start, end, wait_end;
+    struct timespec ts = { 0, 10000000 };
+    int             rv;
+
+    if (!have_mc)
+	ipmi_domain_pointer_cb(domain_id, find_mc, NULL);
+    if (!have_mc)
+	return ENOENT;
+
+    pthread_mutex_lock(&msg_lock);
+    msgs_outstanding = outstanding;
+    msgs_done = 0;
+    msg_errs = 0;
+    msgs_stop = 0;
+    pthread_mutex_unlock(&msg_lock);
+
+    start = bench_now();
+    rv = ipmi_mc_pointer_cb(mc_id, start_msgs, &outstanding);
+    if (rv)
+	return rv;
+    end = start + seconds;
+    while (bench_now() < end)
+	nanosleep(&ts, NULL);
+    pthread_mutex_lock(&msg_lock);
+    msgs_stop = 1;
+    done = msgs_done;
+    pthread_mutex_unlock(&msg_lock);
+    end = bench_now();
+
+    /* Let the outstanding commands finish before the domain goes away. */
+    wait_end = end + 10;
+    do {
+	nanosleep(&ts, NULL);
+	pthread_mutex_lock(&msg_lock);
+	left = msgs_outstanding;
+	pthread_mutex_unlock(&msg_lock);
+    } while (left && bench_now() < wait_end);
+
+    pthread_mutex_lock(&msg_lock);
+    *errs = msg_errs;
+    pthread_mutex_unlock(&msg_lock);
+    *rate = done / (end - start);
+    return 0;
+}
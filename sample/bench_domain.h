@@ -0,0 +1,62 @@
+/*
+ * bench_domain.h
+ *
+ * The domain fixture shared by the benchmarks that run against a BMC:
+ * operation loop threads, opening and closing a domain, and a window
+ * of Get Device ID commands kept outstanding to its first MC.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef BENCH_DOMAIN_H
+#define BENCH_DOMAIN_H
+
+#include <OpenIPMI/ipmiif.h>
+#include <OpenIPMI/os_handler.h>
+
+/* The monotonic time in seconds. */
+double bench_now(void);
+
+/* Set up the connection from the openipmicmd style arguments starting
+   at argv[*curr_arg], start nthreads threads running the OS handler's
+   operation loop and open a domain on the connection.  Returns when
+   the domain is fully up.  Exits the program on errors. */
+void bench_domain_open(os_handler_t *os_hnd, int *curr_arg, int argc,
+		       char *argv[], unsigned int nthreads,
+		       ipmi_domain_id_t *domain_id);
+
+/* Close the domain, stop the threads and free the arguments. */
+void bench_domain_close(void);
+
+/* Keep outstanding Get Device ID commands going to the first MC in the
+   domain for the given number of seconds, each response sends the
+   next command.  Returns the responses per second and the number of
+   errors, or an errno if there is no MC. */
+int bench_msg_window(ipmi_domain_id_t domain_id, unsigned int outstanding,
+		     unsigned int seconds, double *rate,
+		     unsigned long *errs);
+
+#endif /* BENCH_DOMAIN_H */
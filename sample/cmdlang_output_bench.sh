@@ -0,0 +1,190 @@
+#!/bin/bash
+#
+# cmdlang_output_bench.sh
+#
+# Compare the cost of openipmish's text, JSON and CBOR output modes.
+# A large domain is simulated with ipmi_sim and "sensor list" is run
+# repeatedly against it in each output mode; the CPU time used by
+# openipmish and the number of bytes it produced are reported.
+#
+# Run it from the build tree (or point -b at it) after "make":
+#
+#   sample/cmdlang_output_bench.sh [-b builddir] [-s sensors] [-e entities]
+#                                  [-n iterations] [-w wait] [-p port]
+#
+# The first row is a baseline run that brings the domain up and down
+# without listing anything; subtract it from the other rows to get the
+# cost of the listing itself.
+#
+#  Copyright 2026 MontaVista Software Inc.
+#
+#  This program is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public License
+#  as published by the Free Software Foundation; either version 2 of
+#  the License, or (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+
+top=$(dirname "$0")/..
+sensors=1000
+entities=101
+iters=300
+wait=10
+port=9011
+
+usage()
+{
+    echo "usage: $0 [-b builddir] [-s sensors] [-e entities]" \
+	 "[-n iterations] [-w wait] [-p port]" >&2
+    exit 1
+}
+
+while getopts "b:s:e:n:w:p:" opt; do
+    case $opt in
+	b) top=$OPTARG ;;
+	s) sensors=$OPTARG ;;
+	e) entities=$OPTARG ;;
+	n) iters=$OPTARG ;;
+	w) wait=$OPTARG ;;
+	p) port=$OPTARG ;;
+	*) usage ;;
+    esac
+done
+
+# Four LUNs of 255 sensors on the one MC (sensor number 0xff is
+# reserved).
+if [ "$sensors" -lt 1 -o "$sensors" -gt 1020 ]; then
+    echo "$0: sensors must be between 1 and 1020" >&2
+    exit 1
+fi
+if [ "$entities" -lt 1 -o "$entities" -gt "$sensors" ]; then
+    echo "$0: entities must be between 1 and the number of sensors" >&2
+    exit 1
+fi
+
+sim=$top/lanserv/ipmi_sim
+ipmish=$top/cmdlang/openipmish
+ping=$top/sample/rmcp_ping
+for p in "$sim" "$ipmish" "$ping"; do
+    if [ ! -x "$p" ]; then
+	echo "$0: $p not found, build the tree first or use -b" >&2
+	exit 1
+    fi
+done
+
+tmp=$(mktemp -d) || exit 1
+simpid=
+cleanup()
+{
+    if [ -n "$simpid" ]; then
+	kill $simpid 2>/dev/null
+	wait $simpid 2>/dev/null
+    fi
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+cat > "$tmp/lan.conf" <<EOF
+name "bench"
+set_working_mc 0x20
+  startlan 1
+    addr 127.0.0.1 $port
+    priv_limit admin
+    allowed_auths_callback none md2 md5 straight
+    allowed_auths_user none md2 md5 straight
+    allowed_auths_operator none md2 md5 straight
+    allowed_auths_admin none md2 md5 straight
+    guid a123456789abcdefa123456789abcdef
+  endlan
+  user 2 true  "ipmiusr" "test" admin    10       none md2 md5 straight
+EOF
+
+echo 1 > "$tmp/sval"
+
+# Compact sensor SDRs spread round-robin over the entities.  Entity
+# instances are kept system-relative (below 0x60) by moving on to the
+# next entity id every 96 instances.
+{
+    echo "mc_setbmc 0x20"
+    echo "mc_add 0x20 0 no-device-sdrs 0x23 9 8 0x9f 0x1291 0xf02 persist_sdr"
+    echo "sel_enable 0x20 1000 0x0a"
+    i=0
+    while [ $i -lt "$sensors" ]; do
+	lun=$((i / 255))
+	num=$((i % 255))
+	ent=$((i % entities))
+	eid=$((7 + ent / 96))
+	inst=$((ent % 96))
+	name=$(printf "%04d" $i)
+	echo "sensor_add 0x20 $lun $num 0x0c 0x6f poll 1000 file \"$tmp/sval\""
+	echo "sensor_set_event_support 0x20 $lun $num 1 1 0" \
+	     "000000000000001 000000000000000 000000000000001 000000000000000"
+	printf "main_sdr_add 0x20 0x%02x 0x%02x 0x51 0x02 0x20" \
+	       $((i % 256)) $((i / 256))
+	printf " 0x20 0x%02x 0x%02x 0x%02x 0x%02x" $lun $num $eid $inst
+	printf " 0xff 0xc0 0x0c 0x6f 0xff 0x00 0xff 0x00 0xff 0x00"
+	printf " 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x00"
+	printf " 0xc5 'S '%c '%c '%c '%c\n" \
+	       ${name:0:1} ${name:1:1} ${name:2:1} ${name:3:1}
+	i=$((i + 1))
+    done
+    echo "mc_enable 0x20"
+} > "$tmp/bench.emu"
+
+mkdir "$tmp/state"
+"$sim" -c "$tmp/lan.conf" -f "$tmp/bench.emu" -n -p -s "$tmp/state" \
+    > "$tmp/sim.log" 2>&1 &
+simpid=$!
+
+# Loading a big emulation file takes a while; wait until the simulator
+# answers RMCP pings before connecting to it.
+tries=0
+until "$ping" -t 1 -p $port 127.0.0.1 2>/dev/null | grep -q IPMI; do
+    tries=$((tries + 1))
+    if ! kill -0 $simpid 2>/dev/null || [ $tries -ge 60 ]; then
+	echo "$0: ipmi_sim failed to start:" >&2
+	cat "$tmp/sim.log" >&2
+	exit 1
+    fi
+done
+
+# Feed openipmish: open the domain, give it time to read the SDRs,
+# list the sensors $1 times, then close and exit.
+feed()
+{
+    local n=$1 i
+
+    echo "domain open bench lan -U ipmiusr -P test -A rmcp+ -L admin" \
+	 "-p $port 127.0.0.1"
+    sleep "$wait"
+    for ((i = 0; i < n; i++)); do
+	echo "sensor list bench"
+    done
+    echo "domain close bench"
+    sleep 2
+    echo "exit"
+}
+
+# run <label> <mode> <iterations>
+run()
+{
+    local label=$1 mode=$2 n=$3 cpu bytes
+
+    TIMEFORMAT="%U %S"
+    feed $n | { time "$ipmish" --output $mode > "$tmp/out" 2>/dev/null; } \
+	2> "$tmp/time"
+    cpu=$(awk '{ printf "%.2f", $1 + $2 }' "$tmp/time")
+    bytes=$(wc -c < "$tmp/out")
+    printf "%-10s %8s %12s\n" "$label" "$cpu" "$bytes"
+}
+
+echo "$sensors sensors in $entities entities, sensor list x $iters"
+printf "%-10s %8s %12s\n" "mode" "cpu(s)" "bytes"
+run baseline text 0
+for mode in text json cbor; do
+    run $mode $mode "$iters"
+done
@@ -34,9 +34,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -79,6 +83,59 @@ static bool domain_up;
 static bool delete_events;
 static int debug;
 static int childpid = -1;
+static os_handler_t *os_hnd;
+
+/*
+ * The event sink.  With -k, -f or -u events are not written as they
+ * come in.  They are formatted into sinkbuf and written out in batches
+ * from a timer (or once a batch fills up), without blocking, so a slow
+ * reader can't stall the daemon.  If the reader falls so far behind
+ * that the buffer is full, events are dropped and counted, and the
+ * reader is told how many with a "dropped" event once there is room
+ * again.
+ */
+enum sink_format { SINK_TEXT, SINK_JSON, SINK_BINARY };
+
+#define SINK_FLUSH_MSEC		50
+#define SINK_BATCH_SIZE		65536
+#define SINK_DEFAULT_QUEUE	(1024 * 1024)
+#define SINK_MAX_RECORD		4096
+
+static bool sinkmode;
+static enum sink_format sink_format = SINK_TEXT;
+static int sinkfd = -1;
+static char *sink_sockpath;
+static char *sink_filename;
+static unsigned long rotate_size;
+static unsigned int rotate_count = 5;
+static unsigned long sink_filesize;
+static unsigned char *sinkbuf;
+static size_t sinkbuf_len;
+static size_t sinkbuf_size = SINK_DEFAULT_QUEUE;
+static unsigned long sink_queued; /* Events since sinkbuf was empty. */
+static unsigned long events_dropped;
+static unsigned long drops_reported;
+static os_hnd_timer_id_t *sink_timer;
+static bool sink_timer_running;
+static time_t sink_next_connect;
+
+/*
+ * With -e, an event given to the sink is only deleted from the SEL
+ * once its record has been written out.  Each keeps the position in
+ * the output stream its record ends at; sink_added and sink_written
+ * count the bytes put into sinkbuf and written from it.
+ */
+typedef struct sink_pending_s
+{
+    ipmi_event_t *event;
+    unsigned long long end;
+    struct sink_pending_s *next;
+} sink_pending_t;
+
+static sink_pending_t *sink_pending;
+static sink_pending_t **sink_pending_tail = &sink_pending;
+static unsigned long long sink_added;
+static unsigned long long sink_written;
 
 static char *indent_str(const char *instr, const char *indent)
 {
@@ -132,10 +189,38 @@ usage(void)
     printf(" -b, --dont-daemonize - Run the program in foreground.\n");
     printf(" -f, --outfile - Send the output to the given file instead of\n");;
     printf("    spawning another program.\n");
+    printf(" -u, --socket - Send the output to the given Unix socket instead\n");
+    printf("    of spawning another program.\n");
+    printf(" -F, --format - Output format with -k, -f or -u: text (the\n");
+    printf("    default), json or binary.\n");
+    printf(" -q, --queue-size - Bytes of events held for a slow reader\n");
+    printf("    before dropping them, default %d.\n", SINK_DEFAULT_QUEUE);
+    printf(" -r, --rotate-size - Rotate the -f file when it reaches this\n");
+    printf("    many bytes.\n");
+    printf(" -R, --rotate-count - Old -f files to keep, default 5.\n");
     printf("<con_parms> is:");
     ipmi_parse_args_iter_help(con_usage, NULL);
 }
 
+static int
+get_num_arg(int argc, char *argv[], int *curr_arg, size_t *val)
+{
+    const char *opt = argv[*curr_arg - 1];
+    char *end;
+
+    if (*curr_arg == argc) {
+	fprintf(stderr, "%s given, but no value given\n", opt);
+	return -1;
+    }
+    *val = strtoul(argv[*curr_arg], &end, 0);
+    if (argv[*curr_arg][0] == '\0' || *end != '\0') {
+	fprintf(stderr, "Invalid value for %s: %s\n", opt, argv[*curr_arg]);
+	return -1;
+    }
+    (*curr_arg)++;
+    return 0;
+}
+
 static int
 send_parms_to_file(char *type, char **parms1, int num_parms1,
 		   char **parms2, int num_parms2)
@@ -181,6 +266,425 @@ newpipe(FILE **retfile)
     return fds[0];
 }
 
+static size_t
+put_bytes(unsigned char *out, size_t pos, size_t size,
+	  const void *data, size_t len)
+{
+    if (pos < size)
+	memcpy(out + pos, data, (len < size - pos) ? len : size - pos);
+    return pos + len;
+}
+
+static size_t
+put_str(unsigned char *out, size_t pos, size_t size, const char *str)
+{
+    return put_bytes(out, pos, size, str, strlen(str));
+}
+
+static size_t
+put_json_str(unsigned char *out, size_t pos, size_t size, const char *str)
+{
+    char esc[8];
+
+    pos = put_str(out, pos, size, "\"");
+    for (; *str; str++) {
+	unsigned char c = *str;
+
+	if (c == '"' || c == '\\') {
+	    esc[0] = '\\';
+	    esc[1] = c;
+	    pos = put_bytes(out, pos, size, esc, 2);
+	} else if (c < 0x20) {
+	    snprintf(esc, sizeof(esc), "\\u%4.4x", c);
+	    pos = put_str(out, pos, size, esc);
+	} else {
+	    pos = put_bytes(out, pos, size, &c, 1);
+	}
+    }
+    return put_str(out, pos, size, "\"");
+}
+
+static size_t
+put_bin_str(unsigned char *out, size_t pos, size_t size, const char *str)
+{
+    size_t        len = strlen(str);
+    unsigned char c;
+
+    if (len > 255)
+	len = 255;
+    c = len;
+    pos = put_bytes(out, pos, size, &c, 1);
+    return put_bytes(out, pos, size, str, len);
+}
+
+/*
+ * Format an event for the sink, returning its length.  If that is
+ * more than size, it didn't fit.
+ *
+ * A binary record is a 2 byte little-endian length of the rest of the
+ * record, a byte with the number of strings, then the strings: the
+ * type and then the keys and values.  Each string is a length byte
+ * and that many bytes.
+ */
+static size_t
+format_event(unsigned char *out, size_t size, char *type,
+	     char **parms1, int num_parms1, char **parms2, int num_parms2)
+{
+    char   **parms[2] = { parms1, parms2 };
+    int    num_parms[2] = { num_parms1, num_parms2 };
+    size_t pos = 0;
+    int    i, j;
+
+    switch (sink_format) {
+    case SINK_TEXT:
+	pos = put_str(out, pos, size, type);
+	pos = put_str(out, pos, size, "\n");
+	for (i = 0; i < 2; i++) {
+	    for (j = 0; j + 1 < num_parms[i]; j += 2) {
+		pos = put_str(out, pos, size, parms[i][j]);
+		pos = put_str(out, pos, size, " ");
+		pos = put_str(out, pos, size, parms[i][j + 1]);
+		pos = put_str(out, pos, size, "\n");
+	    }
+	}
+	pos = put_str(out, pos, size, "endevent\n");
+	break;
+
+    case SINK_JSON:
+	pos = put_str(out, pos, size, "{\"type\":");
+	pos = put_json_str(out, pos, size, type);
+	for (i = 0; i < 2; i++) {
+	    for (j = 0; j + 1 < num_parms[i]; j += 2) {
+		pos = put_str(out, pos, size, ",");
+		pos = put_json_str(out, pos, size, parms[i][j]);
+		pos = put_str(out, pos, size, ":");
+		pos = put_json_str(out, pos, size, parms[i][j + 1]);
+	    }
+	}
+	pos = put_str(out, pos, size, "}\n");
+	break;
+
+    case SINK_BINARY:
+    {
+	unsigned char nstr = 1 + num_parms1 / 2 * 2 + num_parms2 / 2 * 2;
+
+	pos = 2;
+	pos = put_bytes(out, pos, size, &nstr, 1);
+	pos = put_bin_str(out, pos, size, type);
+	for (i = 0; i < 2; i++) {
+	    for (j = 0; j + 1 < num_parms[i]; j += 2) {
+		pos = put_bin_str(out, pos, size, parms[i][j]);
+		pos = put_bin_str(out, pos, size, parms[i][j + 1]);
+	    }
+	}
+	if (pos <= size && pos - 2 <= 0xffff) {
+	    out[0] = (pos - 2) & 0xff;
+	    out[1] = ((pos - 2) >> 8) & 0xff;
+	}
+	break;
+    }
+    }
+
+    return pos;
+}
+
+static char *
+abs_path(char *path)
+{
+    char cwd[4096];
+    char *s;
+
+    if (path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+	return path;
+    s = malloc(strlen(cwd) + strlen(path) + 2);
+    if (!s)
+	return path;
+    sprintf(s, "%s/%s", cwd, path);
+    return s;
+}
+
+static int
+sink_connect(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(sink_sockpath) >= sizeof(addr.sun_path)) {
+	syslog(LOG_ERR, "%s: Socket path too long: %s", domainname,
+	       sink_sockpath);
+	return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+	syslog(LOG_ERR, "%s: Unable to open socket: %s", domainname,
+	       strerror(errno));
+	return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sink_sockpath);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+	syslog(LOG_ERR, "%s: Unable to connect to %s: %s", domainname,
+	       sink_sockpath, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    sinkfd = fd;
+    return 0;
+}
+
+static int
+sink_open_file(void)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(sink_filename, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (fd == -1)
+	return -1;
+    if (fstat(fd, &st) == 0)
+	sink_filesize = st.st_size;
+    else
+	sink_filesize = 0;
+    sinkfd = fd;
+    return 0;
+}
+
+/* file -> file.1 -> file.2 ... up to rotate_count old files. */
+static void
+sink_rotate(void)
+{
+    size_t len = strlen(sink_filename) + 12;
+    char *from = malloc(len), *to = malloc(len);
+    unsigned int i;
+
+    if (!from || !to)
+	goto out;
+
+    close(sinkfd);
+    sinkfd = -1;
+    for (i = rotate_count; i > 0; i--) {
+	if (i == 1)
+	    snprintf(from, len, "%s", sink_filename);
+	else
+	    snprintf(from, len, "%s.%u", sink_filename, i - 1);
+	snprintf(to, len, "%s.%u", sink_filename, i);
+	rename(from, to);
+    }
+    if (rotate_count == 0)
+	unlink(sink_filename);
+    if (sink_open_file()) {
+	syslog(LOG_CRIT, "%s: Unable to reopen %s: %s\n", domainname,
+	       sink_filename, strerror(errno));
+	exit(1);
+    }
+ out:
+    free(from);
+    free(to);
+}
+
+static void
+sink_defer_delete(ipmi_event_t *event)
+{
+    sink_pending_t *p = malloc(sizeof(*p));
+
+    if (!p)
+	/* Leave it in the SEL, it's better to see it twice than never. */
+	return;
+    p->event = ipmi_event_dup(event);
+    p->end = sink_added;
+    p->next = NULL;
+    *sink_pending_tail = p;
+    sink_pending_tail = &p->next;
+}
+
+/*
+ * Delete the events that have been written out.  If written is false,
+ * the rest of the events were lost, free them and leave them in the
+ * SEL.
+ */
+static void
+sink_finish_pending(bool written)
+{
+    sink_pending_t *p;
+
+    while (sink_pending && (!written || sink_pending->end <= sink_written)) {
+	p = sink_pending;
+	sink_pending = p->next;
+	if (written)
+	    ipmi_event_delete(p->event, NULL, NULL);
+	ipmi_event_free(p->event);
+	free(p);
+    }
+    if (!sink_pending)
+	sink_pending_tail = &sink_pending;
+}
+
+static void
+sink_flush(void)
+{
+    size_t  done = 0;
+    ssize_t rv;
+
+    if (sinkfd == -1) {
+	time_t now = time(NULL);
+
+	/* Only the socket gets reopened, try once a second. */
+	if (now < sink_next_connect)
+	    return;
+	sink_next_connect = now + 1;
+	if (sink_connect())
+	    return;
+	syslog(LOG_NOTICE, "%s: Reconnected to %s", domainname,
+	       sink_sockpath);
+    }
+
+    while (done < sinkbuf_len) {
+	rv = write(sinkfd, sinkbuf + done, sinkbuf_len - done);
+	if (rv > 0) {
+	    done += rv;
+	    continue;
+	}
+	if (rv == -1 && errno == EINTR)
+	    continue;
+	if (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    break;
+
+	if (!sink_sockpath) {
+	    syslog(LOG_CRIT, "%s: Destination end of pipe failed: %s\n",
+		   domainname, rv == -1 ? strerror(errno) : "short write");
+	    exit(1);
+	}
+
+	/*
+	 * The reader went away.  What is left can't be sent on a new
+	 * connection, the first record may be partly sent, so count
+	 * all of it as dropped.
+	 */
+	syslog(LOG_ERR, "%s: Lost connection to %s: %s", domainname,
+	       sink_sockpath, rv == -1 ? strerror(errno) : "short write");
+	close(sinkfd);
+	sinkfd = -1;
+	sink_next_connect = time(NULL) + 1;
+	events_dropped += sink_queued;
+	sink_queued = 0;
+	sinkbuf_len = 0;
+	sink_written += done;
+	sink_finish_pending(true);
+	sink_finish_pending(false);
+	sink_written = sink_added;
+	return;
+    }
+
+    sink_written += done;
+    sink_finish_pending(true);
+    if (done) {
+	memmove(sinkbuf, sinkbuf + done, sinkbuf_len - done);
+	sinkbuf_len -= done;
+	sink_filesize += done;
+    }
+    if (sinkbuf_len == 0) {
+	sink_queued = 0;
+	/* Only rotate between whole records. */
+	if (sink_filename && rotate_size && sink_filesize >= rotate_size)
+	    sink_rotate();
+    }
+}
+
+static void sink_start_timer(void);
+
+static void
+sink_timeout(void *cb_data, os_hnd_timer_id_t *id)
+{
+    sink_timer_running = false;
+    sink_flush();
+    sink_start_timer();
+}
+
+static void
+sink_start_timer(void)
+{
+    struct timeval tv;
+
+    if (sink_timer_running || (sinkbuf_len == 0 && sinkfd != -1))
+	return;
+    tv.tv_sec = 0;
+    tv.tv_usec = SINK_FLUSH_MSEC * 1000;
+    if (os_hnd->start_timer(os_hnd, sink_timer, &tv, sink_timeout, NULL) == 0)
+	sink_timer_running = true;
+}
+
+/*
+ * Queue the record for the reader.  With -e, the event is deleted
+ * from the SEL once the record is written.
+ */
+static void
+sink_add(ipmi_event_t *event, char *type, char **parms1, int num_parms1,
+	 char **parms2, int num_parms2)
+{
+    size_t len;
+
+    if (events_dropped > drops_reported) {
+	char countstr[30];
+	char *dparms[2] = { "count", countstr };
+
+	snprintf(countstr, sizeof(countstr), "%lu",
+		 events_dropped - drops_reported);
+	len = format_event(sinkbuf + sinkbuf_len, sinkbuf_size - sinkbuf_len,
+			   "dropped", dparms, 2, NULL, 0);
+	if (len > sinkbuf_size - sinkbuf_len)
+	    goto drop;
+	sinkbuf_len += len;
+	sink_added += len;
+	sink_queued++;
+	syslog(LOG_WARNING, "%s: Reader caught up, %s events were dropped",
+	       domainname, countstr);
+	drops_reported = events_dropped;
+    }
+
+    len = format_event(sinkbuf + sinkbuf_len, sinkbuf_size - sinkbuf_len,
+		       type, parms1, num_parms1, parms2, num_parms2);
+    if (len > sinkbuf_size - sinkbuf_len || len > SINK_MAX_RECORD)
+	goto drop;
+    sinkbuf_len += len;
+    sink_added += len;
+    sink_queued++;
+    if (event && delete_events)
+	sink_defer_delete(event);
+
+    if (sinkbuf_len >= SINK_BATCH_SIZE)
+	sink_flush();
+    sink_start_timer();
+    return;
+
+ drop:
+    if (events_dropped == drops_reported)
+	syslog(LOG_WARNING, "%s: Reader is too slow, dropping events",
+	       domainname);
+    events_dropped++;
+    sink_start_timer();
+}
+
+static void
+sink_setup(void)
+{
+    sinkbuf = malloc(sinkbuf_size);
+    if (!sinkbuf) {
+	fprintf(stderr, "Out of memory allocating the event buffer\n");
+	exit(1);
+    }
+    if (os_hnd->alloc_timer(os_hnd, &sink_timer)) {
+	fprintf(stderr, "Unable to allocate the flush timer\n");
+	exit(1);
+    }
+    if (sinkfd != -1 && !sink_filename)
+	fcntl(sinkfd, F_SETFL, O_NONBLOCK);
+    /* Write errors are handled where they happen. */
+    signal(SIGPIPE, SIG_IGN);
+    sinkmode = true;
+}
+
 static void
 send_event_to_prog(char         *type,
 		   ipmi_event_t *event,
@@ -226,11 +730,9 @@ send_event_to_prog(char         *type,
     if (!domain_up)
 	goto out;
 
-    if (outfile) {
-	if (send_parms_to_file(type, parms, num_parms, parms2, num_parms2))
-	    /* The remote end is broken, give up. */
-	    exit(1);
-	handled = true;
+    if (sinkmode) {
+	/* The event is deleted once it is written out. */
+	sink_add(event, type, parms, num_parms, parms2, num_parms2);
 	goto out;
     }
 
@@ -546,8 +1048,6 @@ setup_done(ipmi_domain_t *domain,
     }
 }
 
-static os_handler_t *os_hnd;
-
 static void
 handle_openipmi_vlog(os_handler_t         *handler,
 		     const char           *format,
@@ -613,6 +1113,7 @@ main(int argc, char *argv[])
     bool        daemonize = true;
     char        *outfname = NULL;
     int         syslog_options = 0;
+    size_t      val;
 
     if (argc < 2) {
 	fprintf(stderr, "No domain name given\n");
@@ -675,6 +1176,49 @@ main(int argc, char *argv[])
 	    }
 	    outfname = argv[curr_arg];
 	    curr_arg++;
+	} else if ((strcmp(argv[a], "-u") == 0) ||
+		   (strcmp(argv[a], "--socket") == 0)) {
+	    if (curr_arg == argc) {
+		fprintf(stderr, "-u given, but no socket given\n");
+		exit(1);
+	    }
+	    sink_sockpath = argv[curr_arg];
+	    curr_arg++;
+	} else if ((strcmp(argv[a], "-F") == 0) ||
+		   (strcmp(argv[a], "--format") == 0)) {
+	    if (curr_arg == argc) {
+		fprintf(stderr, "-F given, but no format given\n");
+		exit(1);
+	    }
+	    if (strcmp(argv[curr_arg], "text") == 0)
+		sink_format = SINK_TEXT;
+	    else if (strcmp(argv[curr_arg], "json") == 0)
+		sink_format = SINK_JSON;
+	    else if (strcmp(argv[curr_arg], "binary") == 0)
+		sink_format = SINK_BINARY;
+	    else {
+		fprintf(stderr, "Unknown format: %s\n", argv[curr_arg]);
+		exit(1);
+	    }
+	    curr_arg++;
+	} else if ((strcmp(argv[a], "-q") == 0) ||
+		   (strcmp(argv[a], "--queue-size") == 0)) {
+	    if (get_num_arg(argc, argv, &curr_arg, &sinkbuf_size))
+		exit(1);
+	    if (sinkbuf_size < 4096) {
+		fprintf(stderr, "The queue size must be at least 4096\n");
+		exit(1);
+	    }
+	} else if ((strcmp(argv[a], "-r") == 0) ||
+		   (strcmp(argv[a], "--rotate-size") == 0)) {
+	    if (get_num_arg(argc, argv, &curr_arg, &val))
+		exit(1);
+	    rotate_size = val;
+	} else if ((strcmp(argv[a], "-R") == 0) ||
+		   (strcmp(argv[a], "--rotate-count") == 0)) {
+	    if (get_num_arg(argc, argv, &curr_arg, &val))
+		exit(1);
+	    rotate_count = val;
 	} else {
 	    fprintf(stderr, "Unknown parameter: %s\n", argv[a]);
 	    exit(1);
@@ -704,17 +1248,32 @@ main(int argc, char *argv[])
     }
 
     if (outfname) {
-	if (curr_arg != argc || execnow) {
-	    fprintf(stderr, "You can't specify a program or -k"
+	if (curr_arg != argc || execnow || sink_sockpath) {
+	    fprintf(stderr, "You can't specify a program, -k or -u"
 		    " along with -f\n");
 	    exit(1);
 	}
-	outfile = fopen(outfname, "a");
-	if (!outfile) {
+	/* It is reopened after rotating, when we may be in another dir. */
+	sink_filename = abs_path(outfname);
+	if (sink_open_file()) {
 	    fprintf(stderr, "Unable to output output file %s: %s\n", outfname,
 		    strerror(errno));
 	    exit(1);
 	}
+	sink_setup();
+    } else if (sink_sockpath) {
+	if (curr_arg != argc || execnow) {
+	    fprintf(stderr, "You can't specify a program or -k"
+		    " along with -u\n");
+	    exit(1);
+	}
+	sink_sockpath = abs_path(sink_sockpath);
+	if (sink_connect()) {
+	    fprintf(stderr, "Unable to connect to %s, see syslog for errors\n",
+		    sink_sockpath);
+	    exit(1);
+	}
+	sink_setup();
     } else if (curr_arg == argc) {
 	fprintf(stderr, "No program given to execute on an IPMI event\n");
 	exit(1);
@@ -746,6 +1305,9 @@ main(int argc, char *argv[])
 	    fprintf(stderr, "Unable to open pipe, see syslog for errors\n");
 	    exit(1);
 	}
+	/* The events are written to the pipe by the sink. */
+	sinkfd = fileno(outfile);
+	sink_setup();
 	
 	childpid = fork();
 	if (childpid < 0) {
@@ -759,6 +1321,7 @@ main(int argc, char *argv[])
 		exit(1);
 	    }
 	    close(infd);
+	    signal(SIGPIPE, SIG_DFL);
 	    execv(prog[0], prog);
 	    syslog(LOG_CRIT, "%s: Unable to exec %s: %s\n", domainname, prog[0],
 		    strerror(errno));
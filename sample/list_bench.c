@@ -0,0 +1,295 @@
+/*
+ * list_bench.c
+ *
+ * Benchmark for the locked containers.  It compares a locked list
+ * with allocated entries, a locked list with entries embedded in the
+ * items and a locked array, timing full iterations (the way handler
+ * lists are walked) and remove/add churn (the way sensors and handlers
+ * come and go).  It also checks that removing and adding items from
+ * inside an iteration handler works.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Usage: ipmi_listbench [-n items] [-i iterations] [-c churn ops]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+
+#include <OpenIPMI/ipmi_types.h>
+#include <OpenIPMI/ipmi_posix.h>
+#include <OpenIPMI/internal/ipmi_malloc.h>
+#include <OpenIPMI/internal/locked_list.h>
+#include <OpenIPMI/internal/locked_array.h>
+
+enum { LIST_ALLOC, LIST_EMBEDDED, ARRAY, NUM_KINDS };
+
+static const char *kind_names[NUM_KINDS] = {
+    "list", "list-embedded", "array"
+};
+
+typedef struct bench_item_s
+{
+    unsigned long       value;
+    locked_list_entry_t link;
+} bench_item_t;
+
+typedef struct container_s
+{
+    int            kind;
+    locked_list_t  *ll;
+    locked_array_t *la;
+} container_t;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+c_add(container_t *c, bench_item_t *item)
+{
+    switch (c->kind) {
+    case LIST_ALLOC:
+	return locked_list_add(c->ll, item, NULL);
+    case LIST_EMBEDDED:
+	return locked_list_add_embedded(c->ll, item, NULL, &item->link);
+    default:
+	return locked_array_add(c->la, item, NULL);
+    }
+}
+
+static int
+c_remove(container_t *c, bench_item_t *item)
+{
+    switch (c->kind) {
+    case LIST_ALLOC:
+	return locked_list_remove(c->ll, item, NULL);
+    case LIST_EMBEDDED:
+	return locked_list_remove_entry(c->ll, &item->link);
+    default:
+	return locked_array_remove(c->la, item, NULL);
+    }
+}
+
+static void
+c_iterate(container_t *c, locked_list_handler_cb handler, void *cb_data)
+{
+    if (c->la)
+	locked_array_iterate(c->la, handler, cb_data);
+    else
+	locked_list_iterate(c->ll, handler, cb_data);
+}
+
+static unsigned int
+c_num_entries(container_t *c)
+{
+    if (c->la)
+	return locked_array_num_entries(c->la);
+    return locked_list_num_entries(c->ll);
+}
+
+static int
+sum_handler(void *cb_data, void *item1, void *item2)
+{
+    unsigned long *sum = cb_data;
+    bench_item_t  *item = item1;
+
+    *sum += item->value;
+    return LOCKED_LIST_ITER_CONTINUE;
+}
+
+typedef struct churn_check_s
+{
+    container_t  *c;
+    bench_item_t *items;
+    unsigned int nitems;
+    unsigned int visited;
+    int          failed;
+} churn_check_t;
+
+/* Remove the current item and the one after it, then add the current
+   one back at the end.  Each item should still be seen exactly once
+   per pass, except the ones removed ahead of the iterator. */
+static int
+churn_handler(void *cb_data, void *item1, void *item2)
+{
+    churn_check_t *info = cb_data;
+    bench_item_t  *item = item1;
+    unsigned int  idx = item - info->items;
+
+    info->visited++;
+    if (info->visited > info->nitems) {
+	/* Items we put back are seen again, stop there. */
+	return LOCKED_LIST_ITER_STOP;
+    }
+    if (!c_remove(info->c, item))
+	info->failed = 1;
+    if (idx + 1 < info->nitems)
+	c_remove(info->c, &info->items[idx + 1]);
+    if (c_add(info->c, item) != 1)
+	info->failed = 1;
+    return LOCKED_LIST_ITER_CONTINUE;
+}
+
+static int
+bench(int kind, os_handler_t *os_hnd, unsigned int nitems,
+      unsigned int iterations, unsigned int churn)
+{
+    container_t   c;
+    bench_item_t  *items;
+    churn_check_t check;
+    unsigned long sum = 0, expect;
+    unsigned int  i, j;
+    double        start, iter_time, churn_time;
+    int           rv = 0;
+
+    memset(&c, 0, sizeof(c));
+    c.kind = kind;
+    if (kind == ARRAY)
+	c.la = locked_array_alloc(os_hnd);
+    else
+	c.ll = locked_list_alloc(os_hnd);
+    items = calloc(nitems, sizeof(*items));
+    if (!items || (!c.la && !c.ll)) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    for (i = 0; i < nitems; i++) {
+	items[i].value = i;
+	if (c_add(&c, &items[i]) != 1)
+	    rv = 1;
+    }
+
+    start = now();
+    for (i = 0; i < iterations; i++)
+	c_iterate(&c, sum_handler, &sum);
+    iter_time = now() - start;
+    expect = (unsigned long) nitems * (nitems - 1) / 2 * iterations;
+    if (sum != expect)
+	rv = 1;
+
+    /* Take an item out and put one back, walking through the set. */
+    start = now();
+    for (i = 0, j = 0; i < churn; i++) {
+	if (!c_remove(&c, &items[j]) || (c_add(&c, &items[j]) != 1))
+	    rv = 1;
+	j = (j + 7) % nitems;
+    }
+    churn_time = now() - start;
+
+    memset(&check, 0, sizeof(check));
+    check.c = &c;
+    check.items = items;
+    check.nitems = nitems;
+    c_iterate(&c, churn_handler, &check);
+    if (check.failed)
+	rv = 1;
+
+    if (rv)
+	fprintf(stderr, "%s: check failed\n", kind_names[kind]);
+    else
+	printf("%-14s %8.2f ns/item iterated  %8.1f ns/remove+add\n",
+	       kind_names[kind], iter_time * 1e9 / ((double) iterations * nitems),
+	       churn ? churn_time * 1e9 / churn : 0.0);
+
+    /* Everything removed by the check goes away, check the count. */
+    for (i = 0; i < nitems; i++)
+	c_remove(&c, &items[i]);
+    if (c_num_entries(&c) != 0) {
+	fprintf(stderr, "%s: items left after removal\n", kind_names[kind]);
+	rv = 1;
+    }
+
+    if (c.la)
+	locked_array_destroy(c.la);
+    else
+	locked_list_destroy(c.ll);
+    free(items);
+    return rv;
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int nitems = 16, iterations = 1000000, churn = 1000000;
+    os_handler_t *os_hnd;
+    int          c, kind, rv = 0;
+
+    while ((c = getopt(argc, argv, "n:i:c:")) != -1) {
+	switch (c) {
+	case 'n':
+	    nitems = strtoul(optarg, NULL, 0);
+	    break;
+	case 'i':
+	    iterations = strtoul(optarg, NULL, 0);
+	    break;
+	case 'c':
+	    churn = strtoul(optarg, NULL, 0);
+	    break;
+	default:
+	    fprintf(stderr,
+		    "Usage: %s [-n items] [-i iterations] [-c churn ops]\n",
+		    argv[0]);
+	    return 1;
+	}
+    }
+    if (nitems == 0) {
+	fprintf(stderr, "The item count must not be zero\n");
+	return 1;
+    }
+
+    os_hnd = ipmi_posix_thread_setup_os_handler(SIGUSR1);
+    if (!os_hnd) {
+	fprintf(stderr, "Unable to allocate OS handler\n");
+	return 1;
+    }
+    ipmi_malloc_init(os_hnd);
+
+    printf("%u items, %u iterations, %u remove/adds\n", nitems, iterations,
+	   churn);
+    for (kind = 0; kind < NUM_KINDS; kind++) {
+	if (bench(kind, os_hnd, nitems, iterations, churn))
+	    rv = 1;
+    }
+
+    ipmi_malloc_shutdown();
+    os_hnd->free_os_handler(os_hnd);
+    return rv;
+}
@@ -0,0 +1,638 @@
+/*
+ * loadgen.c
+ *
+ * A load generator for IPMI connections.  It opens a number of
+ * connections to a BMC, sends a mix of commands on them at a fixed
+ * rate (or as fast as the BMC will answer) and reports the
+ * throughput and the latency distribution.  Useful against ipmi_sim
+ * for measuring changes to the transports.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Usage: ipmi_loadgen [options] <connection args>
+ *
+ * The connection arguments are the same as for openipmicmd, for
+ * instance "lan -U user -P pw -A rmcp+ -L admin bmc-host".
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <OpenIPMI/ipmiif.h>
+#include <OpenIPMI/ipmi_conn.h>
+#include <OpenIPMI/ipmi_lan.h>
+#include <OpenIPMI/ipmi_msgbits.h>
+#include <OpenIPMI/ipmi_err.h>
+#include <OpenIPMI/ipmi_posix.h>
+
+static const char *progname;
+static os_handler_t *os_hnd;
+
+/*
+ * Latency histogram, in microseconds.  Values below HIST_SUB are
+ * exact, above that each power of two is split into HIST_SUB
+ * buckets, so the error is under about 3%.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct hist_s
+{
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long max;
+    unsigned long buckets[HIST_BUCKETS];
+} hist_t;
+
+static unsigned int
+hist_bucket(unsigned long v)
+{
+    unsigned int msb = 0;
+
+    if (v < HIST_SUB)
+	return v;
+    if (v > 0xffffffff)
+	v = 0xffffffff;
+    while ((v >> msb) > 1)
+	msb++;
+    return ((msb - HIST_SUB_BITS + 1) * HIST_SUB
+	    + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1)));
+}
+
+/* The lowest value that goes into the given bucket. */
+static unsigned long
+hist_bucket_value(unsigned int b)
+{
+    unsigned int shift;
+
+    if (b < HIST_SUB)
+	return b;
+    shift = b / HIST_SUB - 1;
+    return (unsigned long) (HIST_SUB + (b % HIST_SUB)) << shift;
+}
+
+static void
+hist_add(hist_t *h, unsigned long v)
+{
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+	h->max = v;
+    h->buckets[hist_bucket(v)]++;
+}
+
+static unsigned long
+hist_percentile(hist_t *h, double p)
+{
+    unsigned long want, seen = 0;
+    unsigned int  i;
+
+    if (h->count == 0)
+	return 0;
+    want = (unsigned long) (p * h->count);
+    if (want >= h->count)
+	want = h->count - 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+	seen += h->buckets[i];
+	if (seen > want) {
+	    /* Report the top of the bucket, but never above the max. */
+	    if (i + 1 < HIST_BUCKETS && hist_bucket_value(i + 1) - 1 < h->max)
+		return hist_bucket_value(i + 1) - 1;
+	    return h->max;
+	}
+    }
+    return h->max;
+}
+
+/* The commands that can be in the mix. */
+typedef struct load_cmd_s
+{
+    const char    *name;
+    unsigned char netfn;
+    unsigned char cmd;
+    unsigned char data[6];
+    unsigned int  data_len;
+    unsigned int  weight;
+
+    unsigned long sent;
+    unsigned long errors;
+    hist_t        hist;
+} load_cmd_t;
+
+static load_cmd_t cmds[] =
+{
+    { "devid",	IPMI_APP_NETFN, IPMI_GET_DEVICE_ID_CMD, { 0 }, 0, 1 },
+    { "sensor",	IPMI_SENSOR_EVENT_NETFN, IPMI_GET_SENSOR_READING_CMD,
+      { 0 }, 1, 0 },
+    /* Reservation 0, first record, offset 0, 16 bytes */
+    { "sdr",	IPMI_STORAGE_NETFN, IPMI_GET_SDR_CMD,
+      { 0, 0, 0, 0, 0, 16 }, 6, 0 },
+    /* Reservation 0, first entry, whole record */
+    { "sel",	IPMI_STORAGE_NETFN, IPMI_GET_SEL_ENTRY_CMD,
+      { 0, 0, 0, 0, 0, 0xff }, 6, 0 },
+};
+#define NUM_CMDS (sizeof(cmds) / sizeof(cmds[0]))
+
+typedef struct load_con_s
+{
+    ipmi_con_t   *con;
+    unsigned int num;
+    int          up;
+    unsigned int outstanding;
+} load_con_t;
+
+typedef struct load_req_s
+{
+    load_con_t     *lcon;
+    load_cmd_t     *cmd;
+    struct timeval sent;
+} load_req_t;
+
+static load_con_t *cons;
+static unsigned int num_cons = 1;
+static unsigned int cons_up;
+static unsigned int window = 1;
+static unsigned int rate;
+static unsigned int duration = 10;
+static int verbose;
+
+static unsigned int total_weight;
+static unsigned int next_con;
+static unsigned int outstanding;
+static unsigned long total_sent;
+static unsigned long total_rsps;
+static unsigned long total_failed;
+static unsigned long total_late;
+static hist_t total_hist;
+
+static int running;
+static int done;
+static struct timeval con_start_time;
+static struct timeval start_time;
+static struct timeval stop_time;
+static unsigned long last_report_rsps;
+static unsigned int last_report_sec;
+static os_hnd_timer_id_t *timer;
+
+static ipmi_system_interface_addr_t bmc_addr;
+
+static unsigned long
+diff_us(struct timeval *end, struct timeval *start)
+{
+    return ((end->tv_sec - start->tv_sec) * 1000000
+	    + (end->tv_usec - start->tv_usec));
+}
+
+static load_cmd_t *
+pick_cmd(void)
+{
+    unsigned int v = rand() % total_weight;
+    unsigned int i;
+
+    for (i = 0; i < NUM_CMDS; i++) {
+	if (v < cmds[i].weight)
+	    break;
+	v -= cmds[i].weight;
+    }
+    return &cmds[i];
+}
+
+static int send_req(load_con_t *lcon);
+
+static int
+rsp_handler(ipmi_con_t *ipmi, ipmi_msgi_t *rspi)
+{
+    load_req_t     *req = rspi->data1;
+    load_con_t     *lcon = req->lcon;
+    struct timeval now;
+    unsigned long  lat;
+
+    os_hnd->get_monotonic_time(os_hnd, &now);
+    lat = diff_us(&now, &req->sent);
+
+    lcon->outstanding--;
+    outstanding--;
+    total_rsps++;
+    if (rspi->msg.data_len < 1 || rspi->msg.data[0] == IPMI_TIMEOUT_CC) {
+	/* Failed in the transport, don't count it in the latency. */
+	total_failed++;
+    } else {
+	if (rspi->msg.data[0] != 0)
+	    req->cmd->errors++;
+	hist_add(&req->cmd->hist, lat);
+	hist_add(&total_hist, lat);
+    }
+    free(req);
+
+    /* With no rate set, keep the window full. */
+    if (running && rate == 0)
+	send_req(lcon);
+
+    return IPMI_MSG_ITEM_NOT_USED;
+}
+
+static int
+send_req(load_con_t *lcon)
+{
+    load_req_t  *req;
+    ipmi_msgi_t *rspi;
+    ipmi_msg_t  msg;
+    int         rv;
+
+    req = malloc(sizeof(*req));
+    if (!req)
+	return ENOMEM;
+    rspi = ipmi_alloc_msg_item();
+    if (!rspi) {
+	free(req);
+	return ENOMEM;
+    }
+
+    req->lcon = lcon;
+    req->cmd = pick_cmd();
+    msg.netfn = req->cmd->netfn;
+    msg.cmd = req->cmd->cmd;
+    msg.data = req->cmd->data;
+    msg.data_len = req->cmd->data_len;
+    rspi->data1 = req;
+
+    os_hnd->get_monotonic_time(os_hnd, &req->sent);
+    rv = lcon->con->send_command(lcon->con, (ipmi_addr_t *) &bmc_addr,
+				 sizeof(bmc_addr), &msg, rsp_handler, rspi);
+    if (rv) {
+	ipmi_free_msg_item(rspi);
+	free(req);
+	total_failed++;
+	return rv;
+    }
+
+    req->cmd->sent++;
+    total_sent++;
+    lcon->outstanding++;
+    outstanding++;
+    return 0;
+}
+
+/*
+ * Send what the rate says should have been sent by now, round robin
+ * over the connections.  A connection with a full window is skipped;
+ * if they are all full, the sends are counted as late and dropped so
+ * the BMC being slow does not turn into a burst later.
+ */
+static void
+send_at_rate(struct timeval *now)
+{
+    unsigned long due;
+    load_con_t    *lcon;
+    unsigned int  i;
+
+    due = (unsigned long) ((double) diff_us(now, &start_time) * rate
+			   / 1000000.0);
+    while (total_sent + total_late < due) {
+	lcon = NULL;
+	for (i = 0; i < num_cons; i++) {
+	    load_con_t *c = &cons[next_con];
+
+	    next_con = (next_con + 1) % num_cons;
+	    if (c->outstanding < window) {
+		lcon = c;
+		break;
+	    }
+	}
+	if (!lcon || send_req(lcon))
+	    total_late++;
+    }
+}
+
+static void
+report_interval(struct timeval *now)
+{
+    unsigned int sec = diff_us(now, &start_time) / 1000000;
+
+    if (sec == last_report_sec)
+	return;
+    printf("%4u s: %lu msgs/s, %u outstanding\n", sec,
+	   (total_rsps - last_report_rsps) / (sec - last_report_sec),
+	   outstanding);
+    last_report_rsps = total_rsps;
+    last_report_sec = sec;
+}
+
+static void
+print_hist(const char *name, hist_t *h)
+{
+    if (h->count == 0)
+	return;
+    printf("%-8s %10lu %10lu %10lu %10lu %10lu %10lu\n", name, h->count,
+	   (unsigned long) (h->sum / h->count),
+	   hist_percentile(h, 0.50), hist_percentile(h, 0.99),
+	   hist_percentile(h, 0.999), h->max);
+}
+
+static void
+report(void)
+{
+    unsigned long us = diff_us(&stop_time, &start_time);
+    unsigned int  i;
+
+    printf("\n%u connections, window %u, ", num_cons, window);
+    if (rate)
+	printf("target %u msgs/s\n", rate);
+    else
+	printf("no rate limit\n");
+    printf("Sent %lu, received %lu, failed %lu, late %lu\n",
+	   total_sent, total_rsps, total_failed, total_late);
+    if (us)
+	printf("Throughput: %.1f msgs/s\n",
+	       (double) total_hist.count * 1000000.0 / us);
+    printf("\nLatency (us):\n");
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n", "command", "count",
+	   "mean", "p50", "p99", "p999", "max");
+    for (i = 0; i < NUM_CMDS; i++)
+	print_hist(cmds[i].name, &cmds[i].hist);
+    print_hist("all", &total_hist);
+    for (i = 0; i < NUM_CMDS; i++) {
+	if (cmds[i].errors)
+	    printf("%s: %lu responses had a non-zero completion code\n",
+		   cmds[i].name, cmds[i].errors);
+    }
+}
+
+static void
+timer_cb(void *cb_data, os_hnd_timer_id_t *id)
+{
+    struct timeval now, tv;
+
+    os_hnd->get_monotonic_time(os_hnd, &now);
+    if (running) {
+	if (diff_us(&now, &start_time) >= duration * 1000000UL) {
+	    /* Stop sending and wait for the outstanding responses. */
+	    running = 0;
+	    stop_time = now;
+	} else {
+	    if (rate)
+		send_at_rate(&now);
+	    if (verbose)
+		report_interval(&now);
+	}
+    }
+    if (!running && (outstanding == 0
+		     || diff_us(&now, &stop_time) > 10000000UL)) {
+	done = 1;
+	return;
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 1000;
+    os_hnd->start_timer(os_hnd, timer, &tv, timer_cb, NULL);
+}
+
+static void
+start_load(void)
+{
+    struct timeval tv;
+    unsigned int   i, j;
+
+    os_hnd->get_monotonic_time(os_hnd, &start_time);
+    printf("All %u connections up in %lu ms, running for %u seconds\n",
+	   num_cons, diff_us(&start_time, &con_start_time) / 1000, duration);
+    running = 1;
+    if (rate == 0) {
+	for (i = 0; i < num_cons; i++) {
+	    for (j = 0; j < window; j++)
+		send_req(&cons[i]);
+	}
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 1000;
+    os_hnd->start_timer(os_hnd, timer, &tv, timer_cb, NULL);
+}
+
+static void
+con_changed_handler(ipmi_con_t   *ipmi,
+		    int          err,
+		    unsigned int port_num,
+		    int          still_connected,
+		    void         *cb_data)
+{
+    load_con_t *lcon = cb_data;
+
+    if (err) {
+	fprintf(stderr, "Connection %u failed: %x\n", lcon->num, err);
+	if (!still_connected)
+	    done = 1;
+	return;
+    }
+    if (lcon->up)
+	return;
+    lcon->up = 1;
+    cons_up++;
+    if (cons_up == num_cons)
+	start_load();
+}
+
+static int
+set_mix(char *str)
+{
+    char         *tok, *val, *next;
+    unsigned int i;
+
+    for (i = 0; i < NUM_CMDS; i++)
+	cmds[i].weight = 0;
+    for (tok = strtok_r(str, ",", &next); tok; tok = strtok_r(NULL, ",", &next)) {
+	val = strchr(tok, '=');
+	if (val)
+	    *val++ = '\0';
+	for (i = 0; i < NUM_CMDS; i++) {
+	    if (strcmp(tok, cmds[i].name) == 0)
+		break;
+	}
+	if (i == NUM_CMDS) {
+	    fprintf(stderr, "Unknown command in mix: %s\n", tok);
+	    return EINVAL;
+	}
+	cmds[i].weight = val ? strtoul(val, NULL, 0) : 1;
+    }
+    return 0;
+}
+
+static void
+usage(void)
+{
+    printf("Usage: %s [options] <connection args>\n", progname);
+    printf(" Options are:\n"
+	   "  -n <count>   Number of connections to open (default 1)\n"
+	   "  -w <count>   Messages outstanding per connection (default 1)\n"
+	   "  -r <rate>    Total messages per second, 0 to send as fast\n"
+	   "               as the responses come back (default 0)\n"
+	   "  -d <secs>    How long to run (default 10)\n"
+	   "  -m <mix>     Command mix, a comma separated list of\n"
+	   "               cmd[=weight] where cmd is devid, sensor, sdr\n"
+	   "               or sel (default devid)\n"
+	   "  -s <num>     Sensor number for the sensor command (default 0)\n"
+	   "  -H <count>   Connection handshakes run at once, 0 for no\n"
+	   "               limit (default %u)\n"
+	   "  -v           Print the throughput every second\n"
+	   " The connection arguments are the same as openipmicmd.\n",
+	   ipmi_lan_get_max_handshakes());
+}
+
+int
+main(int argc, char *argv[])
+{
+    int          rv;
+    int          curr_arg;
+    ipmi_args_t  *args;
+    unsigned int i;
+
+    progname = argv[0];
+
+    os_hnd = ipmi_posix_setup_os_handler();
+    if (!os_hnd) {
+	fprintf(stderr, "Unable to allocate os handler\n");
+	exit(1);
+    }
+
+    rv = ipmi_init(os_hnd);
+    if (rv) {
+	fprintf(stderr, "Error initializing connections: 0x%x\n", rv);
+	exit(1);
+    }
+
+    for (i = 1; i < (unsigned int) argc; i++) {
+	if (argv[i][0] != '-')
+	    break;
+	if (strcmp(argv[i], "--") == 0) {
+	    i++;
+	    break;
+	} else if (strcmp(argv[i], "-v") == 0) {
+	    verbose = 1;
+	    continue;
+	} else if (strcmp(argv[i], "-h") == 0) {
+	    usage();
+	    exit(0);
+	}
+
+	if (i + 1 >= (unsigned int) argc || strlen(argv[i]) != 2) {
+	    usage();
+	    exit(1);
+	}
+	switch (argv[i][1]) {
+	case 'n': num_cons = strtoul(argv[++i], NULL, 0); break;
+	case 'w': window = strtoul(argv[++i], NULL, 0); break;
+	case 'r': rate = strtoul(argv[++i], NULL, 0); break;
+	case 'd': duration = strtoul(argv[++i], NULL, 0); break;
+	case 's': cmds[1].data[0] = strtoul(argv[++i], NULL, 0); break;
+	case 'H': ipmi_lan_set_max_handshakes(strtoul(argv[++i], NULL, 0));
+	    break;
+	case 'm':
+	    if (set_mix(argv[++i]))
+		exit(1);
+	    break;
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+
+    if (i >= (unsigned int) argc) {
+	fprintf(stderr, "No connection arguments given\n");
+	usage();
+	exit(1);
+    }
+    curr_arg = i;
+
+    for (i = 0; i < NUM_CMDS; i++)
+	total_weight += cmds[i].weight;
+    if (num_cons == 0 || window == 0 || total_weight == 0) {
+	fprintf(stderr, "Connections, window and mix must not be zero\n");
+	exit(1);
+    }
+
+    rv = ipmi_parse_args2(&curr_arg, argc, argv, &args);
+    if (rv) {
+	fprintf(stderr, "Error parsing command arguments, argument %d: %s\n",
+		curr_arg, strerror(rv));
+	exit(1);
+    }
+
+    bmc_addr.addr_type = IPMI_SYSTEM_INTERFACE_ADDR_TYPE;
+    bmc_addr.channel = IPMI_BMC_CHANNEL;
+    bmc_addr.lun = 0;
+
+    rv = os_hnd->alloc_timer(os_hnd, &timer);
+    if (rv) {
+	fprintf(stderr, "Unable to allocate timer: 0x%x\n", rv);
+	exit(1);
+    }
+
+    cons = calloc(num_cons, sizeof(*cons));
+    if (!cons) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    os_hnd->get_monotonic_time(os_hnd, &con_start_time);
+    for (i = 0; i < num_cons; i++) {
+	cons[i].num = i;
+	rv = ipmi_args_setup_con(args, os_hnd, NULL, &cons[i].con);
+	if (rv) {
+	    fprintf(stderr, "ipmi_ip_setup_con: %s\n", strerror(rv));
+	    exit(1);
+	}
+	cons[i].con->add_con_change_handler(cons[i].con, con_changed_handler,
+					    &cons[i]);
+	rv = cons[i].con->start_con(cons[i].con);
+	if (rv) {
+	    fprintf(stderr, "Could not start connection %u: %x\n", i, rv);
+	    exit(1);
+	}
+    }
+
+    while (!done) {
+	rv = os_hnd->perform_one_op(os_hnd, NULL);
+	if (rv)
+	    break;
+    }
+
+    if (cons_up == num_cons)
+	report();
+
+    for (i = 0; i < num_cons; i++)
+	cons[i].con->close_connection(cons[i].con);
+    ipmi_free_args(args);
+    os_hnd->free_timer(os_hnd, timer);
+    os_hnd->free_os_handler(os_hnd);
+
+    return (cons_up == num_cons) ? 0 : 1;
+}
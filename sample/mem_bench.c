@@ -0,0 +1,315 @@
+/*
+ * mem_bench.c
+ *
+ * Benchmark for the object caches behind ipmi_mem_alloc().  It first
+ * runs the allocations of a command round trip that use public types
+ * (the message item and the list items for the wait queue and the
+ * operation queue) with a window of outstanding commands that
+ * complete in order, once through an object cache and once through
+ * plain ipmi_mem_alloc(), in one or more threads.  Given connection
+ * arguments, it then opens a domain and keeps a window of Get Device
+ * ID commands outstanding to the first MC, so the LAN code allocates
+ * and frees its own objects from the library's caches, and reports
+ * the caches afterwards.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Usage: ipmi_membench [-n round trips] [-w window] [-t threads]
+ *                      [-d seconds] [<connection args>]
+ *
+ * The connection arguments are the same as for openipmicmd, for
+ * instance "lan -U user -P pw -A rmcp+ -L admin bmc-host".
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <OpenIPMI/ipmiif.h>
+#include <OpenIPMI/ipmi_posix.h>
+#include <OpenIPMI/internal/ipmi_malloc.h>
+#include <OpenIPMI/internal/ilist.h>
+
+#include "bench_domain.h"
+
+static const char *progname;
+static os_handler_t *os_hnd;
+
+static unsigned int count = 1000000;
+static unsigned int window = 16;
+static unsigned int num_threads = 1;
+static unsigned int duration = 5;
+
+/* The objects of a round trip with a public type: the message item
+   and the list items for the wait queue and the operation queue. */
+#define NUM_OBJS	3
+
+static unsigned int obj_sizes[NUM_OBJS] = {
+    sizeof(ipmi_msgi_t),
+    sizeof(ilist_item_t),
+    sizeof(ilist_item_t)
+};
+
+static ipmi_mem_cache_t msgi_cache =
+    IPMI_MEM_CACHE_INIT("bench_msgi", sizeof(ipmi_msgi_t));
+static ipmi_mem_cache_t item_cache =
+    IPMI_MEM_CACHE_INIT("bench_ilist_item", sizeof(ilist_item_t));
+
+static ipmi_mem_cache_t *caches[NUM_OBJS] = {
+    &msgi_cache, &item_cache, &item_cache
+};
+
+typedef struct bench_s
+{
+    int          cached;
+    int          failed;
+    double       time;
+    pthread_t    thread;
+} bench_t;
+
+static void *
+obj_alloc(int cached, int i)
+{
+    void *obj;
+
+    if (cached)
+	obj = ipmi_mem_cache_alloc(caches[i]);
+    else
+	obj = ipmi_mem_alloc(obj_sizes[i]);
+    /* Touch it, the users initialize their objects. */
+    if (obj)
+	memset(obj, 0, obj_sizes[i]);
+    return obj;
+}
+
+static void
+obj_free(int cached, int i, void *obj)
+{
+    if (!obj)
+	return;
+    if (cached)
+	ipmi_mem_cache_free(caches[i], obj);
+    else
+	ipmi_mem_free(obj);
+}
+
+static void *
+run(void *cb_data)
+{
+    bench_t      *b = cb_data;
+    void         **out;
+    unsigned int i, j, slot;
+    double       start;
+
+    out = calloc(window * NUM_OBJS, sizeof(void *));
+    if (!out) {
+	b->failed = 1;
+	return NULL;
+    }
+
+    start = bench_now();
+    for (i = 0; i < count; i++) {
+	slot = (i % window) * NUM_OBJS;
+
+	/* The response for the oldest command comes in. */
+	for (j = 0; j < NUM_OBJS; j++)
+	    obj_free(b->cached, j, out[slot + j]);
+
+	/* Send a new one. */
+	for (j = 0; j < NUM_OBJS; j++) {
+	    out[slot + j] = obj_alloc(b->cached, j);
+	    if (!out[slot + j])
+		b->failed = 1;
+	}
+    }
+    for (i = 0; i < window * NUM_OBJS; i++)
+	obj_free(b->cached, i % NUM_OBJS, out[i]);
+    b->time = bench_now() - start;
+
+    free(out);
+    return NULL;
+}
+
+static int
+bench(int cached)
+{
+    bench_t      *b;
+    unsigned int i, nthreads = num_threads;
+    double       max = 0;
+    int          rv = 0;
+
+    b = calloc(nthreads, sizeof(*b));
+    if (!b)
+	return 1;
+
+    for (i = 0; i < nthreads; i++) {
+	b[i].cached = cached;
+	if (pthread_create(&b[i].thread, NULL, run, &b[i])) {
+	    fprintf(stderr, "Unable to start thread\n");
+	    nthreads = i;
+	    rv = 1;
+	    break;
+	}
+    }
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(b[i].thread, NULL);
+	if (b[i].failed)
+	    rv = 1;
+	if (b[i].time > max)
+	    max = b[i].time;
+    }
+
+    if (!rv)
+	printf("%-7s %10.0f round trips/s  %6.1f ns/round trip\n",
+	       cached ? "cache" : "malloc",
+	       (double) count * nthreads / max, max * 1e9 / count);
+    free(b);
+    return rv;
+}
+
+/*
+ * LAN phase: the LAN code allocates and frees its own objects from
+ * the library's caches.
+ */
+static int
+lan_bench(int curr_arg, int argc, char *argv[])
+{
+    ipmi_domain_id_t domain_id;
+    double           rate;
+    unsigned long    errs;
+    int              rv;
+
+    bench_domain_open(os_hnd, &curr_arg, argc, argv, num_threads,
+		      &domain_id);
+    rv = bench_msg_window(domain_id, num_threads * window, duration,
+			  &rate, &errs);
+    if (rv)
+	fprintf(stderr, "Unable to send to the MC: %s\n", strerror(rv));
+    else
+	printf("lan     %10.0f round trips/s  (%lu errors, %u outstanding)\n",
+	       rate, errs, num_threads * window);
+    bench_domain_close();
+    return rv;
+}
+
+static void
+report(const char *name, unsigned int size, unsigned int obj_size,
+       unsigned long in_use, unsigned long high_water, unsigned long allocs,
+       void *cb_data)
+{
+    printf("  %-18s %4u/%-4u in use %-5lu high water %-6lu allocs %lu\n",
+	   name, size, obj_size, in_use, high_water, allocs);
+}
+
+static void
+usage(void)
+{
+    printf("Usage:\n"
+	   " %s [options] [<connection args>]\n"
+	   " Options are:\n"
+	   "  -n count     Round trips per thread (default %u)\n"
+	   "  -w window    Commands outstanding per thread (default %u)\n"
+	   "  -t threads   Allocating or operation loop threads (default %u)\n"
+	   "  -d seconds   Time to run the LAN phase (default %u)\n"
+	   " The connection arguments are the same as openipmicmd.  Without\n"
+	   " them only the allocation phase is run.\n",
+	   progname, count, window, num_threads, duration);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int          rv;
+    int          curr_arg;
+    unsigned int i;
+
+    progname = argv[0];
+
+    for (i = 1; i < (unsigned int) argc; i++) {
+	if (argv[i][0] != '-')
+	    break;
+	if (strcmp(argv[i], "--") == 0) {
+	    i++;
+	    break;
+	} else if (strcmp(argv[i], "-h") == 0) {
+	    usage();
+	    exit(0);
+	}
+
+	if (i + 1 >= (unsigned int) argc || strlen(argv[i]) != 2) {
+	    usage();
+	    exit(1);
+	}
+	switch (argv[i][1]) {
+	case 'n': count = strtoul(argv[++i], NULL, 0); break;
+	case 'w': window = strtoul(argv[++i], NULL, 0); break;
+	case 't': num_threads = strtoul(argv[++i], NULL, 0); break;
+	case 'd': duration = strtoul(argv[++i], NULL, 0); break;
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (window == 0 || num_threads == 0) {
+	fprintf(stderr, "The window and thread count must not be zero\n");
+	exit(1);
+    }
+    curr_arg = i;
+
+    os_hnd = ipmi_posix_thread_setup_os_handler(SIGUSR1);
+    if (!os_hnd) {
+	fprintf(stderr, "Unable to allocate OS handler\n");
+	exit(1);
+    }
+    rv = ipmi_init(os_hnd);
+    if (rv) {
+	fprintf(stderr, "Error initializing connections: 0x%x\n", rv);
+	exit(1);
+    }
+
+    printf("%u round trips, %u outstanding, %u thread(s)\n", count, window,
+	   num_threads);
+    if (bench(0) || bench(1))
+	exit(1);
+
+    if (curr_arg < argc) {
+	if (lan_bench(curr_arg, argc, argv))
+	    exit(1);
+    }
+
+    printf("%lu bytes in slabs\n", ipmi_mem_cache_slab_bytes());
+    ipmi_mem_cache_report(report, NULL);
+
+    ipmi_shutdown();
+    os_hnd->free_os_handler(os_hnd);
+    return 0;
+}
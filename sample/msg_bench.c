@@ -0,0 +1,302 @@
+/*
+ * msg_bench.c
+ *
+ * Lock and message path benchmark for the pthread OS handler.  It
+ * first times the handler's normal (recursive) locks against its
+ * non-recursive ones, uncontended and with all threads on one lock.
+ * Given connection arguments, it then opens a domain and keeps a
+ * window of Get Device ID commands outstanding to the first MC,
+ * which goes through the selector, connection, domain and MC locks
+ * on every message.  Run it with and without -l to see what the
+ * leaf locks buy, and with -s to see where the lock time goes.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+/*
+ * Usage: ipmi_msgbench [-l] [-s] [-t threads] [-d seconds] [-w window]
+ *                      [<connection args>]
+ *
+ * The connection arguments are the same as for openipmicmd, for
+ * instance "lan -U user -P pw -A rmcp+ -L admin bmc-host".
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <OpenIPMI/ipmiif.h>
+#include <OpenIPMI/ipmi_err.h>
+#include <OpenIPMI/ipmi_posix.h>
+
+#include "bench_domain.h"
+
+static const char *progname;
+static os_handler_t *os_hnd;
+
+static unsigned int flags;
+static unsigned int num_threads = 4;
+static unsigned int duration = 5;
+static unsigned int window = 8;
+
+static void
+print_lock_stats(void)
+{
+    ipmi_posix_lock_stats_t s;
+    unsigned int            i;
+
+    if (!(flags & IPMI_POSIX_THREAD_LOCK_STATS))
+	return;
+
+    printf("%-9s %10s %9s %10s %8s %10s %8s\n", "class", "acquires",
+	   "contended", "wait avg", "wait p99", "hold avg", "hold p99");
+    for (i = 0; i < IPMI_POSIX_NUM_LOCK_CLASSES; i++) {
+	if (ipmi_posix_thread_get_lock_stats(os_hnd, i, &s, 1))
+	    continue;
+	if (s.acquires == 0)
+	    continue;
+	printf("%-9s %10lu %9lu %8luns %6luns %8luns %6luns\n", s.name,
+	       s.acquires, s.contended, s.wait_ns_total / s.acquires,
+	       s.wait_ns_p99, s.hold_ns_total / s.acquires, s.hold_ns_p99);
+    }
+}
+
+/*
+ * Lock phase: time lock/unlock pairs on the handler's locks.
+ */
+#define LOCK_OPS 100000
+
+typedef struct lock_thread_s
+{
+    pthread_t     thread;
+    os_hnd_lock_t *lock;
+    double        end;
+    unsigned long ops;
+} lock_thread_t;
+
+static volatile unsigned long lock_shared;
+
+static void *
+lock_run(void *cb_data)
+{
+    lock_thread_t *t = cb_data;
+    unsigned int  n;
+
+    while (bench_now() < t->end) {
+	for (n = 0; n < LOCK_OPS; n++) {
+	    os_hnd->lock(os_hnd, t->lock);
+	    lock_shared++;
+	    os_hnd->unlock(os_hnd, t->lock);
+	}
+	t->ops += LOCK_OPS;
+    }
+    return NULL;
+}
+
+static double
+lock_time(os_hnd_lock_t *lock, unsigned int threads, double secs)
+{
+    lock_thread_t *t;
+    unsigned int  i;
+    unsigned long ops = 0;
+    double        start, end;
+
+    t = calloc(threads, sizeof(*t));
+    if (!t)
+	return 0;
+    start = bench_now();
+    for (i = 0; i < threads; i++) {
+	t[i].lock = lock;
+	t[i].end = start + secs;
+	if (pthread_create(&t[i].thread, NULL, lock_run, &t[i])) {
+	    fprintf(stderr, "Unable to start thread\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < threads; i++) {
+	pthread_join(t[i].thread, NULL);
+	ops += t[i].ops;
+    }
+    end = bench_now();
+    free(t);
+    return (end - start) * 1e9 / ops;
+}
+
+static void
+lock_bench(void)
+{
+    os_hnd_lock_t *lock;
+    double        secs = duration / 4.0;
+    int           nr;
+
+    for (nr = 0; nr < 2; nr++) {
+	int rv;
+
+	if (nr)
+	    rv = os_hnd->create_nr_lock(os_hnd, &lock);
+	else
+	    rv = os_hnd->create_lock(os_hnd, &lock);
+	if (rv) {
+	    fprintf(stderr, "Unable to create lock: %s\n", strerror(rv));
+	    exit(1);
+	}
+	printf("%-8s lock: %6.1f ns/op, %6.1f ns/op with %u threads\n",
+	       nr ? "leaf" : "general", lock_time(lock, 1, secs),
+	       lock_time(lock, num_threads, secs), num_threads);
+	os_hnd->destroy_lock(os_hnd, lock);
+    }
+    print_lock_stats();
+}
+
+/*
+ * Message phase: the operation loop threads handle the responses,
+ * each response sends the next command.
+ */
+static int
+msg_bench(ipmi_domain_id_t domain_id)
+{
+    double        rate;
+    unsigned long errs;
+    int           rv;
+
+    /* Only count the lock use of the message path. */
+    if (flags & IPMI_POSIX_THREAD_LOCK_STATS) {
+	ipmi_posix_lock_stats_t s;
+	unsigned int            i;
+
+	for (i = 0; i < IPMI_POSIX_NUM_LOCK_CLASSES; i++)
+	    ipmi_posix_thread_get_lock_stats(os_hnd, i, &s, 1);
+    }
+
+    rv = bench_msg_window(domain_id, num_threads * window, duration,
+			  &rate, &errs);
+    if (rv) {
+	fprintf(stderr, "Unable to send to the MC: %s\n", strerror(rv));
+	return rv;
+    }
+    printf("messages: %9.0f/s  (%lu errors, %u outstanding)\n",
+	   rate, errs, num_threads * window);
+    print_lock_stats();
+    return 0;
+}
+
+static void
+usage(void)
+{
+    printf("Usage:\n"
+	   " %s [options] [<connection args>]\n"
+	   " Options are:\n"
+	   "  -l           Use non-recursive adaptive mutexes for leaf locks\n"
+	   "  -s           Collect and print lock statistics\n"
+	   "  -t threads   Lock and operation loop threads (default %u)\n"
+	   "  -d seconds   Time to run each phase (default %u)\n"
+	   "  -w window    Commands outstanding per thread (default %u)\n"
+	   " The connection arguments are the same as openipmicmd.  Without\n"
+	   " them only the lock phase is run.\n",
+	   progname, num_threads, duration, window);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int              rv;
+    int              curr_arg;
+    ipmi_domain_id_t domain_id;
+    unsigned int     i;
+
+    progname = argv[0];
+
+    for (i = 1; i < (unsigned int) argc; i++) {
+	if (argv[i][0] != '-')
+	    break;
+	if (strcmp(argv[i], "--") == 0) {
+	    i++;
+	    break;
+	} else if (strcmp(argv[i], "-h") == 0) {
+	    usage();
+	    exit(0);
+	} else if (strcmp(argv[i], "-l") == 0) {
+	    flags |= IPMI_POSIX_THREAD_LEAF_LOCKS;
+	    continue;
+	} else if (strcmp(argv[i], "-s") == 0) {
+	    flags |= IPMI_POSIX_THREAD_LOCK_STATS;
+	    continue;
+	}
+
+	if (i + 1 >= (unsigned int) argc || strlen(argv[i]) != 2) {
+	    usage();
+	    exit(1);
+	}
+	switch (argv[i][1]) {
+	case 't': num_threads = strtoul(argv[++i], NULL, 0); break;
+	case 'd': duration = strtoul(argv[++i], NULL, 0); break;
+	case 'w': window = strtoul(argv[++i], NULL, 0); break;
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (num_threads == 0 || window == 0) {
+	fprintf(stderr, "The thread count and window must not be zero\n");
+	exit(1);
+    }
+    curr_arg = i;
+
+    os_hnd = ipmi_posix_thread_setup_os_handler2(SIGUSR1, flags);
+    if (!os_hnd) {
+	fprintf(stderr, "Unable to allocate os handler\n");
+	exit(1);
+    }
+
+    lock_bench();
+    if (curr_arg >= argc) {
+	os_hnd->free_os_handler(os_hnd);
+	return 0;
+    }
+
+    rv = ipmi_init(os_hnd);
+    if (rv) {
+	fprintf(stderr, "Error initializing connections: 0x%x\n", rv);
+	exit(1);
+    }
+
+    bench_domain_open(os_hnd, &curr_arg, argc, argv, num_threads,
+		      &domain_id);
+    printf("%u threads, %u commands outstanding\n", num_threads,
+	   num_threads * window);
+
+    msg_bench(domain_id);
+
+    bench_domain_close();
+    os_hnd->free_os_handler(os_hnd);
+    return 0;
+}
@@ -0,0 +1,403 @@
+/*
+ * rmcpp_bench.c
+ *
+ * Throughput benchmark for building and verifying RMCP+ packets
+ * (AES-CBC-128 confidentiality and HMAC-SHA1-96 or HMAC-MD5-128
+ * integrity).  It compares setting up the crypto from the keys for
+ * every packet, the way it used to be done, against the library's
+ * own algorithms (lib/hmac.c and lib/aes_cbc.c, fetched from the
+ * RMCP+ algorithm tables), which keep keyed contexts per session.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Usage: rmcpp_bench [-n packets] [-l payload length] [-a sha1|md5]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <OpenIPMI/ipmiif.h>
+#include <OpenIPMI/ipmi_conn.h>
+#include <OpenIPMI/ipmi_lan.h>
+#include <OpenIPMI/ipmi_posix.h>
+
+#define HDR_LEN		16	/* RMCP + session header */
+#define MAX_PKT		512
+
+static const EVP_MD *evp_md;
+static unsigned int klen, ilen;
+static unsigned char k1[20], k2[16];
+
+/* The library's algorithms for the "session" mode. */
+static ipmi_con_t                   con;
+static ipmi_rmcpp_confidentiality_t *conf_alg;
+static ipmi_rmcpp_integrity_t       *integ_alg;
+static void                         *conf_data, *integ_data;
+
+typedef struct pkt_s
+{
+    unsigned char d[MAX_PKT];
+    unsigned int  len;
+} pkt_t;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+session_setup(unsigned int integ_num)
+{
+    os_handler_t      *os_hnd;
+    ipmi_rmcpp_auth_t *ainfo;
+    unsigned char     *k;
+    unsigned int      len;
+    int               rv;
+
+    os_hnd = ipmi_posix_thread_setup_os_handler(SIGUSR1);
+    if (!os_hnd) {
+	fprintf(stderr, "Unable to allocate os handler\n");
+	return ENOMEM;
+    }
+    rv = ipmi_init(os_hnd);
+    if (rv) {
+	fprintf(stderr, "Error initializing OpenIPMI: 0x%x\n", rv);
+	return rv;
+    }
+    con.os_hnd = os_hnd;
+
+    conf_alg = ipmi_rmcpp_get_confidentiality
+	(IPMI_LANP_CONFIDENTIALITY_ALGORITHM_AES_CBC_128);
+    integ_alg = ipmi_rmcpp_get_integrity(integ_num);
+    if (!conf_alg || !integ_alg) {
+	fprintf(stderr, "The library has no RMCP+ crypto algorithms\n");
+	return ENOSYS;
+    }
+
+    /* The same keys as the oneshot mode.  SHA1 keys with K1, MD5
+       with the SIK. */
+    ainfo = ipmi_rmcpp_auth_alloc();
+    if (!ainfo)
+	return ENOMEM;
+    k = ipmi_rmcpp_auth_get_sik(ainfo, &len);
+    memcpy(k, k1, sizeof(k1));
+    ipmi_rmcpp_auth_set_sik_len(ainfo, sizeof(k1));
+    k = ipmi_rmcpp_auth_get_k1(ainfo, &len);
+    memcpy(k, k1, sizeof(k1));
+    ipmi_rmcpp_auth_set_k1_len(ainfo, sizeof(k1));
+    k = ipmi_rmcpp_auth_get_k2(ainfo, &len);
+    memset(k, 0, len);
+    memcpy(k, k2, sizeof(k2));
+    ipmi_rmcpp_auth_set_k2_len(ainfo, len);
+
+    rv = conf_alg->conf_init(&con, ainfo, &conf_data);
+    if (!rv)
+	rv = integ_alg->integ_init(&con, ainfo, &integ_data);
+    ipmi_rmcpp_auth_free(ainfo);
+    if (rv)
+	fprintf(stderr, "Unable to set up the algorithms: %s\n",
+		strerror(rv));
+    return rv;
+}
+
+/*
+ * The old way: a one-shot HMAC that rehashes the key, and a new
+ * cipher context and a copy of the data per packet.
+ */
+static void
+integ(const unsigned char *data, unsigned int len, unsigned char *out)
+{
+    unsigned int l;
+
+    HMAC(evp_md, k1, klen, data, len, out, &l);
+}
+
+static int
+conf_crypt(int encrypt, unsigned char *iv, unsigned char *data,
+	   unsigned int len)
+{
+    EVP_CIPHER_CTX *ctx;
+    unsigned char  *tmp;
+    int            outlen;
+    int            rv;
+
+    tmp = malloc(len);
+    if (!tmp)
+	return -1;
+    memcpy(tmp, data, len);
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_CipherInit_ex(ctx, EVP_aes_128_cbc(), NULL, k2, iv, encrypt);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    rv = EVP_CipherUpdate(ctx, data, &outlen, tmp, len) ? 0 : -1;
+    EVP_CIPHER_CTX_free(ctx);
+    free(tmp);
+    return rv;
+}
+
+/*
+ * Build a packet: header, IV, the encrypted and padded payload, the
+ * integrity pad and the authcode.
+ */
+static void
+build_hdr(pkt_t *p, unsigned int seq)
+{
+    memset(p->d, 0, HDR_LEN);
+    p->d[0] = 6;
+    p->d[2] = 0xff;
+    p->d[3] = 0x07;
+    p->d[4] = 6;
+    p->d[5] = 0xc0;
+    p->d[10] = seq;
+}
+
+static int
+build(pkt_t *p, const unsigned char *payload, unsigned int plen,
+      unsigned int seq)
+{
+    unsigned char *iv = p->d + HDR_LEN;
+    unsigned char *d = iv + 16;
+    unsigned int  padlen, i, l;
+
+    build_hdr(p, seq);
+    memcpy(d, payload, plen);
+    padlen = 15 - (plen % 16);
+    for (i = 0; i < padlen; i++)
+	d[plen + i] = i + 1;
+    d[plen + padlen] = padlen;
+    l = plen + padlen + 1;
+    memset(iv, seq, 16);
+    if (conf_crypt(1, iv, d, l))
+	return -1;
+    l += 16 + HDR_LEN;
+    p->d[14] = (l - HDR_LEN) & 0xff;
+    p->d[15] = (l - HDR_LEN) >> 8;
+
+    while ((l + 2) % 4)
+	p->d[l++] = 0xff;
+    p->d[l] = (l - (plen + padlen + 1 + 16 + HDR_LEN));
+    l++;
+    p->d[l++] = 0x07;
+    integ(p->d + 4, l - 4, p->d + l);
+    p->len = l + ilen;
+    return 0;
+}
+
+static int
+verify(pkt_t *p, unsigned char *payload, unsigned int plen)
+{
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int  l = p->len - ilen;
+    unsigned int  clen = p->d[14] | (p->d[15] << 8);
+    unsigned char *iv = p->d + HDR_LEN;
+
+    integ(p->d + 4, l - 4, mac);
+    if (memcmp(mac, p->d + l, ilen) != 0)
+	return -1;
+    if (conf_crypt(0, iv, iv + 16, clen - 16))
+	return -1;
+    return memcmp(iv + 16, payload, plen);
+}
+
+/*
+ * The same through the library's algorithms, called the way
+ * lib/ipmi_lan.c calls them.
+ */
+static int
+lib_build(pkt_t *p, const unsigned char *payload, unsigned int plen,
+	  unsigned int seq)
+{
+    unsigned char *data = p->d + HDR_LEN + 16;
+    unsigned int  hlen = HDR_LEN + 16;
+    unsigned int  len = plen;
+    unsigned int  max = MAX_PKT - hlen;
+    int           rv;
+
+    memcpy(data, payload, plen);
+    rv = conf_alg->conf_encrypt(&con, conf_data, &data, &hlen, &len, &max);
+    if (rv)
+	return rv;
+    build_hdr(p, seq);
+    p->d[14] = len & 0xff;
+    p->d[15] = len >> 8;
+    len += HDR_LEN;
+    max += HDR_LEN;
+    rv = integ_alg->integ_pad(&con, integ_data, p->d, &len, max);
+    if (!rv)
+	rv = integ_alg->integ_add(&con, integ_data, p->d, &len, max);
+    p->len = len;
+    return rv;
+}
+
+static int
+lib_verify(pkt_t *p, unsigned char *payload, unsigned int plen)
+{
+    unsigned int  clen = p->d[14] | (p->d[15] << 8);
+    unsigned int  integ_len = HDR_LEN + clen;
+    unsigned char *data = p->d + HDR_LEN;
+
+    while ((integ_len < p->len) && (p->d[integ_len] == 0xff))
+	integ_len++;
+    if (integ_len < p->len)
+	integ_len++;
+    if (integ_alg->integ_check(&con, integ_data, p->d, integ_len, p->len))
+	return -1;
+    if (conf_alg->conf_decrypt(&con, conf_data, &data, &clen))
+	return -1;
+    if (clen != plen)
+	return -1;
+    return memcmp(data, payload, plen);
+}
+
+static int
+run(int session, unsigned int count, unsigned int plen)
+{
+    static pkt_t  pkts[64];
+    unsigned char payload[MAX_PKT];
+    unsigned int  i, j;
+    int           rv;
+    double        start, tbuild = 0, tverify = 0;
+
+    for (i = 0; i < plen; i++)
+	payload[i] = i;
+
+    for (i = 0; i < count; i += 64) {
+	start = now();
+	for (j = 0; j < 64; j++) {
+	    if (session)
+		rv = lib_build(&pkts[j], payload, plen, i + j);
+	    else
+		rv = build(&pkts[j], payload, plen, i + j);
+	    if (rv) {
+		fprintf(stderr, "Packet %u failed to build\n", i + j);
+		return 1;
+	    }
+	}
+	tbuild += now() - start;
+	start = now();
+	for (j = 0; j < 64; j++) {
+	    if (session)
+		rv = lib_verify(&pkts[j], payload, plen);
+	    else
+		rv = verify(&pkts[j], payload, plen);
+	    if (rv) {
+		fprintf(stderr, "Packet %u failed to verify\n", i + j);
+		return 1;
+	    }
+	}
+	tverify += now() - start;
+    }
+
+    printf("%-8s build %9.0f pkt/s (%5.2f us)  verify %9.0f pkt/s (%5.2f us)\n",
+	   session ? "library" : "oneshot",
+	   count / tbuild, tbuild * 1e6 / count,
+	   count / tverify, tverify * 1e6 / count);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int count = 200000, plen = 32;
+    int          c;
+    unsigned int i;
+    unsigned int integ_num = IPMI_LANP_INTEGRITY_ALGORITHM_HMAC_SHA1_96;
+
+    evp_md = EVP_sha1();
+    klen = 20;
+    ilen = 12;
+    while ((c = getopt(argc, argv, "n:l:a:")) != -1) {
+	switch (c) {
+	case 'n':
+	    count = strtoul(optarg, NULL, 0);
+	    break;
+	case 'l':
+	    plen = strtoul(optarg, NULL, 0);
+	    break;
+	case 'a':
+	    if (strcmp(optarg, "md5") == 0) {
+		evp_md = EVP_md5();
+		klen = 16;
+		ilen = 16;
+		integ_num = IPMI_LANP_INTEGRITY_ALGORITHM_HMAC_MD5_128;
+	    } else if (strcmp(optarg, "sha1") != 0) {
+		fprintf(stderr, "Unknown integrity algorithm: %s\n", optarg);
+		return 1;
+	    }
+	    break;
+	default:
+	    fprintf(stderr,
+		    "Usage: %s [-n packets] [-l payload length] [-a sha1|md5]\n",
+		    argv[0]);
+	    return 1;
+	}
+    }
+    if (plen == 0 || plen > MAX_PKT - HDR_LEN - 16 - 16 - 4 - EVP_MAX_MD_SIZE) {
+	fprintf(stderr, "Invalid payload length: %u\n", plen);
+	return 1;
+    }
+    count = (count + 63) & ~63;
+
+    for (i = 0; i < sizeof(k1); i++)
+	k1[i] = i * 7 + 1;
+    for (i = 0; i < sizeof(k2); i++)
+	k2[i] = i * 13 + 5;
+    if (session_setup(integ_num))
+	return 1;
+
+    printf("%u packets, %u byte payload, AES-CBC-128 + %s\n", count, plen,
+	   klen == 20 ? "HMAC-SHA1-96" : "HMAC-MD5-128");
+    if (run(0, count, plen) || run(1, count, plen))
+	return 1;
+    return 0;
+}
+
+#else
+
+int
+main(int argc, char *argv[])
+{
+    fprintf(stderr, "%s: built without OpenSSL\n", argv[0]);
+    return 1;
+}
+
+#endif /* HAVE_OPENSSL */
@@ -0,0 +1,376 @@
+/*
+ * sensor_bench.c
+ *
+ * Multithreaded sensor benchmark.  It opens a domain, collects every
+ * sensor in it and then, from several threads at once, first turns
+ * sensor ids into pointers as fast as it can (the lookup path every
+ * sensor operation goes through) and then keeps a window of sensor
+ * reads outstanding per thread.  Point it at an ipmi_sim with a few
+ * thousand sensors to see how the domain scales with threads.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Usage: ipmi_sensorbench [-t threads] [-d seconds] [-w window]
+ *                         <connection args>
+ *
+ * The connection arguments are the same as for openipmicmd, for
+ * instance "lan -U user -P pw -A rmcp+ -L admin bmc-host".
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <OpenIPMI/ipmiif.h>
+#include <OpenIPMI/ipmi_err.h>
+#include <OpenIPMI/ipmi_posix.h>
+
+#include "bench_domain.h"
+
+static const char *progname;
+static os_handler_t *os_hnd;
+
+static unsigned int num_threads = 4;
+static unsigned int duration = 5;
+static unsigned int window = 8;
+
+typedef struct bench_sensor_s
+{
+    ipmi_sensor_id_t id;
+    int              threshold;
+} bench_sensor_t;
+
+static bench_sensor_t *sensors;
+static unsigned int   num_sensors;
+static unsigned int   max_sensors;
+
+/* Shared state for the read phase. */
+static pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int    read_next;
+static unsigned int    reads_outstanding;
+static unsigned long   reads_done;
+static unsigned long   read_errs;
+static volatile int    reads_stop;
+
+static void
+got_sensor(ipmi_entity_t *ent, ipmi_sensor_t *sensor, void *cb_data)
+{
+    if (num_sensors == max_sensors) {
+	bench_sensor_t *n;
+
+	max_sensors = max_sensors ? max_sensors * 2 : 256;
+	n = realloc(sensors, sizeof(*n) * max_sensors);
+	if (!n)
+	    return;
+	sensors = n;
+    }
+    sensors[num_sensors].id = ipmi_sensor_convert_to_id(sensor);
+    sensors[num_sensors].threshold
+	= (ipmi_sensor_get_event_reading_type(sensor)
+	   == IPMI_EVENT_READING_TYPE_THRESHOLD);
+    num_sensors++;
+}
+
+static void
+got_entity(ipmi_entity_t *ent, void *cb_data)
+{
+    ipmi_entity_iterate_sensors(ent, got_sensor, NULL);
+}
+
+static void
+collect_sensors(ipmi_domain_t *domain, void *cb_data)
+{
+    ipmi_domain_iterate_entities(domain, got_entity, NULL);
+}
+
+/*
+ * Lookup phase: each thread walks the sensor list from its own
+ * starting point, converting ids to pointers.
+ */
+typedef struct lookup_thread_s
+{
+    pthread_t     thread;
+    unsigned int  start;
+    double        end;
+    unsigned long lookups;
+    unsigned long errs;
+} lookup_thread_t;
+
+static void
+lookup_handler(ipmi_sensor_t *sensor, void *cb_data)
+{
+    unsigned long *lookups = cb_data;
+
+    if (ipmi_sensor_get_num(sensor, NULL, NULL) == 0)
+	(*lookups)++;
+}
+
+static void *
+lookup_run(void *cb_data)
+{
+    lookup_thread_t *t = cb_data;
+    unsigned int    i = t->start, n;
+
+    while (bench_now() < t->end) {
+	for (n = 0; n < 256; n++) {
+	    if (ipmi_sensor_pointer_cb(sensors[i].id, lookup_handler,
+				       &t->lookups))
+		t->errs++;
+	    if (++i == num_sensors)
+		i = 0;
+	}
+    }
+    return NULL;
+}
+
+static int
+lookup_bench(void)
+{
+    lookup_thread_t *t;
+    unsigned int    i;
+    unsigned long   lookups = 0, errs = 0;
+    double          start, end;
+
+    t = calloc(num_threads, sizeof(*t));
+    if (!t)
+	return ENOMEM;
+    start = bench_now();
+    end = start + duration;
+    for (i = 0; i < num_threads; i++) {
+	t[i].start = (num_sensors / num_threads) * i;
+	t[i].end = end;
+	if (pthread_create(&t[i].thread, NULL, lookup_run, &t[i])) {
+	    fprintf(stderr, "Unable to start thread\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < num_threads; i++) {
+	pthread_join(t[i].thread, NULL);
+	lookups += t[i].lookups;
+	errs += t[i].errs;
+    }
+    end = bench_now();
+    printf("lookups: %10.0f/s  (%lu errors)\n",
+	   lookups / (end - start), errs);
+    free(t);
+    return 0;
+}
+
+/*
+ * Read phase: the operation loop threads handle the responses, each
+ * completion starts a read on the next sensor.
+ */
+static void start_read(void);
+
+static void
+read_done(int err)
+{
+    int next = 0;
+
+    pthread_mutex_lock(&read_lock);
+    if (err)
+	read_errs++;
+    else
+	reads_done++;
+    if (reads_stop)
+	reads_outstanding--;
+    else
+	next = 1;
+    pthread_mutex_unlock(&read_lock);
+    if (next)
+	start_read();
+}
+
+static void
+reading_cb(ipmi_sensor_t *sensor, int err, enum ipmi_value_present_e present,
+	   unsigned int raw, double val, ipmi_states_t *states, void *cb_data)
+{
+    read_done(err);
+}
+
+static void
+states_cb(ipmi_sensor_t *sensor, int err, ipmi_states_t *states,
+	  void *cb_data)
+{
+    read_done(err);
+}
+
+static void
+start_read(void)
+{
+    bench_sensor_t *s;
+    int            rv;
+
+    pthread_mutex_lock(&read_lock);
+    s = &sensors[read_next];
+    if (++read_next == num_sensors)
+	read_next = 0;
+    pthread_mutex_unlock(&read_lock);
+
+    if (s->threshold)
+	rv = ipmi_sensor_id_get_reading(s->id, reading_cb, NULL);
+    else
+	rv = ipmi_sensor_id_get_states(s->id, states_cb, NULL);
+    if (rv) {
+	pthread_mutex_lock(&read_lock);
+	read_errs++;
+	reads_outstanding--;
+	pthread_mutex_unlock(&read_lock);
+    }
+}
+
+static int
+read_bench(void)
+{
+    unsigned int  i, outstanding;
+    unsigned long done;
+    double        start, end, wait_end;
+    struct timespec ts = { 0, 10000000 };
+
+    reads_outstanding = num_threads * window;
+    start = bench_now();
+    for (i = 0; i < num_threads * window; i++)
+	start_read();
+    end = start + duration;
+    while (bench_now() < end)
+	nanosleep(&ts, NULL);
+    pthread_mutex_lock(&read_lock);
+    reads_stop = 1;
+    done = reads_done;
+    pthread_mutex_unlock(&read_lock);
+    end = bench_now();
+
+    /* Let the outstanding reads finish before the domain goes away. */
+    wait_end = end + 10;
+    do {
+	nanosleep(&ts, NULL);
+	pthread_mutex_lock(&read_lock);
+	outstanding = reads_outstanding;
+	pthread_mutex_unlock(&read_lock);
+    } while (outstanding && bench_now() < wait_end);
+
+    printf("reads:   %10.0f/s  (%lu errors, %u outstanding)\n",
+	   done / (end - start), read_errs, num_threads * window);
+    return 0;
+}
+
+static void
+usage(void)
+{
+    printf("Usage:\n"
+	   " %s [options] <connection args>\n"
+	   " Options are:\n"
+	   "  -t threads   Lookup and operation loop threads (default %u)\n"
+	   "  -d seconds   Time to run each phase (default %u)\n"
+	   "  -w window    Reads outstanding per thread (default %u)\n"
+	   " The connection arguments are the same as openipmicmd.\n",
+	   progname, num_threads, duration, window);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int              rv;
+    int              curr_arg;
+    ipmi_domain_id_t domain_id;
+    unsigned int     i;
+
+    progname = argv[0];
+
+    for (i = 1; i < (unsigned int) argc; i++) {
+	if (argv[i][0] != '-')
+	    break;
+	if (strcmp(argv[i], "--") == 0) {
+	    i++;
+	    break;
+	} else if (strcmp(argv[i], "-h") == 0) {
+	    usage();
+	    exit(0);
+	}
+
+	if (i + 1 >= (unsigned int) argc || strlen(argv[i]) != 2) {
+	    usage();
+	    exit(1);
+	}
+	switch (argv[i][1]) {
+	case 't': num_threads = strtoul(argv[++i], NULL, 0); break;
+	case 'd': duration = strtoul(argv[++i], NULL, 0); break;
+	case 'w': window = strtoul(argv[++i], NULL, 0); break;
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (i >= (unsigned int) argc) {
+	fprintf(stderr, "No connection arguments given\n");
+	usage();
+	exit(1);
+    }
+    if (num_threads == 0 || window == 0) {
+	fprintf(stderr, "The thread count and window must not be zero\n");
+	exit(1);
+    }
+    curr_arg = i;
+
+    os_hnd = ipmi_posix_thread_setup_os_handler(SIGUSR1);
+    if (!os_hnd) {
+	fprintf(stderr, "Unable to allocate os handler\n");
+	exit(1);
+    }
+
+    rv = ipmi_init(os_hnd);
+    if (rv) {
+	fprintf(stderr, "Error initializing connections: 0x%x\n", rv);
+	exit(1);
+    }
+
+    bench_domain_open(os_hnd, &curr_arg, argc, argv, num_threads,
+		      &domain_id);
+
+    ipmi_domain_pointer_cb(domain_id, collect_sensors, NULL);
+    if (num_sensors == 0) {
+	fprintf(stderr, "No sensors found\n");
+	exit(1);
+    }
+    printf("%u sensors, %u threads, %u reads outstanding\n", num_sensors,
+	   num_threads, num_threads * window);
+
+    lookup_bench();
+    read_bench();
+
+    bench_domain_close();
+    free(sensors);
+    os_hnd->free_os_handler(os_hnd);
+    return 0;
+}
@@ -0,0 +1,1082 @@
+/*
+ * smuxd.c
+ *
+ * OpenIPMI local interface multiplexer
+ *
+ * This program owns one connection (normally the local system
+ * interface) and shares it with other OpenIPMI programs through a Unix
+ * socket, they connect to it with the "smux" connection type.  Things
+ * that rarely change (the device id, FRU data, SDRs and SEL entries)
+ * are cached, so when many programs start up and scan the same BMC
+ * only the first one has to wait on the interface.  Async events are
+ * sent to every client that asked for them.
+ *
+ * The cache is kept coherent by watching what goes through it.  Writes
+ * (Write FRU, Add/Delete/Clear SDR and SEL) flush the entries of their
+ * class for that address.  The SDR and SEL info commands are never
+ * cached, their timestamps (or the whole response for the device SDR
+ * info) are compared against the last ones seen and a change flushes
+ * the class.  Changes made behind our back are caught by the info
+ * commands, which every client sends before reading a repository, and
+ * the entry lifetime (-t) bounds everything else.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include <OpenIPMI/ipmiif.h>
+#include <OpenIPMI/ipmi_conn.h>
+#include <OpenIPMI/ipmi_smi.h>
+#include <OpenIPMI/ipmi_msgbits.h>
+#include <OpenIPMI/ipmi_err.h>
+#include <OpenIPMI/ipmi_posix.h>
+
+#define STDERR_IPMIERR(err, format, ...) \
+    do {								\
+	char errstr[128];						\
+	ipmi_get_error_string(err, errstr, sizeof(errstr));		\
+	fprintf(stderr, "%s: " format ": %s\n", progname, ##__VA_ARGS__, \
+		errstr);						\
+    } while(0)
+
+#define debug_printf(format, ...) \
+    do {								\
+	if (debug)							\
+	    printf(format, ##__VA_ARGS__);				\
+    } while(0)
+
+static const char *progname;
+static const char *sock_path = IPMI_SMUX_DEFAULT_PATH;
+static int debug;
+static os_handler_t *os_hnd;
+static ipmi_con_t *con;
+static bool con_up;
+
+/* How long a cache entry is good for, in seconds. */
+static unsigned int cache_ttl = 60;
+/* When the cache gets this big it is flushed. */
+static unsigned int cache_max = 4096;
+
+/* How many messages to take from a client at a time. */
+#define CLIENT_RECV_BATCH 32
+
+/**********************************************************************
+ *
+ * The response cache
+ *
+ **********************************************************************/
+
+enum cache_class_e {
+    CACHE_DEVID, CACHE_FRU, CACHE_SDR, CACHE_DEV_SDR, CACHE_SEL,
+    NUM_CACHE_CLASSES
+};
+
+enum cache_action_e {
+    CACHE_RSP,		/* Cache the response. */
+    CACHE_INFO,		/* Flush the class if the response changes. */
+    CACHE_FLUSH		/* A write, flush the class. */
+};
+
+typedef struct cache_rule_s
+{
+    unsigned char       netfn;
+    unsigned char       cmd;
+    enum cache_class_e  class;
+    enum cache_action_e action;
+    /* For CACHE_RSP, this many leading request bytes are not part of
+       the key (they are the reservation id).  For CACHE_INFO, the
+       range of response bytes that show a change, info_end of 0 means
+       the whole response. */
+    unsigned int        skip;
+    unsigned int        info_start;
+    unsigned int        info_end;
+} cache_rule_t;
+
+static cache_rule_t cache_rules[] =
+{
+    { IPMI_APP_NETFN, IPMI_GET_DEVICE_ID_CMD, CACHE_DEVID, CACHE_RSP, 0 },
+
+    { IPMI_STORAGE_NETFN, IPMI_GET_FRU_INVENTORY_AREA_INFO_CMD,
+      CACHE_FRU, CACHE_RSP, 0 },
+    { IPMI_STORAGE_NETFN, IPMI_READ_FRU_DATA_CMD, CACHE_FRU, CACHE_RSP, 0 },
+    { IPMI_STORAGE_NETFN, IPMI_WRITE_FRU_DATA_CMD, CACHE_FRU, CACHE_FLUSH },
+
+    { IPMI_STORAGE_NETFN, IPMI_GET_SDR_REPOSITORY_INFO_CMD,
+      CACHE_SDR, CACHE_INFO, 0, 6, 14 },
+    { IPMI_STORAGE_NETFN, IPMI_GET_SDR_CMD, CACHE_SDR, CACHE_RSP, 2 },
+    { IPMI_STORAGE_NETFN, IPMI_ADD_SDR_CMD, CACHE_SDR, CACHE_FLUSH },
+    { IPMI_STORAGE_NETFN, IPMI_PARTIAL_ADD_SDR_CMD, CACHE_SDR, CACHE_FLUSH },
+    { IPMI_STORAGE_NETFN, IPMI_DELETE_SDR_CMD, CACHE_SDR, CACHE_FLUSH },
+    { IPMI_STORAGE_NETFN, IPMI_CLEAR_SDR_REPOSITORY_CMD,
+      CACHE_SDR, CACHE_FLUSH },
+
+    { IPMI_SENSOR_EVENT_NETFN, IPMI_GET_DEVICE_SDR_INFO_CMD,
+      CACHE_DEV_SDR, CACHE_INFO, 0, 0, 0 },
+    { IPMI_SENSOR_EVENT_NETFN, IPMI_GET_DEVICE_SDR_CMD,
+      CACHE_DEV_SDR, CACHE_RSP, 2 },
+
+    { IPMI_STORAGE_NETFN, IPMI_GET_SEL_INFO_CMD, CACHE_SEL, CACHE_INFO,
+      0, 6, 14 },
+    { IPMI_STORAGE_NETFN, IPMI_GET_SEL_ENTRY_CMD, CACHE_SEL, CACHE_RSP, 2 },
+    { IPMI_STORAGE_NETFN, IPMI_ADD_SEL_ENTRY_CMD, CACHE_SEL, CACHE_FLUSH },
+    { IPMI_STORAGE_NETFN, IPMI_PARTIAL_ADD_SEL_ENTRY_CMD,
+      CACHE_SEL, CACHE_FLUSH },
+    { IPMI_STORAGE_NETFN, IPMI_DELETE_SEL_ENTRY_CMD, CACHE_SEL, CACHE_FLUSH },
+    { IPMI_STORAGE_NETFN, IPMI_CLEAR_SEL_CMD, CACHE_SEL, CACHE_FLUSH },
+
+    { 0 }
+};
+
+static cache_rule_t *
+find_cache_rule(unsigned char netfn, unsigned char cmd)
+{
+    cache_rule_t *r;
+
+    for (r = cache_rules; r->netfn || r->cmd; r++) {
+	if ((r->netfn == netfn) && (r->cmd == cmd))
+	    return r;
+    }
+    return NULL;
+}
+
+typedef struct cache_entry_s
+{
+    struct cache_entry_s *next;
+    enum cache_class_e   class;
+    struct timeval       expires;
+
+    /* The key. */
+    unsigned char        netfn;
+    unsigned char        cmd;
+    unsigned int         addr_len;
+    unsigned char        addr[sizeof(ipmi_addr_t)];
+    unsigned int         key_len;
+    unsigned char        key[IPMI_MAX_MSG_LENGTH];
+
+    /* The response. */
+    unsigned char        rsp_netfn;
+    unsigned char        rsp_cmd;
+    unsigned int         rsp_addr_len;
+    unsigned char        rsp_addr[sizeof(ipmi_addr_t)];
+    unsigned int         rsp_len;
+    unsigned char        rsp[IPMI_MAX_MSG_LENGTH];
+} cache_entry_t;
+
+/* The last info response seen for a class on an address. */
+typedef struct cache_info_s
+{
+    struct cache_info_s *next;
+    enum cache_class_e  class;
+    unsigned int        addr_len;
+    unsigned char       addr[sizeof(ipmi_addr_t)];
+    unsigned int        len;
+    unsigned char       data[IPMI_MAX_MSG_LENGTH];
+} cache_info_t;
+
+#define CACHE_HASH_SIZE 256
+
+static cache_entry_t *cache_hash[CACHE_HASH_SIZE];
+static unsigned int  cache_count;
+static cache_info_t  *cache_infos;
+
+/*
+ * Bumped every time a class is flushed.  A response is only stored if
+ * the generation is the same as when the command was sent, so a read
+ * that raced with a write can't put old data back in.
+ */
+static unsigned int cache_gen[NUM_CACHE_CLASSES];
+
+static unsigned long cache_hits, cache_misses, cache_flushes;
+
+static unsigned int
+cache_hash_key(unsigned char netfn, unsigned char cmd,
+	       const unsigned char *addr, unsigned int addr_len,
+	       const unsigned char *key, unsigned int key_len)
+{
+    unsigned int h = 2166136261U;
+    unsigned int i;
+
+    h = (h ^ netfn) * 16777619U;
+    h = (h ^ cmd) * 16777619U;
+    for (i = 0; i < addr_len; i++)
+	h = (h ^ addr[i]) * 16777619U;
+    for (i = 0; i < key_len; i++)
+	h = (h ^ key[i]) * 16777619U;
+    return h % CACHE_HASH_SIZE;
+}
+
+static int
+time_before(const struct timeval *t1, const struct timeval *t2)
+{
+    if (t1->tv_sec != t2->tv_sec)
+	return t1->tv_sec < t2->tv_sec;
+    return t1->tv_usec < t2->tv_usec;
+}
+
+static void
+cache_flush_all(void)
+{
+    cache_entry_t *e;
+    unsigned int  i;
+
+    for (i = 0; i < CACHE_HASH_SIZE; i++) {
+	while (cache_hash[i]) {
+	    e = cache_hash[i];
+	    cache_hash[i] = e->next;
+	    free(e);
+	}
+    }
+    cache_count = 0;
+    for (i = 0; i < NUM_CACHE_CLASSES; i++)
+	cache_gen[i]++;
+}
+
+/* Flush a class for an address, or for all addresses if addr is NULL. */
+static void
+cache_flush_class(enum cache_class_e  class,
+		  const unsigned char *addr,
+		  unsigned int        addr_len)
+{
+    cache_entry_t *e, **prev;
+    unsigned int  i;
+
+    cache_gen[class]++;
+    cache_flushes++;
+    for (i = 0; i < CACHE_HASH_SIZE; i++) {
+	prev = &cache_hash[i];
+	while (*prev) {
+	    e = *prev;
+	    if ((e->class == class)
+		&& (!addr || ((e->addr_len == addr_len)
+			      && (memcmp(e->addr, addr, addr_len) == 0))))
+	    {
+		*prev = e->next;
+		free(e);
+		cache_count--;
+	    } else
+		prev = &e->next;
+	}
+    }
+}
+
+static cache_entry_t *
+cache_find(cache_rule_t *rule, const ipmi_smux_msg_t *m)
+{
+    cache_entry_t       *e, **prev;
+    const unsigned char *key = m->data + rule->skip;
+    unsigned int        key_len;
+    unsigned int        h;
+    struct timeval      now;
+
+    if (m->data_len < rule->skip)
+	return NULL;
+    key_len = m->data_len - rule->skip;
+    h = cache_hash_key(m->netfn, m->cmd, m->addr, m->addr_len, key, key_len);
+    os_hnd->get_monotonic_time(os_hnd, &now);
+    prev = &cache_hash[h];
+    while (*prev) {
+	e = *prev;
+	if ((e->netfn == m->netfn) && (e->cmd == m->cmd)
+	    && (e->addr_len == m->addr_len) && (e->key_len == key_len)
+	    && (memcmp(e->addr, m->addr, m->addr_len) == 0)
+	    && (memcmp(e->key, key, key_len) == 0))
+	{
+	    if (time_before(&e->expires, &now)) {
+		*prev = e->next;
+		free(e);
+		cache_count--;
+		return NULL;
+	    }
+	    return e;
+	}
+	prev = &e->next;
+    }
+    return NULL;
+}
+
+static void
+cache_store(cache_rule_t          *rule,
+	    const ipmi_smux_msg_t *m,
+	    ipmi_msgi_t           *rspi)
+{
+    cache_entry_t *e;
+    unsigned int  h;
+
+    if ((cache_max == 0) || (m->data_len < rule->skip))
+	return;
+    if (rspi->addr_len > sizeof(e->rsp_addr))
+	return;
+    if (cache_count >= cache_max) {
+	debug_printf("Cache full, flushing it\n");
+	cache_flush_all();
+    }
+
+    e = malloc(sizeof(*e));
+    if (!e)
+	return;
+    e->class = rule->class;
+    os_hnd->get_monotonic_time(os_hnd, &e->expires);
+    e->expires.tv_sec += cache_ttl;
+    e->netfn = m->netfn;
+    e->cmd = m->cmd;
+    e->addr_len = m->addr_len;
+    memcpy(e->addr, m->addr, m->addr_len);
+    e->key_len = m->data_len - rule->skip;
+    memcpy(e->key, m->data + rule->skip, e->key_len);
+    e->rsp_netfn = rspi->msg.netfn;
+    e->rsp_cmd = rspi->msg.cmd;
+    e->rsp_addr_len = rspi->addr_len;
+    memcpy(e->rsp_addr, &rspi->addr, rspi->addr_len);
+    e->rsp_len = rspi->msg.data_len;
+    memcpy(e->rsp, rspi->msg.data, rspi->msg.data_len);
+
+    h = cache_hash_key(e->netfn, e->cmd, e->addr, e->addr_len,
+		       e->key, e->key_len);
+    e->next = cache_hash[h];
+    cache_hash[h] = e;
+    cache_count++;
+}
+
+/* Compare an info response with the last one, flush the class if it
+   changed. */
+static void
+cache_check_info(cache_rule_t          *rule,
+		 const ipmi_smux_msg_t *m,
+		 ipmi_msgi_t           *rspi)
+{
+    cache_info_t        *info;
+    const unsigned char *data = rspi->msg.data;
+    unsigned int        len = rspi->msg.data_len;
+
+    if (rule->info_end) {
+	if (len < rule->info_end)
+	    return;
+	data += rule->info_start;
+	len = rule->info_end - rule->info_start;
+    }
+
+    for (info = cache_infos; info; info = info->next) {
+	if ((info->class == rule->class) && (info->addr_len == m->addr_len)
+	    && (memcmp(info->addr, m->addr, m->addr_len) == 0))
+	    break;
+    }
+    if (!info) {
+	info = malloc(sizeof(*info));
+	if (!info) {
+	    /* Can't tell if it changed, so assume it did. */
+	    cache_flush_class(rule->class, m->addr, m->addr_len);
+	    return;
+	}
+	info->class = rule->class;
+	info->addr_len = m->addr_len;
+	memcpy(info->addr, m->addr, m->addr_len);
+	info->len = 0;
+	info->next = cache_infos;
+	cache_infos = info;
+    } else if ((info->len == len) && (memcmp(info->data, data, len) == 0))
+	return;
+
+    if (info->len)
+	debug_printf("Info for class %d changed, flushing\n", rule->class);
+    cache_flush_class(rule->class, m->addr, m->addr_len);
+    info->len = len;
+    memcpy(info->data, data, len);
+}
+
+static void
+cache_stats_timeout(void *cb_data, os_hnd_timer_id_t *id)
+{
+    struct timeval tv;
+
+    debug_printf("Cache: %u entries, %lu hits, %lu misses, %lu flushes\n",
+		 cache_count, cache_hits, cache_misses, cache_flushes);
+    fflush(stdout);
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    os_hnd->start_timer(os_hnd, id, &tv, cache_stats_timeout, NULL);
+}
+
+/**********************************************************************
+ *
+ * Clients
+ *
+ **********************************************************************/
+
+typedef struct client_s
+{
+    int             fd;
+    os_hnd_fd_id_t  *fd_id;
+    unsigned int    refcount;
+    bool            closed;
+    bool            events;
+    struct client_s *next, *prev;
+} client_t;
+
+static client_t *clients;
+static unsigned int num_clients;
+
+/* A command sent to the interface for a client. */
+typedef struct pending_s
+{
+    client_t        *client;
+    cache_rule_t    *rule;
+    unsigned int    gen;
+    ipmi_smux_msg_t m;
+} pending_t;
+
+static void
+client_put(client_t *c)
+{
+    c->refcount--;
+    if (c->refcount == 0)
+	free(c);
+}
+
+static void
+client_fd_freed(int fd, void *cb_data)
+{
+    client_t *c = cb_data;
+
+    close(fd);
+    client_put(c);
+}
+
+static void
+client_close(client_t *c, const char *why)
+{
+    if (c->closed)
+	return;
+    debug_printf("Closing client %d: %s\n", c->fd, why);
+    c->closed = true;
+    if (c->next)
+	c->next->prev = c->prev;
+    if (c->prev)
+	c->prev->next = c->next;
+    else
+	clients = c->next;
+    num_clients--;
+    /* The fd is closed and the reference dropped in client_fd_freed. */
+    os_hnd->remove_fd_to_wait_for(os_hnd, c->fd_id);
+}
+
+static void
+client_send(client_t *c, ipmi_smux_msg_t *m)
+{
+    if (c->closed)
+	return;
+    if (send(c->fd, m, IPMI_SMUX_MSG_LEN(m), MSG_DONTWAIT | MSG_NOSIGNAL)
+	== -1)
+    {
+	/* A client that can't keep up gets dropped rather than holding
+	   everyone else up; it will see the socket close. */
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+	    syslog(LOG_WARNING, "Client %d not reading, dropping it", c->fd);
+	client_close(c, strerror(errno));
+    }
+}
+
+static void
+client_send_err(client_t *c, const ipmi_smux_msg_t *req, unsigned char cc)
+{
+    ipmi_smux_msg_t m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = IPMI_SMUX_RSP;
+    m.netfn = req->netfn | 1;
+    m.cmd = req->cmd;
+    m.msgid = req->msgid;
+    m.addr_len = req->addr_len;
+    memcpy(m.addr, req->addr, req->addr_len);
+    m.data_len = 1;
+    m.data[0] = cc;
+    client_send(c, &m);
+}
+
+static int
+rsp_handler(ipmi_con_t *ipmi, ipmi_msgi_t *rspi)
+{
+    pending_t       *p = rspi->data1;
+    cache_rule_t    *rule = p->rule;
+    ipmi_smux_msg_t m;
+    int             ok = (rspi->msg.data_len > 0) && (rspi->msg.data[0] == 0);
+
+    if (rule) {
+	switch (rule->action) {
+	case CACHE_RSP:
+	    if (ok && (p->gen == cache_gen[rule->class]))
+		cache_store(rule, &p->m, rspi);
+	    break;
+	case CACHE_INFO:
+	    if (ok)
+		cache_check_info(rule, &p->m, rspi);
+	    break;
+	case CACHE_FLUSH:
+	    /* Flushed when sent, do it again in case a read got in
+	       between. */
+	    cache_flush_class(rule->class, p->m.addr, p->m.addr_len);
+	    break;
+	}
+    }
+
+    if (!p->client->closed && (rspi->addr_len <= sizeof(m.addr))) {
+	memset(&m, 0, sizeof(m));
+	m.type = IPMI_SMUX_RSP;
+	m.netfn = rspi->msg.netfn;
+	m.cmd = rspi->msg.cmd;
+	m.msgid = p->m.msgid;
+	m.addr_len = rspi->addr_len;
+	memcpy(m.addr, &rspi->addr, rspi->addr_len);
+	m.data_len = rspi->msg.data_len;
+	memcpy(m.data, rspi->msg.data, rspi->msg.data_len);
+	client_send(p->client, &m);
+    }
+
+    client_put(p->client);
+    free(p);
+    return IPMI_MSG_ITEM_NOT_USED;
+}
+
+static void
+handle_client_send(client_t *c, ipmi_smux_msg_t *m)
+{
+    cache_rule_t  *rule;
+    cache_entry_t *e;
+    pending_t     *p;
+    ipmi_msgi_t   *rspi;
+    ipmi_msg_t    msg;
+    int           rv;
+
+    if (!con_up) {
+	client_send_err(c, m, IPMI_NODE_BUSY_CC);
+	return;
+    }
+
+    rule = find_cache_rule(m->netfn, m->cmd);
+    if (rule && (rule->action == CACHE_RSP)) {
+	e = cache_find(rule, m);
+	if (e) {
+	    ipmi_smux_msg_t r;
+
+	    cache_hits++;
+	    memset(&r, 0, sizeof(r));
+	    r.type = IPMI_SMUX_RSP;
+	    r.netfn = e->rsp_netfn;
+	    r.cmd = e->rsp_cmd;
+	    r.msgid = m->msgid;
+	    r.addr_len = e->rsp_addr_len;
+	    memcpy(r.addr, e->rsp_addr, e->rsp_addr_len);
+	    r.data_len = e->rsp_len;
+	    memcpy(r.data, e->rsp, e->rsp_len);
+	    client_send(c, &r);
+	    return;
+	}
+	cache_misses++;
+    } else if (rule && (rule->action == CACHE_FLUSH))
+	cache_flush_class(rule->class, m->addr, m->addr_len);
+
+    p = malloc(sizeof(*p));
+    if (!p) {
+	client_send_err(c, m, IPMI_OUT_OF_SPACE_CC);
+	return;
+    }
+    rspi = ipmi_alloc_msg_item();
+    if (!rspi) {
+	free(p);
+	client_send_err(c, m, IPMI_OUT_OF_SPACE_CC);
+	return;
+    }
+    p->client = c;
+    p->rule = rule;
+    p->gen = rule ? cache_gen[rule->class] : 0;
+    memcpy(&p->m, m, IPMI_SMUX_MSG_LEN(m));
+    c->refcount++;
+    rspi->data1 = p;
+
+    msg.netfn = m->netfn;
+    msg.cmd = m->cmd;
+    msg.data = p->m.data;
+    msg.data_len = m->data_len;
+    rv = con->send_command(con, (ipmi_addr_t *) p->m.addr, p->m.addr_len,
+			   &msg, rsp_handler, rspi);
+    if (rv) {
+	ipmi_free_msg_item(rspi);
+	free(p);
+	client_send_err(c, m, IPMI_UNKNOWN_ERR_CC);
+	client_put(c);
+    }
+}
+
+static void
+client_data_ready(int fd, void *cb_data, os_hnd_fd_id_t *id)
+{
+    client_t        *c = cb_data;
+    ipmi_smux_msg_t m;
+    ssize_t         len;
+    ssize_t         hdr = offsetof(ipmi_smux_msg_t, data);
+    int             count = 0;
+
+    while (!c->closed && (count < CLIENT_RECV_BATCH)) {
+	len = recv(fd, &m, sizeof(m), MSG_DONTWAIT);
+	if (len == 0) {
+	    client_close(c, "closed");
+	    break;
+	}
+	if (len < 0) {
+	    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+		client_close(c, strerror(errno));
+	    break;
+	}
+	count++;
+	if ((len < hdr) || (m.data_len > (len - hdr))
+	    || (m.addr_len > sizeof(m.addr)))
+	{
+	    client_close(c, "bad message");
+	    break;
+	}
+
+	switch (m.type) {
+	case IPMI_SMUX_SEND:
+	    handle_client_send(c, &m);
+	    break;
+
+	case IPMI_SMUX_EVENTS:
+	    c->events = m.netfn != 0;
+	    break;
+
+	default:
+	    client_close(c, "bad message type");
+	    break;
+	}
+    }
+}
+
+static void
+listen_data_ready(int fd, void *cb_data, os_hnd_fd_id_t *id)
+{
+    client_t *c;
+    int      cfd;
+    int      rv;
+
+    cfd = accept(fd, NULL, NULL);
+    if (cfd == -1)
+	return;
+
+    c = malloc(sizeof(*c));
+    if (!c) {
+	syslog(LOG_ERR, "Out of memory allocating a client");
+	close(cfd);
+	return;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fd = cfd;
+    c->refcount = 1; /* Dropped when the fd is freed. */
+    rv = os_hnd->add_fd_to_wait_for(os_hnd, cfd, client_data_ready, c,
+				    client_fd_freed, &c->fd_id);
+    if (rv) {
+	syslog(LOG_ERR, "Unable to add client fd: %s", strerror(rv));
+	close(cfd);
+	free(c);
+	return;
+    }
+
+    c->next = clients;
+    if (clients)
+	clients->prev = c;
+    clients = c;
+    num_clients++;
+    debug_printf("New client %d, %u clients\n", cfd, num_clients);
+}
+
+/**********************************************************************
+ *
+ * The interface
+ *
+ **********************************************************************/
+
+static void
+event_handler(ipmi_con_t        *ipmi,
+	      const ipmi_addr_t *addr,
+	      unsigned int      addr_len,
+	      ipmi_event_t      *event,
+	      void              *cb_data)
+{
+    ipmi_smux_msg_t m;
+    client_t        *c, *next;
+    unsigned int    record_id;
+
+    /* A new event may have gone into the SEL, the last entry we have
+       cached points to it now. */
+    cache_flush_class(CACHE_SEL, NULL, 0);
+
+    if (!event || (addr_len > sizeof(m.addr)))
+	return;
+
+    /* Rebuild it in the same format the driver gives it. */
+    memset(&m, 0, sizeof(m));
+    m.type = IPMI_SMUX_EVENT;
+    m.netfn = IPMI_APP_NETFN | 1;
+    m.cmd = IPMI_READ_EVENT_MSG_BUFFER_CMD;
+    m.msgid = 0;
+    m.addr_len = addr_len;
+    memcpy(m.addr, addr, addr_len);
+    record_id = ipmi_event_get_record_id(event);
+    m.data[0] = record_id & 0xff;
+    m.data[1] = (record_id >> 8) & 0xff;
+    m.data[2] = ipmi_event_get_type(event);
+    ipmi_event_get_data(event, m.data + 3, 0, 13);
+    m.data_len = 16;
+
+    for (c = clients; c; c = next) {
+	/* client_send may close and unlink c. */
+	next = c->next;
+	if (c->events)
+	    client_send(c, &m);
+    }
+}
+
+static void
+con_changed_handler(ipmi_con_t   *ipmi,
+		    int          err,
+		    unsigned int port_num,
+		    int          still_connected,
+		    void         *cb_data)
+{
+    if (err) {
+	char errstr[128];
+
+	ipmi_get_error_string(err, errstr, sizeof(errstr));
+	syslog(LOG_ERR, "Connection error: %s", errstr);
+    }
+    if (still_connected && !con_up)
+	syslog(LOG_INFO, "Connection is up");
+    else if (!still_connected && con_up) {
+	syslog(LOG_ERR, "Connection is down");
+	/* Nothing we have cached can be trusted any more. */
+	cache_flush_all();
+    }
+    con_up = still_connected;
+}
+
+static void
+handle_openipmi_vlog(os_handler_t         *handler,
+		     const char           *format,
+		     enum ipmi_log_type_e log_type,
+		     va_list              ap)
+{
+    int level;
+
+    switch(log_type)
+    {
+    case IPMI_LOG_INFO: level = LOG_INFO; break;
+    case IPMI_LOG_WARNING: level = LOG_WARNING; break;
+    case IPMI_LOG_SEVERE: level = LOG_ERR; break;
+    case IPMI_LOG_FATAL: level = LOG_CRIT; break;
+    case IPMI_LOG_ERR_INFO: level = LOG_WARNING; break;
+
+    case IPMI_LOG_DEBUG_START:
+    case IPMI_LOG_DEBUG:
+    case IPMI_LOG_DEBUG_CONT:
+    case IPMI_LOG_DEBUG_END:
+	level = LOG_DEBUG;
+	break;
+    default:
+	level = LOG_NOTICE;
+    }
+
+    vsyslog(level, format, ap);
+}
+
+static void
+shutdown_handler(int sig)
+{
+    unlink(sock_path);
+    _exit(0);
+}
+
+static int
+open_listen_socket(const char *path, mode_t mode)
+{
+    struct sockaddr_un sun;
+    int                fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+	fprintf(stderr, "%s: Socket path too long: %s\n", progname, path);
+	return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1) {
+	perror("socket");
+	return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+	fprintf(stderr, "%s: Unable to bind to %s: %s\n", progname, path,
+		strerror(errno));
+	close(fd);
+	return -1;
+    }
+    if (chmod(path, mode) == -1) {
+	fprintf(stderr, "%s: Unable to set the mode of %s: %s\n", progname,
+		path, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    if (listen(fd, 16) == -1) {
+	perror("listen");
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static char *indent_str(const char *instr, const char *indent)
+{
+    int p, o;
+    int ilen = strlen(indent);
+    size_t extra = 0;
+    char *s;
+
+    for (p = 0; instr[p]; p++) {
+	if (instr[p] == '\n')
+	    extra += ilen;
+    }
+    if (extra == 0)
+	return (char *) instr;
+    s = malloc(strlen(instr) + extra + 1);
+    if (!s)
+	return NULL;
+    for (p = 0, o = 0; instr[p]; p++) {
+	s[o++] = instr[p];
+	if (instr[p] == '\n') {
+	    memcpy(s + o, indent, ilen);
+	    o += ilen;
+	}
+    }
+    s[o] = '\0';
+    return s;
+}
+
+static void con_usage(const char *name, const char *help, void *cb_data)
+{
+    char *newhelp = indent_str(help, "     ");
+
+    if (!newhelp)
+	newhelp = (char *) help;
+    printf("\n %s%s", name, newhelp);
+    if (newhelp != help)
+	free(newhelp);
+}
+
+static void
+usage(void)
+{
+    printf("Usage:\n");
+    printf(" %s [-s <path>] [-m <mode>] [-t <secs>] [-n <num>] [-d] [-b]"
+	   " <con_parms>\n", progname);
+    printf("Options are:\n");
+    printf(" -s, --socket - The socket to listen on, the default is\n");
+    printf("    %s.\n", IPMI_SMUX_DEFAULT_PATH);
+    printf(" -m, --mode - The (octal) permissions of the socket, the default\n");
+    printf("    is 0600.\n");
+    printf(" -t, --cache-time - How long to keep cached responses, in\n");
+    printf("    seconds.  The default is 60, 0 disables the cache.\n");
+    printf(" -n, --cache-size - The maximum number of cached responses,\n");
+    printf("    the default is 4096.\n");
+    printf(" -d, --debug - Enable debugging\n");
+    printf(" -b, --dont-daemonize - Run the program in foreground.\n");
+    printf("<con_parms> is the connection to share, normally \"smi 0\":");
+    ipmi_parse_args_iter_help(con_usage, NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int            rv;
+    int            curr_arg = 1;
+    ipmi_args_t    *args;
+    bool           daemonize = true;
+    mode_t         mode = 0600;
+    int            syslog_options = 0;
+    int            listen_fd;
+    os_hnd_fd_id_t *listen_id;
+    os_hnd_timer_id_t *stats_timer;
+
+    progname = argv[0];
+
+    while (curr_arg < argc && argv[curr_arg][0] == '-') {
+	int a = curr_arg;
+	curr_arg++;
+	if (strcmp(argv[a], "--") == 0)
+	    break;
+	if ((strcmp(argv[a], "-d") == 0) ||
+	    (strcmp(argv[a], "--debug") == 0)) {
+	    debug++;
+	    daemonize = false;
+	} else if ((strcmp(argv[a], "-b") == 0) ||
+		   (strcmp(argv[a], "--dont-daemonize") == 0))
+	    daemonize = false;
+	else if ((strcmp(argv[a], "-s") == 0) ||
+		 (strcmp(argv[a], "--socket") == 0)) {
+	    if (curr_arg == argc) {
+		fprintf(stderr, "-s given, but no path given\n");
+		exit(1);
+	    }
+	    sock_path = argv[curr_arg++];
+	} else if ((strcmp(argv[a], "-m") == 0) ||
+		   (strcmp(argv[a], "--mode") == 0)) {
+	    if (curr_arg == argc) {
+		fprintf(stderr, "-m given, but no mode given\n");
+		exit(1);
+	    }
+	    mode = strtoul(argv[curr_arg++], NULL, 8);
+	} else if ((strcmp(argv[a], "-t") == 0) ||
+		   (strcmp(argv[a], "--cache-time") == 0)) {
+	    if (curr_arg == argc) {
+		fprintf(stderr, "-t given, but no time given\n");
+		exit(1);
+	    }
+	    cache_ttl = strtoul(argv[curr_arg++], NULL, 0);
+	} else if ((strcmp(argv[a], "-n") == 0) ||
+		   (strcmp(argv[a], "--cache-size") == 0)) {
+	    if (curr_arg == argc) {
+		fprintf(stderr, "-n given, but no size given\n");
+		exit(1);
+	    }
+	    cache_max = strtoul(argv[curr_arg++], NULL, 0);
+	} else {
+	    fprintf(stderr, "Unknown parameter: %s\n", argv[a]);
+	    usage();
+	    exit(1);
+	}
+    }
+    if (cache_ttl == 0)
+	cache_max = 0;
+
+    os_hnd = ipmi_posix_setup_os_handler();
+    if (!os_hnd) {
+	fprintf(stderr, "%s: Unable to allocate os handler\n", progname);
+	exit(1);
+    }
+
+    /* Override the default log handler. */
+    os_hnd->set_log_handler(os_hnd, handle_openipmi_vlog);
+
+    rv = ipmi_init(os_hnd);
+    if (rv) {
+	STDERR_IPMIERR(rv, "Error in ipmi initialization");
+	exit(1);
+    }
+
+    if (curr_arg >= argc) {
+	fprintf(stderr, "No connection given\n");
+	usage();
+	exit(1);
+    }
+    rv = ipmi_parse_args2(&curr_arg, argc, argv, &args);
+    if (rv) {
+	STDERR_IPMIERR(rv, "Error parsing command arguments, argument %d",
+		       curr_arg);
+	usage();
+	exit(1);
+    }
+
+    if (debug)
+	syslog_options |= LOG_PERROR;
+
+    openlog("openipmi_smuxd", syslog_options, LOG_DAEMON);
+
+    rv = ipmi_args_setup_con(args, os_hnd, NULL, &con);
+    if (rv) {
+	STDERR_IPMIERR(rv, "Unable to set up the connection");
+	exit(1);
+    }
+    ipmi_free_args(args);
+
+    listen_fd = open_listen_socket(sock_path, mode);
+    if (listen_fd == -1)
+	exit(1);
+
+    /* Nobody else owns the SIGPIPE for us, clients going away is normal. */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, shutdown_handler);
+    signal(SIGINT, shutdown_handler);
+
+    if (daemonize) {
+	if (daemon(0, 0) == -1) {
+	    perror("Call to daemonize failed");
+	    exit(1);
+	}
+    }
+
+    rv = con->add_con_change_handler(con, con_changed_handler, NULL);
+    if (!rv)
+	rv = con->add_event_handler(con, event_handler, NULL);
+    if (!rv)
+	rv = con->start_con(con);
+    if (rv) {
+	char errstr[128];
+
+	ipmi_get_error_string(rv, errstr, sizeof(errstr));
+	syslog(LOG_CRIT, "Unable to start the connection: %s", errstr);
+	unlink(sock_path);
+	exit(1);
+    }
+
+    rv = os_hnd->add_fd_to_wait_for(os_hnd, listen_fd, listen_data_ready,
+				    NULL, NULL, &listen_id);
+    if (rv) {
+	syslog(LOG_CRIT, "Unable to wait on the socket: %s", strerror(rv));
+	unlink(sock_path);
+	exit(1);
+    }
+
+    if (debug && !os_hnd->alloc_timer(os_hnd, &stats_timer)) {
+	struct timeval tv = { 10, 0 };
+
+	os_hnd->start_timer(os_hnd, stats_timer, &tv, cache_stats_timeout,
+			    NULL);
+    }
+
+    /* Let the selector code run the select loop. */
+    os_hnd->operation_loop(os_hnd);
+
+    /* Technically, we can't get here, but just to be sure... */
+    os_hnd->free_os_handler(os_hnd);
+    return 0;
+}
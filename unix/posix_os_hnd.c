@@ -44,12 +44,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #ifdef HAVE_GDBM
 #include <gdbm.h>
 #endif
 
 #include <OpenIPMI/ipmi_posix.h>
 
+#include "posix_random.h"
+
 typedef struct iposix_info_s
 {
     struct selector_s *sel;
@@ -290,30 +293,19 @@ free_timer(os_handler_t *handler, os_hnd_timer_id_t *timer_data)
     return 0;
 }
 
+/* This os handler is single-threaded, so one generator will do. */
+static posix_rand_t rand_state;
+static int rand_atfork_registered;
+
 static int
 get_random(os_handler_t *handler, void *data, unsigned int len)
 {
-    int fd = open("/dev/urandom", O_RDONLY);
-    int rv = 0;
-
-    if (fd == -1)
-	return errno;
-
-    while (len > 0) {
-	rv = read(fd, data, len);
-	if (rv < 0) {
-	    rv = errno;
-	    goto out;
-	}
-	len -= rv;
-	data += rv;
+    if (!rand_atfork_registered) {
+	pthread_atfork(NULL, NULL, posix_rand_forked);
+	rand_atfork_registered = 1;
     }
 
-    rv = 0;
-
- out:
-    close(fd);
-    return rv;
+    return posix_rand_bytes(&rand_state, data, len);
 }
 
 static void
@@ -0,0 +1,249 @@
+/*
+ * A buffered ChaCha20 random number generator for the os handlers.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ * Copyright 2002 MontaVista Software Inc.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Random numbers for the os handlers' get_random().  Instead of
+ * reading /dev/urandom for every request, a ChaCha20 keystream is
+ * generated a block at a time, keyed from the kernel.  The first part
+ * of every block becomes the key for the next one and the output is
+ * wiped from the buffer as it is handed out, so a dump of the state
+ * cannot be used to recover earlier output.  The key is refreshed
+ * from the kernel every POSIX_RAND_RESEED bytes.
+ *
+ * The state is not locked; the includer must keep a state per thread
+ * (or only use it from one thread).  The includer must also arrange
+ * for posix_rand_forked() to be called in the child after a fork
+ * (with pthread_atfork()), so the child does not hand out the same
+ * numbers as the parent.
+ *
+ * This file is included, not compiled separately, like heap.h.
+ */
+
+#ifndef POSIX_RANDOM_H
+#define POSIX_RANDOM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(HAVE_GETRANDOM) && defined(HAVE_SYS_RANDOM_H)
+#include <sys/random.h>
+#endif
+
+#define POSIX_RAND_BLOCKS	16	/* 64-byte ChaCha20 blocks per refill */
+#define POSIX_RAND_KEYLEN	32
+#define POSIX_RAND_RESEED	(1024 * 1024)
+
+typedef struct posix_rand_s
+{
+    int           seeded;
+    unsigned int  fork_gen;
+    unsigned long since_reseed;
+    uint32_t      key[POSIX_RAND_KEYLEN / 4];
+    unsigned int  avail; /* Unused bytes at the end of buf. */
+    unsigned char buf[POSIX_RAND_BLOCKS * 64];
+} posix_rand_t;
+
+static volatile unsigned int posix_rand_fork_gen;
+
+static void
+posix_rand_forked(void)
+{
+    posix_rand_fork_gen++;
+}
+
+#define POSIX_RAND_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define POSIX_RAND_QR(a, b, c, d)			\
+    do {						\
+	a += b; d ^= a; d = POSIX_RAND_ROTL(d, 16);	\
+	c += d; b ^= c; b = POSIX_RAND_ROTL(b, 12);	\
+	a += b; d ^= a; d = POSIX_RAND_ROTL(d, 8);	\
+	c += d; b ^= c; b = POSIX_RAND_ROTL(b, 7);	\
+    } while (0)
+
+/* The ChaCha20 block function (RFC 7539 section 2.3). */
+static void
+posix_rand_chacha_block(const uint32_t in[16], unsigned char *out)
+{
+    uint32_t     x[16];
+    unsigned int i;
+
+    memcpy(x, in, sizeof(x));
+    for (i = 0; i < 10; i++) {
+	POSIX_RAND_QR(x[0], x[4], x[8], x[12]);
+	POSIX_RAND_QR(x[1], x[5], x[9], x[13]);
+	POSIX_RAND_QR(x[2], x[6], x[10], x[14]);
+	POSIX_RAND_QR(x[3], x[7], x[11], x[15]);
+	POSIX_RAND_QR(x[0], x[5], x[10], x[15]);
+	POSIX_RAND_QR(x[1], x[6], x[11], x[12]);
+	POSIX_RAND_QR(x[2], x[7], x[8], x[13]);
+	POSIX_RAND_QR(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++) {
+	uint32_t v = x[i] + in[i];
+
+	out[i * 4] = v;
+	out[i * 4 + 1] = v >> 8;
+	out[i * 4 + 2] = v >> 16;
+	out[i * 4 + 3] = v >> 24;
+    }
+    memset(x, 0, sizeof(x));
+}
+
+static int
+posix_rand_kernel(void *data, unsigned int len)
+{
+    unsigned char *p = data;
+    int           rv;
+#if defined(HAVE_GETRANDOM) && defined(HAVE_SYS_RANDOM_H)
+
+    while (len > 0) {
+	rv = getrandom(p, len, 0);
+	if (rv < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == ENOSYS)
+		break; /* Old kernel, use the device. */
+	    return errno;
+	}
+	len -= rv;
+	p += rv;
+    }
+    if (len == 0)
+	return 0;
+#endif
+    {
+	int fd = open("/dev/urandom", O_RDONLY);
+
+	if (fd == -1)
+	    return errno;
+	while (len > 0) {
+	    rv = read(fd, p, len);
+	    if (rv <= 0) {
+		if (rv < 0 && errno == EINTR)
+		    continue;
+		rv = rv < 0 ? errno : EIO;
+		close(fd);
+		return rv;
+	    }
+	    len -= rv;
+	    p += rv;
+	}
+	close(fd);
+    }
+    return 0;
+}
+
+static int
+posix_rand_seed(posix_rand_t *r)
+{
+    unsigned char seed[POSIX_RAND_KEYLEN];
+    unsigned int  i;
+    int           rv;
+
+    rv = posix_rand_kernel(seed, sizeof(seed));
+    if (rv)
+	return rv;
+    for (i = 0; i < POSIX_RAND_KEYLEN / 4; i++)
+	r->key[i] = (seed[i * 4] | (seed[i * 4 + 1] << 8)
+		     | (seed[i * 4 + 2] << 16)
+		     | ((uint32_t) seed[i * 4 + 3] << 24));
+    memset(seed, 0, sizeof(seed));
+
+    /* Throw away anything generated from the old key. */
+    memset(r->buf, 0, sizeof(r->buf));
+    r->avail = 0;
+    r->since_reseed = 0;
+    r->fork_gen = posix_rand_fork_gen;
+    r->seeded = 1;
+    return 0;
+}
+
+static void
+posix_rand_refill(posix_rand_t *r)
+{
+    uint32_t     in[16];
+    unsigned int i;
+
+    in[0] = 0x61707865; /* "expand 32-byte k" */
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    memcpy(in + 4, r->key, sizeof(r->key));
+    in[13] = in[14] = in[15] = 0; /* Nonce, the key is never reused */
+    for (i = 0; i < POSIX_RAND_BLOCKS; i++) {
+	in[12] = i;
+	posix_rand_chacha_block(in, r->buf + i * 64);
+    }
+    memset(in, 0, sizeof(in));
+
+    /* Take the next key from the front of the output and wipe it. */
+    for (i = 0; i < POSIX_RAND_KEYLEN / 4; i++)
+	r->key[i] = (r->buf[i * 4] | (r->buf[i * 4 + 1] << 8)
+		     | (r->buf[i * 4 + 2] << 16)
+		     | ((uint32_t) r->buf[i * 4 + 3] << 24));
+    memset(r->buf, 0, POSIX_RAND_KEYLEN);
+    r->avail = sizeof(r->buf) - POSIX_RAND_KEYLEN;
+}
+
+static int
+posix_rand_bytes(posix_rand_t *r, void *data, unsigned int len)
+{
+    unsigned char *p = data;
+    unsigned char *src;
+    unsigned int  n;
+    int           rv;
+
+    if (!r->seeded || r->fork_gen != posix_rand_fork_gen
+	|| r->since_reseed >= POSIX_RAND_RESEED)
+    {
+	rv = posix_rand_seed(r);
+	if (rv)
+	    return rv;
+    }
+
+    r->since_reseed += len;
+    while (len > 0) {
+	if (r->avail == 0)
+	    posix_rand_refill(r);
+	n = len < r->avail ? len : r->avail;
+	src = r->buf + sizeof(r->buf) - r->avail;
+	memcpy(p, src, n);
+	memset(src, 0, n);
+	r->avail -= n;
+	len -= n;
+	p += n;
+    }
+    return 0;
+}
+
+#endif /* POSIX_RANDOM_H */
@@ -56,6 +56,9 @@
 #include <OpenIPMI/ipmi_posix.h>
 
 #include <OpenIPMI/internal/ipmi_int.h>
+#include <OpenIPMI/internal/ipmi_stat.h>
+
+#include "posix_random.h"
 
 static void i_posix_lock(pthread_mutex_t *lock)
 {
@@ -73,12 +76,38 @@ static void i_posix_unlock(pthread_mutex_t *lock)
 	abort();
 }
 
+/*
+ * Locks that are known not to be claimed recursively can use a
+ * plain mutex, which is cheaper to claim and will spin a bit before
+ * sleeping.
+ */
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+#define PT_LEAF_MUTEX_TYPE PTHREAD_MUTEX_ADAPTIVE_NP
+#else
+#define PT_LEAF_MUTEX_TYPE PTHREAD_MUTEX_NORMAL
+#endif
+
+/* Contention statistics for one class of locks, in nanoseconds. */
+typedef struct pt_lock_class_s
+{
+    unsigned long    contended;
+    ipmi_stat_hist_t wait_ns;
+    ipmi_stat_hist_t hold_ns;
+} pt_lock_class_t;
+
+static const char *pt_lock_class_names[IPMI_POSIX_NUM_LOCK_CLASSES] =
+{
+    "general", "leaf", "selector"
+};
+
 typedef struct pt_os_hnd_data_s
 {
     struct selector_s *sel;
     os_vlog_t        log_handler;
     int              wake_sig;
     struct sigaction oldact;
+    unsigned int     flags;
+    pt_lock_class_t  lock_classes[IPMI_POSIX_NUM_LOCK_CLASSES];
 #ifdef HAVE_GDBM
     char *gdbm_filename;
     GDBM_FILE gdbmf;
@@ -291,30 +320,47 @@ free_timer(os_handler_t *handler, os_hnd_timer_id_t *timer_data)
     return 0;
 }
 
-static int
-get_random(os_handler_t *handler, void *data, unsigned int len)
+/* Each thread gets its own generator, see posix_random.h. */
+static pthread_once_t rand_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rand_key;
+static int rand_key_err;
+
+static void
+rand_state_free(void *data)
 {
-    int fd = open("/dev/urandom", O_RDONLY);
-    int rv;
+    memset(data, 0, sizeof(posix_rand_t));
+    free(data);
+}
 
-    if (fd == -1)
-	return errno;
+static void
+rand_init(void)
+{
+    rand_key_err = pthread_key_create(&rand_key, rand_state_free);
+    pthread_atfork(NULL, NULL, posix_rand_forked);
+}
 
-    while (len > 0) {
-	rv = read(fd, data, len);
-	if (rv < 0) {
-	    rv = errno;
-	    goto out;
+static int
+get_random(os_handler_t *handler, void *data, unsigned int len)
+{
+    posix_rand_t *r;
+
+    pthread_once(&rand_once, rand_init);
+    if (rand_key_err)
+	return rand_key_err;
+
+    r = pthread_getspecific(rand_key);
+    if (!r) {
+	r = malloc(sizeof(*r));
+	if (!r)
+	    return ENOMEM;
+	memset(r, 0, sizeof(*r));
+	if (pthread_setspecific(rand_key, r)) {
+	    free(r);
+	    return ENOMEM;
 	}
-	len -= rv;
-	data += rv;
     }
 
-    rv = 0;
-
- out:
-    close(fd);
-    return rv;
+    return posix_rand_bytes(r, data, len);
 }
 
 static void
@@ -397,15 +443,37 @@ sposix_log(os_handler_t         *handler,
 struct os_hnd_lock_s
 {
     pthread_mutex_t mutex;
+
+    /* Only set if lock statistics are enabled.  The rest is only
+       touched by the thread holding the lock. */
+    pt_lock_class_t *lclass;
+    unsigned int    depth;
+    unsigned long   acquired;
 };
 
+static unsigned long
+pt_lock_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
 static int
-create_lock(os_handler_t  *handler,
-	    os_hnd_lock_t **id)
+create_lock_class(os_handler_t  *handler,
+		  os_hnd_lock_t **id,
+		  unsigned int  lclass)
 {
-    os_hnd_lock_t *lock;
+    pt_os_hnd_data_t    *info = handler->internal_data;
+    os_hnd_lock_t       *lock;
     pthread_mutexattr_t attr;
-    int           rv;
+    int                 type = PTHREAD_MUTEX_RECURSIVE;
+    int                 rv;
+
+    if ((lclass != IPMI_POSIX_LOCK_CLASS_GENERAL)
+	&& (info->flags & IPMI_POSIX_THREAD_LEAF_LOCKS))
+	type = PT_LEAF_MUTEX_TYPE;
 
     lock = malloc(sizeof(*lock));
     if (!lock)
@@ -413,13 +481,17 @@ create_lock(os_handler_t  *handler,
     rv = pthread_mutexattr_init(&attr);
     if (rv)
 	goto out_err;
-    rv = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    rv = pthread_mutexattr_settype(&attr, type);
     if (rv)
 	goto out_err_destroy;
     rv = pthread_mutex_init(&lock->mutex, &attr);
     if (rv)
 	goto out_err_destroy;
     pthread_mutexattr_destroy(&attr);
+    lock->lclass = NULL;
+    if (info->flags & IPMI_POSIX_THREAD_LOCK_STATS)
+	lock->lclass = &info->lock_classes[lclass];
+    lock->depth = 0;
     *id = lock;
     return 0;
 
@@ -430,6 +502,20 @@ create_lock(os_handler_t  *handler,
     return rv;
 }
 
+static int
+create_lock(os_handler_t  *handler,
+	    os_hnd_lock_t **id)
+{
+    return create_lock_class(handler, id, IPMI_POSIX_LOCK_CLASS_GENERAL);
+}
+
+static int
+create_nr_lock(os_handler_t  *handler,
+	       os_hnd_lock_t **id)
+{
+    return create_lock_class(handler, id, IPMI_POSIX_LOCK_CLASS_LEAF);
+}
+
 static int
 destroy_lock(os_handler_t  *handler,
 	     os_hnd_lock_t *id)
@@ -447,7 +533,31 @@ static int
 lock(os_handler_t  *handler,
      os_hnd_lock_t *id)
 {
-    i_posix_lock(&id->mutex);
+    pt_lock_class_t *lc = id->lclass;
+    unsigned long   start, now;
+    int             rv;
+
+    if (!lc) {
+	i_posix_lock(&id->mutex);
+	return 0;
+    }
+
+    rv = pthread_mutex_trylock(&id->mutex);
+    if (rv == 0) {
+	now = pt_lock_now();
+	start = now;
+    } else if (rv == EBUSY) {
+	start = pt_lock_now();
+	i_posix_lock(&id->mutex);
+	now = pt_lock_now();
+	ipmi_stat_atomic_add(&lc->contended, 1);
+    } else {
+	abort();
+    }
+    if (id->depth++ == 0) {
+	id->acquired = now;
+	ipmi_stat_hist_add(&lc->wait_ns, now - start);
+    }
     return 0;
 }
 
@@ -455,10 +565,91 @@ static int
 unlock(os_handler_t  *handler,
        os_hnd_lock_t *id)
 {
+    pt_lock_class_t *lc = id->lclass;
+
+    if (lc && (--id->depth == 0))
+	ipmi_stat_hist_add(&lc->hold_ns, pt_lock_now() - id->acquired);
     i_posix_unlock(&id->mutex);
     return 0;
 }
 
+struct os_hnd_rwlock_s
+{
+    pthread_rwlock_t rwlock;
+};
+
+static int
+create_rwlock(os_handler_t    *handler,
+	      os_hnd_rwlock_t **id)
+{
+    os_hnd_rwlock_t *lock;
+    int             rv;
+
+    lock = malloc(sizeof(*lock));
+    if (!lock)
+	return ENOMEM;
+    rv = pthread_rwlock_init(&lock->rwlock, NULL);
+    if (rv) {
+	free(lock);
+	return rv;
+    }
+    *id = lock;
+    return 0;
+}
+
+static int
+destroy_rwlock(os_handler_t    *handler,
+	       os_hnd_rwlock_t *id)
+{
+    int rv;
+
+    rv = pthread_rwlock_destroy(&id->rwlock);
+    if (rv)
+	return rv;
+    free(id);
+    return 0;
+}
+
+static int
+read_lock(os_handler_t    *handler,
+	  os_hnd_rwlock_t *id)
+{
+    int rv = pthread_rwlock_rdlock(&id->rwlock);
+
+    if (rv)
+	abort();
+    return 0;
+}
+
+static int
+read_unlock(os_handler_t    *handler,
+	    os_hnd_rwlock_t *id)
+{
+    int rv = pthread_rwlock_unlock(&id->rwlock);
+
+    if (rv)
+	abort();
+    return 0;
+}
+
+static int
+write_lock(os_handler_t    *handler,
+	   os_hnd_rwlock_t *id)
+{
+    int rv = pthread_rwlock_wrlock(&id->rwlock);
+
+    if (rv)
+	abort();
+    return 0;
+}
+
+static int
+write_unlock(os_handler_t    *handler,
+	     os_hnd_rwlock_t *id)
+{
+    return read_unlock(handler, id);
+}
+
 struct os_hnd_cond_s
 {
     pthread_cond_t cond;
@@ -519,7 +710,12 @@ cond_wait(os_handler_t  *handler,
 {
     int       rv;
 
+    if (lock->lclass)
+	ipmi_stat_hist_add(&lock->lclass->hold_ns,
+			   pt_lock_now() - lock->acquired);
     rv = pthread_cond_wait(&cond->cond, &lock->mutex);
+    if (lock->lclass)
+	lock->acquired = pt_lock_now();
     return rv;
 }
 
@@ -543,7 +739,12 @@ cond_timedwait(os_handler_t   *handler,
 	spec.tv_sec += 1;
 	spec.tv_nsec -= 1000000000;
     }
+    if (lock->lclass)
+	ipmi_stat_hist_add(&lock->lclass->hold_ns,
+			   pt_lock_now() - lock->acquired);
     rv = pthread_cond_timedwait(&cond->cond, &lock->mutex, &spec);
+    if (lock->lclass)
+	lock->acquired = pt_lock_now();
     return rv;
 }
 
@@ -861,6 +1062,12 @@ static os_handler_t ipmi_posix_thread_os_handler =
     .destroy_lock = destroy_lock,
     .lock = lock,
     .unlock = unlock,
+    .create_rwlock = create_rwlock,
+    .destroy_rwlock = destroy_rwlock,
+    .read_lock = read_lock,
+    .read_unlock = read_unlock,
+    .write_lock = write_lock,
+    .write_unlock = write_unlock,
     .get_random = get_random,
     .log = sposix_log,
     .vlog = sposix_vlog,
@@ -883,7 +1090,8 @@ static os_handler_t ipmi_posix_thread_os_handler =
 #endif
     .set_log_handler = sset_log_handler,
     .get_monotonic_time = get_monotonic_time,
-    .get_real_time = get_real_time
+    .get_real_time = get_real_time,
+    .create_nr_lock = create_nr_lock
 };
 
 os_handler_t *
@@ -945,7 +1153,8 @@ slock_alloc(void *cb_data)
     if (!l)
 	return NULL;
     l->os_hnd = os_hnd;
-    if (os_hnd->create_lock(os_hnd, &l->lock)) {
+    /* The selector never holds its locks while calling out. */
+    if (create_lock_class(os_hnd, &l->lock, IPMI_POSIX_LOCK_CLASS_SELECTOR)) {
 	os_hnd->mem_free(l);
 	l = NULL;
     }
@@ -972,7 +1181,7 @@ slock_unlock(sel_lock_t *l)
 }
 
 os_handler_t *
-ipmi_posix_thread_setup_os_handler(int wake_sig)
+ipmi_posix_thread_setup_os_handler2(int wake_sig, unsigned int flags)
 {
     os_handler_t     *os_hnd;
     pt_os_hnd_data_t *info;
@@ -984,6 +1193,7 @@ ipmi_posix_thread_setup_os_handler(int wake_sig)
 	return NULL;
 
     info = os_hnd->internal_data;
+    info->flags = flags;
 
     rv = sel_alloc_selector_thread(&info->sel, wake_sig,
 				   slock_alloc, slock_free,
@@ -1008,6 +1218,45 @@ ipmi_posix_thread_setup_os_handler(int wake_sig)
     return os_hnd;
 }
 
+os_handler_t *
+ipmi_posix_thread_setup_os_handler(int wake_sig)
+{
+    return ipmi_posix_thread_setup_os_handler2(wake_sig, 0);
+}
+
+int
+ipmi_posix_thread_get_lock_stats(os_handler_t            *os_hnd,
+				 unsigned int            lclass,
+				 ipmi_posix_lock_stats_t *stats,
+				 int                     zero)
+{
+    pt_os_hnd_data_t *info = os_hnd->internal_data;
+    pt_lock_class_t  *lc;
+    ipmi_stat_hist_t wait, hold;
+
+    if (lclass >= IPMI_POSIX_NUM_LOCK_CLASSES)
+	return EINVAL;
+    if (!(info->flags & IPMI_POSIX_THREAD_LOCK_STATS))
+	return ENOSYS;
+
+    lc = &info->lock_classes[lclass];
+    ipmi_stat_hist_snapshot(&lc->wait_ns, &wait, zero);
+    ipmi_stat_hist_snapshot(&lc->hold_ns, &hold, zero);
+    stats->name = pt_lock_class_names[lclass];
+    stats->acquires = wait.count;
+    if (zero)
+	stats->contended = ipmi_stat_atomic_xchg(&lc->contended, 0);
+    else
+	stats->contended = ipmi_stat_atomic_load(&lc->contended);
+    stats->wait_ns_total = wait.sum;
+    stats->wait_ns_max = wait.max;
+    stats->wait_ns_p99 = ipmi_stat_hist_percentile(&wait, 99);
+    stats->hold_ns_total = hold.sum;
+    stats->hold_ns_max = hold.max;
+    stats->hold_ns_p99 = ipmi_stat_hist_percentile(&hold, 99);
+    return 0;
+}
+
 /*
  * Cruft below, do not use these any more.
  */
@@ -1516,12 +1516,18 @@ slock_alloc(void *cb_data)
 {
     os_handler_t *os_hnd = cb_data;
     sel_lock_t *l;
+    int rv;
 
     l = os_hnd->mem_alloc(sizeof(*l));
     if (!l)
 	return NULL;
     l->os_hnd = os_hnd;
-    if (os_hnd->create_lock(os_hnd, &l->lock)) {
+    /* The selector never holds its locks while calling out. */
+    if (os_hnd->create_nr_lock)
+	rv = os_hnd->create_nr_lock(os_hnd, &l->lock);
+    else
+	rv = os_hnd->create_lock(os_hnd, &l->lock);
+    if (rv) {
 	os_hnd->mem_free(l);
 	l = NULL;
     }
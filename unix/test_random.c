@@ -0,0 +1,235 @@
+/*
+ * test_random.c
+ *
+ * Tests and a benchmark for the os handler random number generator.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ * Copyright 2002 MontaVista Software Inc.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <OpenIPMI/os_handler.h>
+#include <OpenIPMI/ipmi_posix.h>
+
+#include "posix_random.h"
+
+/* RFC 7539 section 2.3.2 */
+static const unsigned char chacha_expect[64] = {
+    0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+    0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+    0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03,
+    0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+    0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09,
+    0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+    0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9,
+    0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e
+};
+
+static int
+test_chacha(void)
+{
+    uint32_t      in[16];
+    unsigned char out[64];
+    unsigned int  i;
+
+    in[0] = 0x61707865;
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    for (i = 0; i < 8; i++)
+	in[4 + i] = ((i * 4) | ((i * 4 + 1) << 8) | ((i * 4 + 2) << 16)
+		     | ((i * 4 + 3) << 24));
+    in[12] = 1;
+    in[13] = 0x09000000;
+    in[14] = 0x4a000000;
+    in[15] = 0;
+    posix_rand_chacha_block(in, out);
+    if (memcmp(out, chacha_expect, sizeof(out)) != 0) {
+	fprintf(stderr, "ChaCha20 block does not match RFC 7539\n");
+	return 1;
+    }
+    return 0;
+}
+
+/* Run a generator across a refill and through a fork notification. */
+static int
+test_generator(void)
+{
+    posix_rand_t  r;
+    unsigned char a[700], b[700];
+
+    memset(&r, 0, sizeof(r));
+    if (posix_rand_bytes(&r, a, sizeof(a))
+	|| posix_rand_bytes(&r, b, sizeof(b)))
+    {
+	fprintf(stderr, "Unable to get random data\n");
+	return 1;
+    }
+    if (memcmp(a, b, sizeof(a)) == 0) {
+	fprintf(stderr, "Generator repeated its output\n");
+	return 1;
+    }
+
+    posix_rand_forked();
+    if (posix_rand_bytes(&r, a, 16))
+	return 1;
+    if (r.fork_gen != posix_rand_fork_gen || r.since_reseed != 16) {
+	fprintf(stderr, "Generator did not reseed after a fork\n");
+	return 1;
+    }
+    return 0;
+}
+
+/* A fork must not make the child repeat the parent's numbers. */
+static int
+test_fork(os_handler_t *os_hnd)
+{
+    unsigned char parent[16], child[16];
+    int           pfd[2];
+    pid_t         pid;
+    int           status;
+
+    /* Get the buffer going so there is something to repeat. */
+    if (os_hnd->get_random(os_hnd, parent, sizeof(parent)))
+	return 1;
+
+    if (pipe(pfd) == -1)
+	return 1;
+    pid = fork();
+    if (pid == -1)
+	return 1;
+    if (pid == 0) {
+	if (os_hnd->get_random(os_hnd, child, sizeof(child)))
+	    _exit(1);
+	if (write(pfd[1], child, sizeof(child)) != sizeof(child))
+	    _exit(1);
+	_exit(0);
+    }
+    if (os_hnd->get_random(os_hnd, parent, sizeof(parent)))
+	return 1;
+    if (read(pfd[0], child, sizeof(child)) != sizeof(child))
+	return 1;
+    waitpid(pid, &status, 0);
+    close(pfd[0]);
+    close(pfd[1]);
+    if (memcmp(parent, child, sizeof(parent)) == 0) {
+	fprintf(stderr, "Child after fork repeated the parent's output\n");
+	return 1;
+    }
+    return 0;
+}
+
+/* What get_random() used to do. */
+static int
+urandom_per_call(void *data, unsigned int len)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+    int rv = 0;
+
+    if (fd == -1)
+	return errno;
+    if (read(fd, data, len) != (int) len)
+	rv = EIO;
+    close(fd);
+    return rv;
+}
+
+static double
+now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/* 16 bytes at a time, the size of an RMCP+ IV. */
+static int
+bench(const char *name, os_handler_t *os_hnd, unsigned int count)
+{
+    unsigned char buf[16];
+    unsigned int  i;
+    double        start, end;
+    int           rv;
+
+    start = now_us();
+    for (i = 0; i < count; i++) {
+	if (os_hnd)
+	    rv = os_hnd->get_random(os_hnd, buf, sizeof(buf));
+	else
+	    rv = urandom_per_call(buf, sizeof(buf));
+	if (rv) {
+	    fprintf(stderr, "%s failed: %s\n", name, strerror(rv));
+	    return 1;
+	}
+    }
+    end = now_us();
+    printf("%-24s %8.3f us per 16 bytes\n", name, (end - start) / count);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    os_handler_t *os_hnd, *thread_os_hnd;
+    unsigned int count = 20000;
+    int          rv = 0;
+
+    if (argc > 1)
+	count = strtoul(argv[1], NULL, 0);
+
+    os_hnd = ipmi_posix_setup_os_handler();
+    thread_os_hnd = ipmi_posix_thread_setup_os_handler(SIGUSR1);
+    if (!os_hnd || !thread_os_hnd) {
+	fprintf(stderr, "Unable to allocate os handlers\n");
+	return 1;
+    }
+
+    rv |= test_chacha();
+    rv |= test_generator();
+    rv |= test_fork(os_hnd);
+    rv |= test_fork(thread_os_hnd);
+
+    rv |= bench("open/read/close", NULL, count);
+    rv |= bench("posix get_random", os_hnd, count * 10);
+    rv |= bench("pthread get_random", thread_os_hnd, count * 10);
+
+    os_hnd->free_os_handler(os_hnd);
+    thread_os_hnd->free_os_handler(thread_os_hnd);
+    return rv;
+}
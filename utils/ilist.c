@@ -67,7 +67,7 @@ alloc_ilist(void)
     if (!rv)
 	return NULL;
 
-    rv->head = ilist_mem_alloc(sizeof(*(rv->head)));
+    rv->head = ilist_item_mem_alloc();
     if (!rv->head) {
 	ilist_mem_free(rv);
 	return NULL;
@@ -104,10 +104,10 @@ void free_ilist(ilist_t *list)
     while (curr != list->head) {
 	next = curr->next;
 	if (curr->malloced)
-	    ilist_mem_free(curr);
+	    ilist_item_mem_free(curr);
 	curr = next;
     }
-    ilist_mem_free(list->head);
+    ilist_item_mem_free(list->head);
     ilist_mem_free(list);
 }
 
@@ -126,7 +126,7 @@ add_after(ilist_item_t *pos, void *item, ilist_item_t *entry)
 	new_item = entry;
 	new_item->malloced = 0;
     } else {
-	new_item = ilist_mem_alloc(sizeof(*new_item));
+	new_item = ilist_item_mem_alloc();
 	if (!new_item)
 	    return 0;
 	new_item->malloced = 1;
@@ -149,7 +149,7 @@ add_before(ilist_item_t *pos, void *item, ilist_item_t *entry)
 	new_item = entry;
 	new_item->malloced = 0;
     } else {
-	new_item = ilist_mem_alloc(sizeof(*new_item));
+	new_item = ilist_item_mem_alloc();
 	if (!new_item)
 	    return 0;
 	new_item->malloced = 1;
@@ -249,7 +249,7 @@ ilist_delete(ilist_iter_t *iter)
     curr->next->prev = curr->prev;
     curr->prev->next = curr->next;
     if (curr->malloced)
-	ilist_mem_free(curr);
+	ilist_item_mem_free(curr);
     return 1;
 }
 
@@ -374,7 +374,7 @@ ilist_remove_first(ilist_t *list)
     curr->prev->next = curr->next;
     item = curr->item;
     if (curr->malloced)
-	ilist_mem_free(curr);
+	ilist_item_mem_free(curr);
     return item;
 }
 
@@ -392,7 +392,7 @@ ilist_remove_last(ilist_t *list)
     curr->prev->next = curr->next;
     item = curr->item;
     if (curr->malloced)
-	ilist_mem_free(curr);
+	ilist_item_mem_free(curr);
     return item;
 }
 
@@ -413,7 +413,7 @@ ilist_remove_item_from_list(ilist_t *list, void *item)
     curr->next->prev = curr->prev;
     curr->prev->next = curr->next;
     if (curr->malloced)
-	ilist_mem_free(curr);
+	ilist_item_mem_free(curr);
     return 1;
 }
 
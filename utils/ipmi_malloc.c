@@ -55,6 +55,11 @@
 
 #include <config.h>
 #include <string.h>
+#include <errno.h>
+#if defined(HAVE_TLS_VARS) && defined(HAVE_PTHREAD_KEY_CREATE)
+#include <pthread.h>
+#define MEM_CACHE_THREAD_EXIT
+#endif
 
 #ifdef HAVE_EXECINFO_H
 #include <execinfo.h> /* For backtrace() */
@@ -64,6 +69,7 @@
 #include <OpenIPMI/os_handler.h>
 
 #include <OpenIPMI/internal/ipmi_malloc.h>
+#include <OpenIPMI/internal/ipmi_stat.h>
 #include <OpenIPMI/internal/ilist.h>
 
 IPMI_UTILS_DLL_PUBLIC
@@ -422,6 +428,617 @@ ipmi_mem_free(void *data)
 	malloc_os_hnd->mem_free(data);
 }
 
+/*
+ * Object caches.  Each size class has a depot, a free list of objects
+ * carved out of slabs, protected by a lock from the OS handler (if it
+ * has locks).  With thread-local variables, each thread keeps a
+ * magazine of free objects per class in front of the depot; it is
+ * refilled or drained half a magazine at a time, so a steady
+ * alloc/free pattern stays in the magazine and takes no lock and no
+ * atomic operation.  The magazines are allocated the first time a
+ * thread uses a cache.  With pthread keys, a thread that exits gives
+ * its magazines' objects back to the depots and its counts to the
+ * caches; otherwise they stay with the thread until shutdown.
+ */
+#define MEM_CACHE_SLAB_SIZE	16384
+#define MEM_CACHE_ALIGN		16
+#define MEM_CACHE_MAG_SIZE	32
+#define MEM_CACHE_COUNT_BATCH	(MEM_CACHE_MAG_SIZE / 2)
+
+/* Caches past this many are counted with atomic operations and do not
+   use the magazines. */
+#define MEM_CACHE_MAX_COUNTED	64
+
+static const unsigned int mem_cache_sizes[] =
+{
+    32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+#define MEM_CACHE_NUM_CLASSES \
+	((int) (sizeof(mem_cache_sizes) / sizeof(mem_cache_sizes[0])))
+
+typedef struct mem_cache_obj_s
+{
+    struct mem_cache_obj_s *next;
+} mem_cache_obj_t;
+
+/* At the beginning of each slab, the objects follow it. */
+typedef struct mem_cache_slab_s
+{
+    struct mem_cache_slab_s *next;
+} mem_cache_slab_t;
+#define MEM_CACHE_SLAB_HDR \
+	((sizeof(mem_cache_slab_t) + MEM_CACHE_ALIGN - 1) \
+	 & ~((size_t) MEM_CACHE_ALIGN - 1))
+
+typedef struct mem_cache_class_s
+{
+    os_handler_t     *os_hnd;
+    os_hnd_lock_t    *lock;
+    mem_cache_obj_t  *free_list;
+    mem_cache_slab_t *slabs;
+    unsigned long    num_slabs;
+} mem_cache_class_t;
+
+static mem_cache_class_t mem_cache_classes[MEM_CACHE_NUM_CLASSES];
+
+/* Registered caches, only ever pushed on the front so the report can
+   walk it without the lock. */
+static ipmi_mem_cache_t *mem_caches;
+static int mem_cache_count;
+static os_hnd_lock_t *mem_cache_reg_lock;
+
+/* Bumped when the slabs and magazines are freed, so a thread does not
+   use the magazines it had from before. */
+static unsigned int mem_cache_gen = 1;
+
+#ifdef HAVE_TLS_VARS
+typedef struct mem_cache_mag_s
+{
+    unsigned int count;
+    void         *objs[MEM_CACHE_MAG_SIZE];
+} mem_cache_mag_t;
+
+/*
+ * A thread's magazines, and its allocation counts per cache that have
+ * not been added into the cache yet.  The counts are added in when
+ * in_use gets MEM_CACHE_COUNT_BATCH away from zero, which keeps the
+ * cache's count within a batch per thread of the truth.  in_use goes
+ * negative here when objects are freed by a different thread than
+ * allocated them.  high_water is the most objects in use the thread
+ * has seen, the cache's count plus its own; the report takes the
+ * largest over all the threads.
+ */
+
+typedef struct mem_cache_mags_s
+{
+    struct mem_cache_mags_s *next;
+    mem_cache_mag_t         mag[MEM_CACHE_NUM_CLASSES];
+    long                    in_use[MEM_CACHE_MAX_COUNTED];
+    long                    high_water[MEM_CACHE_MAX_COUNTED];
+    unsigned long           allocs[MEM_CACHE_MAX_COUNTED];
+} mem_cache_mags_t;
+
+/* All the magazines ever handed to a thread. */
+static mem_cache_mags_t *mem_cache_all_mags;
+
+/*
+ * Only a pointer is kept in thread-local storage, so it can use the
+ * initial-exec model (a plain load off the thread pointer instead of
+ * a call to __tls_get_addr) without taking much of the static TLS
+ * space a dlopen()ed library has to fit in.
+ */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define MEM_CACHE_TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define MEM_CACHE_TLS_MODEL
+#endif
+
+typedef struct mem_cache_tls_s
+{
+    unsigned int     gen;
+    mem_cache_mags_t *mags;
+} mem_cache_tls_t;
+
+static __thread mem_cache_tls_t mem_cache_tls MEM_CACHE_TLS_MODEL;
+
+#ifdef MEM_CACHE_THREAD_EXIT
+/* Holds a thread's magazines so they are given back when it exits. */
+static pthread_key_t mem_cache_key;
+static int mem_cache_key_valid;
+#endif
+#endif
+
+#ifdef HAVE_GCC_ATOMICS
+#define mem_cache_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define mem_cache_store_release(p, v) \
+	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define mem_cache_load_acquire(p) (*(p))
+#define mem_cache_store_release(p, v) (*(p) = (v))
+#endif
+
+static void
+mem_cache_reg_lock_get(void)
+{
+    if (mem_cache_reg_lock)
+	malloc_os_hnd->lock(malloc_os_hnd, mem_cache_reg_lock);
+}
+
+static void
+mem_cache_reg_lock_put(void)
+{
+    if (mem_cache_reg_lock)
+	malloc_os_hnd->unlock(malloc_os_hnd, mem_cache_reg_lock);
+}
+
+static int
+mem_cache_find_class(unsigned int size)
+{
+    int i;
+
+    for (i=0; i<MEM_CACHE_NUM_CLASSES; i++) {
+	if (size <= mem_cache_sizes[i])
+	    return i;
+    }
+    return -1;
+}
+
+static void
+mem_cache_register(ipmi_mem_cache_t *cache)
+{
+    mem_cache_reg_lock_get();
+    if (!cache->registered) {
+	cache->size_class = mem_cache_find_class(cache->size);
+	if (mem_cache_count < MEM_CACHE_MAX_COUNTED)
+	    cache->id = mem_cache_count;
+	mem_cache_count++;
+	cache->next = mem_caches;
+	mem_cache_store_release(&mem_caches, cache);
+	mem_cache_store_release(&cache->registered, 1);
+    }
+    mem_cache_reg_lock_put();
+}
+
+/* Raise the cache's high water mark to in_use if it is below it. */
+static void
+mem_cache_high_water_set(ipmi_mem_cache_t *cache, long in_use)
+{
+#ifdef HAVE_GCC_ATOMICS
+    long old;
+
+    old = __atomic_load_n(&cache->high_water, __ATOMIC_RELAXED);
+    while (in_use > old) {
+	if (__atomic_compare_exchange_n(&cache->high_water, &old, in_use, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    break;
+    }
+#else
+    if (in_use > cache->high_water)
+	cache->high_water = in_use;
+#endif
+}
+
+/* Add delta objects in use and allocs allocations to the cache. */
+static void
+mem_cache_count_add(ipmi_mem_cache_t *cache, long delta,
+		    unsigned long allocs)
+{
+#ifdef HAVE_GCC_ATOMICS
+    long in_use;
+
+    if (allocs)
+	__atomic_fetch_add(&cache->allocs, allocs, __ATOMIC_RELAXED);
+    in_use = __atomic_add_fetch(&cache->in_use, delta, __ATOMIC_RELAXED);
+#else
+    long in_use;
+
+    cache->allocs += allocs;
+    in_use = (cache->in_use += delta);
+#endif
+    mem_cache_high_water_set(cache, in_use);
+}
+
+/* The objects in use from the cache, including the counts the threads
+   have not added in yet.  Must be called with the registration lock
+   held. */
+static long
+mem_cache_in_use(ipmi_mem_cache_t *cache)
+{
+    long in_use = ipmi_stat_atomic_load(&cache->in_use);
+#ifdef HAVE_TLS_VARS
+    mem_cache_mags_t *mags;
+
+    if (cache->id >= 0) {
+	for (mags = mem_cache_all_mags; mags; mags = mags->next)
+	    in_use += mags->in_use[cache->id];
+    }
+#endif
+    return in_use;
+}
+
+static int
+mem_cache_grow(mem_cache_class_t *cl, unsigned int obj_size)
+{
+    mem_cache_slab_t *slab;
+    char             *obj;
+    char             *end;
+
+    slab = cl->os_hnd->mem_alloc(MEM_CACHE_SLAB_SIZE);
+    if (!slab)
+	return ENOMEM;
+    slab->next = cl->slabs;
+    cl->slabs = slab;
+    cl->num_slabs++;
+
+    obj = ((char *) slab) + MEM_CACHE_SLAB_HDR;
+    end = ((char *) slab) + MEM_CACHE_SLAB_SIZE;
+    while (obj + obj_size <= end) {
+	((mem_cache_obj_t *) obj)->next = cl->free_list;
+	cl->free_list = (mem_cache_obj_t *) obj;
+	obj += obj_size;
+    }
+    return 0;
+}
+
+/* Take up to count objects from the depot, growing it as needed.
+   Returns the number actually taken. */
+static unsigned int
+mem_cache_get(int cls, void **objs, unsigned int count)
+{
+    mem_cache_class_t *cl = &mem_cache_classes[cls];
+    mem_cache_obj_t   *obj;
+    unsigned int      n = 0;
+
+    if (cl->lock)
+	cl->os_hnd->lock(cl->os_hnd, cl->lock);
+    while (n < count) {
+	if (!cl->free_list && mem_cache_grow(cl, mem_cache_sizes[cls]))
+	    break;
+	obj = cl->free_list;
+	cl->free_list = obj->next;
+	objs[n++] = obj;
+    }
+    if (cl->lock)
+	cl->os_hnd->unlock(cl->os_hnd, cl->lock);
+    return n;
+}
+
+static void
+mem_cache_put(int cls, void **objs, unsigned int count)
+{
+    mem_cache_class_t *cl = &mem_cache_classes[cls];
+    mem_cache_obj_t   *obj;
+    unsigned int      i;
+
+    if (cl->lock)
+	cl->os_hnd->lock(cl->os_hnd, cl->lock);
+    for (i=0; i<count; i++) {
+	obj = objs[i];
+	obj->next = cl->free_list;
+	cl->free_list = obj;
+    }
+    if (cl->lock)
+	cl->os_hnd->unlock(cl->os_hnd, cl->lock);
+}
+
+#ifdef HAVE_TLS_VARS
+/* Returns the calling thread's magazines, or NULL if it has none and
+   they cannot be allocated; the depot is used directly then. */
+static mem_cache_mags_t *
+mem_cache_thread_mags(void)
+{
+    mem_cache_mags_t *mags = mem_cache_tls.mags;
+
+    if (mags && (mem_cache_tls.gen == mem_cache_gen))
+	return mags;
+
+    mags = malloc_os_hnd->mem_alloc(sizeof(*mags));
+    if (!mags)
+	return NULL;
+    memset(mags, 0, sizeof(*mags));
+
+    mem_cache_reg_lock_get();
+    mags->next = mem_cache_all_mags;
+    mem_cache_all_mags = mags;
+    mem_cache_reg_lock_put();
+
+    mem_cache_tls.mags = mags;
+    mem_cache_tls.gen = mem_cache_gen;
+#ifdef MEM_CACHE_THREAD_EXIT
+    if (mem_cache_key_valid)
+	pthread_setspecific(mem_cache_key, mags);
+#endif
+    return mags;
+}
+
+/* Move the thread's counts for the cache into the cache. */
+static void
+mem_cache_flush_counts(ipmi_mem_cache_t *cache, mem_cache_mags_t *mags)
+{
+    int id = cache->id;
+
+    mem_cache_count_add(cache, mags->in_use[id], mags->allocs[id]);
+    mags->in_use[id] = 0;
+    mags->allocs[id] = 0;
+}
+
+/* Add all of the thread's counts into the caches.  Must be called
+   with the registration lock held. */
+static void
+mem_cache_fold_mags(mem_cache_mags_t *mags)
+{
+    ipmi_mem_cache_t *cache;
+
+    for (cache = mem_caches; cache; cache = cache->next) {
+	if (cache->id < 0)
+	    continue;
+	mem_cache_high_water_set(cache, mags->high_water[cache->id]);
+	mem_cache_flush_counts(cache, mags);
+    }
+}
+#endif
+
+#ifdef MEM_CACHE_THREAD_EXIT
+/* Called when a thread with magazines exits. */
+static void
+mem_cache_thread_exit(void *data)
+{
+    mem_cache_mags_t *mags = data;
+    mem_cache_mags_t **p;
+    int              i;
+
+    mem_cache_reg_lock_get();
+    for (p = &mem_cache_all_mags; *p; p = &(*p)->next) {
+	if (*p == mags)
+	    break;
+    }
+    if (!*p) {
+	/* Already freed by a shutdown. */
+	mem_cache_reg_lock_put();
+	return;
+    }
+    *p = mags->next;
+    mem_cache_fold_mags(mags);
+    mem_cache_reg_lock_put();
+
+    for (i=0; i<MEM_CACHE_NUM_CLASSES; i++) {
+	if (mags->mag[i].count)
+	    mem_cache_put(i, mags->mag[i].objs, mags->mag[i].count);
+    }
+    if (mem_cache_tls.mags == mags)
+	mem_cache_tls.mags = NULL;
+    malloc_os_hnd->mem_free(mags);
+}
+#endif
+
+void *
+ipmi_mem_cache_alloc(ipmi_mem_cache_t *cache)
+{
+    int  cls;
+    void *rv;
+
+    if (!mem_cache_load_acquire(&cache->registered))
+	mem_cache_register(cache);
+
+    cls = cache->size_class;
+    if ((cls < 0) || DEBUG_MALLOC) {
+	rv = ipmi_mem_alloc(cache->size);
+	if (rv)
+	    mem_cache_count_add(cache, 1, 1);
+	return rv;
+    }
+
+#ifdef HAVE_TLS_VARS
+    if (cache->id >= 0) {
+	mem_cache_mags_t *mags = mem_cache_thread_mags();
+	mem_cache_mag_t  *mag;
+
+	if (mags) {
+	    int  id = cache->id;
+	    long in_use;
+
+	    mag = &mags->mag[cls];
+	    if (mag->count == 0) {
+		mag->count = mem_cache_get(cls, mag->objs,
+					   MEM_CACHE_MAG_SIZE / 2);
+		if (mag->count == 0)
+		    return NULL;
+	    }
+	    mags->allocs[id]++;
+	    in_use = ipmi_stat_atomic_load(&cache->in_use)
+		+ ++mags->in_use[id];
+	    if (in_use > mags->high_water[id])
+		mags->high_water[id] = in_use;
+	    if (mags->in_use[id] >= MEM_CACHE_COUNT_BATCH)
+		mem_cache_flush_counts(cache, mags);
+	    return mag->objs[--mag->count];
+	}
+    }
+#endif
+
+    if (mem_cache_get(cls, &rv, 1) == 0)
+	return NULL;
+    mem_cache_count_add(cache, 1, 1);
+    return rv;
+}
+
+void
+ipmi_mem_cache_free(ipmi_mem_cache_t *cache, void *data)
+{
+    int cls = cache->size_class;
+
+    if ((cls < 0) || DEBUG_MALLOC) {
+	mem_cache_count_add(cache, -1, 0);
+	ipmi_mem_free(data);
+	return;
+    }
+
+#ifdef HAVE_TLS_VARS
+    if (cache->id >= 0) {
+	mem_cache_mags_t *mags = mem_cache_thread_mags();
+	mem_cache_mag_t  *mag;
+
+	if (mags) {
+	    mag = &mags->mag[cls];
+	    if (mag->count == MEM_CACHE_MAG_SIZE) {
+		mem_cache_put(cls, mag->objs + (MEM_CACHE_MAG_SIZE / 2),
+			      MEM_CACHE_MAG_SIZE / 2);
+		mag->count = MEM_CACHE_MAG_SIZE / 2;
+	    }
+	    if (--mags->in_use[cache->id] <= -MEM_CACHE_COUNT_BATCH)
+		mem_cache_flush_counts(cache, mags);
+	    mag->objs[mag->count++] = data;
+	    return;
+	}
+    }
+#endif
+
+    mem_cache_count_add(cache, -1, 0);
+    mem_cache_put(cls, &data, 1);
+}
+
+void
+ipmi_mem_cache_report(ipmi_mem_cache_report_cb handler, void *cb_data)
+{
+    ipmi_mem_cache_t *cache;
+    long             in_use, high_water;
+    unsigned long    allocs;
+#ifdef HAVE_TLS_VARS
+    mem_cache_mags_t *mags;
+#endif
+
+    cache = mem_cache_load_acquire(&mem_caches);
+    while (cache) {
+	mem_cache_reg_lock_get();
+	in_use = mem_cache_in_use(cache);
+	allocs = ipmi_stat_atomic_load(&cache->allocs);
+	high_water = ipmi_stat_atomic_load(&cache->high_water);
+#ifdef HAVE_TLS_VARS
+	if (cache->id >= 0) {
+	    for (mags = mem_cache_all_mags; mags; mags = mags->next) {
+		allocs += mags->allocs[cache->id];
+		if (mags->high_water[cache->id] > high_water)
+		    high_water = mags->high_water[cache->id];
+	    }
+	}
+#endif
+	mem_cache_reg_lock_put();
+
+	if (in_use < 0)
+	    in_use = 0;
+	if (in_use > high_water)
+	    high_water = in_use;
+
+	handler(cache->name, cache->size,
+		cache->size_class < 0 ? 0 : mem_cache_sizes[cache->size_class],
+		in_use, high_water, allocs, cb_data);
+	cache = cache->next;
+    }
+}
+
+unsigned long
+ipmi_mem_cache_slab_bytes(void)
+{
+    unsigned long total = 0;
+    int           i;
+
+    for (i=0; i<MEM_CACHE_NUM_CLASSES; i++)
+	total += mem_cache_classes[i].num_slabs * MEM_CACHE_SLAB_SIZE;
+    return total;
+}
+
+static void
+mem_cache_init(os_handler_t *os_hnd)
+{
+    mem_cache_class_t *cl;
+    int               i;
+
+    /* The cache locks are only held around list manipulation and
+       calls to the OS handler's allocator, never recursively. */
+    if (!mem_cache_reg_lock && os_hnd->create_nr_lock)
+	os_hnd->create_nr_lock(os_hnd, &mem_cache_reg_lock);
+    else if (!mem_cache_reg_lock && os_hnd->create_lock)
+	os_hnd->create_lock(os_hnd, &mem_cache_reg_lock);
+
+#ifdef MEM_CACHE_THREAD_EXIT
+    if (!mem_cache_key_valid
+	&& !pthread_key_create(&mem_cache_key, mem_cache_thread_exit))
+	mem_cache_key_valid = 1;
+#endif
+
+    for (i=0; i<MEM_CACHE_NUM_CLASSES; i++) {
+	cl = &mem_cache_classes[i];
+	if (cl->os_hnd)
+	    /* Kept over a shutdown because it still had objects out. */
+	    continue;
+	cl->os_hnd = os_hnd;
+	if (os_hnd->create_nr_lock)
+	    os_hnd->create_nr_lock(os_hnd, &cl->lock);
+	else if (os_hnd->create_lock)
+	    os_hnd->create_lock(os_hnd, &cl->lock);
+    }
+}
+
+/* Give the slabs of every class with nothing allocated from it back
+   to the OS handler, and free all the magazines. */
+static void
+mem_cache_shutdown(void)
+{
+    mem_cache_class_t *cl;
+    mem_cache_slab_t  *slab;
+    ipmi_mem_cache_t  *cache;
+    int               i;
+
+#ifdef MEM_CACHE_THREAD_EXIT
+    /* The magazines are all freed here, so no thread may give them
+       back when it exits. */
+    if (mem_cache_key_valid)
+	pthread_key_delete(mem_cache_key);
+    mem_cache_key_valid = 0;
+#endif
+#ifdef HAVE_TLS_VARS
+    /* The thread counts go away with the magazines. */
+    mem_cache_reg_lock_get();
+    while (mem_cache_all_mags) {
+	mem_cache_mags_t *mags = mem_cache_all_mags;
+
+	mem_cache_all_mags = mags->next;
+	mem_cache_fold_mags(mags);
+	malloc_os_hnd->mem_free(mags);
+    }
+    mem_cache_reg_lock_put();
+#endif
+
+    for (i=0; i<MEM_CACHE_NUM_CLASSES; i++) {
+	cl = &mem_cache_classes[i];
+	if (!cl->os_hnd)
+	    continue;
+	for (cache = mem_caches; cache; cache = cache->next) {
+	    if ((cache->size_class == i) && (cache->in_use > 0))
+		break;
+	}
+	if (cache)
+	    continue;
+
+	while (cl->slabs) {
+	    slab = cl->slabs;
+	    cl->slabs = slab->next;
+	    cl->os_hnd->mem_free(slab);
+	}
+	cl->free_list = NULL;
+	cl->num_slabs = 0;
+	if (cl->lock)
+	    cl->os_hnd->destroy_lock(cl->os_hnd, cl->lock);
+	cl->lock = NULL;
+	cl->os_hnd = NULL;
+    }
+    mem_cache_gen++;
+
+    if (mem_cache_reg_lock)
+	malloc_os_hnd->destroy_lock(malloc_os_hnd, mem_cache_reg_lock);
+    mem_cache_reg_lock = NULL;
+}
+
 void *
 ilist_mem_alloc(size_t size)
 {
@@ -434,6 +1051,21 @@ ilist_mem_free(void *data)
     ipmi_mem_free(data);
 }
 
+static ipmi_mem_cache_t ilist_item_cache =
+    IPMI_MEM_CACHE_INIT("ilist_item", sizeof(ilist_item_t));
+
+void *
+ilist_item_mem_alloc(void)
+{
+    return ipmi_mem_cache_alloc(&ilist_item_cache);
+}
+
+void
+ilist_item_mem_free(void *data)
+{
+    ipmi_mem_cache_free(&ilist_item_cache, data);
+}
+
 char *
 ipmi_strdup(const char *str)
 {
@@ -469,13 +1101,17 @@ ipmi_strndup(const char *str, int n)
 int
 ipmi_malloc_init(os_handler_t *os_hnd)
 {
-    if (!malloc_os_hnd)
+    if (!malloc_os_hnd) {
 	malloc_os_hnd = os_hnd;
+	mem_cache_init(os_hnd);
+    }
     return 0;
 }
 
 void
 ipmi_malloc_shutdown(void)
 {
+    if (malloc_os_hnd)
+	mem_cache_shutdown();
     malloc_os_hnd = NULL;
 }
@@ -0,0 +1,264 @@
+/*
+ * locked_array.c
+ *
+ * Code for a locked container stored in a flat array.
+ *
+ * Author: MontaVista Software, Inc.
+ *         Corey Minyard <minyard@mvista.com>
+ *         source@mvista.com
+ *
+ * Copyright 2004,2005 MontaVista Software Inc.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * Lesser General Public License (GPL) Version 2 or the modified BSD
+ * license below.  The following disclamer applies to both licenses:
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ *  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ *  OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ *  USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * GNU Lesser General Public Licence
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2 of
+ *  the License, or (at your option) any later version.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Modified BSD Licence
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *   3. The name of the author may not be used to endorse or promote
+ *      products derived from this software without specific prior
+ *      written permission.
+ */
+
+#include <string.h>
+
+#include <OpenIPMI/internal/ipmi_locks.h>
+#include <OpenIPMI/internal/ipmi_malloc.h>
+#include <OpenIPMI/internal/locked_array.h>
+
+#define LOCKED_ARRAY_MIN_SIZE 4
+
+typedef struct locked_array_slot_s
+{
+    void *item1, *item2;
+} locked_array_slot_t;
+
+/* Stored in item1 of a slot removed while an iteration is running. */
+static char dead_slot;
+#define SLOT_DEAD ((void *) &dead_slot)
+
+struct locked_array_s
+{
+    ipmi_lock_t         *lock;
+    unsigned int        cb_count;
+    unsigned int        count; /* Live items. */
+    unsigned int        len;   /* Used slots, including dead ones. */
+    unsigned int        size;
+    locked_array_slot_t *slots;
+};
+
+locked_array_t *
+locked_array_alloc(os_handler_t *os_hnd)
+{
+    locked_array_t *la;
+    int            rv;
+
+    la = ipmi_mem_alloc(sizeof(*la));
+    if (!la)
+	return NULL;
+    memset(la, 0, sizeof(*la));
+    rv = ipmi_create_lock_os_hnd(os_hnd, &la->lock);
+    if (rv) {
+	ipmi_mem_free(la);
+	return NULL;
+    }
+
+    return la;
+}
+
+void
+locked_array_destroy(locked_array_t *la)
+{
+    if (la->slots)
+	ipmi_mem_free(la->slots);
+    ipmi_destroy_lock(la->lock);
+    ipmi_mem_free(la);
+}
+
+static int
+internal_find(locked_array_t *la, void *item1, void *item2)
+{
+    unsigned int i;
+
+    for (i=0; i<la->len; i++) {
+	if ((la->slots[i].item1 == item1) && (la->slots[i].item2 == item2))
+	    return i;
+    }
+    return -1;
+}
+
+/* Squeeze out the dead slots, keeping the order. */
+static void
+compact(locked_array_t *la)
+{
+    unsigned int i, j;
+
+    for (i=0, j=0; i<la->len; i++) {
+	if (la->slots[i].item1 != SLOT_DEAD)
+	    la->slots[j++] = la->slots[i];
+    }
+    la->len = j;
+}
+
+int
+locked_array_add(locked_array_t *la, void *item1, void *item2)
+{
+    int rv = 1;
+
+    ipmi_lock(la->lock);
+
+    /* We don't allow duplicates. */
+    if (internal_find(la, item1, item2) >= 0) {
+	rv = 2;
+	goto out_unlock;
+    }
+
+    if (la->len == la->size) {
+	locked_array_slot_t *new_slots;
+	unsigned int        new_size;
+
+	new_size = la->size * 2;
+	if (new_size < LOCKED_ARRAY_MIN_SIZE)
+	    new_size = LOCKED_ARRAY_MIN_SIZE;
+	new_slots = ipmi_mem_alloc(sizeof(*new_slots) * new_size);
+	if (!new_slots) {
+	    rv = 0;
+	    goto out_unlock;
+	}
+	if (la->slots) {
+	    memcpy(new_slots, la->slots, sizeof(*new_slots) * la->len);
+	    ipmi_mem_free(la->slots);
+	}
+	la->slots = new_slots;
+	la->size = new_size;
+    }
+
+    la->slots[la->len].item1 = item1;
+    la->slots[la->len].item2 = item2;
+    la->len++;
+    la->count++;
+
+ out_unlock:
+    ipmi_unlock(la->lock);
+    return rv;
+}
+
+int
+locked_array_remove(locked_array_t *la, void *item1, void *item2)
+{
+    int idx;
+
+    ipmi_lock(la->lock);
+    idx = internal_find(la, item1, item2);
+    if (idx < 0) {
+	ipmi_unlock(la->lock);
+	return 0;
+    }
+
+    la->count--;
+    if (la->cb_count) {
+	/* Someone is walking the array, the indexes must not move
+	   under them.  The last iterator out cleans up. */
+	la->slots[idx].item1 = SLOT_DEAD;
+	la->slots[idx].item2 = NULL;
+    } else {
+	la->len--;
+	memmove(la->slots + idx, la->slots + idx + 1,
+		sizeof(*la->slots) * (la->len - idx));
+    }
+    ipmi_unlock(la->lock);
+    return 1;
+}
+
+void
+locked_array_iterate_prefunc(locked_array_t         *la,
+			     locked_list_handler_cb prefunc,
+			     locked_list_handler_cb handler,
+			     void                   *cb_data)
+{
+    int          rv;
+    unsigned int i;
+
+    ipmi_lock(la->lock);
+    la->cb_count++;
+    /* The array may grow (and move) while the lock is released, so
+       always go through la->slots and re-check the length. */
+    for (i=0; i<la->len; i++) {
+	void *item1 = la->slots[i].item1;
+	void *item2 = la->slots[i].item2;
+
+	if (item1 == SLOT_DEAD)
+	    continue;
+	if (prefunc) {
+	    rv = prefunc(cb_data, item1, item2);
+	    if (rv == LOCKED_LIST_ITER_SKIP)
+		continue;
+	    else if (rv)
+		break;
+	}
+	if (handler) {
+	    ipmi_unlock(la->lock);
+	    rv = handler(cb_data, item1, item2);
+	    ipmi_lock(la->lock);
+	    if (rv)
+		break;
+	}
+    }
+    la->cb_count--;
+
+    if ((la->cb_count == 0) && (la->len != la->count))
+	compact(la);
+    ipmi_unlock(la->lock);
+}
+
+void
+locked_array_iterate(locked_array_t         *la,
+		     locked_list_handler_cb handler,
+		     void                   *cb_data)
+{
+    locked_array_iterate_prefunc(la, NULL, handler, cb_data);
+}
+
+unsigned int
+locked_array_num_entries(locked_array_t *la)
+{
+    unsigned int rv;
+
+    ipmi_lock(la->lock);
+    rv = la->count;
+    ipmi_unlock(la->lock);
+    return rv;
+}
@@ -59,25 +59,29 @@
 #include <OpenIPMI/internal/ipmi_malloc.h>
 #include <OpenIPMI/internal/locked_list.h>
 
-#define LOCKED_LIST_ENTRIES_INCREMENT 5
-
-struct locked_list_entry_s
+static ipmi_mem_cache_t entry_cache =
+    IPMI_MEM_CACHE_INIT("locked_list_entry", sizeof(locked_list_entry_t));
+
+/* Every running iteration registers one of these (on its stack).
+   "pos" is the last entry handed to the iterator; if that entry is
+   removed while the lock is dropped, pos is moved back to the entry
+   before it, so the iteration always continues from an entry that is
+   still on the list and removed entries can be unlinked (and freed)
+   immediately. */
+typedef struct locked_list_iter_s locked_list_iter_t;
+struct locked_list_iter_s
 {
-    unsigned int destroyed;
-    void *item1, *item2;
-    locked_list_entry_t *next, *prev;
-    locked_list_entry_t *dlist_next;
+    locked_list_entry_t *pos;
+    locked_list_iter_t  *next;
 };
 
 struct locked_list_s
 {
-    unsigned int        destroyed;
-    unsigned int        cb_count;
     locked_list_lock_cb lock, unlock;
     void                *lock_cb_data;
     unsigned int        count;
     locked_list_entry_t head;
-    locked_list_entry_t *destroy_list;
+    locked_list_iter_t  *iters;
 };
 
 static void
@@ -116,10 +120,8 @@ locked_list_alloc(os_handler_t *os_hnd)
     ll->unlock = ll_std_unlock;
     ll->lock_cb_data = lock;
 
-    ll->destroyed = 0;
-    ll->cb_count = 0;
     ll->count = 0;
-    ll->destroy_list = NULL;
+    ll->iters = NULL;
     ll->head.next = &ll->head;
     ll->head.prev = &ll->head;
 
@@ -142,10 +144,8 @@ locked_list_alloc_my_lock(locked_list_lock_cb lock_func,
     ll->unlock = unlock_func;
     ll->lock_cb_data = lock_func_cb_data;
 
-    ll->destroyed = 0;
-    ll->cb_count = 0;
     ll->count = 0;
-    ll->destroy_list = NULL;
+    ll->iters = NULL;
     ll->head.next = &ll->head;
     ll->head.prev = &ll->head;
 
@@ -160,7 +160,10 @@ locked_list_destroy(locked_list_t *ll)
     entry = ll->head.next;
     while (entry != &ll->head) {
 	next = entry->next;
-	ipmi_mem_free(entry);
+	entry->next = NULL;
+	entry->prev = NULL;
+	if (!entry->embedded)
+	    ipmi_mem_cache_free(&entry_cache, entry);
 	entry = next;
     }
     if (ll->lock == ll_std_lock)
@@ -175,117 +178,147 @@ internal_find(locked_list_t *ll, void *item1, void *item2)
 
     entry = ll->head.next;
     while (entry != &ll->head) {
-	if ((!entry->destroyed)
-	    && (entry->item1 == item1)
-	    && (entry->item2 == item2))
-	{
+	if ((entry->item1 == item1) && (entry->item2 == item2))
 	    return entry;
-	}
 	entry = entry->next;
     }
 
     return NULL;
 }
 
-int
-locked_list_add_entry(locked_list_t *ll, void *item1, void *item2,
-		      locked_list_entry_t *entry)
+static void
+internal_link(locked_list_t *ll, void *item1, void *item2,
+	      locked_list_entry_t *entry)
 {
-    int rv = 1;
-    if (!entry)
-	entry = ipmi_mem_alloc(sizeof(*entry));
-    if (!entry)
-	return 0;
-
-    ll->lock(ll->lock_cb_data);
-
-    /* We don't allow duplicates. */
-    if (internal_find(ll, item1, item2)) {
-	ipmi_mem_free(entry);
-	rv = 2;
-	goto out_unlock;
-    }
-
     entry->item1 = item1;
     entry->item2 = item2;
-    entry->destroyed = 0;
     entry->next = &ll->head;
     entry->prev = ll->head.prev;
     entry->prev->next = entry;
     entry->next->prev = entry;
     ll->count++;
-
- out_unlock:
-    ll->unlock(ll->lock_cb_data);
-    return rv;
 }
 
-int
-locked_list_add(locked_list_t *ll, void *item1, void *item2)
+static void
+internal_unlink(locked_list_t *ll, locked_list_entry_t *entry)
 {
-    return locked_list_add_entry(ll, item1, item2, NULL);
+    locked_list_iter_t *iter;
+
+    for (iter = ll->iters; iter; iter = iter->next) {
+	if (iter->pos == entry)
+	    iter->pos = entry->prev;
+    }
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = NULL;
+    entry->prev = NULL;
+    ll->count--;
+    if (!entry->embedded)
+	ipmi_mem_cache_free(&entry_cache, entry);
 }
 
 int
 locked_list_add_entry_nolock(locked_list_t *ll, void *item1, void *item2,
 			     locked_list_entry_t *entry)
 {
-    int rv = 1;
     if (!entry)
-	entry = ipmi_mem_alloc(sizeof(*entry));
+	entry = ipmi_mem_cache_alloc(&entry_cache);
     if (!entry)
 	return 0;
 
     /* We don't allow duplicates. */
     if (internal_find(ll, item1, item2)) {
-	ipmi_mem_free(entry);
-	rv = 2;
-	goto out;
+	ipmi_mem_cache_free(&entry_cache, entry);
+	return 2;
     }
 
-    entry->item1 = item1;
-    entry->item2 = item2;
-    entry->destroyed = 0;
-    entry->next = &ll->head;
-    entry->prev = ll->head.prev;
-    entry->prev->next = entry;
-    entry->next->prev = entry;
-    ll->count++;
+    entry->embedded = 0;
+    internal_link(ll, item1, item2, entry);
+    return 1;
+}
 
- out:
+int
+locked_list_add_entry(locked_list_t *ll, void *item1, void *item2,
+		      locked_list_entry_t *entry)
+{
+    int rv;
+
+    if (!entry)
+	entry = ipmi_mem_cache_alloc(&entry_cache);
+    if (!entry)
+	return 0;
+
+    ll->lock(ll->lock_cb_data);
+    rv = locked_list_add_entry_nolock(ll, item1, item2, entry);
+    ll->unlock(ll->lock_cb_data);
     return rv;
 }
 
+int
+locked_list_add(locked_list_t *ll, void *item1, void *item2)
+{
+    return locked_list_add_entry(ll, item1, item2, NULL);
+}
+
 int
 locked_list_add_nolock(locked_list_t *ll, void *item1, void *item2)
 {
     return locked_list_add_entry_nolock(ll, item1, item2, NULL);
 }
 
+int
+locked_list_add_embedded_nolock(locked_list_t *ll, void *item1, void *item2,
+				locked_list_entry_t *entry)
+{
+    if (internal_find(ll, item1, item2))
+	return 2;
+
+    entry->embedded = 1;
+    internal_link(ll, item1, item2, entry);
+    return 1;
+}
+
+int
+locked_list_add_embedded(locked_list_t *ll, void *item1, void *item2,
+			 locked_list_entry_t *entry)
+{
+    int rv;
+
+    ll->lock(ll->lock_cb_data);
+    rv = locked_list_add_embedded_nolock(ll, item1, item2, entry);
+    ll->unlock(ll->lock_cb_data);
+    return rv;
+}
+
 int
 locked_list_remove_nolock(locked_list_t *ll, void *item1, void *item2)
 {
-    int                 rv;
     locked_list_entry_t *entry;
 
     entry = internal_find(ll, item1, item2);
-    if (!entry) {
-	rv = 0;
-    } else {
-	rv = 1;
-	ll->count--;
-	if (ll->cb_count) {
-	    /* We are in callbacks, just mark it destroyed and let the
-	       last call back exit clear it up. */
-	    entry->destroyed = 1;
-	    entry->dlist_next = ll->destroy_list;
-	    ll->destroy_list = entry;
-	} else {
-	    entry->next->prev = entry->prev;
-	    entry->prev->next = entry->next;
-	    ipmi_mem_free(entry);
-	}
-    }
+    if (!entry)
+	return 0;
+    internal_unlink(ll, entry);
+    return 1;
+}
+
+int
+locked_list_remove_entry_nolock(locked_list_t *ll, locked_list_entry_t *entry)
+{
+    if (!entry->next)
+	return 0;
+    internal_unlink(ll, entry);
+    return 1;
+}
+
+int
+locked_list_remove_entry(locked_list_t *ll, locked_list_entry_t *entry)
+{
+    int rv;
+
+    ll->lock(ll->lock_cb_data);
+    rv = locked_list_remove_entry_nolock(ll, entry);
+    ll->unlock(ll->lock_cb_data);
     return rv;
 }
 
@@ -306,48 +339,38 @@ locked_list_iterate_prefunc_nolock(locked_list_t          *ll,
 				   void                   *cb_data)
 {
     int                 rv;
+    locked_list_iter_t  iter, **iterp;
     locked_list_entry_t *entry;
 
-    ll->cb_count++;
-    entry = ll->head.next;
-    while (entry != &ll->head) {
-	if (!entry->destroyed)
-	{
-	    void *item1, *item2;
-	    int  process = 1;
-
-	    item1 = entry->item1;
-	    item2 = entry->item2;
-	    if (prefunc) {
-		rv = prefunc(cb_data, item1, item2);
-		if (rv == LOCKED_LIST_ITER_SKIP)
-		    process = 0;
-		else if (rv)
-		    break;
-	    }
-	    if (process && handler) {
-		ll->unlock(ll->lock_cb_data);
-		rv = handler(cb_data, item1, item2);
-		ll->lock(ll->lock_cb_data);
-		if (rv)
-		    break;
-	    }
+    iter.pos = &ll->head;
+    iter.next = ll->iters;
+    ll->iters = &iter;
+
+    while ((entry = iter.pos->next) != &ll->head) {
+	void *item1, *item2;
+
+	iter.pos = entry;
+	item1 = entry->item1;
+	item2 = entry->item2;
+	if (prefunc) {
+	    rv = prefunc(cb_data, item1, item2);
+	    if (rv == LOCKED_LIST_ITER_SKIP)
+		continue;
+	    else if (rv)
+		break;
 	}
-	entry = entry->next;
-    }
-    ll->cb_count--;
-
-    /* If no one else is going through the list, clean up the
-       destroyed entries. */
-    if (ll->cb_count == 0) {
-	while (ll->destroy_list) {
-	    entry = ll->destroy_list;
-	    ll->destroy_list = entry->dlist_next;
-	    entry->next->prev = entry->prev;
-	    entry->prev->next = entry->next;
-	    ipmi_mem_free(entry);
+	if (handler) {
+	    ll->unlock(ll->lock_cb_data);
+	    rv = handler(cb_data, item1, item2);
+	    ll->lock(ll->lock_cb_data);
+	    if (rv)
+		break;
 	}
     }
+
+    for (iterp = &ll->iters; *iterp != &iter; iterp = &(*iterp)->next)
+	;
+    *iterp = iter.next;
 }
 
 void
@@ -399,13 +422,13 @@ locked_list_num_entries_nolock(locked_list_t *ll)
 locked_list_entry_t *
 locked_list_alloc_entry(void)
 {
-    return ipmi_mem_alloc(sizeof(locked_list_entry_t));
+    return ipmi_mem_cache_alloc(&entry_cache);
 }
 
 void
 locked_list_free_entry(locked_list_entry_t *entry)
 {
-    ipmi_mem_free(entry);
+    ipmi_mem_cache_free(&entry_cache, entry);
 }
 
 void
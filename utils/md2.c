@@ -77,7 +77,7 @@ md2_init( MD2_CONTEXT *ctx )
 }
 
 /* The "Bytes of PI" defined by the algorithm. */
-static byte s[256] =
+static const byte s[256] =
 {
    41,  46,  67, 201, 162, 216, 124,   1,  61,  54,  84, 161, 236, 240,   6,  19,
    98, 167,   5, 243, 192, 199, 115, 140, 152, 147,  43, 217, 188,  76, 130, 202,
@@ -207,6 +207,11 @@ struct ipmi_authdata_s
     void          *(*mem_alloc)(void *info, int size);
     void          (*mem_free)(void *info, void *data);
     unsigned char data[16];
+
+    /* The password is exactly one block and always comes first, so
+       the context after it is computed once here instead of for
+       every message. */
+    MD2_CONTEXT   pre;
 };
 
 /* External functions for the IPMI authcode algorithms. */
@@ -228,6 +233,8 @@ ipmi_md2_authcode_init(unsigned char   *password,
     data->mem_free = mem_free;
 
     memcpy(data->data, password, 16);
+    md2_init(&data->pre);
+    md2_write(&data->pre, data->data, 16);
     *handle = data;
     return 0;
 }
@@ -237,11 +244,9 @@ ipmi_md2_authcode_gen(ipmi_authdata_t handle,
 		      ipmi_auth_sg_t  data[],
 		      void            *output)
 {
-    MD2_CONTEXT ctx;
+    MD2_CONTEXT ctx = handle->pre;
     int         i;
 
-    md2_init(&ctx);
-    md2_write(&ctx, handle->data, 16);
     for (i=0; data[i].data != NULL; i++) {
 	md2_write(&ctx, data[i].data, data[i].len);
     }
@@ -256,11 +261,9 @@ ipmi_md2_authcode_check(ipmi_authdata_t handle,
 			ipmi_auth_sg_t  data[],
 			void            *code)
 {
-    MD2_CONTEXT ctx;
+    MD2_CONTEXT ctx = handle->pre;
     int         i;
 
-    md2_init(&ctx);
-    md2_write(&ctx, handle->data, 16);
     for (i=0; data[i].data != NULL; i++) {
 	md2_write(&ctx, data[i].data, data[i].len);
     }
@@ -275,6 +278,7 @@ void
 ipmi_md2_authcode_cleanup(ipmi_authdata_t handle)
 {
     memset(handle->data, 0, sizeof(handle->data));
+    memset(&handle->pre, 0, sizeof(handle->pre));
     handle->mem_free(handle->info, handle);
     handle = NULL;
 }
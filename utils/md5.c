@@ -214,37 +214,46 @@ transform( MD5_CONTEXT *ctx, byte *data )
 /* The routine updates the message-digest context to
  * account for the presence of each of the characters inBuf[0..inLen-1]
  * in the message whose digest is being computed.
+ *
+ * IPMI authcodes are computed over short messages, so partial blocks
+ * are buffered with memcpy and the stack is only burned once, in
+ * md5_final, instead of on every write.
  */
 static void
 md5_write( MD5_CONTEXT *hd, byte *inbuf, size_t inlen)
 {
+    size_t cnt;
+
     if( hd->count == 64 ) { /* flush the buffer */
 	transform( hd, hd->buf );
-        burn_stack (80+6*sizeof(void*));
 	hd->count = 0;
 	hd->nblocks++;
     }
     if( !inbuf )
 	return;
     if( hd->count ) {
-	for( ; inlen && hd->count < 64; inlen-- )
-	    hd->buf[hd->count++] = *inbuf++;
-	md5_write( hd, NULL, 0 );
+	cnt = 64 - hd->count;
+	if( cnt > inlen )
+	    cnt = inlen;
+	memcpy(hd->buf + hd->count, inbuf, cnt);
+	hd->count += cnt;
+	inbuf += cnt;
+	inlen -= cnt;
 	if( !inlen )
 	    return;
+	transform( hd, hd->buf );
+	hd->count = 0;
+	hd->nblocks++;
     }
-    burn_stack (80+6*sizeof(void*));
 
     while( inlen >= 64 ) {
 	transform( hd, inbuf );
-	hd->count = 0;
 	hd->nblocks++;
 	inlen -= 64;
 	inbuf += 64;
     }
-    for( ; inlen && hd->count < 64; inlen-- )
-	hd->buf[hd->count++] = *inbuf++;
-
+    memcpy(hd->buf, inbuf, inlen);
+    hd->count = inlen;
 }
 
 
@@ -279,14 +288,12 @@ md5_final( MD5_CONTEXT *hd )
 
     if( hd->count < 56 ) { /* enough room */
 	hd->buf[hd->count++] = 0x80; /* pad */
-	while( hd->count < 56 )
-	    hd->buf[hd->count++] = 0;  /* pad */
+	memset(hd->buf + hd->count, 0, 56 - hd->count);
     }
     else { /* need one extra block */
 	hd->buf[hd->count++] = 0x80; /* pad character */
-	while( hd->count < 64 )
-	    hd->buf[hd->count++] = 0;
-	md5_write(hd, NULL, 0);  /* flush */;
+	memset(hd->buf + hd->count, 0, 64 - hd->count);
+	transform( hd, hd->buf );
 	memset(hd->buf, 0, 56 ); /* fill next block with zeroes */
     }
     /* append the 64 bit count */